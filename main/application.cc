@@ -8,6 +8,8 @@
 #include "font_awesome_symbols.h"
 #include "assets/lang_config.h"
 #include "mcp_server.h"
+#include "main_loop_profiler.h"
+#include "latency_tracer.h"
 #include "reminder/alarm.h"
 
 #include <cstring>
@@ -254,15 +256,15 @@ void Application::ToggleChatState() {
             }
 
             SetListeningMode(aec_mode_ == kAecOff ? kListeningModeAutoStop : kListeningModeRealtime);
-        });
+        }, kMainTaskPriorityHigh);
     } else if (device_state_ == kDeviceStateSpeaking) {
         Schedule([this]() {
             AbortSpeaking(kAbortReasonNone);
-        });
+        }, kMainTaskPriorityHigh);
     } else if (device_state_ == kDeviceStateListening) {
         Schedule([this]() {
             protocol_->CloseAudioChannel();
-        });
+        }, kMainTaskPriorityHigh);
     }
 }
 
@@ -291,12 +293,12 @@ void Application::StartListening() {
             }
 
             SetListeningMode(kListeningModeManualStop);
-        });
+        }, kMainTaskPriorityHigh);
     } else if (device_state_ == kDeviceStateSpeaking) {
         Schedule([this]() {
             AbortSpeaking(kAbortReasonNone);
             SetListeningMode(kListeningModeManualStop);
-        });
+        }, kMainTaskPriorityHigh);
     }
 }
 
@@ -322,7 +324,7 @@ void Application::StopListening() {
             protocol_->SendStopListening();
             SetDeviceState(kDeviceStateIdle);
         }
-    });
+    }, kMainTaskPriorityHigh);
 }
 
 void Application::Start() {
@@ -339,7 +341,9 @@ void Application::Start() {
 
     AudioServiceCallbacks callbacks;
     callbacks.on_send_queue_available = [this]() {
-        xEventGroupSetBits(event_group_, MAIN_EVENT_SEND_AUDIO);
+        if (protocol_) {
+            protocol_->NotifyAudioSender();
+        }
     };
     callbacks.on_wake_word_detected = [this](const std::string& wake_word) {
         xEventGroupSetBits(event_group_, MAIN_EVENT_WAKE_WORD_DETECTED);
@@ -382,8 +386,11 @@ void Application::Start() {
         xEventGroupSetBits(event_group_, MAIN_EVENT_ERROR);
     });
     protocol_->OnIncomingAudio([this](std::unique_ptr<AudioStreamPacket> packet) {
-        if (device_state_ == kDeviceStateSpeaking) {
+        /* After an abort, the frames still in flight from the server are not played */
+        if (device_state_ == kDeviceStateSpeaking && !aborted_) {
             audio_service_.PushPacketToDecodeQueue(std::move(packet));
+        } else {
+            audio_service_.ReleasePacket(std::move(packet));
         }
     });
     protocol_->OnAudioChannelOpened([this, codec, &board]() {
@@ -392,6 +399,10 @@ void Application::Start() {
             ESP_LOGW(TAG, "Server sample rate %d does not match device output sample rate %d, resampling may cause distortion",
                 protocol_->server_sample_rate(), codec->output_sample_rate());
         }
+        audio_service_.SetAudioProfile(protocol_->server_audio_profile());
+        audio_service_.SetDownlinkFrameDuration(protocol_->server_frame_duration());
+        audio_service_.PrepareDecoder(protocol_->server_sample_rate(), protocol_->server_frame_duration());
+        audio_service_.SetAudioFec(protocol_->audio_fec_inband());
     });
     protocol_->OnAudioChannelClosed([this, &board]() {
         board.SetPowerSaveMode(true);
@@ -399,22 +410,24 @@ void Application::Start() {
             auto display = Board::GetInstance().GetDisplay();
             display->SetChatMessage("system", "");
             SetDeviceState(kDeviceStateIdle);
-        });
+        }, kMainTaskPriorityHigh, "audio_channel_closed");
     });
-    protocol_->OnIncomingJson([this, display](const cJSON* root) {
-        // Parse JSON data
-        auto type = cJSON_GetObjectItem(root, "type");
-        if (strcmp(type->valuestring, "tts") == 0) {
-            auto state = cJSON_GetObjectItem(root, "state");
-            if (strcmp(state->valuestring, "start") == 0) {
+    protocol_->OnIncomingJson([this, display](const JsonMessage& message) {
+        std::string text;
+        switch (message.type()) {
+        case kJsonKeywordTts:
+            if (message.state() == kJsonKeywordStart) {
+                TraceLatency(kLatencyTtsStart);
                 Schedule([this]() {
                     aborted_ = false;
                     if (device_state_ == kDeviceStateIdle || device_state_ == kDeviceStateListening) {
                         SetDeviceState(kDeviceStateSpeaking);
                     }
-                });
-            } else if (strcmp(state->valuestring, "stop") == 0) {
+                }, kMainTaskPriorityHigh, "tts_start");
+            } else if (message.state() == kJsonKeywordStop) {
                 Schedule([this]() {
+                    /* Recorded by the main loop, which logs the breakdown of the turn */
+                    TraceLatency(kLatencyTtsStop);
                     if (device_state_ == kDeviceStateSpeaking) {
                         if (listening_mode_ == kListeningModeManualStop) {
                             SetDeviceState(kDeviceStateIdle);
@@ -422,74 +435,89 @@ void Application::Start() {
                             SetDeviceState(kDeviceStateListening);
                         }
                     }
-                });
-            } else if (strcmp(state->valuestring, "sentence_start") == 0) {
-                auto text = cJSON_GetObjectItem(root, "text");
-                if (cJSON_IsString(text)) {
-                    ESP_LOGI(TAG, "<< %s", text->valuestring);
-                    Schedule([this, display, message = std::string(text->valuestring)]() {
+                }, kMainTaskPriorityHigh, "tts_stop");
+            } else if (message.state() == kJsonKeywordSentenceStart) {
+                if (message.GetString("text", text)) {
+                    ESP_LOGI(TAG, "<< %s", text.c_str());
+                    Schedule([this, display, message = std::move(text)]() {
                         display->SetChatMessage("assistant", message.c_str());
-                    });
+                    }, kMainTaskPriorityDisplay, "sentence_start");
                 }
             }
-        } else if (strcmp(type->valuestring, "stt") == 0) {
-            auto text = cJSON_GetObjectItem(root, "text");
-            if (cJSON_IsString(text)) {
-                ESP_LOGI(TAG, ">> %s", text->valuestring);
-                Schedule([this, display, message = std::string(text->valuestring)]() {
+            break;
+        case kJsonKeywordStt:
+            TraceLatency(kLatencyStt);
+            if (message.GetString("text", text)) {
+                ESP_LOGI(TAG, ">> %s", text.c_str());
+                Schedule([this, display, message = std::move(text)]() {
                     display->SetChatMessage("user", message.c_str());
-                });
+                }, kMainTaskPriorityDisplay, "stt");
             }
-        } else if (strcmp(type->valuestring, "llm") == 0) {
-            auto emotion = cJSON_GetObjectItem(root, "emotion");
-            if (cJSON_IsString(emotion)) {
-                Schedule([this, display, emotion_str = std::string(emotion->valuestring)]() {
+            break;
+        case kJsonKeywordLlm:
+            if (message.GetString("emotion", text)) {
+                Schedule([this, display, emotion_str = std::move(text)]() {
                     display->SetEmotion(emotion_str.c_str());
-                });
+                }, kMainTaskPriorityDisplay, "llm_emotion");
             }
-        } else if (strcmp(type->valuestring, "mcp") == 0) {
-            auto payload = cJSON_GetObjectItem(root, "payload");
-            if (cJSON_IsObject(payload)) {
-                McpServer::GetInstance().ParseMessage(payload);
+            break;
+        case kJsonKeywordMcp: {
+            /* Only the payload is handed to cJSON */
+            auto payload = message.GetRaw("payload");
+            auto root = cJSON_ParseWithLength(payload.data(), payload.size());
+            if (cJSON_IsObject(root)) {
+                McpServer::GetInstance().ParseMessage(root);
             }
-        } else if (strcmp(type->valuestring, "system") == 0) {
-            auto command = cJSON_GetObjectItem(root, "command");
-            if (cJSON_IsString(command)) {
-                ESP_LOGI(TAG, "System command: %s", command->valuestring);
-                if (strcmp(command->valuestring, "reboot") == 0) {
+            cJSON_Delete(root);
+            break;
+        }
+        case kJsonKeywordSystem:
+            if (message.GetString("command", text)) {
+                ESP_LOGI(TAG, "System command: %s", text.c_str());
+                if (text == "reboot") {
                     // Do a reboot if user requests a OTA update
                     Schedule([this]() {
                         Reboot();
-                    });
+                    }, kMainTaskPriorityNormal, "system_reboot");
                 } else {
-                    ESP_LOGW(TAG, "Unknown system command: %s", command->valuestring);
+                    ESP_LOGW(TAG, "Unknown system command: %s", text.c_str());
                 }
             }
-        } else if (strcmp(type->valuestring, "alert") == 0) {
-            auto status = cJSON_GetObjectItem(root, "status");
-            auto message = cJSON_GetObjectItem(root, "message");
-            auto emotion = cJSON_GetObjectItem(root, "emotion");
-            if (cJSON_IsString(status) && cJSON_IsString(message) && cJSON_IsString(emotion)) {
-                Alert(status->valuestring, message->valuestring, emotion->valuestring, Lang::Sounds::P3_VIBRATION);
+            break;
+        case kJsonKeywordAlert: {
+            std::string status, emotion;
+            if (message.GetString("status", status) && message.GetString("message", text) && message.GetString("emotion", emotion)) {
+                Alert(status.c_str(), text.c_str(), emotion.c_str(), Lang::Sounds::P3_VIBRATION);
             } else {
                 ESP_LOGW(TAG, "Alert command requires status, message and emotion");
             }
+            break;
+        }
 #if CONFIG_RECEIVE_CUSTOM_MESSAGE
-        } else if (strcmp(type->valuestring, "custom") == 0) {
-            auto payload = cJSON_GetObjectItem(root, "payload");
-            ESP_LOGI(TAG, "Received custom message: %s", cJSON_PrintUnformatted(root));
-            if (cJSON_IsObject(payload)) {
-                Schedule([this, display, payload_str = std::string(cJSON_PrintUnformatted(payload))]() {
+        case kJsonKeywordCustom: {
+            /* The payload is shown as it was received, without building and printing a cJSON tree */
+            auto payload = message.GetRaw("payload");
+            ESP_LOGI(TAG, "Received custom message: %.*s", (int)payload.size(), payload.data());
+            if (!payload.empty() && payload.front() == '{') {
+                Schedule([this, display, payload_str = std::string(payload)]() {
                     display->SetChatMessage("system", payload_str.c_str());
-                });
+                }, kMainTaskPriorityDisplay, "custom_message");
             } else {
                 ESP_LOGW(TAG, "Invalid custom message format: missing payload");
             }
+            break;
+        }
 #endif
-        } else {
-            ESP_LOGW(TAG, "Unknown message type: %s", type->valuestring);
+        default:
+            ESP_LOGW(TAG, "Unknown message type: %.*s", (int)message.type_name().size(), message.type_name().data());
+            break;
         }
     });
+    /* The uplink audio is sent by its own task, a slow link does not hold up the main loop */
+    protocol_->OnAudioSent([this]() {
+        OnAudioSent(true);
+    });
+    protocol_->StartAudioSender(audio_service_);
     bool protocol_started = protocol_->Start();
 
     SetDeviceState(kDeviceStateIdle);
@@ -518,13 +546,45 @@ void Application::Start() {
 void Application::OnClockTimer() {
     clock_ticks_++;
 
+#if CONFIG_USE_AUDIO_CHANNEL_KEEP_WARM
+    // Release the warm audio channel after the device stayed idle for a while
+    if (device_state_ == kDeviceStateIdle && clock_ticks_ == CONFIG_AUDIO_CHANNEL_WARM_IDLE_TIMEOUT_SECONDS) {
+        Schedule([this]() {
+            if (device_state_ == kDeviceStateIdle && protocol_->HasWarmAudioChannel()) {
+                ESP_LOGI(TAG, "Idle timeout, the warm audio channel is released");
+                protocol_->ReleaseWarmAudioChannel();
+            }
+        }, kMainTaskPriorityNormal, "warm_channel_timeout");
+    }
+#endif
+
     auto display = Board::GetInstance().GetDisplay();
     display->UpdateStatusBar();
 
+#if CONFIG_USE_AUDIO_FEC
+    // Tune the in-band FEC of the encoder to the loss measured on the link every 5 seconds
+    if (clock_ticks_ % 5 == 0) {
+        Schedule([this]() {
+            if (protocol_ && protocol_->audio_fec_inband() && protocol_->IsAudioChannelOpened()) {
+                audio_service_.SetUplinkPacketLoss(protocol_->transport_metrics().UpdateExpectedLoss());
+            }
+        }, kMainTaskPriorityNormal, "fec_loss_update");
+    }
+#endif
+
+#if CONFIG_USE_MAIN_LOOP_PROFILER
+    // Print the main loop latency every 60 seconds, the clock ticks restart with every state change
+    static int profiler_ticks = 0;
+    if (++profiler_ticks % 60 == 0) {
+        MainLoopProfiler::GetInstance().PrintStatistics();
+    }
+#endif
+
     // Print the debug info every 10 seconds
     if (clock_ticks_ % 10 == 0) {
         // SystemInfo::PrintTaskCpuUsage(pdMS_TO_TICKS(1000));
         // SystemInfo::PrintTaskList();
+        // audio_service_.PrintDebugStatistics();
         SystemInfo::PrintHeapStats();
         
         // If we have synchronized server time, set the status to clock "HH:MM" if the device is idle
@@ -536,7 +596,7 @@ void Application::OnClockTimer() {
                     char time_str[64];
                     strftime(time_str, sizeof(time_str), "%H:%M  ", localtime(&now));
                     Board::GetInstance().GetDisplay()->SetStatus(time_str);
-                });
+                }, kMainTaskPriorityDisplay, "clock_status");
             }
 
             // alarm check
@@ -548,14 +608,35 @@ void Application::OnClockTimer() {
 }
 
 // Add a async task to MainLoop
-void Application::Schedule(std::function<void()> callback) {
-    {
-        std::lock_guard<std::mutex> lock(mutex_);
-        main_tasks_.push_back(std::move(callback));
-    }
+void Application::Schedule(MainTask&& task, MainTaskPriority priority, const char* label) {
+    MainTaskTag tag;
+    tag.label = label;
+#if CONFIG_USE_MAIN_LOOP_PROFILER
+    tag.scheduled_us = esp_timer_get_time();
+#endif
+    main_tasks_.Push(priority, std::move(task), tag);
     xEventGroupSetBits(event_group_, MAIN_EVENT_SCHEDULE);
 }
 
+// Runs the scheduled tasks one at a time, so a task of a higher lane pushed meanwhile goes first
+void Application::RunScheduledTasks() {
+    const EventBits_t urgent_events = MAIN_EVENT_ERROR | MAIN_EVENT_WAKE_WORD_DETECTED;
+    MainTask task;
+    MainTaskTag tag;
+    while (main_tasks_.Pop(task, nullptr, &tag)) {
+        {
+            MainLoopTaskScope scope(tag.label, tag.scheduled_us);
+            task();
+            task.Reset();
+        }
+        /* Wake word and error events do not wait for the rest of a display backlog */
+        if ((xEventGroupGetBits(event_group_) & urgent_events) && !main_tasks_.IsEmpty()) {
+            xEventGroupSetBits(event_group_, MAIN_EVENT_SCHEDULE);
+            return;
+        }
+    }
+}
+
 // The Main Event Loop controls the chat state and websocket connection
 // If other tasks need to access the websocket or chat state,
 // they should use Schedule to call this function
@@ -565,28 +646,22 @@ void Application::MainEventLoop() {
 
     while (true) {
         auto bits = xEventGroupWaitBits(event_group_, MAIN_EVENT_SCHEDULE |
-            MAIN_EVENT_SEND_AUDIO |
             MAIN_EVENT_WAKE_WORD_DETECTED |
             MAIN_EVENT_VAD_CHANGE |
             MAIN_EVENT_ERROR, pdTRUE, pdFALSE, portMAX_DELAY);
         if (bits & MAIN_EVENT_ERROR) {
+            MainLoopTaskScope scope("event:error");
             SetDeviceState(kDeviceStateIdle);
             Alert(Lang::Strings::ERROR, last_error_message_.c_str(), "sad", Lang::Sounds::P3_EXCLAMATION);
         }
 
-        if (bits & MAIN_EVENT_SEND_AUDIO) {
-            while (auto packet = audio_service_.PopPacketFromSendQueue()) {
-                if (!protocol_->SendAudio(std::move(packet))) {
-                    break;
-                }
-            }
-        }
-
         if (bits & MAIN_EVENT_WAKE_WORD_DETECTED) {
+            MainLoopTaskScope scope("event:wake_word");
             OnWakeWordDetected();
         }
 
         if (bits & MAIN_EVENT_VAD_CHANGE) {
+            MainLoopTaskScope scope("event:vad_change");
             if (device_state_ == kDeviceStateListening) {
                 auto led = Board::GetInstance().GetLed();
                 led->OnStateChanged();
@@ -594,12 +669,7 @@ void Application::MainEventLoop() {
         }
 
         if (bits & MAIN_EVENT_SCHEDULE) {
-            std::unique_lock<std::mutex> lock(mutex_);
-            auto tasks = std::move(main_tasks_);
-            lock.unlock();
-            for (auto& task : tasks) {
-                task();
-            }
+            RunScheduledTasks();
         }
     }
 }
@@ -610,23 +680,45 @@ void Application::OnWakeWordDetected() {
     }
 
     if (device_state_ == kDeviceStateIdle) {
+        /* The pre-roll is encoded, the channel is opened and the live audio is captured at the same time */
+        // The live frames wait in the send queue until the pre-roll and the listen messages are sent
+        protocol_->PauseAudioSender(true);
+        wake_timing_ = WakeSequenceTiming();
+        wake_timing_.detected_us = esp_timer_get_time();
+        wake_timing_.warm_channel = protocol_->HasWarmAudioChannel();
         audio_service_.EncodeWakeWord();
+        audio_service_.EnableVoiceProcessing(true, false);
+        audio_service_.EnableWakeWordDetection(false);
+        wake_timing_.capture_started_us = esp_timer_get_time();
 
         if (!protocol_->IsAudioChannelOpened()) {
+            auto& capture_profile = audio_service_.GetAudioProfile();
             SetDeviceState(kDeviceStateConnecting);
             if (!protocol_->OpenAudioChannel()) {
+                wake_timing_.detected_us = 0;
+                /* The capture stops first, the frames it still hands to the encoder are dropped with the send queue */
+                audio_service_.EnableVoiceProcessing(false);
+                audio_service_.ClearSendQueue();
                 audio_service_.EnableWakeWordDetection(true);
+                protocol_->PauseAudioSender(false);
                 return;
             }
+            /* The server hello may have selected another profile than the one of the audio captured so far */
+            audio_service_.ReencodeQueuedAudio(capture_profile);
         }
+        wake_timing_.channel_opened_us = esp_timer_get_time();
 
         auto wake_word = audio_service_.GetLastWakeWord();
         ESP_LOGI(TAG, "Wake word detected: %s", wake_word.c_str());
 #if CONFIG_USE_AFE_WAKE_WORD || CONFIG_USE_CUSTOM_WAKE_WORD
         // Encode and send the wake word data to the server
         while (auto packet = audio_service_.PopWakeWordPacket()) {
-            protocol_->SendAudio(std::move(packet));
+            if (protocol_->SendAudio(*packet)) {
+                OnAudioSent(false);
+            }
+            audio_service_.ReleasePacket(std::move(packet));
         }
+        wake_timing_.preroll_sent_us = esp_timer_get_time();
         // Set the chat state to wake word detected
         protocol_->SendWakeWordDetected(wake_word);
         SetListeningMode(aec_mode_ == kAecOff ? kListeningModeAutoStop : kListeningModeRealtime);
@@ -635,6 +727,7 @@ void Application::OnWakeWordDetected() {
         // Play the pop up sound to indicate the wake word is detected
         audio_service_.PlaySound(Lang::Sounds::P3_POPUP);
 #endif
+        protocol_->PauseAudioSender(false);
     } else if (device_state_ == kDeviceStateSpeaking) {
         AbortSpeaking(kAbortReasonWakeWordDetected);
     } else if (device_state_ == kDeviceStateActivating) {
@@ -642,9 +735,64 @@ void Application::OnWakeWordDetected() {
     }
 }
 
+void Application::OnAudioSent(bool live) {
+    if (wake_timing_.detected_us == 0) {
+        return;
+    }
+
+    auto now = esp_timer_get_time();
+    if (wake_timing_.first_audio_sent_us == 0) {
+        wake_timing_.first_audio_sent_us = now;
+    }
+    if (!live) {
+        wake_timing_.preroll_packets++;
+        return;
+    }
+
+    /* Phases of the wake sequence, relative to the wake word */
+    auto since_wake = [this](int64_t time_us) {
+        return time_us != 0 ? (long)((time_us - wake_timing_.detected_us) / 1000) : -1L;
+    };
+    ESP_LOGI(TAG, "Wake sequence: capture %ld ms, channel opened %ld ms (warm connection: %s), %d pre-roll packets sent %ld ms, "
+        "first audio sent %ld ms, first live audio sent %ld ms",
+        since_wake(wake_timing_.capture_started_us), since_wake(wake_timing_.channel_opened_us), wake_timing_.warm_channel ? "yes" : "no",
+        wake_timing_.preroll_packets, since_wake(wake_timing_.preroll_sent_us), since_wake(wake_timing_.first_audio_sent_us), since_wake(now));
+    wake_timing_.detected_us = 0;
+}
+
+void Application::WarmUpAudioChannel() {
+#if CONFIG_USE_AUDIO_CHANNEL_KEEP_WARM
+    Schedule([this]() {
+        /* Only starts the warm-up task, a wake word meanwhile cancels it and connects on its own */
+        if (protocol_ && device_state_ == kDeviceStateIdle && !power_saving_ && !protocol_->IsAudioChannelOpened()) {
+            protocol_->WarmUpAudioChannel();
+        }
+    }, kMainTaskPriorityNormal, "warm_up_channel");
+#endif
+}
+
+void Application::SetPowerSaving(bool power_saving) {
+    power_saving_ = power_saving;
+#if CONFIG_USE_AUDIO_CHANNEL_KEEP_WARM
+    if (power_saving) {
+        Schedule([this]() {
+            if (protocol_ && protocol_->HasWarmAudioChannel()) {
+                ESP_LOGI(TAG, "Entering power save mode, the warm audio channel is released");
+                protocol_->ReleaseWarmAudioChannel();
+            }
+        }, kMainTaskPriorityHigh, "release_warm_channel");
+    } else if (device_state_ == kDeviceStateIdle) {
+        WarmUpAudioChannel();
+    }
+#endif
+}
+
 void Application::AbortSpeaking(AbortReason reason) {
     ESP_LOGI(TAG, "Abort speaking");
     aborted_ = true;
+    TraceLatency(kLatencyAbort);
+    /* The speaker is silenced first, the abort message may wait for a frame being sent */
+    audio_service_.AbortPlayback();
     protocol_->SendAbortSpeaking(reason);
 }
 
@@ -675,6 +823,7 @@ void Application::SetDeviceState(DeviceState state) {
         case kDeviceStateIdle:
             display->SetStatus(Lang::Strings::STANDBY);
             display->SetEmotion("neutral");
+            WarmUpAudioChannel();
             audio_service_.EnableVoiceProcessing(false);
             audio_service_.EnableWakeWordDetection(true);
             break;
@@ -684,13 +833,17 @@ void Application::SetDeviceState(DeviceState state) {
             display->SetChatMessage("system", "");
             break;
         case kDeviceStateListening:
+            TraceLatency(kLatencyListenStart);
             display->SetStatus(Lang::Strings::LISTENING);
             display->SetEmotion("neutral");
 
-            // Make sure the audio processor is running
-            if (!audio_service_.IsAudioProcessorRunning()) {
+            // The audio processor keeps running from speaking to listening in realtime mode, no new start is needed
+            if (previous_state != kDeviceStateSpeaking || !audio_service_.IsAudioProcessorRunning()) {
                 // Send the start listening command
                 protocol_->SendStartListening(listening_mode_);
+            }
+            // Make sure the audio processor is running, the wake word has started it already
+            if (!audio_service_.IsAudioProcessorRunning()) {
                 audio_service_.EnableVoiceProcessing(true);
                 audio_service_.EnableWakeWordDetection(false);
             }
@@ -731,13 +884,13 @@ void Application::WakeWordInvoke(const std::string& wake_word) {
     } else if (device_state_ == kDeviceStateSpeaking) {
         Schedule([this]() {
             AbortSpeaking(kAbortReasonNone);
-        });
+        }, kMainTaskPriorityHigh);
     } else if (device_state_ == kDeviceStateListening) {   
         Schedule([this]() {
             if (protocol_) {
                 protocol_->CloseAudioChannel();
             }
-        });
+        }, kMainTaskPriorityHigh);
     }
 }
 
@@ -7,18 +7,17 @@
 #include <esp_timer.h>
 
 #include <string>
-#include <mutex>
-#include <deque>
 #include <vector>
 #include <memory>
+#include <atomic>
 
 #include "protocol.h"
 #include "ota.h"
 #include "audio_service.h"
 #include "device_state_event.h"
+#include "main_task_queue.h"
 
 #define MAIN_EVENT_SCHEDULE (1 << 0)
-#define MAIN_EVENT_SEND_AUDIO (1 << 1)
 #define MAIN_EVENT_WAKE_WORD_DETECTED (1 << 2)
 #define MAIN_EVENT_VAD_CHANGE (1 << 3)
 #define MAIN_EVENT_ERROR (1 << 4)
@@ -44,7 +43,9 @@ public:
     void MainEventLoop();
     DeviceState GetDeviceState() const { return device_state_; }
     bool IsVoiceDetected() const { return audio_service_.IsVoiceDetected(); }
-    void Schedule(std::function<void()> callback);
+    // Runs the task in the main loop, only a display update may be dropped for a newer one. The label
+    // tells the profiler where the task comes from, it defaults to the name of the calling function.
+    void Schedule(MainTask&& task, MainTaskPriority priority = kMainTaskPriorityNormal, const char* label = __builtin_FUNCTION());
     void SetDeviceState(DeviceState state);
     void Alert(const char* status, const char* message, const char* emotion = "", const std::string_view& sound = "");
     void DismissAlert();
@@ -55,19 +56,22 @@ public:
     void Reboot();
     void WakeWordInvoke(const std::string& wake_word);
     bool CanEnterSleepMode();
+    // Called by the power save timer, a warm audio channel is not kept while sleeping
+    void SetPowerSaving(bool power_saving);
     void SendMcpMessage(const std::string& payload);
     void SendReminderMessage(const std::string& payload);
     void SetAecMode(AecMode mode);
     AecMode GetAecMode() const { return aec_mode_; }
     void PlaySound(const std::string_view& sound);
     AudioService& GetAudioService() { return audio_service_; }
+    // nullptr until the protocol is chosen in Start()
+    Protocol* GetProtocol() { return protocol_.get(); }
 
 private:
     Application();
     ~Application();
 
-    std::mutex mutex_;
-    std::deque<std::function<void()>> main_tasks_;
+    MainTaskQueue main_tasks_;
     std::unique_ptr<Protocol> protocol_;
     EventGroupHandle_t event_group_ = nullptr;
     esp_timer_handle_t clock_timer_handle_ = nullptr;
@@ -78,7 +82,19 @@ private:
     AudioService audio_service_;
 
     bool has_server_time_ = false;
-    bool aborted_ = false;
+    std::atomic<bool> aborted_ = false;
+    std::atomic<bool> power_saving_ = false;
+    // Timestamps of the wake sequence, measured until the first live frame is sent
+    struct WakeSequenceTiming {
+        int64_t detected_us = 0;
+        int64_t capture_started_us = 0;
+        int64_t channel_opened_us = 0;
+        int64_t preroll_sent_us = 0;
+        int64_t first_audio_sent_us = 0;
+        int preroll_packets = 0;
+        bool warm_channel = false;
+    };
+    WakeSequenceTiming wake_timing_;
     int clock_ticks_ = 0;
     TaskHandle_t check_new_version_task_handle_ = nullptr;
 
@@ -87,6 +103,9 @@ private:
     void ShowActivationCode(const std::string& code, const std::string& message);
     void OnClockTimer();
     void SetListeningMode(ListeningMode mode);
+    void WarmUpAudioChannel();
+    void OnAudioSent(bool live);
+    void RunScheduledTasks();
 };
 
 #endif // _APPLICATION_H_
@@ -0,0 +1,115 @@
+#ifndef AUDIO_POOL_H
+#define AUDIO_POOL_H
+
+#include <memory>
+#include <vector>
+#include <mutex>
+#include <functional>
+#include <cstdint>
+#include <cstddef>
+
+#include <esp_log.h>
+
+struct AudioPoolStatistics {
+    size_t capacity = 0;
+    size_t in_use = 0;
+    size_t high_water = 0;
+    uint32_t exhausted_count = 0;
+};
+
+/*
+ * Fixed-capacity pool for the per-frame objects of the audio pipeline (AudioTask, AudioStreamPacket).
+ *
+ * All objects are allocated once in Initialize(), while the heap is not fragmented yet. Their
+ * buffers (pcm / payload) keep the capacity they grew to, so a recycled object does not touch
+ * the heap again. The reset hook should free a buffer that grew past the usual size, the pool
+ * never shrinks and would pin it for good. When the pool is exhausted, Acquire() falls back to the heap and counts it;
+ * such overflow objects are freed by Release() if the pool is already full.
+ *
+ * An object deleted instead of released is simply lost to the pool, so consumers should
+ * Release() everything they Acquire(), but forgetting to do it is not a correctness problem.
+ */
+template <typename T>
+class AudioPool {
+public:
+    // reset is called on every released object, it should clear the object without freeing its buffers
+    AudioPool(const char* name, void (*reset)(T&)) : name_(name), reset_(reset) {}
+
+    ~AudioPool() {
+        for (auto object : free_list_) {
+            delete object;
+        }
+    }
+
+    AudioPool(const AudioPool&) = delete;
+    AudioPool& operator=(const AudioPool&) = delete;
+
+    // prepare is called once on every preallocated object, e.g. to reserve its buffers
+    void Initialize(size_t capacity, std::function<void(T&)> prepare = nullptr) {
+        prepare_ = prepare;
+        Reserve(capacity);
+    }
+
+    // Grow the pool, e.g. when the queues hold more frames of a shorter duration. It never shrinks.
+    void Reserve(size_t capacity) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (capacity <= statistics_.capacity) {
+            return;
+        }
+        free_list_.reserve(capacity);
+        for (size_t i = statistics_.capacity; i < capacity; i++) {
+            auto object = new T();
+            if (prepare_) {
+                prepare_(*object);
+            }
+            free_list_.push_back(object);
+        }
+        statistics_.capacity = capacity;
+    }
+
+    std::unique_ptr<T> Acquire() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        statistics_.in_use++;
+        if (statistics_.in_use > statistics_.high_water) {
+            statistics_.high_water = statistics_.in_use;
+        }
+        if (free_list_.empty()) {
+            if (statistics_.exhausted_count++ == 0) {
+                ESP_LOGW("AudioPool", "%s pool exhausted (capacity %u), falling back to heap", name_, statistics_.capacity);
+            }
+            return std::make_unique<T>();
+        }
+        auto object = free_list_.back();
+        free_list_.pop_back();
+        return std::unique_ptr<T>(object);
+    }
+
+    void Release(std::unique_ptr<T> object) {
+        if (!object) {
+            return;
+        }
+        reset_(*object);
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (statistics_.in_use > 0) {
+            statistics_.in_use--;
+        }
+        if (free_list_.size() < statistics_.capacity) {
+            free_list_.push_back(object.release());
+        }
+    }
+
+    AudioPoolStatistics statistics() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return statistics_;
+    }
+
+private:
+    const char* name_;
+    void (*reset_)(T&);
+    std::function<void(T&)> prepare_;
+    std::mutex mutex_;
+    std::vector<T*> free_list_;
+    AudioPoolStatistics statistics_;
+};
+
+#endif // AUDIO_POOL_H
@@ -0,0 +1,45 @@
+#ifndef AUDIO_PROFILE_H
+#define AUDIO_PROFILE_H
+
+#include <string>
+#include <cstring>
+
+/*
+ * Uplink encoder profiles. The device advertises its preferred profile and the names it supports
+ * in the hello message; the server may answer with the profile to use in its own hello.
+ * The encoder always works on 16kHz mono.
+ */
+struct AudioProfile {
+    const char* name;
+    int frame_duration_ms;
+    int bitrate;        // bits per second, 0 lets Opus choose
+    int complexity;
+};
+
+inline constexpr AudioProfile kAudioProfiles[] = {
+    { "low_latency",   20, 24000, 0 },
+    { "standard",      60, 0,     0 },
+    { "low_bandwidth", 60, 16000, 0 },
+};
+
+// Shortest frame of all profiles, the queues are allocated for it
+#define AUDIO_PROFILE_MIN_FRAME_DURATION_MS 20
+
+#if CONFIG_AUDIO_PROFILE_LOW_LATENCY
+#define DEFAULT_AUDIO_PROFILE "low_latency"
+#elif CONFIG_AUDIO_PROFILE_LOW_BANDWIDTH
+#define DEFAULT_AUDIO_PROFILE "low_bandwidth"
+#else
+#define DEFAULT_AUDIO_PROFILE "standard"
+#endif
+
+inline const AudioProfile* FindAudioProfile(const std::string& name) {
+    for (const auto& profile : kAudioProfiles) {
+        if (name == profile.name) {
+            return &profile;
+        }
+    }
+    return nullptr;
+}
+
+#endif // AUDIO_PROFILE_H
@@ -0,0 +1,160 @@
+#ifndef AUDIO_QUEUE_H
+#define AUDIO_QUEUE_H
+
+#include <atomic>
+#include <memory>
+#include <functional>
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/event_groups.h>
+
+/*
+ * Bounded single-producer / single-consumer ring queue used between the audio tasks.
+ *
+ * Push() must only be called by one producer task and Pop() by one consumer task at a time,
+ * so the data path takes no lock. If a queue has more than one producer, the caller serializes
+ * them with its own mutex.
+ *
+ * Clear() may be called from any task. It only moves the flush mark up to the current tail,
+ * the flushed items are dropped by the consumer in its next Pop().
+ *
+ * Each queue owns two bits of an event group: not_empty_bit is set after every push and
+ * not_full_bit after every pop, so a task only wakes up for the queues it is waiting on.
+ * Every bit should only have one waiting task, see WaitNotEmpty() / WaitNotFull().
+ *
+ * The slots are allocated once for the shortest frame duration; SetLimit() bounds the number
+ * of items in use, so the queue holds the same amount of audio for longer frames.
+ */
+template <typename T>
+class AudioQueue {
+public:
+    AudioQueue(size_t capacity, EventGroupHandle_t event_group, EventBits_t not_empty_bit, EventBits_t not_full_bit)
+        : capacity_(capacity), limit_(capacity), slots_(new T[capacity]), event_group_(event_group),
+          not_empty_bit_(not_empty_bit), not_full_bit_(not_full_bit) {
+    }
+
+    AudioQueue(const AudioQueue&) = delete;
+    AudioQueue& operator=(const AudioQueue&) = delete;
+
+    // Producer side, returns false if the queue is full
+    bool Push(T&& item) {
+        uint32_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - head_.load(std::memory_order_acquire) >= limit_.load(std::memory_order_relaxed)) {
+            return false;
+        }
+        slots_[tail % capacity_] = std::move(item);
+        tail_.store(tail + 1, std::memory_order_release);
+        xEventGroupSetBits(event_group_, not_empty_bit_);
+        return true;
+    }
+
+    // Consumer side, returns false if the queue is empty
+    bool Pop(T& item) {
+        uint32_t head = head_.load(std::memory_order_relaxed);
+        while (head != tail_.load(std::memory_order_acquire)) {
+            T value = std::move(slots_[head % capacity_]);
+            head_.store(++head, std::memory_order_release);
+            xEventGroupSetBits(event_group_, not_full_bit_);
+            if (static_cast<int32_t>(flush_.load(std::memory_order_acquire) - head) >= 0) {
+                // Flushed by Clear(), drop it
+                if (on_drop_) {
+                    on_drop_(std::move(value));
+                }
+                continue;
+            }
+            item = std::move(value);
+            return true;
+        }
+        return false;
+    }
+
+    void Clear() {
+        uint32_t tail = tail_.load(std::memory_order_acquire);
+        uint32_t flush = flush_.load(std::memory_order_relaxed);
+        while (static_cast<int32_t>(tail - flush) > 0 &&
+            !flush_.compare_exchange_weak(flush, tail, std::memory_order_acq_rel)) {
+        }
+        // Wake up the consumer so the flushed items are released
+        xEventGroupSetBits(event_group_, not_empty_bit_);
+    }
+
+    // Number of items the consumer will still receive
+    size_t Size() const {
+        /* The tail is read first, the head read after it is at most the capacity behind it, also from another task */
+        uint32_t tail = tail_.load(std::memory_order_acquire);
+        uint32_t flush = flush_.load(std::memory_order_acquire);
+        uint32_t head = head_.load(std::memory_order_acquire);
+        uint32_t start = static_cast<int32_t>(flush - head) > 0 ? flush : head;
+        return static_cast<int32_t>(tail - start) > 0 ? tail - start : 0;
+    }
+
+    /*
+     * Empty() and Full() look at the slots held by the ring, including flushed items not yet
+     * dropped. The consumer keeps calling Pop() while !Empty(), so the slots are released.
+     */
+    bool Empty() const {
+        return tail_.load(std::memory_order_acquire) == head_.load(std::memory_order_acquire);
+    }
+
+    bool Full() const {
+        return tail_.load(std::memory_order_acquire) - head_.load(std::memory_order_acquire) >= limit_.load(std::memory_order_relaxed);
+    }
+
+    // Maximum number of items in the queue, from 1 to capacity(). May be called from any task.
+    void SetLimit(size_t limit) {
+        limit_.store(std::clamp<size_t>(limit, 1, capacity_), std::memory_order_relaxed);
+        // A raised limit may unblock the producer
+        xEventGroupSetBits(event_group_, not_full_bit_);
+    }
+
+    /*
+     * Block until the queue has items, or any of abort_bits is set (e.g. the service is stopped).
+     * The bit is cleared before checking, so a push between the check and the wait is never lost.
+     */
+    bool WaitNotEmpty(EventBits_t abort_bits = 0, TickType_t timeout = portMAX_DELAY) {
+        xEventGroupClearBits(event_group_, not_empty_bit_);
+        if (!Empty()) {
+            return true;
+        }
+        xEventGroupWaitBits(event_group_, not_empty_bit_ | abort_bits, pdFALSE, pdFALSE, timeout);
+        return !Empty();
+    }
+
+    bool WaitNotFull(EventBits_t abort_bits = 0, TickType_t timeout = portMAX_DELAY) {
+        xEventGroupClearBits(event_group_, not_full_bit_);
+        if (!Full()) {
+            return true;
+        }
+        xEventGroupWaitBits(event_group_, not_full_bit_ | abort_bits, pdFALSE, pdFALSE, timeout);
+        return !Full();
+    }
+
+    // Called by the consumer with every flushed item, e.g. to return it to a pool. Set before the tasks start.
+    void OnDrop(std::function<void(T&&)> callback) {
+        on_drop_ = callback;
+    }
+
+    inline size_t capacity() const { return capacity_; }
+    inline size_t limit() const { return limit_.load(std::memory_order_relaxed); }
+    inline EventBits_t not_empty_bit() const { return not_empty_bit_; }
+    inline EventBits_t not_full_bit() const { return not_full_bit_; }
+
+private:
+    const size_t capacity_;
+    std::atomic<size_t> limit_;
+    std::unique_ptr<T[]> slots_;
+    EventGroupHandle_t event_group_;
+    const EventBits_t not_empty_bit_;
+    const EventBits_t not_full_bit_;
+    std::function<void(T&&)> on_drop_;
+
+    // Free running counters, the slot index is counter % capacity_
+    std::atomic<uint32_t> head_ = 0;
+    std::atomic<uint32_t> tail_ = 0;
+    std::atomic<uint32_t> flush_ = 0;
+};
+
+#endif // AUDIO_QUEUE_H
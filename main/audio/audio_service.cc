@@ -1,5 +1,10 @@
 #include "audio_service.h"
 #include <esp_log.h>
+#include <algorithm>
+
+#include "pcm_kernels.h"
+#include "settings.h"
+#include "latency_tracer.h"
 
 #if CONFIG_USE_AUDIO_PROCESSOR
 #include "processors/afe_audio_processor.h"
@@ -18,8 +23,63 @@
 #define TAG "AudioService"
 
 
-AudioService::AudioService() {
-    event_group_ = xEventGroupCreate();
+/* Clear the recycled objects but keep the capacity of their buffers */
+static void ResetPacket(AudioStreamPacket& packet) {
+    packet.sample_rate = 0;
+    packet.frame_duration = 0;
+    packet.timestamp = 0;
+    packet.sequence = 0;
+    if (packet.payload.capacity() > AUDIO_PACKET_MAX_KEPT_CAPACITY) {
+        /* An oversized packet, e.g. a wake word packet or a redundant frame, does not pin its buffer in the pool */
+        std::vector<uint8_t>().swap(packet.payload);
+    } else {
+        packet.payload.clear();
+    }
+    packet.headroom = 0;
+    packet.fec = false;
+    packet.redundant = false;
+}
+
+static void ResetTask(AudioTask& task) {
+    task.type = kAudioTaskTypeEncodeToSendQueue;
+    task.pcm.clear();
+    task.timestamp = 0;
+}
+
+AudioService::AudioService()
+    : opus_decoders_(OPUS_DECODER_CACHE_CAPACITY),
+      event_group_(xEventGroupCreate()),
+      packet_pool_("packet", ResetPacket),
+      task_pool_("task", ResetTask),
+      audio_decode_queue_(MAX_DECODE_PACKETS_IN_QUEUE, event_group_, AS_EVENT_DECODE_NOT_EMPTY, AS_EVENT_DECODE_NOT_FULL),
+      audio_send_queue_(MAX_SEND_PACKETS_IN_QUEUE, event_group_, AS_EVENT_SEND_NOT_EMPTY, AS_EVENT_SEND_NOT_FULL),
+      audio_testing_queue_(MAX_TESTING_PACKETS_IN_QUEUE, event_group_, AS_EVENT_TESTING_NOT_EMPTY, AS_EVENT_TESTING_NOT_FULL),
+      audio_encode_queue_(MAX_ENCODE_TASKS_IN_QUEUE, event_group_, AS_EVENT_ENCODE_NOT_EMPTY, AS_EVENT_ENCODE_NOT_FULL),
+      audio_playback_queue_(MAX_PLAYBACK_TASKS_IN_QUEUE, event_group_, AS_EVENT_PLAYBACK_NOT_EMPTY, AS_EVENT_PLAYBACK_NOT_FULL),
+      jitter_buffer_(JITTER_BUFFER_CAPACITY, JITTER_BUFFER_MIN_DELAY_MS, JITTER_BUFFER_MAX_DELAY_MS),
+      sound_cache_(SOUND_CACHE_BUDGET_BYTES),
+      audio_sound_queue_(MAX_SOUNDS_IN_QUEUE, event_group_, AS_EVENT_SOUND_NOT_EMPTY, AS_EVENT_SOUND_NOT_FULL),
+      audio_sound_decode_queue_(MAX_SOUNDS_IN_QUEUE, event_group_, AS_EVENT_SOUND_DECODE_NOT_EMPTY, AS_EVENT_SOUND_DECODE_NOT_FULL) {
+    /* Flushed items go back to the pools */
+    auto release_packet = [this](std::unique_ptr<AudioStreamPacket>&& packet) {
+        packet_pool_.Release(std::move(packet));
+    };
+    auto release_task = [this](std::unique_ptr<AudioTask>&& task) {
+        task_pool_.Release(std::move(task));
+    };
+    audio_decode_queue_.OnDrop(release_packet);
+    audio_send_queue_.OnDrop(release_packet);
+    audio_testing_queue_.OnDrop(release_packet);
+    audio_encode_queue_.OnDrop(release_task);
+    audio_playback_queue_.OnDrop(release_task);
+    audio_playback_queue_.SetLimit(MIN_PLAYBACK_TASKS_IN_QUEUE);
+    jitter_buffer_.OnDrop(release_packet);
+    audio_sound_queue_.OnDrop([this](SoundChunk&& chunk) {
+        task_pool_.Release(std::move(chunk.task));
+    });
+    audio_sound_decode_queue_.OnDrop([this](SoundRequest&& request) {
+        pending_sound_requests_--;
+    });
 }
 
 AudioService::~AudioService() {
@@ -34,14 +94,31 @@ void AudioService::Initialize(AudioCodec* codec) {
     codec_->Start();
 
     /* Setup the audio codec */
-    opus_decoder_ = std::make_unique<OpusDecoderWrapper>(codec->output_sample_rate(), 1, OPUS_FRAME_DURATION_MS);
-    opus_encoder_ = std::make_unique<OpusEncoderWrapper>(16000, 1, OPUS_FRAME_DURATION_MS);
-    opus_encoder_->SetComplexity(0);
+    opus_decoders_.Initialize(codec->output_sample_rate());
+
+    /* Allocate the frame pools before the heap gets fragmented */
+    size_t max_frame_samples = OPUS_FRAME_DURATION_MS * std::max(codec->output_sample_rate(), 16000) / 1000;
+    task_pool_.Initialize(AUDIO_TASK_POOL_SIZE(MIN_PLAYBACK_TASKS_IN_QUEUE), [max_frame_samples](AudioTask& task) {
+        task.pcm.reserve(max_frame_samples);
+    });
+    resample_buffer_.reserve(max_frame_samples);
+    output_chunk_.reserve(PLAYBACK_CHUNK_DURATION_MS * codec->output_sample_rate() / 1000);
+
+    /* Create the encoder and size the queues and the packet pool for the preferred profile */
+    SetDownlinkFrameDuration(OPUS_FRAME_DURATION_MS);
+    SetAudioProfile("");
 
     if (codec->input_sample_rate() != 16000) {
         input_resampler_.Configure(codec->input_sample_rate(), 16000);
         reference_resampler_.Configure(codec->input_sample_rate(), 16000);
+
+        size_t input_frame_samples = OPUS_FRAME_DURATION_MS * codec->input_sample_rate() / 1000;
+        mic_channel_buffer_.reserve(input_frame_samples);
+        reference_channel_buffer_.reserve(input_frame_samples);
+        resampled_mic_buffer_.reserve(OPUS_FRAME_DURATION_MS * 16000 / 1000);
+        resampled_reference_buffer_.reserve(OPUS_FRAME_DURATION_MS * 16000 / 1000);
     }
+    input_buffer_.reserve(OPUS_FRAME_DURATION_MS * codec->input_sample_rate() / 1000 * codec->input_channels());
 
 #if CONFIG_USE_AUDIO_PROCESSOR
     audio_processor_ = std::make_unique<AfeAudioProcessor>();
@@ -65,6 +142,7 @@ void AudioService::Initialize(AudioCodec* codec) {
 
     audio_processor_->OnVadStateChange([this](bool speaking) {
         voice_detected_ = speaking;
+        TraceLatency(speaking ? kLatencyVoiceStart : kLatencyVoiceEnd);
         if (callbacks_.on_vad_change) {
             callbacks_.on_vad_change(speaking);
         }
@@ -72,6 +150,7 @@ void AudioService::Initialize(AudioCodec* codec) {
 
     if (wake_word_) {
         wake_word_->OnWakeWordDetected([this](const std::string& wake_word) {
+            TraceLatency(kLatencyWakeWord);
             if (callbacks_.on_wake_word_detected) {
                 callbacks_.on_wake_word_detected(wake_word);
             }
@@ -89,11 +168,24 @@ void AudioService::Initialize(AudioCodec* codec) {
         .skip_unhandled_events = true,
     };
     esp_timer_create(&audio_power_timer_args, &audio_power_timer_);
+
+    esp_timer_create_args_t jitter_buffer_timer_args = {
+        .callback = [](void* arg) {
+            AudioService* audio_service = (AudioService*)arg;
+            audio_service->OnJitterBufferTimer();
+        },
+        .arg = this,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "jitter_buffer_timer",
+        .skip_unhandled_events = true,
+    };
+    esp_timer_create(&jitter_buffer_timer_args, &jitter_buffer_timer_);
 }
 
 void AudioService::Start() {
     service_stopped_ = false;
-    xEventGroupClearBits(event_group_, AS_EVENT_AUDIO_TESTING_RUNNING | AS_EVENT_WAKE_WORD_RUNNING | AS_EVENT_AUDIO_PROCESSOR_RUNNING);
+    xEventGroupClearBits(event_group_, AS_EVENT_AUDIO_TESTING_RUNNING | AS_EVENT_WAKE_WORD_RUNNING | AS_EVENT_AUDIO_PROCESSOR_RUNNING |
+        AS_EVENT_ALL_QUEUES | AS_EVENT_SERVICE_STOPPED);
 
     esp_timer_start_periodic(audio_power_timer_, 1000000);
 
@@ -127,12 +219,18 @@ void AudioService::Start() {
     }, "audio_output", 2048, this, 3, &audio_output_task_handle_);
 #endif
 
-    /* Start the opus codec task */
-    xTaskCreate([](void* arg) {
+    /* Start the opus tasks, so encoding and decoding make progress at the same time in full-duplex mode */
+    xTaskCreatePinnedToCore([](void* arg) {
+        AudioService* audio_service = (AudioService*)arg;
+        audio_service->OpusEncodeTask();
+        vTaskDelete(NULL);
+    }, "opus_encode", OPUS_ENCODE_TASK_STACK_SIZE, this, OPUS_ENCODE_TASK_PRIORITY, &opus_encode_task_handle_, OPUS_ENCODE_TASK_CORE);
+
+    xTaskCreatePinnedToCore([](void* arg) {
         AudioService* audio_service = (AudioService*)arg;
-        audio_service->OpusCodecTask();
+        audio_service->OpusDecodeTask();
         vTaskDelete(NULL);
-    }, "opus_codec", 2048 * 13, this, 2, &opus_codec_task_handle_);
+    }, "opus_decode", OPUS_DECODE_TASK_STACK_SIZE, this, OPUS_DECODE_TASK_PRIORITY, &opus_decode_task_handle_, OPUS_DECODE_TASK_CORE);
 }
 
 void AudioService::Stop() {
@@ -142,12 +240,20 @@ void AudioService::Stop() {
         AS_EVENT_WAKE_WORD_RUNNING |
         AS_EVENT_AUDIO_PROCESSOR_RUNNING);
 
-    std::lock_guard<std::mutex> lock(audio_queue_mutex_);
-    audio_encode_queue_.clear();
-    audio_decode_queue_.clear();
-    audio_playback_queue_.clear();
-    audio_testing_queue_.clear();
-    audio_queue_cv_.notify_all();
+    audio_encode_queue_.Clear();
+    audio_decode_queue_.Clear();
+    audio_playback_queue_.Clear();
+    audio_testing_queue_.Clear();
+    audio_testing_replay_ = false;
+    audio_sound_queue_.Clear();
+    audio_sound_decode_queue_.Clear();
+    {
+        std::lock_guard<std::mutex> lock(decode_producer_mutex_);
+        esp_timer_stop(jitter_buffer_timer_);
+        jitter_buffer_.Reset();
+    }
+    // Wake up every task waiting on a queue, so they can see service_stopped_
+    xEventGroupSetBits(event_group_, AS_EVENT_SERVICE_STOPPED);
 }
 
 bool AudioService::ReadAudioData(std::vector<int16_t>& data, int sample_rate, int samples) {
@@ -161,27 +267,25 @@ bool AudioService::ReadAudioData(std::vector<int16_t>& data, int sample_rate, in
         if (!codec_->InputData(data)) {
             return false;
         }
+        std::lock_guard<std::mutex> lock(input_mutex_);
+        auto start_time = esp_timer_get_time();
         if (codec_->input_channels() == 2) {
-            auto mic_channel = std::vector<int16_t>(data.size() / 2);
-            auto reference_channel = std::vector<int16_t>(data.size() / 2);
-            for (size_t i = 0, j = 0; i < mic_channel.size(); ++i, j += 2) {
-                mic_channel[i] = data[j];
-                reference_channel[i] = data[j + 1];
-            }
-            auto resampled_mic = std::vector<int16_t>(input_resampler_.GetOutputSamples(mic_channel.size()));
-            auto resampled_reference = std::vector<int16_t>(reference_resampler_.GetOutputSamples(reference_channel.size()));
-            input_resampler_.Process(mic_channel.data(), mic_channel.size(), resampled_mic.data());
-            reference_resampler_.Process(reference_channel.data(), reference_channel.size(), resampled_reference.data());
-            data.resize(resampled_mic.size() + resampled_reference.size());
-            for (size_t i = 0, j = 0; i < resampled_mic.size(); ++i, j += 2) {
-                data[j] = resampled_mic[i];
-                data[j + 1] = resampled_reference[i];
-            }
+            size_t frames = data.size() / 2;
+            mic_channel_buffer_.resize(frames);
+            reference_channel_buffer_.resize(frames);
+            PcmDeinterleaveStereo(data.data(), mic_channel_buffer_.data(), reference_channel_buffer_.data(), frames);
+            resampled_mic_buffer_.resize(input_resampler_.GetOutputSamples(frames));
+            resampled_reference_buffer_.resize(reference_resampler_.GetOutputSamples(frames));
+            input_resampler_.Process(mic_channel_buffer_.data(), frames, resampled_mic_buffer_.data());
+            reference_resampler_.Process(reference_channel_buffer_.data(), frames, resampled_reference_buffer_.data());
+            data.resize(resampled_mic_buffer_.size() * 2);
+            PcmInterleaveStereo(resampled_mic_buffer_.data(), resampled_reference_buffer_.data(), data.data(), resampled_mic_buffer_.size());
         } else {
-            auto resampled = std::vector<int16_t>(input_resampler_.GetOutputSamples(data.size()));
-            input_resampler_.Process(data.data(), data.size(), resampled.data());
-            data = std::move(resampled);
+            resampled_mic_buffer_.resize(input_resampler_.GetOutputSamples(data.size()));
+            input_resampler_.Process(data.data(), data.size(), resampled_mic_buffer_.data());
+            data.assign(resampled_mic_buffer_.begin(), resampled_mic_buffer_.end());
         }
+        debug_statistics_.input_resample_time.Add(esp_timer_get_time() - start_time);
     } else {
         data.resize(samples);
         if (!codec_->InputData(data)) {
@@ -221,34 +325,29 @@ void AudioService::AudioInputTask() {
 
         /* Used for audio testing in NetworkConfiguring mode by clicking the BOOT button */
         if (bits & AS_EVENT_AUDIO_TESTING_RUNNING) {
-            if (audio_testing_queue_.size() >= AUDIO_TESTING_MAX_DURATION_MS / OPUS_FRAME_DURATION_MS) {
+            if (audio_testing_queue_.Full()) {
                 ESP_LOGW(TAG, "Audio testing queue is full, stopping audio testing");
                 EnableAudioTesting(false);
                 continue;
             }
-            std::vector<int16_t> data;
-            int samples = OPUS_FRAME_DURATION_MS * 16000 / 1000;
-            if (ReadAudioData(data, 16000, samples)) {
+            int samples = audio_profile_.load()->frame_duration_ms * 16000 / 1000;
+            if (ReadAudioData(input_buffer_, 16000, samples)) {
                 // If input channels is 2, we need to fetch the left channel data
                 if (codec_->input_channels() == 2) {
-                    auto mono_data = std::vector<int16_t>(data.size() / 2);
-                    for (size_t i = 0, j = 0; i < mono_data.size(); ++i, j += 2) {
-                        mono_data[i] = data[j];
-                    }
-                    data = std::move(mono_data);
+                    PcmExtractLeft(input_buffer_.data(), input_buffer_.data(), input_buffer_.size() / 2);
+                    input_buffer_.resize(input_buffer_.size() / 2);
                 }
-                PushTaskToEncodeQueue(kAudioTaskTypeEncodeToTestingQueue, std::move(data));
+                PushTaskToEncodeQueue(kAudioTaskTypeEncodeToTestingQueue, std::move(input_buffer_));
                 continue;
             }
         }
 
         /* Feed the wake word */
         if (bits & AS_EVENT_WAKE_WORD_RUNNING) {
-            std::vector<int16_t> data;
             int samples = wake_word_->GetFeedSize();
             if (samples > 0) {
-                if (ReadAudioData(data, 16000, samples)) {
-                    wake_word_->Feed(data);
+                if (ReadAudioData(input_buffer_, 16000, samples)) {
+                    wake_word_->Feed(input_buffer_);
                     continue;
                 }
             }
@@ -256,11 +355,10 @@ void AudioService::AudioInputTask() {
 
         /* Feed the audio processor */
         if (bits & AS_EVENT_AUDIO_PROCESSOR_RUNNING) {
-            std::vector<int16_t> data;
             int samples = audio_processor_->GetFeedSize();
             if (samples > 0) {
-                if (ReadAudioData(data, 16000, samples)) {
-                    audio_processor_->Feed(std::move(data));
+                if (ReadAudioData(input_buffer_, 16000, samples)) {
+                    audio_processor_->Feed(std::move(input_buffer_));
                     continue;
                 }
             }
@@ -274,185 +372,575 @@ void AudioService::AudioInputTask() {
 }
 
 void AudioService::AudioOutputTask() {
+    const EventBits_t wait_bits = audio_playback_queue_.not_empty_bit() | audio_sound_queue_.not_empty_bit();
+    bool frame_played = false;
+
     while (true) {
-        std::unique_lock<std::mutex> lock(audio_queue_mutex_);
-        audio_queue_cv_.wait(lock, [this]() { return !audio_playback_queue_.empty() || service_stopped_; });
+        /* Clear the bits before checking the queues, so no push in between is lost */
+        xEventGroupClearBits(event_group_, wait_bits);
         if (service_stopped_) {
             break;
         }
 
-        auto task = std::move(audio_playback_queue_.front());
-        audio_playback_queue_.pop_front();
-        audio_queue_cv_.notify_all();
-        lock.unlock();
+        if (audio_playback_queue_.Empty() && audio_sound_queue_.Empty()) {
+            /* Nothing is playing, so an abort requested meanwhile has nothing to fade out */
+            handled_playback_abort_count_ = playback_abort_count_;
+            playback_abort_time_us_ = 0;
+            if (frame_played) {
+                /* The speaker starves once the DMA buffers run out, unless the next frame comes first */
+                playback_starved_since_us_ = esp_timer_get_time();
+                frame_played = false;
+            }
+            xEventGroupWaitBits(event_group_, wait_bits | AS_EVENT_SERVICE_STOPPED, pdFALSE, pdFALSE, portMAX_DELAY);
+            if (handled_playback_abort_count_ != playback_abort_count_) {
+                /* Stopped on purpose, the next frame starts a new stream */
+                handled_playback_abort_count_ = playback_abort_count_;
+                playback_starved_since_us_ = 0;
+            }
+            continue;
+        }
 
-        if (!codec_->output_enabled()) {
-            codec_->EnableOutput(true);
-            esp_timer_start_periodic(audio_power_timer_, AUDIO_POWER_CHECK_INTERVAL_MS * 1000);
+        /* Decoded sounds do not wait behind the decoded frames */
+        SoundChunk sound;
+        if (audio_sound_queue_.Pop(sound)) {
+            if (sound.pcm) {
+                WriteOutput(sound.pcm->data(), sound.pcm->size());
+            } else {
+                WriteOutput(sound.task->pcm.data(), sound.task->pcm.size());
+                task_pool_.Release(std::move(sound.task));
+            }
+            /* The speaker did not starve while the sound was playing */
+            frame_played = false;
+            playback_starved_since_us_ = 0;
+            continue;
         }
-        codec_->OutputData(task->pcm);
 
-        /* Update the last output time */
-        last_output_time_ = std::chrono::steady_clock::now();
+        std::unique_ptr<AudioTask> task;
+        size_t depth = audio_playback_queue_.Size();
+        if (!audio_playback_queue_.Pop(task)) {
+            continue;
+        }
+        TrackPlaybackQueue(depth);
+        TraceLatency(kLatencyPlaybackFirst);
+
+        auto start_time = esp_timer_get_time();
+        frame_played = WriteOutput(task->pcm.data(), task->pcm.size());
+        debug_statistics_.output_time.Add(esp_timer_get_time() - start_time);
         debug_statistics_.playback_count++;
 
 #if CONFIG_USE_SERVER_AEC
         /* Record the timestamp for server AEC */
         if (task->timestamp > 0) {
-            lock.lock();
+            std::lock_guard<std::mutex> lock(timestamp_mutex_);
             timestamp_queue_.push_back(task->timestamp);
         }
 #endif
+        task_pool_.Release(std::move(task));
     }
 
     ESP_LOGW(TAG, "Audio output task stopped");
 }
 
-void AudioService::OpusCodecTask() {
+// Returns false if the playback was stopped before the end of the data
+bool AudioService::WriteOutput(const int16_t* data, size_t samples) {
+    if (!codec_->output_enabled()) {
+        codec_->EnableOutput(true);
+        esp_timer_start_periodic(audio_power_timer_, AUDIO_POWER_CHECK_INTERVAL_MS * 1000);
+    }
+
+    size_t chunk_samples = PLAYBACK_CHUNK_DURATION_MS * codec_->output_sample_rate() / 1000;
+    for (size_t offset = 0; offset < samples; offset += chunk_samples) {
+        if (service_stopped_) {
+            return false;
+        }
+        uint32_t abort_count = playback_abort_count_;
+        if (abort_count != handled_playback_abort_count_) {
+            handled_playback_abort_count_ = abort_count;
+            FadeOutput(data + offset, samples - offset);
+            return false;
+        }
+        size_t count = std::min(chunk_samples, samples - offset);
+        output_chunk_.assign(data + offset, data + offset + count);
+        codec_->OutputData(output_chunk_);
+
+        /* Update the last output time */
+        last_output_time_ = std::chrono::steady_clock::now();
+    }
+    return true;
+}
+
+// Fade the next samples out after an abort, and record the abort latency
+void AudioService::FadeOutput(const int16_t* data, size_t samples) {
+    int32_t fade_samples = std::min<size_t>(samples, PLAYBACK_FADE_OUT_DURATION_MS * codec_->output_sample_rate() / 1000);
+    if (fade_samples > 0) {
+        output_chunk_.resize(fade_samples);
+        PcmFadeOut(data, output_chunk_.data(), fade_samples);
+        codec_->OutputData(output_chunk_);
+    }
+
+    int64_t abort_time = playback_abort_time_us_.exchange(0);
+    if (abort_time > 0) {
+        /* What was written last still has to leave the DMA buffers, they are cleared after being sent */
+        int64_t latency_us = esp_timer_get_time() - abort_time + GetOutputBufferDurationUs();
+        debug_statistics_.abort_latency.Add(latency_us);
+        ESP_LOGI(TAG, "Playback aborted, silent after %ld ms", (long)(latency_us / 1000));
+    }
+}
+
+int64_t AudioService::GetOutputBufferDurationUs() const {
+    return AUDIO_CODEC_DMA_DESC_NUM * AUDIO_CODEC_DMA_FRAME_NUM * 1000000LL / codec_->output_sample_rate();
+}
+
+// Called by the output task for every decoded frame it takes, with the number of frames that were queued
+void AudioService::TrackPlaybackQueue(size_t depth) {
+    auto& s = debug_statistics_;
+    s.playback_queue_depth[std::min<size_t>(depth, MAX_PLAYBACK_TASKS_IN_QUEUE)]++;
+
+    if (playback_starved_since_us_ > 0) {
+        int64_t gap_us = esp_timer_get_time() - playback_starved_since_us_;
+        int64_t starvation_us = gap_us - GetOutputBufferDurationUs();
+        playback_starved_since_us_ = 0;
+        if (starvation_us > 0 && gap_us < PLAYBACK_UNDERRUN_MAX_GAP_MS * 1000) {
+            s.playback_underruns++;
+            s.starvation_time.Add(starvation_us);
+            playback_stable_frames_ = 0;
+            if (s.playback_lookahead < MAX_PLAYBACK_TASKS_IN_QUEUE) {
+                s.playback_lookahead++;
+                task_pool_.Reserve(AUDIO_TASK_POOL_SIZE(s.playback_lookahead));
+                audio_playback_queue_.SetLimit(s.playback_lookahead);
+                ESP_LOGI(TAG, "Playback underrun (%ld ms), look-ahead raised to %lu frames",
+                    (long)(starvation_us / 1000), s.playback_lookahead);
+            }
+            return;
+        }
+    }
+
+    if (++playback_stable_frames_ >= PLAYBACK_STABLE_FRAMES_TO_SHRINK) {
+        playback_stable_frames_ = 0;
+        if (s.playback_lookahead > MIN_PLAYBACK_TASKS_IN_QUEUE) {
+            s.playback_lookahead--;
+            audio_playback_queue_.SetLimit(s.playback_lookahead);
+            ESP_LOGI(TAG, "Playback stable, look-ahead lowered to %lu frames", s.playback_lookahead);
+        }
+    }
+}
+
+void AudioService::OpusDecodeTask() {
+    const EventBits_t wait_bits = audio_decode_queue_.not_empty_bit() | audio_playback_queue_.not_full_bit() |
+        audio_testing_queue_.not_empty_bit() | audio_sound_decode_queue_.not_empty_bit() | audio_sound_queue_.not_full_bit();
+
     while (true) {
-        std::unique_lock<std::mutex> lock(audio_queue_mutex_);
-        audio_queue_cv_.wait(lock, [this]() {
-            return service_stopped_ ||
-                (!audio_encode_queue_.empty() && audio_send_queue_.size() < MAX_SEND_PACKETS_IN_QUEUE) ||
-                (!audio_decode_queue_.empty() && audio_playback_queue_.size() < MAX_PLAYBACK_TASKS_IN_QUEUE);
-        });
+        /* Clear the bits before checking the queues, so no push / pop in between is lost */
+        xEventGroupClearBits(event_group_, wait_bits);
         if (service_stopped_) {
             break;
         }
 
-        /* Decode the audio from decode queue */
-        if (!audio_decode_queue_.empty() && audio_playback_queue_.size() < MAX_PLAYBACK_TASKS_IN_QUEUE) {
-            auto packet = std::move(audio_decode_queue_.front());
-            audio_decode_queue_.pop_front();
-            audio_queue_cv_.notify_all();
-            lock.unlock();
-
-            auto task = std::make_unique<AudioTask>();
-            task->type = kAudioTaskTypeDecodeToPlaybackQueue;
-            task->timestamp = packet->timestamp;
-
-            SetDecodeSampleRate(packet->sample_rate, packet->frame_duration);
-            if (opus_decoder_->Decode(std::move(packet->payload), task->pcm)) {
-                // Resample if the sample rate is different
-                if (opus_decoder_->sample_rate() != codec_->output_sample_rate()) {
-                    int target_size = output_resampler_.GetOutputSamples(task->pcm.size());
-                    std::vector<int16_t> resampled(target_size);
-                    output_resampler_.Process(task->pcm.data(), task->pcm.size(), resampled.data());
-                    task->pcm = std::move(resampled);
+        /* Sounds go first, a cached sound is only passed on, a long one is decoded a frame at a time */
+        if (!sound_stream_.empty() && !audio_sound_queue_.Full()) {
+            DecodeSoundStreamFrame();
+            continue;
+        }
+        if (sound_stream_.empty() && !audio_sound_decode_queue_.Empty() && !audio_sound_queue_.Full()) {
+            SoundRequest request;
+            if (audio_sound_decode_queue_.Pop(request)) {
+                if (!request.pcm && GetSoundPcmBytes(request.sound) > SOUND_CACHE_MAX_ENTRY_BYTES) {
+                    /* Still pending until the last frame is queued */
+                    StartSoundStream(request.sound);
+                    continue;
                 }
-
-                lock.lock();
-                audio_playback_queue_.push_back(std::move(task));
-                audio_queue_cv_.notify_all();
-            } else {
-                ESP_LOGE(TAG, "Failed to decode audio");
-                lock.lock();
+                if (!request.pcm) {
+                    request.pcm = DecodeSound(request.sound);
+                }
+                audio_sound_queue_.Push(SoundChunk{std::move(request.pcm), nullptr});
+                pending_sound_requests_--;
             }
-            debug_statistics_.decode_count++;
-        }
-        
-        /* Encode the audio to send queue */
-        if (!audio_encode_queue_.empty() && audio_send_queue_.size() < MAX_SEND_PACKETS_IN_QUEUE) {
-            auto task = std::move(audio_encode_queue_.front());
-            audio_encode_queue_.pop_front();
-            audio_queue_cv_.notify_all();
-            lock.unlock();
-
-            auto packet = std::make_unique<AudioStreamPacket>();
-            packet->frame_duration = OPUS_FRAME_DURATION_MS;
-            packet->sample_rate = 16000;
-            packet->timestamp = task->timestamp;
-            if (!opus_encoder_->Encode(std::move(task->pcm), packet->payload)) {
-                ESP_LOGE(TAG, "Failed to encode audio");
-                continue;
+            continue;
+        }
+
+        /* The testing queue is only played after recording, but flushed items are always dropped */
+        if (audio_testing_replay_ && audio_testing_queue_.Size() == 0) {
+            audio_testing_replay_ = false;
+        }
+        bool testing_ready = !audio_testing_queue_.Empty() && (audio_testing_replay_ || audio_testing_queue_.Size() == 0);
+        if (audio_playback_queue_.Full() || (audio_decode_queue_.Empty() && !testing_ready)) {
+            /* Also woken up by sound requests, and by the sound queue when a request waits for it */
+            xEventGroupWaitBits(event_group_, wait_bits | AS_EVENT_SERVICE_STOPPED, pdFALSE, pdFALSE, portMAX_DELAY);
+            continue;
+        }
+
+        std::unique_ptr<AudioStreamPacket> packet;
+        if (!audio_decode_queue_.Pop(packet) && !(testing_ready && audio_testing_queue_.Pop(packet))) {
+            continue;
+        }
+
+        auto start_time = esp_timer_get_time();
+        auto task = task_pool_.Acquire();
+        task->type = kAudioTaskTypeDecodeToPlaybackQueue;
+        task->timestamp = packet->timestamp;
+
+        auto& decoder = opus_decoders_.Select(packet->sample_rate, packet->frame_duration);
+        if (packet->fec) {
+            debug_statistics_.fec_count++;
+        }
+        if (decoder.decoder->Decode(packet->opus_data(), packet->opus_size(), task->pcm, packet->fec)) {
+            // Resample if the sample rate is different
+            if (decoder.resampler) {
+                auto resample_start_time = esp_timer_get_time();
+                int target_size = decoder.resampler->GetOutputSamples(task->pcm.size());
+                resample_buffer_.resize(target_size);
+                decoder.resampler->Process(task->pcm.data(), task->pcm.size(), resample_buffer_.data());
+                task->pcm.swap(resample_buffer_);
+                debug_statistics_.resample_time.Add(esp_timer_get_time() - resample_start_time);
             }
+            audio_playback_queue_.Push(std::move(task));
+        } else {
+            ESP_LOGE(TAG, "Failed to decode audio");
+            task_pool_.Release(std::move(task));
+        }
+        packet_pool_.Release(std::move(packet));
+        debug_statistics_.decode_count++;
+        debug_statistics_.decode_time.Add(esp_timer_get_time() - start_time);
+    }
 
-            if (task->type == kAudioTaskTypeEncodeToSendQueue) {
-                {
-                    std::lock_guard<std::mutex> lock(audio_queue_mutex_);
-                    audio_send_queue_.push_back(std::move(packet));
-                }
-                if (callbacks_.on_send_queue_available) {
-                    callbacks_.on_send_queue_available();
+    ESP_LOGW(TAG, "Opus decode task stopped");
+}
+
+void AudioService::OpusEncodeTask() {
+    const EventBits_t wait_bits = audio_encode_queue_.not_empty_bit() | audio_send_queue_.not_full_bit();
+
+    while (true) {
+        /* Clear the bits before checking the queues, so no push / pop in between is lost */
+        xEventGroupClearBits(event_group_, wait_bits);
+        if (service_stopped_) {
+            break;
+        }
+
+        /* A held send queue makes room for the packet itself, see HoldSendQueue() */
+        if ((audio_send_queue_.Full() && !send_queue_held_) || audio_encode_queue_.Empty()) {
+            xEventGroupWaitBits(event_group_, wait_bits | AS_EVENT_SERVICE_STOPPED, pdFALSE, pdFALSE, portMAX_DELAY);
+            continue;
+        }
+
+        std::unique_ptr<AudioTask> task;
+        if (!audio_encode_queue_.Pop(task)) {
+            continue;
+        }
+
+        auto start_time = esp_timer_get_time();
+        auto type = task->type;
+        auto packet = packet_pool_.Acquire();
+        size_t packets = 0;
+        {
+            std::lock_guard<std::mutex> lock(encoder_mutex_);
+            if (type == kAudioTaskTypeEncodeToSendQueue && task->send_queue_epoch != send_queue_epoch_) {
+                /* Captured for a channel that failed to open, ClearSendQueue() was called meanwhile */
+                ESP_LOGD(TAG, "Dropping a frame captured before the send queue was cleared");
+            } else if (type == kAudioTaskTypeEncodeToSendQueue && (!reframe_pcm_.empty() || task->pcm.size() != opus_encoder_->frame_size())) {
+                /* Captured before the audio profile changed, or behind such samples: cut again into frames */
+                reframe_pcm_.insert(reframe_pcm_.end(), task->pcm.begin(), task->pcm.end());
+                packets = EncodeReframedPcm(task->timestamp);
+            } else if (task->pcm.size() != opus_encoder_->frame_size()) {
+                /* Queued for the testing queue before the audio profile changed */
+                ESP_LOGD(TAG, "Dropping a frame of %u samples, frame size: %u", task->pcm.size(), opus_encoder_->frame_size());
+            } else {
+                packet->frame_duration = opus_encoder_->duration_ms();
+                packet->sample_rate = opus_encoder_->sample_rate();
+                packet->timestamp = task->timestamp;
+                /* Packets for the server get room for the transport header, the testing queue is decoded here */
+                packet->headroom = type == kAudioTaskTypeEncodeToSendQueue ? AUDIO_PACKET_HEADROOM : 0;
+                if (!opus_encoder_->Encode(task->pcm, packet->payload, packet->headroom)) {
+                    ESP_LOGE(TAG, "Failed to encode audio");
+                } else if (type == kAudioTaskTypeEncodeToSendQueue) {
+                    /* Pushed with the encoder held, so ReencodeQueuedAudio() finds the send queue in capture order */
+                    packets = PushPacketToSendQueue(std::move(packet)) ? 1 : 0;
+                } else {
+                    packets = 1;
                 }
-            } else if (task->type == kAudioTaskTypeEncodeToTestingQueue) {
-                std::lock_guard<std::mutex> lock(audio_queue_mutex_);
-                audio_testing_queue_.push_back(std::move(packet));
             }
-            debug_statistics_.encode_count++;
-            lock.lock();
+        }
+        task_pool_.Release(std::move(task));
+        debug_statistics_.encode_time.Add(esp_timer_get_time() - start_time);
+        debug_statistics_.encode_count += packets;
+
+        if (packets > 0 && type == kAudioTaskTypeEncodeToTestingQueue) {
+            audio_testing_queue_.Push(std::move(packet));
+        }
+        if (packet != nullptr) {
+            packet_pool_.Release(std::move(packet));
+        }
+        if (packets > 0 && type == kAudioTaskTypeEncodeToSendQueue && callbacks_.on_send_queue_available) {
+            callbacks_.on_send_queue_available();
         }
     }
 
-    ESP_LOGW(TAG, "Opus codec task stopped");
+    ESP_LOGW(TAG, "Opus encode task stopped");
 }
 
-void AudioService::SetDecodeSampleRate(int sample_rate, int frame_duration) {
-    if (opus_decoder_->sample_rate() == sample_rate && opus_decoder_->duration_ms() == frame_duration) {
-        return;
+std::shared_ptr<const std::vector<int16_t>> AudioService::DecodeSound(const std::string_view& sound) {
+    auto start_time = esp_timer_get_time();
+    /* A separate decoder, the state of the stream decoder is kept */
+    OpusDecoderWrapper decoder(16000, 1, OPUS_FRAME_DURATION_MS);
+    OpusResampler resampler;
+    bool resample = decoder.sample_rate() != codec_->output_sample_rate();
+    if (resample) {
+        resampler.Configure(decoder.sample_rate(), codec_->output_sample_rate());
+    }
+
+    auto pcm = std::make_shared<std::vector<int16_t>>();
+    std::vector<uint8_t> opus;
+    std::vector<int16_t> frame;
+    const char* data = sound.data();
+    size_t size = sound.size();
+    for (const char* p = data; p < data + size; ) {
+        auto p3 = (BinaryProtocol3*)p;
+        p += sizeof(BinaryProtocol3);
+
+        auto payload_size = ntohs(p3->payload_size);
+        opus.assign(p3->payload, p3->payload + payload_size);
+        p += payload_size;
+
+        if (!decoder.Decode(std::move(opus), frame)) {
+            ESP_LOGE(TAG, "Failed to decode sound");
+            continue;
+        }
+        size_t offset = pcm->size();
+        if (resample) {
+            pcm->resize(offset + resampler.GetOutputSamples(frame.size()));
+            resampler.Process(frame.data(), frame.size(), pcm->data() + offset);
+        } else {
+            pcm->insert(pcm->end(), frame.begin(), frame.end());
+        }
     }
 
-    opus_decoder_.reset();
-    opus_decoder_ = std::make_unique<OpusDecoderWrapper>(sample_rate, 1, frame_duration);
+    sound_cache_.Insert(sound.data(), pcm);
+    debug_statistics_.sound_decode_time.Add(esp_timer_get_time() - start_time);
+    return pcm;
+}
 
-    auto codec = Board::GetInstance().GetAudioCodec();
-    if (opus_decoder_->sample_rate() != codec->output_sample_rate()) {
-        ESP_LOGI(TAG, "Resampling audio from %d to %d", opus_decoder_->sample_rate(), codec->output_sample_rate());
-        output_resampler_.Configure(opus_decoder_->sample_rate(), codec->output_sample_rate());
+// Size of the decoded sound at the output sample rate, from the number of frames, without decoding it
+size_t AudioService::GetSoundPcmBytes(const std::string_view& sound) {
+    size_t frames = 0;
+    for (size_t offset = 0; offset + sizeof(BinaryProtocol3) <= sound.size(); frames++) {
+        auto p3 = (const BinaryProtocol3*)(sound.data() + offset);
+        offset += sizeof(BinaryProtocol3) + ntohs(p3->payload_size);
+    }
+    return frames * (OPUS_FRAME_DURATION_MS * codec_->output_sample_rate() / 1000) * sizeof(int16_t);
+}
+
+void AudioService::StartSoundStream(const std::string_view& sound) {
+    sound_stream_decoder_ = std::make_unique<OpusDecoderWrapper>(16000, 1, OPUS_FRAME_DURATION_MS);
+    if (sound_stream_decoder_->sample_rate() != codec_->output_sample_rate()) {
+        sound_stream_resampler_.Configure(sound_stream_decoder_->sample_rate(), codec_->output_sample_rate());
+    }
+    sound_stream_abort_count_ = playback_abort_count_;
+    sound_stream_ = sound;
+}
+
+// Queues the next frame of the streamed sound, as the playback of the server audio does
+void AudioService::DecodeSoundStreamFrame() {
+    while (!sound_stream_.empty() && sound_stream_abort_count_ == playback_abort_count_) {
+        auto p3 = (const BinaryProtocol3*)sound_stream_.data();
+        size_t frame_size = sizeof(BinaryProtocol3) + ntohs(p3->payload_size);
+        if (frame_size > sound_stream_.size()) {
+            break;
+        }
+        sound_stream_opus_.assign(p3->payload, p3->payload + frame_size - sizeof(BinaryProtocol3));
+        sound_stream_.remove_prefix(frame_size);
+
+        auto task = task_pool_.Acquire();
+        bool resample = sound_stream_decoder_->sample_rate() != codec_->output_sample_rate();
+        if (!sound_stream_decoder_->Decode(std::move(sound_stream_opus_), resample ? resample_buffer_ : task->pcm)) {
+            ESP_LOGE(TAG, "Failed to decode sound");
+            task_pool_.Release(std::move(task));
+            continue;
+        }
+        if (resample) {
+            task->pcm.resize(sound_stream_resampler_.GetOutputSamples(resample_buffer_.size()));
+            sound_stream_resampler_.Process(resample_buffer_.data(), resample_buffer_.size(), task->pcm.data());
+        }
+        audio_sound_queue_.Push(SoundChunk{nullptr, std::move(task)});
+        if (!sound_stream_.empty()) {
+            return;
+        }
     }
+
+    /* The last frame is queued, or the playback was aborted */
+    sound_stream_ = std::string_view();
+    sound_stream_decoder_.reset();
+    pending_sound_requests_--;
 }
 
 void AudioService::PushTaskToEncodeQueue(AudioTaskType type, std::vector<int16_t>&& pcm) {
-    auto task = std::make_unique<AudioTask>();
+    auto task = task_pool_.Acquire();
     task->type = type;
-    task->pcm = std::move(pcm);
-    
-    /* Push the task to the encode queue */
-    std::unique_lock<std::mutex> lock(audio_queue_mutex_);
+    // Hand the recycled buffer back to the producer, so it can refill it without allocating
+    task->pcm.swap(pcm);
 
     /* If the task is to send queue, we need to set the timestamp */
-    if (type == kAudioTaskTypeEncodeToSendQueue && !timestamp_queue_.empty()) {
-        if (timestamp_queue_.size() <= MAX_TIMESTAMPS_IN_QUEUE) {
-            task->timestamp = timestamp_queue_.front();
-        } else {
-            ESP_LOGW(TAG, "Timestamp queue (%u) is full, dropping timestamp", timestamp_queue_.size());
+    if (type == kAudioTaskTypeEncodeToSendQueue) {
+        task->send_queue_epoch = send_queue_epoch_;
+        std::lock_guard<std::mutex> lock(timestamp_mutex_);
+        if (!timestamp_queue_.empty()) {
+            if (timestamp_queue_.size() <= MAX_TIMESTAMPS_IN_QUEUE) {
+                task->timestamp = timestamp_queue_.front();
+            } else {
+                ESP_LOGW(TAG, "Timestamp queue (%u) is full, dropping timestamp", timestamp_queue_.size());
+            }
+            timestamp_queue_.pop_front();
         }
-        timestamp_queue_.pop_front();
     }
 
-    audio_queue_cv_.wait(lock, [this]() { return audio_encode_queue_.size() < MAX_ENCODE_TASKS_IN_QUEUE; });
-    audio_encode_queue_.push_back(std::move(task));
-    audio_queue_cv_.notify_all();
+    /* Push the task to the encode queue */
+    std::lock_guard<std::mutex> lock(encode_producer_mutex_);
+    while (!audio_encode_queue_.Push(std::move(task))) {
+        audio_encode_queue_.WaitNotFull(AS_EVENT_SERVICE_STOPPED);
+        if (service_stopped_) {
+            task_pool_.Release(std::move(task));
+            return;
+        }
+    }
 }
 
 bool AudioService::PushPacketToDecodeQueue(std::unique_ptr<AudioStreamPacket> packet, bool wait) {
-    std::unique_lock<std::mutex> lock(audio_queue_mutex_);
-    if (audio_decode_queue_.size() >= MAX_DECODE_PACKETS_IN_QUEUE) {
-        if (wait) {
-            audio_queue_cv_.wait(lock, [this]() { return audio_decode_queue_.size() < MAX_DECODE_PACKETS_IN_QUEUE; });
-        } else {
+    std::lock_guard<std::mutex> lock(decode_producer_mutex_);
+    if (packet->sequence != 0) {
+        /* Numbered packets are reordered by the jitter buffer, they are never waited for */
+        jitter_buffer_.Put(std::move(packet), esp_timer_get_time() / 1000);
+        DrainJitterBuffer();
+        if (!esp_timer_is_active(jitter_buffer_timer_)) {
+            esp_timer_start_periodic(jitter_buffer_timer_, JITTER_BUFFER_CHECK_INTERVAL_MS * 1000);
+        }
+        return true;
+    }
+
+    while (!audio_decode_queue_.Push(std::move(packet))) {
+        if (!wait) {
+            packet_pool_.Release(std::move(packet));
+            return false;
+        }
+        audio_decode_queue_.WaitNotFull(AS_EVENT_SERVICE_STOPPED);
+        if (service_stopped_) {
+            packet_pool_.Release(std::move(packet));
             return false;
         }
     }
-    audio_decode_queue_.push_back(std::move(packet));
-    audio_queue_cv_.notify_all();
     return true;
 }
 
+// The caller holds decode_producer_mutex_
+void AudioService::DrainJitterBuffer() {
+    int64_t now_ms = esp_timer_get_time() / 1000;
+    while (!audio_decode_queue_.Full()) {
+        std::unique_ptr<AudioStreamPacket> packet;
+        auto result = jitter_buffer_.Get(now_ms, packet);
+        if (result == JitterBuffer::kNone) {
+            break;
+        }
+        if (result == JitterBuffer::kLost) {
+            /* An empty payload makes the Opus decoder conceal the lost frame */
+            packet = packet_pool_.Acquire();
+            packet->sample_rate = jitter_buffer_.sample_rate();
+            packet->frame_duration = jitter_buffer_.frame_duration();
+            auto next = downlink_fec_ ? jitter_buffer_.Peek() : nullptr;
+            if (next != nullptr) {
+                /* The next packet is here already, the decoder rebuilds the lost frame from its FEC data */
+                packet->payload.assign(next->opus_data(), next->opus_data() + next->opus_size());
+                packet->fec = true;
+            }
+        }
+        audio_decode_queue_.Push(std::move(packet));
+    }
+}
+
+void AudioService::OnJitterBufferTimer() {
+    /* Do not block the timer task while a producer is waiting for the decode queue */
+    std::unique_lock<std::mutex> lock(decode_producer_mutex_, std::try_to_lock);
+    if (!lock.owns_lock()) {
+        return;
+    }
+    DrainJitterBuffer();
+    if (jitter_buffer_.IsIdle()) {
+        esp_timer_stop(jitter_buffer_timer_);
+    }
+}
+
+void AudioService::PrintDebugStatistics() {
+    auto& s = debug_statistics_;
+    ESP_LOGI(TAG, "Frames: input %lu, encode %lu, decode %lu, playback %lu", s.input_count, s.encode_count, s.decode_count, s.playback_count);
+    ESP_LOGI(TAG, "Stage time avg/max (us): input resample %lu/%lu, encode %lu/%lu, decode %lu/%lu, output resample %lu/%lu, output %lu/%lu",
+        s.input_resample_time.average_us(), s.input_resample_time.max_us,
+        s.encode_time.average_us(), s.encode_time.max_us,
+        s.decode_time.average_us(), s.decode_time.max_us,
+        s.resample_time.average_us(), s.resample_time.max_us,
+        s.output_time.average_us(), s.output_time.max_us);
+    auto sound_cache = sound_cache_.statistics();
+    ESP_LOGI(TAG, "Sound cache: hits %lu, misses %lu, evictions %lu, entries %u, bytes %u/%u, decode avg/max %lu/%lu us",
+        sound_cache.hits, sound_cache.misses, sound_cache.evictions, sound_cache.entries, sound_cache.bytes, sound_cache.budget,
+        s.sound_decode_time.average_us(), s.sound_decode_time.max_us);
+    auto jitter = GetJitterBufferStatistics();
+    ESP_LOGI(TAG, "Lost frames: decoded %lu (from FEC %lu), recovered from redundancy %lu, skipped %lu",
+        jitter.concealed, s.fec_count, jitter.recovered, jitter.skipped);
+    auto decoders = opus_decoders_.statistics();
+    ESP_LOGI(TAG, "Decoder cache: switches %lu, creations %lu, evictions %lu, entries %u/%u",
+        decoders.switches, decoders.creations, decoders.evictions, decoders.entries, decoders.capacity);
+    ESP_LOGI(TAG, "Audio profile mismatches: %lu, packets encoded again %lu", s.profile_mismatches, s.reencoded_packets);
+    ESP_LOGI(TAG, "Uplink packets dropped while the send queue was held: %lu", s.held_packets_dropped);
+    ESP_LOGI(TAG, "Playback aborts: %lu, latency avg/max %lu/%lu us",
+        s.abort_latency.count, s.abort_latency.average_us(), s.abort_latency.max_us);
+    ESP_LOGI(TAG, "Playback: look-ahead %lu, underruns %lu, starvation avg/max %lu/%lu us, queue depth p50/p90/p99 %lu/%lu/%lu",
+        s.playback_lookahead, s.playback_underruns, s.starvation_time.average_us(), s.starvation_time.max_us,
+        s.playback_queue_depth_percentile(50), s.playback_queue_depth_percentile(90), s.playback_queue_depth_percentile(99));
+}
+
+JitterBufferStatistics AudioService::GetJitterBufferStatistics() {
+    std::lock_guard<std::mutex> lock(decode_producer_mutex_);
+    return jitter_buffer_.statistics();
+}
+
 std::unique_ptr<AudioStreamPacket> AudioService::PopPacketFromSendQueue() {
-    std::lock_guard<std::mutex> lock(audio_queue_mutex_);
-    if (audio_send_queue_.empty()) {
+    std::unique_ptr<AudioStreamPacket> packet;
+    if (!audio_send_queue_.Pop(packet)) {
         return nullptr;
     }
-    auto packet = std::move(audio_send_queue_.front());
-    audio_send_queue_.pop_front();
-    audio_queue_cv_.notify_all();
     return packet;
 }
 
+void AudioService::ClearSendQueue() {
+    /* The frames in the encode queue, and the one being encoded, are dropped by the encode task */
+    send_queue_epoch_++;
+    std::lock_guard<std::mutex> lock(encoder_mutex_);
+    audio_send_queue_.Clear();
+    reframe_pcm_.clear();
+}
+
+void AudioService::HoldSendQueue(bool hold) {
+    /* Released with the encoder held, so the encode task no longer pops once the sender resumes */
+    std::lock_guard<std::mutex> lock(encoder_mutex_);
+    send_queue_held_ = hold;
+    if (hold) {
+        xEventGroupSetBits(event_group_, audio_send_queue_.not_full_bit());
+    }
+}
+
+std::unique_ptr<AudioStreamPacket> AudioService::AcquirePacket() {
+    return packet_pool_.Acquire();
+}
+
+void AudioService::ReleasePacket(std::unique_ptr<AudioStreamPacket> packet) {
+    packet_pool_.Release(std::move(packet));
+}
+
 void AudioService::EncodeWakeWord() {
     if (wake_word_) {
-        wake_word_->EncodeWakeWordData();
+        for (auto& packet : reencoded_wake_word_) {
+            if (packet != nullptr) {
+                packet_pool_.Release(std::move(packet));
+            }
+        }
+        reencoded_wake_word_.clear();
+        wake_word_frame_duration_ms_ = audio_profile_.load()->frame_duration_ms;
+        wake_word_->EncodeWakeWordData(wake_word_frame_duration_ms_);
     }
 }
 
@@ -461,13 +949,178 @@ const std::string& AudioService::GetLastWakeWord() const {
 }
 
 std::unique_ptr<AudioStreamPacket> AudioService::PopWakeWordPacket() {
-    auto packet = std::make_unique<AudioStreamPacket>();
+    if (wake_word_frame_duration_ms_ != 0 && wake_word_frame_duration_ms_ != audio_profile_.load()->frame_duration_ms) {
+        ReencodeWakeWord();
+    }
+    if (!reencoded_wake_word_.empty()) {
+        /* Ends with nullptr like the pre-roll of the wake word */
+        auto packet = std::move(reencoded_wake_word_.front());
+        reencoded_wake_word_.pop_front();
+        return packet;
+    }
+
+    auto packet = packet_pool_.Acquire();
     if (wake_word_->GetWakeWordOpus(packet->payload)) {
+        packet->frame_duration = wake_word_frame_duration_ms_;
+        packet->sample_rate = 16000;
+        packet->headroom = 0;
         return packet;
     }
+    packet_pool_.Release(std::move(packet));
     return nullptr;
 }
 
+// The pre-roll was encoded before the hello exchange selected a profile of another frame duration
+void AudioService::ReencodeWakeWord() {
+    auto start_time = esp_timer_get_time();
+    int previous_duration_ms = wake_word_frame_duration_ms_;
+    int frame_duration_ms = audio_profile_.load()->frame_duration_ms;
+    OpusVoiceDecoder decoder(16000, 1, previous_duration_ms);
+    OpusVoiceEncoder encoder(16000, 1, frame_duration_ms);
+    encoder.SetComplexity(0);
+
+    std::vector<uint8_t> opus;
+    std::vector<int16_t> pcm;
+    std::vector<int16_t> samples;
+    std::vector<int16_t> frame(encoder.frame_size());
+    int packets = 0;
+    bool more = true;
+    while (more) {
+        more = wake_word_->GetWakeWordOpus(opus);
+        if (more) {
+            packets++;
+            if (decoder.Decode(opus.data(), opus.size(), pcm)) {
+                samples.insert(samples.end(), pcm.begin(), pcm.end());
+            }
+        } else if (!samples.empty()) {
+            /* The tail is padded with silence to a whole frame */
+            samples.resize(frame.size(), 0);
+        }
+
+        size_t offset = 0;
+        for (; samples.size() - offset >= frame.size(); offset += frame.size()) {
+            std::copy(samples.begin() + offset, samples.begin() + offset + frame.size(), frame.begin());
+            auto packet = packet_pool_.Acquire();
+            packet->headroom = 0;
+            if (!encoder.Encode(frame, packet->payload)) {
+                packet_pool_.Release(std::move(packet));
+                continue;
+            }
+            packet->frame_duration = frame_duration_ms;
+            packet->sample_rate = 16000;
+            reencoded_wake_word_.push_back(std::move(packet));
+        }
+        samples.erase(samples.begin(), samples.begin() + offset);
+    }
+    reencoded_wake_word_.push_back(nullptr);
+    wake_word_frame_duration_ms_ = frame_duration_ms;
+
+    debug_statistics_.reencoded_packets += packets;
+    ESP_LOGW(TAG, "Pre-roll encoded again from %d ms to %d ms frames: %d -> %u packets in %ld ms", previous_duration_ms,
+        frame_duration_ms, packets, reencoded_wake_word_.size() - 1, (long)((esp_timer_get_time() - start_time) / 1000));
+}
+
+void AudioService::ReencodeQueuedAudio(const AudioProfile& previous_profile) {
+    auto profile = audio_profile_.load();
+    if (profile == &previous_profile) {
+        return;
+    }
+    debug_statistics_.profile_mismatches++;
+    if (profile->frame_duration_ms == previous_profile.frame_duration_ms) {
+        /* Only the bitrate differs, the packets are valid as they are */
+        ESP_LOGW(TAG, "Audio profile %s negotiated instead of %s, the queued audio is sent as it is", profile->name, previous_profile.name);
+        return;
+    }
+
+    auto start_time = esp_timer_get_time();
+    size_t queued = 0;
+    size_t reencoded = 0;
+    size_t packets = 0;
+    {
+        /* Holds off the encode task, the live frames of the encode queue are cut again after these */
+        std::lock_guard<std::mutex> lock(encoder_mutex_);
+        std::deque<std::unique_ptr<AudioStreamPacket>> packets_in_queue;
+        std::unique_ptr<AudioStreamPacket> packet;
+        while (audio_send_queue_.Pop(packet)) {
+            packets_in_queue.push_back(std::move(packet));
+        }
+        queued = packets_in_queue.size();
+
+        std::unique_ptr<OpusVoiceDecoder> decoder;
+        std::vector<int16_t> pcm;
+        for (auto& packet : packets_in_queue) {
+            if (reframe_pcm_.empty() && packet->frame_duration == opus_encoder_->duration_ms()) {
+                /* Encoded after the profile changed */
+                if (PushPacketToSendQueue(std::move(packet))) {
+                    packets++;
+                }
+                continue;
+            }
+            if (decoder == nullptr || decoder->duration_ms() != packet->frame_duration) {
+                decoder = std::make_unique<OpusVoiceDecoder>(16000, 1, packet->frame_duration);
+            }
+            if (decoder->Decode(packet->opus_data(), packet->opus_size(), pcm)) {
+                reframe_pcm_.insert(reframe_pcm_.end(), pcm.begin(), pcm.end());
+            }
+            packets += EncodeReframedPcm(packet->timestamp);
+            packet_pool_.Release(std::move(packet));
+            reencoded++;
+        }
+    }
+    debug_statistics_.reencoded_packets += reencoded;
+    ESP_LOGW(TAG, "Audio profile %s negotiated instead of %s, %u of %u queued packets encoded again in %ld ms", profile->name,
+        previous_profile.name, reencoded, queued, (long)((esp_timer_get_time() - start_time) / 1000));
+    if (packets > 0 && callbacks_.on_send_queue_available) {
+        callbacks_.on_send_queue_available();
+    }
+}
+
+// Encodes the whole frames at the front of reframe_pcm_ into the send queue, with encoder_mutex_ held
+size_t AudioService::EncodeReframedPcm(uint32_t timestamp) {
+    size_t frame_size = opus_encoder_->frame_size();
+    size_t offset = 0;
+    size_t packets = 0;
+    reframe_frame_.resize(frame_size);
+    for (; reframe_pcm_.size() - offset >= frame_size; offset += frame_size) {
+        std::copy(reframe_pcm_.begin() + offset, reframe_pcm_.begin() + offset + frame_size, reframe_frame_.begin());
+        auto packet = packet_pool_.Acquire();
+        packet->frame_duration = opus_encoder_->duration_ms();
+        packet->sample_rate = opus_encoder_->sample_rate();
+        packet->timestamp = timestamp;
+        packet->headroom = AUDIO_PACKET_HEADROOM;
+        if (!opus_encoder_->Encode(reframe_frame_, packet->payload, packet->headroom)) {
+            ESP_LOGE(TAG, "Failed to encode audio");
+            packet_pool_.Release(std::move(packet));
+            continue;
+        }
+        if (PushPacketToSendQueue(std::move(packet))) {
+            packets++;
+        }
+    }
+    reframe_pcm_.erase(reframe_pcm_.begin(), reframe_pcm_.begin() + offset);
+    return packets;
+}
+
+// With encoder_mutex_ held, the packet is released if it is not queued
+bool AudioService::PushPacketToSendQueue(std::unique_ptr<AudioStreamPacket>&& packet) {
+    if (audio_send_queue_.Push(std::move(packet))) {
+        return true;
+    }
+    if (send_queue_held_) {
+        /* Nothing else takes from the queue while it is held, the oldest packet makes room */
+        std::unique_ptr<AudioStreamPacket> oldest;
+        if (audio_send_queue_.Pop(oldest)) {
+            packet_pool_.Release(std::move(oldest));
+            debug_statistics_.held_packets_dropped++;
+        }
+        if (audio_send_queue_.Push(std::move(packet))) {
+            return true;
+        }
+    }
+    packet_pool_.Release(std::move(packet));
+    return false;
+}
+
 void AudioService::EnableWakeWordDetection(bool enable) {
     if (!wake_word_) {
         return;
@@ -490,17 +1143,22 @@ void AudioService::EnableWakeWordDetection(bool enable) {
     }
 }
 
-void AudioService::EnableVoiceProcessing(bool enable) {
+void AudioService::EnableVoiceProcessing(bool enable, bool input_warmup) {
     ESP_LOGD(TAG, "%s voice processing", enable ? "Enabling" : "Disabling");
     if (enable) {
         if (!audio_processor_initialized_) {
-            audio_processor_->Initialize(codec_, OPUS_FRAME_DURATION_MS);
+            audio_processor_->Initialize(codec_, audio_profile_.load()->frame_duration_ms);
             audio_processor_initialized_ = true;
         }
 
         /* We should make sure no audio is playing */
         ResetDecoder();
-        audio_input_need_warmup_ = true;
+        {
+            /* Samples left over from the last capture are not sent before the new one */
+            std::lock_guard<std::mutex> lock(encoder_mutex_);
+            reframe_pcm_.clear();
+        }
+        audio_input_need_warmup_ = input_warmup;
         audio_processor_->Start();
         xEventGroupSetBits(event_group_, AS_EVENT_AUDIO_PROCESSOR_RUNNING);
     } else {
@@ -512,20 +1170,21 @@ void AudioService::EnableVoiceProcessing(bool enable) {
 void AudioService::EnableAudioTesting(bool enable) {
     ESP_LOGI(TAG, "%s audio testing", enable ? "Enabling" : "Disabling");
     if (enable) {
+        audio_testing_replay_ = false;
+        audio_testing_queue_.Clear();
         xEventGroupSetBits(event_group_, AS_EVENT_AUDIO_TESTING_RUNNING);
     } else {
         xEventGroupClearBits(event_group_, AS_EVENT_AUDIO_TESTING_RUNNING);
-        /* Copy audio_testing_queue_ to audio_decode_queue_ */
-        std::lock_guard<std::mutex> lock(audio_queue_mutex_);
-        audio_decode_queue_ = std::move(audio_testing_queue_);
-        audio_queue_cv_.notify_all();
+        /* Let the codec task play back audio_testing_queue_ after the decode queue */
+        audio_testing_replay_ = true;
+        xEventGroupSetBits(event_group_, audio_testing_queue_.not_empty_bit());
     }
 }
 
 void AudioService::EnableDeviceAec(bool enable) {
     ESP_LOGI(TAG, "%s device AEC", enable ? "Enabling" : "Disabling");
     if (!audio_processor_initialized_) {
-        audio_processor_->Initialize(codec_, OPUS_FRAME_DURATION_MS);
+        audio_processor_->Initialize(codec_, audio_profile_.load()->frame_duration_ms);
         audio_processor_initialized_ = true;
     }
 
@@ -536,38 +1195,160 @@ void AudioService::SetCallbacks(AudioServiceCallbacks& callbacks) {
     callbacks_ = callbacks;
 }
 
+bool AudioService::SetAudioProfile(const std::string& name) {
+    const AudioProfile* profile = name.empty() ? &GetPreferredAudioProfile() : FindAudioProfile(name);
+    bool found = profile != nullptr;
+    if (!found) {
+        ESP_LOGW(TAG, "Unknown audio profile: %s", name.c_str());
+        profile = &GetPreferredAudioProfile();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(encoder_mutex_);
+        if (opus_encoder_ && audio_profile_ == profile) {
+            return found;
+        }
+        opus_encoder_ = std::make_unique<OpusVoiceEncoder>(16000, 1, profile->frame_duration_ms);
+        opus_encoder_->SetComplexity(profile->complexity);
+        opus_encoder_->SetBitrate(profile->bitrate);
+        opus_encoder_->SetInbandFec(uplink_fec_);
+        opus_encoder_->SetPacketLossPercent(uplink_fec_ ? uplink_packet_loss_percent_ : 0);
+        audio_profile_ = profile;
+    }
+
+    /* Keep the same duration of audio in the queues */
+    audio_send_queue_.SetLimit(MAX_SEND_QUEUE_DURATION_MS / profile->frame_duration_ms);
+    audio_testing_queue_.SetLimit(AUDIO_TESTING_MAX_DURATION_MS / profile->frame_duration_ms);
+    if (audio_processor_initialized_) {
+        audio_processor_->SetFrameDuration(profile->frame_duration_ms);
+    }
+    ReservePackets();
+    ESP_LOGI(TAG, "Audio profile: %s, frame duration: %d ms, bitrate: %d", profile->name, profile->frame_duration_ms, profile->bitrate);
+    return found;
+}
+
+void AudioService::SetAudioFec(bool enable) {
+    downlink_fec_ = enable;
+    std::lock_guard<std::mutex> lock(encoder_mutex_);
+    if (uplink_fec_ == enable) {
+        return;
+    }
+    uplink_fec_ = enable;
+    uplink_packet_loss_percent_ = OPUS_FEC_MIN_PACKET_LOSS_PERCENT;
+    if (opus_encoder_) {
+        opus_encoder_->SetInbandFec(enable);
+        opus_encoder_->SetPacketLossPercent(enable ? uplink_packet_loss_percent_ : 0);
+    }
+    ESP_LOGI(TAG, "Opus in-band FEC %s", enable ? "enabled" : "disabled");
+}
+
+void AudioService::SetUplinkPacketLoss(int percent) {
+    percent = std::clamp(percent, OPUS_FEC_MIN_PACKET_LOSS_PERCENT, OPUS_FEC_MAX_PACKET_LOSS_PERCENT);
+    std::lock_guard<std::mutex> lock(encoder_mutex_);
+    if (!uplink_fec_ || uplink_packet_loss_percent_ == percent) {
+        return;
+    }
+    uplink_packet_loss_percent_ = percent;
+    if (opus_encoder_) {
+        opus_encoder_->SetPacketLossPercent(percent);
+    }
+    ESP_LOGI(TAG, "Expected uplink packet loss: %d%%", percent);
+}
+
+const AudioProfile& AudioService::GetPreferredAudioProfile() const {
+    Settings settings("audio");
+    auto profile = FindAudioProfile(settings.GetString("profile", DEFAULT_AUDIO_PROFILE));
+    if (profile == nullptr) {
+        profile = FindAudioProfile(DEFAULT_AUDIO_PROFILE);
+    }
+    return *profile;
+}
+
+bool AudioService::SetPreferredAudioProfile(const std::string& name) {
+    if (FindAudioProfile(name) == nullptr) {
+        return false;
+    }
+    Settings settings("audio", true);
+    settings.SetString("profile", name);
+    return true;
+}
+
+void AudioService::SetDownlinkFrameDuration(int frame_duration_ms) {
+    if (frame_duration_ms <= 0) {
+        frame_duration_ms = OPUS_FRAME_DURATION_MS;
+    }
+    downlink_frame_duration_ = frame_duration_ms;
+    audio_decode_queue_.SetLimit(MAX_DECODE_QUEUE_DURATION_MS / frame_duration_ms);
+    ReservePackets();
+}
+
+void AudioService::PrepareDecoder(int sample_rate, int frame_duration_ms) {
+    opus_decoders_.Prepare(sample_rate, frame_duration_ms);
+}
+
+void AudioService::ReservePackets() {
+    packet_pool_.Reserve(AUDIO_PACKET_POOL_SIZE(audio_profile_.load()->frame_duration_ms, downlink_frame_duration_.load()));
+}
+
 void AudioService::PlaySound(const std::string_view& sound) {
-    const char* data = sound.data();
-    size_t size = sound.size();
-    for (const char* p = data; p < data + size; ) {
-        auto p3 = (BinaryProtocol3*)p;
-        p += sizeof(BinaryProtocol3);
+    std::lock_guard<std::mutex> lock(sound_producer_mutex_);
+    SoundRequest request = { sound, sound_cache_.Find(sound.data()) };
 
-        auto payload_size = ntohs(p3->payload_size);
-        auto packet = std::make_unique<AudioStreamPacket>();
-        packet->sample_rate = 16000;
-        packet->frame_duration = 60;
-        packet->payload.resize(payload_size);
-        memcpy(packet->payload.data(), p3->payload, payload_size);
-        p += payload_size;
+    /* A cached sound starts at once, unless an earlier sound is still being decoded */
+    if (request.pcm && pending_sound_requests_ == 0 && audio_sound_queue_.Push(SoundChunk{request.pcm, nullptr})) {
+        return;
+    }
 
-        PushPacketToDecodeQueue(std::move(packet), true);
+    pending_sound_requests_++;
+    while (!audio_sound_decode_queue_.Push(std::move(request))) {
+        audio_sound_decode_queue_.WaitNotFull(AS_EVENT_SERVICE_STOPPED);
+        if (service_stopped_) {
+            pending_sound_requests_--;
+            return;
+        }
     }
 }
 
 bool AudioService::IsIdle() {
-    std::lock_guard<std::mutex> lock(audio_queue_mutex_);
-    return audio_encode_queue_.empty() && audio_decode_queue_.empty() && audio_playback_queue_.empty() && audio_testing_queue_.empty();
+    {
+        std::lock_guard<std::mutex> lock(decode_producer_mutex_);
+        if (jitter_buffer_.Size() > 0) {
+            return false;
+        }
+    }
+    return audio_encode_queue_.Size() == 0 && audio_decode_queue_.Size() == 0 &&
+        audio_playback_queue_.Size() == 0 && audio_testing_queue_.Size() == 0 &&
+        audio_sound_queue_.Size() == 0 && pending_sound_requests_ == 0;
 }
 
 void AudioService::ResetDecoder() {
-    std::lock_guard<std::mutex> lock(audio_queue_mutex_);
-    opus_decoder_->ResetState();
-    timestamp_queue_.clear();
-    audio_decode_queue_.clear();
-    audio_playback_queue_.clear();
-    audio_testing_queue_.clear();
-    audio_queue_cv_.notify_all();
+    opus_decoders_.ResetState();
+    {
+        std::lock_guard<std::mutex> lock(timestamp_mutex_);
+        timestamp_queue_.clear();
+    }
+    FlushPlayback();
+    audio_testing_queue_.Clear();
+    audio_testing_replay_ = false;
+    audio_sound_decode_queue_.Clear();
+}
+
+void AudioService::AbortPlayback() {
+    playback_abort_time_us_ = esp_timer_get_time();
+    FlushPlayback();
+}
+
+// Drop the queued downlink audio and stop the frame being played
+void AudioService::FlushPlayback() {
+    /* Counted first, so a frame popped before the queues are cleared is faded out as well */
+    playback_abort_count_++;
+    {
+        std::lock_guard<std::mutex> lock(decode_producer_mutex_);
+        jitter_buffer_.Reset();
+    }
+    audio_decode_queue_.Clear();
+    audio_playback_queue_.Clear();
+    audio_sound_queue_.Clear();
 }
 
 void AudioService::CheckAndUpdateAudioPowerState() {
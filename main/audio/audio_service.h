@@ -2,21 +2,28 @@
 #define AUDIO_SERVICE_H
 
 #include <memory>
+#include <atomic>
 #include <deque>
-#include <condition_variable>
 #include <chrono>
 #include <mutex>
+#include <string_view>
 
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
 #include <freertos/event_groups.h>
 #include <esp_timer.h>
 
-#include <opus_encoder.h>
 #include <opus_decoder.h>
 #include <opus_resampler.h>
 
 #include "audio_codec.h"
+#include "audio_profile.h"
+#include "opus_voice_encoder.h"
+#include "audio_queue.h"
+#include "audio_pool.h"
+#include "jitter_buffer.h"
+#include "sound_cache.h"
+#include "opus_decoder_cache.h"
 #include "audio_processor.h"
 #include "processors/audio_debugger.h"
 #include "wake_word.h"
@@ -28,19 +35,98 @@
  * 1. (MIC) -> [Processors] -> {Encode Queue} -> [Opus Encoder] -> {Send Queue} -> (Server)
  * 2. (Server) -> {Decode Queue} -> [Opus Decoder] -> {Playback Queue} -> (Speaker)
  *
- * We use one task for MIC / Speaker / Processors, and one task for Opus Encoder / Opus Decoder.
+ * We use one task for MIC / Speaker / Processors, and one task each for Opus Encoder and Opus Decoder,
+ * so the two directions do not wait for each other in full-duplex (realtime) mode.
  * 
  * Decode Queue and Send Queue are the main queues, because Opus packets are quite smaller than PCM packets.
  * 
+ * Every queue is a bounded single-producer / single-consumer ring (AudioQueue) with its own
+ * wakeup bits in event_group_, so the tasks do not contend on a shared lock.
+ *
+ * AudioTask and AudioStreamPacket objects are taken from fixed-capacity pools sized after the queues
+ * and released after use, so a conversation does not allocate on the heap for every frame.
+ *
+ * Packets numbered by the transport (MQTT + UDP) go through a jitter buffer before the Decode Queue,
+ * it puts them back in order and lets the Opus decoder conceal the lost ones.
+ *
+ * Short notification sounds are decoded once by the Opus decode task and kept in a sound cache, the
+ * cached PCM is queued to the audio output task directly: (PlaySound) -> {Sound Queue} -> (Speaker)
+ * Longer sounds are decoded frame by frame into pooled tasks on the same queue.
+ *
+ * The uplink frame duration and bitrate follow the AudioProfile negotiated in the hello exchange,
+ * the downlink frame duration follows the server hello. The queues are allocated for the shortest
+ * frame and limited to the same duration of audio for longer frames.
+ *
  */
 
+// Downlink frame duration until the server tells another one, and the frame duration of the built-in sounds
 #define OPUS_FRAME_DURATION_MS 60
 #define MAX_ENCODE_TASKS_IN_QUEUE 2
-#define MAX_PLAYBACK_TASKS_IN_QUEUE 2
-#define MAX_DECODE_PACKETS_IN_QUEUE (2400 / OPUS_FRAME_DURATION_MS)
-#define MAX_SEND_PACKETS_IN_QUEUE (2400 / OPUS_FRAME_DURATION_MS)
+// Decoded frames the Opus decode task may queue ahead of the speaker. The look-ahead starts at the
+// minimum, grows by one frame after each underrun and shrinks again after a run of frames without one.
+#define MIN_PLAYBACK_TASKS_IN_QUEUE 2
+#define MAX_PLAYBACK_TASKS_IN_QUEUE 6
+#define PLAYBACK_STABLE_FRAMES_TO_SHRINK 500
+// A longer silence between two frames is a pause of the server, e.g. between two sentences, not an underrun
+#define PLAYBACK_UNDERRUN_MAX_GAP_MS 500
+#define MAX_DECODE_QUEUE_DURATION_MS 2400
+#define MAX_SEND_QUEUE_DURATION_MS 2400
+#define MAX_DECODE_PACKETS_IN_QUEUE (MAX_DECODE_QUEUE_DURATION_MS / AUDIO_PROFILE_MIN_FRAME_DURATION_MS)
+#define MAX_SEND_PACKETS_IN_QUEUE (MAX_SEND_QUEUE_DURATION_MS / AUDIO_PROFILE_MIN_FRAME_DURATION_MS)
 #define AUDIO_TESTING_MAX_DURATION_MS 10000
+#define MAX_TESTING_PACKETS_IN_QUEUE (AUDIO_TESTING_MAX_DURATION_MS / AUDIO_PROFILE_MIN_FRAME_DURATION_MS)
 #define MAX_TIMESTAMPS_IN_QUEUE 3
+#define MAX_SOUNDS_IN_QUEUE 8
+// A sound whose PCM would be larger than SOUND_CACHE_MAX_ENTRY_BYTES is not cached but streamed frame by frame
+#if CONFIG_SPIRAM
+#define SOUND_CACHE_BUDGET_BYTES (256 * 1024)
+#define SOUND_CACHE_MAX_ENTRY_BYTES (64 * 1024)
+#else
+#define SOUND_CACHE_BUDGET_BYTES (32 * 1024)
+#define SOUND_CACHE_MAX_ENTRY_BYTES (16 * 1024)
+#endif
+// Downlink formats with a decoder ready, e.g. the server TTS and the audio testing replay
+#if CONFIG_SPIRAM
+#define OPUS_DECODER_CACHE_CAPACITY 3
+#else
+#define OPUS_DECODER_CACHE_CAPACITY 2
+#endif
+#define JITTER_BUFFER_DURATION_MS 1200
+#define JITTER_BUFFER_CAPACITY (JITTER_BUFFER_DURATION_MS / AUDIO_PROFILE_MIN_FRAME_DURATION_MS)
+#define JITTER_BUFFER_MIN_DELAY_MS AUDIO_PROFILE_MIN_FRAME_DURATION_MS
+#define JITTER_BUFFER_MAX_DELAY_MS 600
+#define JITTER_BUFFER_CHECK_INTERVAL_MS 20
+// Expected uplink loss given to the encoder while in-band FEC is on, the floor keeps some FEC data
+// in the packets before any loss is measured
+#define OPUS_FEC_MIN_PACKET_LOSS_PERCENT 5
+#define OPUS_FEC_MAX_PACKET_LOSS_PERCENT 30
+// Objects held by the tasks and producers, outside of the queues
+#define AUDIO_POOL_IN_FLIGHT_OBJECTS 4
+// A released packet keeps a payload buffer up to this size, enough for a voice frame with its headroom
+#define AUDIO_PACKET_MAX_KEPT_CAPACITY 512
+// Packets for the queue limits at the given frame durations, the pool grows when they get shorter
+#define AUDIO_PACKET_POOL_SIZE(uplink_frame_ms, downlink_frame_ms) \
+    (MAX_DECODE_QUEUE_DURATION_MS / (downlink_frame_ms) + JITTER_BUFFER_DURATION_MS / (downlink_frame_ms) + \
+     MAX_SEND_QUEUE_DURATION_MS / (uplink_frame_ms) + AUDIO_POOL_IN_FLIGHT_OBJECTS)
+// Tasks for the queue limits at the given playback look-ahead, the pool grows with it
+#define AUDIO_TASK_POOL_SIZE(playback_tasks) (MAX_ENCODE_TASKS_IN_QUEUE + (playback_tasks) + AUDIO_POOL_IN_FLIGHT_OBJECTS)
+
+#define OPUS_ENCODE_TASK_STACK_SIZE (2048 * 13)
+#define OPUS_DECODE_TASK_STACK_SIZE (2048 * 8)
+#define OPUS_ENCODE_TASK_PRIORITY 2
+#define OPUS_DECODE_TASK_PRIORITY 2
+#if CONFIG_SOC_CPU_CORES_NUM > 1
+// The audio input task and AFE run on core 1
+#define OPUS_ENCODE_TASK_CORE 0
+#define OPUS_DECODE_TASK_CORE 1
+#else
+#define OPUS_ENCODE_TASK_CORE tskNO_AFFINITY
+#define OPUS_DECODE_TASK_CORE tskNO_AFFINITY
+#endif
+
+// The output task writes in chunks, so an abort only waits for one chunk and a fade out
+#define PLAYBACK_CHUNK_DURATION_MS 20
+#define PLAYBACK_FADE_OUT_DURATION_MS 10
 
 #define AUDIO_POWER_TIMEOUT_MS 15000
 #define AUDIO_POWER_CHECK_INTERVAL_MS 1000
@@ -50,6 +136,27 @@
 #define AS_EVENT_WAKE_WORD_RUNNING          (1 << 1)
 #define AS_EVENT_AUDIO_PROCESSOR_RUNNING    (1 << 2)
 #define AS_EVENT_PLAYBACK_NOT_EMPTY         (1 << 3)
+#define AS_EVENT_PLAYBACK_NOT_FULL          (1 << 4)
+#define AS_EVENT_ENCODE_NOT_EMPTY           (1 << 5)
+#define AS_EVENT_ENCODE_NOT_FULL            (1 << 6)
+#define AS_EVENT_DECODE_NOT_EMPTY           (1 << 7)
+#define AS_EVENT_DECODE_NOT_FULL            (1 << 8)
+#define AS_EVENT_SEND_NOT_EMPTY             (1 << 9)
+#define AS_EVENT_SEND_NOT_FULL              (1 << 10)
+#define AS_EVENT_TESTING_NOT_EMPTY          (1 << 11)
+#define AS_EVENT_TESTING_NOT_FULL           (1 << 12)
+#define AS_EVENT_SERVICE_STOPPED            (1 << 13)
+#define AS_EVENT_SOUND_NOT_EMPTY            (1 << 14)
+#define AS_EVENT_SOUND_NOT_FULL             (1 << 15)
+#define AS_EVENT_SOUND_DECODE_NOT_EMPTY     (1 << 16)
+#define AS_EVENT_SOUND_DECODE_NOT_FULL      (1 << 17)
+#define AS_EVENT_ALL_QUEUES                 (AS_EVENT_PLAYBACK_NOT_EMPTY | AS_EVENT_PLAYBACK_NOT_FULL | \
+                                             AS_EVENT_ENCODE_NOT_EMPTY | AS_EVENT_ENCODE_NOT_FULL | \
+                                             AS_EVENT_DECODE_NOT_EMPTY | AS_EVENT_DECODE_NOT_FULL | \
+                                             AS_EVENT_SEND_NOT_EMPTY | AS_EVENT_SEND_NOT_FULL | \
+                                             AS_EVENT_TESTING_NOT_EMPTY | AS_EVENT_TESTING_NOT_FULL | \
+                                             AS_EVENT_SOUND_NOT_EMPTY | AS_EVENT_SOUND_NOT_FULL | \
+                                             AS_EVENT_SOUND_DECODE_NOT_EMPTY | AS_EVENT_SOUND_DECODE_NOT_FULL)
 
 struct AudioServiceCallbacks {
     std::function<void(void)> on_send_queue_available;
@@ -69,6 +176,35 @@ struct AudioTask {
     AudioTaskType type;
     std::vector<int16_t> pcm;
     uint32_t timestamp;
+    uint32_t send_queue_epoch;  // a frame captured before the last ClearSendQueue() is not encoded
+};
+
+// A sound waiting for the Opus decode task, pcm is set if it was found in the sound cache
+struct SoundRequest {
+    std::string_view sound;
+    std::shared_ptr<const std::vector<int16_t>> pcm;
+};
+
+// What the audio output task plays from the sound queue: a whole cached sound, or one frame of a streamed sound
+struct SoundChunk {
+    std::shared_ptr<const std::vector<int16_t>> pcm;
+    std::unique_ptr<AudioTask> task;
+};
+
+// Time spent in one stage of the pipeline, in microseconds
+struct StageTiming {
+    uint32_t count = 0;
+    uint64_t total_us = 0;
+    uint32_t max_us = 0;
+
+    void Add(int64_t us) {
+        count++;
+        total_us += us;
+        if (us > max_us) {
+            max_us = us;
+        }
+    }
+    uint32_t average_us() const { return count > 0 ? total_us / count : 0; }
 };
 
 struct DebugStatistics {
@@ -76,6 +212,39 @@ struct DebugStatistics {
     uint32_t decode_count = 0;
     uint32_t encode_count = 0;
     uint32_t playback_count = 0;
+    uint32_t fec_count = 0;             // lost frames rebuilt from the in-band FEC data of the next packet
+    uint32_t profile_mismatches = 0;    // channels opened with another profile than the one of the queued audio
+    uint32_t reencoded_packets = 0;     // queued uplink packets encoded again for the negotiated frame duration
+    uint32_t held_packets_dropped = 0;  // oldest uplink packets dropped while the send queue was held
+    // Each stage is written by one task only
+    StageTiming input_resample_time;    // channel split and resampling of the mic input
+    StageTiming decode_time;            // including output resampling
+    StageTiming resample_time;
+    StageTiming encode_time;
+    StageTiming output_time;
+    StageTiming sound_decode_time;      // notification sounds missing in the sound cache
+    StageTiming abort_latency;          // from AbortPlayback() until the faded out audio has left the DMA buffers
+    // Playback queue, written by the output task
+    uint32_t playback_underruns = 0;
+    StageTiming starvation_time;        // speaker silent between two frames of the same stream
+    uint32_t playback_lookahead = MIN_PLAYBACK_TASKS_IN_QUEUE;
+    uint32_t playback_queue_depth[MAX_PLAYBACK_TASKS_IN_QUEUE + 1] = {};    // frames queued when one is taken
+
+    // Smallest queue depth that covers the given percentage of the taken frames
+    uint32_t playback_queue_depth_percentile(int percent) const {
+        uint64_t total = 0;
+        for (auto count : playback_queue_depth) {
+            total += count;
+        }
+        uint64_t covered = 0;
+        for (uint32_t depth = 0; depth <= MAX_PLAYBACK_TASKS_IN_QUEUE; depth++) {
+            covered += playback_queue_depth[depth];
+            if (total > 0 && covered * 100 >= total * percent) {
+                return depth;
+            }
+        }
+        return 0;
+    }
 };
 
 class AudioService {
@@ -95,17 +264,62 @@ public:
     bool IsAudioProcessorRunning() const { return xEventGroupGetBits(event_group_) & AS_EVENT_AUDIO_PROCESSOR_RUNNING; }
 
     void EnableWakeWordDetection(bool enable);
-    void EnableVoiceProcessing(bool enable);
+    // The input warmup is skipped when the microphone is already running, e.g. right after the wake word
+    void EnableVoiceProcessing(bool enable, bool input_warmup = true);
     void EnableAudioTesting(bool enable);
     void EnableDeviceAec(bool enable);
 
     void SetCallbacks(AudioServiceCallbacks& callbacks);
 
+    /*
+     * Switch the uplink encoder to the given profile, an empty name selects the preferred profile.
+     * Returns false if the name is unknown, then the preferred profile is used.
+     */
+    bool SetAudioProfile(const std::string& name);
+    const AudioProfile& GetAudioProfile() const { return *audio_profile_; }
+    /*
+     * The pre-roll and the audio captured while the channel opens are encoded before the hello exchange,
+     * with the profile given here. Called once the negotiated profile replaced it, with the audio sender
+     * paused: the queued packets are encoded again when the frame duration changed, the pre-roll when
+     * it is popped. A change of the bitrate only is logged and counted.
+     */
+    void ReencodeQueuedAudio(const AudioProfile& previous_profile);
+    // Profile advertised in the hello message, stored in the settings
+    const AudioProfile& GetPreferredAudioProfile() const;
+    bool SetPreferredAudioProfile(const std::string& name);
+    void SetDownlinkFrameDuration(int frame_duration_ms);
+    // In-band FEC of the uplink encoder, and of the decoding of the lost downlink frames
+    void SetAudioFec(bool enable);
+    // Expected uplink packet loss for the in-band FEC, clamped to the OPUS_FEC_*_PACKET_LOSS_PERCENT range
+    void SetUplinkPacketLoss(int percent);
+    // Create the decoder of the downlink format before the first packet arrives
+    void PrepareDecoder(int sample_rate, int frame_duration_ms);
+
     bool PushPacketToDecodeQueue(std::unique_ptr<AudioStreamPacket> packet, bool wait = false);
     std::unique_ptr<AudioStreamPacket> PopPacketFromSendQueue();
+    // Packets waiting in the send queue
+    size_t GetSendQueueSize() const { return audio_send_queue_.Size(); }
+    // Drops the frames that were captured for a channel that failed to open, also those not encoded yet
+    void ClearSendQueue();
+    // While the audio sender is paused nothing takes from the send queue. Holding it makes the encode
+    // task drop the oldest packet when it is full, so the capture never waits for the sender.
+    void HoldSendQueue(bool hold);
     void PlaySound(const std::string_view& sound);
     bool ReadAudioData(std::vector<int16_t>& data, int sample_rate, int samples);
     void ResetDecoder();
+    // Drop the downlink audio and fade out the frame being played, e.g. when the user barges in
+    void AbortPlayback();
+
+    // Packets given to the decode queue or taken from the send queue come from and return to this pool
+    std::unique_ptr<AudioStreamPacket> AcquirePacket();
+    void ReleasePacket(std::unique_ptr<AudioStreamPacket> packet);
+    const DebugStatistics& GetDebugStatistics() const { return debug_statistics_; }
+    void PrintDebugStatistics();
+    AudioPoolStatistics GetPacketPoolStatistics() { return packet_pool_.statistics(); }
+    AudioPoolStatistics GetTaskPoolStatistics() { return task_pool_.statistics(); }
+    JitterBufferStatistics GetJitterBufferStatistics();
+    SoundCacheStatistics GetSoundCacheStatistics() { return sound_cache_.statistics(); }
+    OpusDecoderCacheStatistics GetDecoderCacheStatistics() { return opus_decoders_.statistics(); }
 
 private:
     AudioCodec* codec_ = nullptr;
@@ -113,27 +327,89 @@ private:
     std::unique_ptr<AudioProcessor> audio_processor_;
     std::unique_ptr<WakeWord> wake_word_;
     std::unique_ptr<AudioDebugger> audio_debugger_;
-    std::unique_ptr<OpusEncoderWrapper> opus_encoder_;
-    std::unique_ptr<OpusDecoderWrapper> opus_decoder_;
+    // Guarded by encoder_mutex_, replaced when the audio profile changes
+    std::unique_ptr<OpusVoiceEncoder> opus_encoder_;
+    std::mutex encoder_mutex_;
+    // Applied to the encoder again when it is replaced, guarded by encoder_mutex_
+    bool uplink_fec_ = false;
+    int uplink_packet_loss_percent_ = OPUS_FEC_MIN_PACKET_LOSS_PERCENT;
+    // Live samples cut again into frames of the current profile after it changed, guarded by encoder_mutex_
+    std::vector<int16_t> reframe_pcm_;
+    std::vector<int16_t> reframe_frame_;
+    // Frame duration of the pre-roll encoded by the wake word
+    std::atomic<int> wake_word_frame_duration_ms_ = 0;
+    // Pre-roll encoded again for the negotiated profile, only used by the main loop
+    std::deque<std::unique_ptr<AudioStreamPacket>> reencoded_wake_word_;
+    std::atomic<bool> downlink_fec_ = false;
+    std::atomic<const AudioProfile*> audio_profile_ = FindAudioProfile(DEFAULT_AUDIO_PROFILE);
+    std::atomic<int> downlink_frame_duration_ = OPUS_FRAME_DURATION_MS;
+    OpusDecoderCache opus_decoders_;
     OpusResampler input_resampler_;
     OpusResampler reference_resampler_;
-    OpusResampler output_resampler_;
+    // Scratch buffers of ReadAudioData, which is also called by the audio wifi config task
+    std::mutex input_mutex_;
+    std::vector<int16_t> mic_channel_buffer_;
+    std::vector<int16_t> reference_channel_buffer_;
+    std::vector<int16_t> resampled_mic_buffer_;
+    std::vector<int16_t> resampled_reference_buffer_;
+    // Frame read by AudioInputTask, it goes back and forth with the pcm buffers of the task pool
+    std::vector<int16_t> input_buffer_;
     DebugStatistics debug_statistics_;
 
     EventGroupHandle_t event_group_;
+    AudioPool<AudioStreamPacket> packet_pool_;
+    AudioPool<AudioTask> task_pool_;
+    // Output of the decode resampler, swapped with the pcm of the playback task
+    std::vector<int16_t> resample_buffer_;
 
     // Audio encode / decode
     TaskHandle_t audio_input_task_handle_ = nullptr;
     TaskHandle_t audio_output_task_handle_ = nullptr;
-    TaskHandle_t opus_codec_task_handle_ = nullptr;
-    std::mutex audio_queue_mutex_;
-    std::condition_variable audio_queue_cv_;
-    std::deque<std::unique_ptr<AudioStreamPacket>> audio_decode_queue_;
-    std::deque<std::unique_ptr<AudioStreamPacket>> audio_send_queue_;
-    std::deque<std::unique_ptr<AudioStreamPacket>> audio_testing_queue_;
-    std::deque<std::unique_ptr<AudioTask>> audio_encode_queue_;
-    std::deque<std::unique_ptr<AudioTask>> audio_playback_queue_;
+    TaskHandle_t opus_encode_task_handle_ = nullptr;
+    TaskHandle_t opus_decode_task_handle_ = nullptr;
+    AudioQueue<std::unique_ptr<AudioStreamPacket>> audio_decode_queue_;
+    AudioQueue<std::unique_ptr<AudioStreamPacket>> audio_send_queue_;
+    AudioQueue<std::unique_ptr<AudioStreamPacket>> audio_testing_queue_;
+    AudioQueue<std::unique_ptr<AudioTask>> audio_encode_queue_;
+    AudioQueue<std::unique_ptr<AudioTask>> audio_playback_queue_;
+    // The decode and encode queues have more than one producer
+    std::mutex decode_producer_mutex_;
+    // Guarded by decode_producer_mutex_, drained into the decode queue by PushPacketToDecodeQueue and jitter_buffer_timer_
+    JitterBuffer jitter_buffer_;
+    esp_timer_handle_t jitter_buffer_timer_ = nullptr;
+    std::mutex encode_producer_mutex_;
+    // Incremented by ClearSendQueue()
+    std::atomic<uint32_t> send_queue_epoch_ = 0;
+    // Written with encoder_mutex_ held, see HoldSendQueue()
+    std::atomic<bool> send_queue_held_ = false;
+    // Notification sounds, see PlaySound()
+    SoundCache sound_cache_;
+    AudioQueue<SoundChunk> audio_sound_queue_;
+    AudioQueue<SoundRequest> audio_sound_decode_queue_;
+    // Serializes PlaySound(). It only pushes to audio_sound_queue_ while no request is pending, so it
+    // never pushes at the same time as the Opus decode task.
+    std::mutex sound_producer_mutex_;
+    // Requests in audio_sound_decode_queue_ or being decoded, later sounds wait behind them to keep the order
+    std::atomic<int> pending_sound_requests_ = 0;
+    // Rest of the sound being streamed by the Opus decode task, empty if none
+    std::string_view sound_stream_;
+    std::unique_ptr<OpusDecoderWrapper> sound_stream_decoder_;
+    OpusResampler sound_stream_resampler_;
+    std::vector<uint8_t> sound_stream_opus_;
+    // The stream stops when the playback is aborted
+    uint32_t sound_stream_abort_count_ = 0;
+    // Incremented to stop the frame or sound being played, the output task fades it out
+    std::atomic<uint32_t> playback_abort_count_ = 0;
+    uint32_t handled_playback_abort_count_ = 0;
+    // Set by AbortPlayback() for the abort latency
+    std::atomic<int64_t> playback_abort_time_us_ = 0;
+    // Chunk given to the codec by the output task
+    std::vector<int16_t> output_chunk_;
+    // Underrun detection of the output task, 0 while no stream is playing
+    int64_t playback_starved_since_us_ = 0;
+    uint32_t playback_stable_frames_ = 0;
     // For server AEC
+    std::mutex timestamp_mutex_;
     std::deque<uint32_t> timestamp_queue_;
 
     bool wake_word_initialized_ = false;
@@ -141,6 +417,8 @@ private:
     bool voice_detected_ = false;
     bool service_stopped_ = true;
     bool audio_input_need_warmup_ = false;
+    // Play the audio testing queue after the recording is stopped
+    std::atomic<bool> audio_testing_replay_ = false;
 
     esp_timer_handle_t audio_power_timer_ = nullptr;
     std::chrono::steady_clock::time_point last_input_time_;
@@ -148,9 +426,24 @@ private:
 
     void AudioInputTask();
     void AudioOutputTask();
-    void OpusCodecTask();
+    void OpusEncodeTask();
+    void OpusDecodeTask();
     void PushTaskToEncodeQueue(AudioTaskType type, std::vector<int16_t>&& pcm);
-    void SetDecodeSampleRate(int sample_rate, int frame_duration);
+    size_t EncodeReframedPcm(uint32_t timestamp);
+    bool PushPacketToSendQueue(std::unique_ptr<AudioStreamPacket>&& packet);
+    void ReencodeWakeWord();
+    std::shared_ptr<const std::vector<int16_t>> DecodeSound(const std::string_view& sound);
+    size_t GetSoundPcmBytes(const std::string_view& sound);
+    void StartSoundStream(const std::string_view& sound);
+    void DecodeSoundStreamFrame();
+    bool WriteOutput(const int16_t* data, size_t samples);
+    void FadeOutput(const int16_t* data, size_t samples);
+    void FlushPlayback();
+    void TrackPlaybackQueue(size_t depth);
+    int64_t GetOutputBufferDurationUs() const;
+    void ReservePackets();
+    void DrainJitterBuffer();
+    void OnJitterBufferTimer();
     void CheckAndUpdateAudioPowerState();
 };
 
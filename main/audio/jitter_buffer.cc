@@ -0,0 +1,203 @@
+#include "jitter_buffer.h"
+
+#include <algorithm>
+
+
+JitterBuffer::JitterBuffer(size_t capacity, int min_delay_ms, int max_delay_ms)
+    : slots_(capacity), min_delay_ms_(min_delay_ms), max_delay_ms_(max_delay_ms) {
+}
+
+void JitterBuffer::OnDrop(std::function<void(std::unique_ptr<AudioStreamPacket>&&)> callback) {
+    on_drop_ = callback;
+}
+
+void JitterBuffer::Drop(std::unique_ptr<AudioStreamPacket>&& packet) {
+    if (on_drop_) {
+        on_drop_(std::move(packet));
+    }
+}
+
+void JitterBuffer::Restart(uint32_t sequence, int64_t now_ms) {
+    started_ = true;
+    playing_ = false;
+    next_sequence_ = sequence;
+    highest_sequence_ = sequence - 1;
+    consecutive_lost_ = 0;
+    prebuffer_start_ms_ = now_ms;
+    // Do not measure the jitter across the silence between two streams
+    has_last_arrival_ = false;
+}
+
+void JitterBuffer::Put(std::unique_ptr<AudioStreamPacket> packet, int64_t now_ms) {
+    uint32_t sequence = packet->sequence;
+    if (packet->redundant) {
+        // Usually the frame was received or played already, then the copy is not counted at all
+        int32_t offset = static_cast<int32_t>(sequence - next_sequence_);
+        auto& slot = slots_[sequence % slots_.size()];
+        if (!started_ || offset < 0 || offset >= static_cast<int32_t>(slots_.size()) || slot) {
+            Drop(std::move(packet));
+            return;
+        }
+        statistics_.recovered++;
+        slot = std::move(packet);
+        count_++;
+        return;
+    }
+
+    statistics_.received++;
+    sample_rate_ = packet->sample_rate;
+    if (packet->frame_duration > 0) {
+        frame_duration_ = packet->frame_duration;
+    }
+
+    int32_t capacity = static_cast<int32_t>(slots_.size());
+    int32_t offset = static_cast<int32_t>(sequence - next_sequence_);
+    if (!started_ || offset <= -4 * capacity || offset >= 4 * capacity) {
+        // First packet, or the sender restarted its numbering
+        if (started_) {
+            Reset();
+        }
+        Restart(sequence, now_ms);
+        offset = 0;
+    }
+
+    if (offset < 0 && !playing_ && static_cast<int32_t>(highest_sequence_ - sequence) < capacity) {
+        // Nothing is played yet, an earlier packet of the stream arrived after a later one
+        next_sequence_ = sequence;
+        offset = 0;
+    }
+    if (offset < 0) {
+        /* The lateness of the packet is what the target delay has to cover next time */
+        UpdateJitter(sequence, now_ms);
+        statistics_.late++;
+        Drop(std::move(packet));
+        return;
+    }
+    if (offset >= capacity) {
+        statistics_.overflowed++;
+        Drop(std::move(packet));
+        return;
+    }
+
+    auto& slot = slots_[sequence % capacity];
+    if (slot) {
+        statistics_.duplicated++;
+        Drop(std::move(packet));
+        return;
+    }
+
+    UpdateJitter(sequence, now_ms);
+    if (static_cast<int32_t>(sequence - highest_sequence_) > 0) {
+        highest_sequence_ = sequence;
+    } else {
+        statistics_.reordered++;
+    }
+    slot = std::move(packet);
+    count_++;
+}
+
+const AudioStreamPacket* JitterBuffer::Peek() const {
+    if (count_ == 0) {
+        return nullptr;
+    }
+    return slots_[next_sequence_ % slots_.size()].get();
+}
+
+JitterBuffer::Result JitterBuffer::Get(int64_t now_ms, std::unique_ptr<AudioStreamPacket>& packet) {
+    if (count_ == 0) {
+        if (playing_ && now_ms >= playout_end_ms_) {
+            // Everything is played out, the next packet starts a new stream with a fresh pre-buffer
+            playing_ = false;
+            started_ = false;
+            statistics_.rebuffered++;
+        }
+        return kNone;
+    }
+
+    if (!playing_) {
+        int target_delay_ms = TargetDelayMs();
+        if (now_ms - prebuffer_start_ms_ < target_delay_ms && static_cast<int>(count_) * frame_duration_ < target_delay_ms) {
+            return kNone;
+        }
+        playing_ = true;
+        playout_end_ms_ = now_ms;
+    }
+
+    size_t capacity = slots_.size();
+    while (true) {
+        auto& slot = slots_[next_sequence_ % capacity];
+        if (slot) {
+            packet = std::move(slot);
+            count_--;
+            next_sequence_++;
+            consecutive_lost_ = 0;
+            playout_end_ms_ = std::max(playout_end_ms_, now_ms) + frame_duration_;
+            return kPacket;
+        }
+
+        // Wait for the missing packet as long as the released audio lasts
+        if (playout_end_ms_ - now_ms > frame_duration_ && count_ < capacity / 2) {
+            return kNone;
+        }
+
+        if (consecutive_lost_ < JITTER_BUFFER_MAX_CONCEALED_FRAMES) {
+            consecutive_lost_++;
+            statistics_.concealed++;
+            next_sequence_++;
+            playout_end_ms_ = std::max(playout_end_ms_, now_ms) + frame_duration_;
+            return kLost;
+        }
+
+        // The gap is too long to conceal, continue with the next packet buffered
+        while (!slots_[next_sequence_ % capacity]) {
+            next_sequence_++;
+            statistics_.skipped++;
+        }
+        consecutive_lost_ = 0;
+    }
+}
+
+void JitterBuffer::Reset() {
+    for (auto& slot : slots_) {
+        if (slot) {
+            Drop(std::move(slot));
+            slot.reset();
+        }
+    }
+    count_ = 0;
+    started_ = false;
+    playing_ = false;
+    consecutive_lost_ = 0;
+}
+
+void JitterBuffer::UpdateJitter(uint32_t sequence, int64_t now_ms) {
+    int32_t distance = static_cast<int32_t>(sequence - last_arrival_sequence_);
+    if (has_last_arrival_) {
+        // Signed, a packet overtaken by later ones is measured against them
+        int64_t expected_ms = static_cast<int64_t>(distance) * frame_duration_;
+        int64_t delay_ms = (now_ms - last_arrival_ms_) - expected_ms;
+        if (delay_ms > jitter_ms_) {
+            // Follow a delay peak at once, then decay slowly
+            jitter_ms_ = static_cast<int>(std::min<int64_t>(delay_ms, max_delay_ms_));
+        } else {
+            jitter_ms_ -= static_cast<int>((jitter_ms_ - std::max<int64_t>(delay_ms, 0)) / 16);
+        }
+    }
+    if (!has_last_arrival_ || distance > 0) {
+        has_last_arrival_ = true;
+        last_arrival_sequence_ = sequence;
+        last_arrival_ms_ = now_ms;
+    }
+}
+
+// A missing packet is only waited for until one frame is left, the delay covers that frame on a jittery link
+int JitterBuffer::TargetDelayMs() const {
+    return std::clamp(frame_duration_ + jitter_ms_ + std::min(jitter_ms_, frame_duration_), min_delay_ms_, max_delay_ms_);
+}
+
+JitterBufferStatistics JitterBuffer::statistics() const {
+    JitterBufferStatistics statistics = statistics_;
+    statistics.jitter_ms = jitter_ms_;
+    statistics.target_delay_ms = TargetDelayMs();
+    return statistics;
+}
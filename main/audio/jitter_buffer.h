@@ -0,0 +1,101 @@
+#ifndef JITTER_BUFFER_H
+#define JITTER_BUFFER_H
+
+#include <memory>
+#include <vector>
+#include <functional>
+#include <cstdint>
+#include <cstddef>
+
+#include "protocol.h"
+
+// Consecutive lost frames concealed by the decoder, a longer gap is skipped
+#define JITTER_BUFFER_MAX_CONCEALED_FRAMES 3
+
+struct JitterBufferStatistics {
+    uint32_t received = 0;
+    uint32_t reordered = 0;
+    uint32_t late = 0;
+    uint32_t duplicated = 0;
+    uint32_t overflowed = 0;
+    uint32_t concealed = 0;
+    uint32_t skipped = 0;
+    uint32_t recovered = 0;     // gaps filled by the redundant copy carried in the next packet
+    uint32_t rebuffered = 0;
+    int jitter_ms = 0;
+    int target_delay_ms = 0;
+};
+
+/*
+ * Reorders the incoming packets of an unreliable transport (MQTT + UDP) by sequence before they
+ * are decoded, and reports the frames that never arrived so the decoder can conceal them.
+ *
+ * Packets are stored in a window of `capacity` slots starting at the next sequence to play.
+ * At the start of a stream the buffer waits for the target delay, which follows the measured
+ * inter-arrival jitter, then releases packets in order. A missing packet is waited for until the
+ * audio already released is about to run out, then it is reported as lost.
+ *
+ * The caller passes the current time and serializes the calls, so the buffer has no dependency
+ * on FreeRTOS and packet traces can be replayed on the host.
+ */
+class JitterBuffer {
+public:
+    enum Result {
+        kNone,      // Nothing to play yet
+        kPacket,    // The next packet
+        kLost,      // The next packet is lost and should be concealed
+    };
+
+    JitterBuffer(size_t capacity, int min_delay_ms, int max_delay_ms);
+
+    // Called with every packet that is not played (late, duplicated, overflowed or reset)
+    void OnDrop(std::function<void(std::unique_ptr<AudioStreamPacket>&&)> callback);
+
+    // A redundant packet only fills the slot of a frame that is still missing, it never starts a stream
+    void Put(std::unique_ptr<AudioStreamPacket> packet, int64_t now_ms);
+    Result Get(int64_t now_ms, std::unique_ptr<AudioStreamPacket>& packet);
+    // The packet Get() returns next if it is buffered, nullptr otherwise. After kLost this is the
+    // packet following the lost frame, whose in-band FEC data may rebuild it.
+    const AudioStreamPacket* Peek() const;
+    void Reset();
+
+    // No packet buffered and the released audio has been played out
+    bool IsIdle() const { return count_ == 0 && !playing_; }
+    size_t Size() const { return count_; }
+    // Format of the stream, used for the concealed frames
+    int sample_rate() const { return sample_rate_; }
+    int frame_duration() const { return frame_duration_; }
+    JitterBufferStatistics statistics() const;
+
+private:
+    std::vector<std::unique_ptr<AudioStreamPacket>> slots_;
+    std::function<void(std::unique_ptr<AudioStreamPacket>&&)> on_drop_;
+    const int min_delay_ms_;
+    const int max_delay_ms_;
+    size_t count_ = 0;
+
+    bool started_ = false;
+    bool playing_ = false;
+    uint32_t next_sequence_ = 0;
+    uint32_t highest_sequence_ = 0;
+    uint32_t consecutive_lost_ = 0;
+    int64_t prebuffer_start_ms_ = 0;
+    int64_t playout_end_ms_ = 0;
+    int sample_rate_ = 16000;
+    int frame_duration_ = 60;
+
+    // Inter-arrival jitter, the time a packet arrives later than its sequence implies
+    bool has_last_arrival_ = false;
+    uint32_t last_arrival_sequence_ = 0;
+    int64_t last_arrival_ms_ = 0;
+    int jitter_ms_ = 0;
+
+    JitterBufferStatistics statistics_;
+
+    void Drop(std::unique_ptr<AudioStreamPacket>&& packet);
+    void Restart(uint32_t sequence, int64_t now_ms);
+    void UpdateJitter(uint32_t sequence, int64_t now_ms);
+    int TargetDelayMs() const;
+};
+
+#endif // JITTER_BUFFER_H
@@ -0,0 +1,105 @@
+#include "opus_decoder_cache.h"
+
+#include <esp_log.h>
+
+#define TAG "OpusDecoderCache"
+
+
+OpusDecoderCache::OpusDecoderCache(size_t capacity) {
+    slots_.reserve(capacity);
+    statistics_.capacity = capacity;
+}
+
+void OpusDecoderCache::Initialize(int output_sample_rate) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    output_sample_rate_ = output_sample_rate;
+}
+
+void OpusDecoderCache::Prepare(int sample_rate, int frame_duration_ms) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (Find(sample_rate, frame_duration_ms) == nullptr) {
+        Create(sample_rate, frame_duration_ms).last_used = ++clock_;
+    }
+}
+
+OpusDecoderSlot& OpusDecoderCache::Select(int sample_rate, int frame_duration_ms) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (selected_ != nullptr && selected_->sample_rate == sample_rate && selected_->frame_duration_ms == frame_duration_ms) {
+        if (reset_pending_) {
+            Reset(*selected_);
+            reset_pending_ = false;
+        }
+        return *selected_;
+    }
+
+    auto slot = Find(sample_rate, frame_duration_ms);
+    if (slot != nullptr) {
+        /* The state left in the slot belongs to an earlier stream */
+        Reset(*slot);
+    } else {
+        slot = &Create(sample_rate, frame_duration_ms);
+    }
+    slot->last_used = ++clock_;
+    selected_ = slot;
+    reset_pending_ = false;
+    statistics_.switches++;
+    return *slot;
+}
+
+void OpusDecoderCache::ResetState() {
+    /* The decode task may be using the slot right now, it resets the slot before the next packet */
+    std::lock_guard<std::mutex> lock(mutex_);
+    reset_pending_ = selected_ != nullptr;
+}
+
+OpusDecoderCacheStatistics OpusDecoderCache::statistics() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return statistics_;
+}
+
+OpusDecoderSlot* OpusDecoderCache::Find(int sample_rate, int frame_duration_ms) {
+    for (auto& slot : slots_) {
+        if (slot.sample_rate == sample_rate && slot.frame_duration_ms == frame_duration_ms) {
+            return &slot;
+        }
+    }
+    return nullptr;
+}
+
+OpusDecoderSlot& OpusDecoderCache::Create(int sample_rate, int frame_duration_ms) {
+    OpusDecoderSlot* slot;
+    if (slots_.size() < slots_.capacity()) {
+        slot = &slots_.emplace_back();
+    } else {
+        /* Replace the least recently used slot, but never the one the decode task is using */
+        slot = nullptr;
+        for (auto& candidate : slots_) {
+            if (&candidate != selected_ && (slot == nullptr || candidate.last_used < slot->last_used)) {
+                slot = &candidate;
+            }
+        }
+        ESP_LOGI(TAG, "Evicting decoder %d Hz / %d ms", slot->sample_rate, slot->frame_duration_ms);
+        *slot = OpusDecoderSlot();
+        statistics_.evictions++;
+    }
+
+    slot->sample_rate = sample_rate;
+    slot->frame_duration_ms = frame_duration_ms;
+    slot->decoder = std::make_unique<OpusVoiceDecoder>(sample_rate, 1, frame_duration_ms);
+    if (sample_rate != output_sample_rate_) {
+        ESP_LOGI(TAG, "Resampling audio from %d to %d", sample_rate, output_sample_rate_);
+        slot->resampler = std::make_unique<OpusResampler>();
+        slot->resampler->Configure(sample_rate, output_sample_rate_);
+    }
+    statistics_.creations++;
+    statistics_.entries = slots_.size();
+    return *slot;
+}
+
+void OpusDecoderCache::Reset(OpusDecoderSlot& slot) {
+    slot.decoder->ResetState();
+    if (slot.resampler) {
+        /* Configure() only initializes the filter state, it does not allocate */
+        slot.resampler->Configure(slot.sample_rate, slot.resampler->output_sample_rate());
+    }
+}
@@ -0,0 +1,67 @@
+#ifndef OPUS_DECODER_CACHE_H
+#define OPUS_DECODER_CACHE_H
+
+#include <memory>
+#include <vector>
+#include <mutex>
+#include <cstdint>
+#include <cstddef>
+
+#include <opus_resampler.h>
+
+#include "opus_voice_decoder.h"
+
+struct OpusDecoderCacheStatistics {
+    uint32_t switches = 0;
+    uint32_t creations = 0;
+    uint32_t evictions = 0;
+    size_t entries = 0;
+    size_t capacity = 0;
+};
+
+// A decoder for one packet format, with its resampler to the output sample rate
+struct OpusDecoderSlot {
+    int sample_rate = 0;
+    int frame_duration_ms = 0;
+    std::unique_ptr<OpusVoiceDecoder> decoder;
+    std::unique_ptr<OpusResampler> resampler;   // nullptr if the format is already at the output sample rate
+    uint32_t last_used = 0;
+};
+
+/*
+ * Decoders and resamplers kept per (sample rate, frame duration), so switching between the server
+ * TTS and the other streams does not create a decoder and a resampler at the start of a reply.
+ *
+ * Only the Opus decode task selects a slot and uses it; Prepare() may be called from any task and
+ * never replaces the selected slot. ResetState() may also be called from any task, the reset is
+ * done by the decode task in its next Select(), never while it decodes with the slot.
+ */
+class OpusDecoderCache {
+public:
+    explicit OpusDecoderCache(size_t capacity);
+
+    void Initialize(int output_sample_rate);
+    // Create the slot of a format in advance, e.g. when the server hello tells the downlink format
+    void Prepare(int sample_rate, int frame_duration_ms);
+    // Switch to the format of the next packet. A slot used for another stream meanwhile is reset first.
+    OpusDecoderSlot& Select(int sample_rate, int frame_duration_ms);
+    // Reset the state of the selected slot before the next packet is decoded, e.g. at the start of a new stream
+    void ResetState();
+    OpusDecoderCacheStatistics statistics();
+
+private:
+    std::mutex mutex_;
+    int output_sample_rate_ = 0;
+    // Reserved to the capacity in the constructor, a returned slot never moves
+    std::vector<OpusDecoderSlot> slots_;
+    OpusDecoderSlot* selected_ = nullptr;
+    bool reset_pending_ = false;
+    uint32_t clock_ = 0;
+    OpusDecoderCacheStatistics statistics_;
+
+    OpusDecoderSlot* Find(int sample_rate, int frame_duration_ms);
+    OpusDecoderSlot& Create(int sample_rate, int frame_duration_ms);
+    static void Reset(OpusDecoderSlot& slot);
+};
+
+#endif // OPUS_DECODER_CACHE_H
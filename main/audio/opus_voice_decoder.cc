@@ -0,0 +1,49 @@
+#include "opus_voice_decoder.h"
+
+#include <opus.h>
+#include <esp_log.h>
+
+#define TAG "OpusVoiceDecoder"
+
+
+OpusVoiceDecoder::OpusVoiceDecoder(int sample_rate, int channels, int duration_ms)
+    : sample_rate_(sample_rate), duration_ms_(duration_ms), channels_(channels) {
+    int error;
+    audio_dec_ = opus_decoder_create(sample_rate, channels, &error);
+    if (audio_dec_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to create audio decoder, error code: %d", error);
+        return;
+    }
+
+    frame_size_ = sample_rate / 1000 * duration_ms;
+}
+
+OpusVoiceDecoder::~OpusVoiceDecoder() {
+    if (audio_dec_ != nullptr) {
+        opus_decoder_destroy(audio_dec_);
+    }
+}
+
+void OpusVoiceDecoder::ResetState() {
+    if (audio_dec_ != nullptr) {
+        opus_decoder_ctl(audio_dec_, OPUS_RESET_STATE);
+    }
+}
+
+bool OpusVoiceDecoder::Decode(const uint8_t* data, size_t size, std::vector<int16_t>& pcm, bool fec) {
+    if (audio_dec_ == nullptr) {
+        ESP_LOGE(TAG, "Audio decoder is not configured");
+        return false;
+    }
+
+    /* A lost frame, concealed or rebuilt from the FEC data, has the duration of the stream frames */
+    pcm.resize(frame_size_ * channels_);
+    auto ret = opus_decode(audio_dec_, size > 0 ? data : nullptr, size, pcm.data(), frame_size_, fec ? 1 : 0);
+    if (ret < 0) {
+        ESP_LOGE(TAG, "Failed to decode audio, error code: %d", ret);
+        pcm.clear();
+        return false;
+    }
+    pcm.resize(ret * channels_);
+    return true;
+}
@@ -0,0 +1,37 @@
+#ifndef OPUS_VOICE_DECODER_H
+#define OPUS_VOICE_DECODER_H
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+struct OpusDecoder;
+
+/*
+ * Downlink Opus decoder working on one frame at a time.
+ *
+ * OpusDecoderWrapper cannot decode the in-band FEC data of a packet, so the stream decoders use
+ * libopus directly. The packet is read in place, it stays with its pooled AudioStreamPacket.
+ */
+class OpusVoiceDecoder {
+public:
+    OpusVoiceDecoder(int sample_rate, int channels, int duration_ms);
+    ~OpusVoiceDecoder();
+
+    // An empty packet conceals a lost frame. With fec, the packet is the one after a lost frame
+    // and the lost frame is rebuilt from its in-band FEC data, or concealed if it has none.
+    bool Decode(const uint8_t* data, size_t size, std::vector<int16_t>& pcm, bool fec = false);
+    void ResetState();
+
+    inline int sample_rate() const { return sample_rate_; }
+    inline int duration_ms() const { return duration_ms_; }
+
+private:
+    OpusDecoder* audio_dec_ = nullptr;
+    int sample_rate_;
+    int duration_ms_;
+    int channels_;
+    int frame_size_ = 0;
+};
+
+#endif // OPUS_VOICE_DECODER_H
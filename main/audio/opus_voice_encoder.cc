@@ -0,0 +1,87 @@
+#include "opus_voice_encoder.h"
+
+#include <opus.h>
+#include <esp_log.h>
+#include <cstring>
+
+#define TAG "OpusVoiceEncoder"
+
+#define MAX_OPUS_PACKET_SIZE 1500
+
+
+OpusVoiceEncoder::OpusVoiceEncoder(int sample_rate, int channels, int duration_ms)
+    : sample_rate_(sample_rate), duration_ms_(duration_ms) {
+    int error;
+    audio_enc_ = opus_encoder_create(sample_rate, channels, OPUS_APPLICATION_VOIP, &error);
+    if (audio_enc_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to create audio encoder, error code: %d", error);
+        return;
+    }
+
+    frame_size_ = sample_rate / 1000 * channels * duration_ms;
+    packet_buffer_.resize(MAX_OPUS_PACKET_SIZE);
+}
+
+OpusVoiceEncoder::~OpusVoiceEncoder() {
+    if (audio_enc_ != nullptr) {
+        opus_encoder_destroy(audio_enc_);
+    }
+}
+
+void OpusVoiceEncoder::SetComplexity(int complexity) {
+    if (audio_enc_ != nullptr) {
+        opus_encoder_ctl(audio_enc_, OPUS_SET_COMPLEXITY(complexity));
+    }
+}
+
+void OpusVoiceEncoder::SetBitrate(int bitrate) {
+    if (audio_enc_ != nullptr) {
+        opus_encoder_ctl(audio_enc_, OPUS_SET_BITRATE(bitrate > 0 ? bitrate : OPUS_AUTO));
+    }
+}
+
+void OpusVoiceEncoder::SetDtx(bool enable) {
+    if (audio_enc_ != nullptr) {
+        opus_encoder_ctl(audio_enc_, OPUS_SET_DTX(enable ? 1 : 0));
+    }
+}
+
+void OpusVoiceEncoder::SetInbandFec(bool enable) {
+    if (audio_enc_ != nullptr) {
+        opus_encoder_ctl(audio_enc_, OPUS_SET_INBAND_FEC(enable ? 1 : 0));
+    }
+}
+
+void OpusVoiceEncoder::SetPacketLossPercent(int percent) {
+    if (audio_enc_ != nullptr) {
+        opus_encoder_ctl(audio_enc_, OPUS_SET_PACKET_LOSS_PERC(percent));
+    }
+}
+
+void OpusVoiceEncoder::ResetState() {
+    if (audio_enc_ != nullptr) {
+        opus_encoder_ctl(audio_enc_, OPUS_RESET_STATE);
+    }
+}
+
+bool OpusVoiceEncoder::Encode(const std::vector<int16_t>& pcm, std::vector<uint8_t>& opus, size_t headroom) {
+    if (audio_enc_ == nullptr) {
+        ESP_LOGE(TAG, "Audio encoder is not configured");
+        return false;
+    }
+    if (pcm.size() != frame_size_) {
+        ESP_LOGE(TAG, "Audio data size is not equal to frame size, size: %u, frame size: %u", pcm.size(), frame_size_);
+        return false;
+    }
+
+    /* Encoded into the scratch buffer, the output only grows to the real size of the packet */
+    auto ret = opus_encode(audio_enc_, pcm.data(), frame_size_, packet_buffer_.data(), packet_buffer_.size());
+    if (ret < 0) {
+        ESP_LOGE(TAG, "Failed to encode audio, error code: %ld", (long)ret);
+        opus.clear();
+        return false;
+    }
+    opus.resize(headroom + ret);
+    memcpy(opus.data() + headroom, packet_buffer_.data(), ret);
+    return true;
+}
@@ -0,0 +1,45 @@
+#ifndef OPUS_VOICE_ENCODER_H
+#define OPUS_VOICE_ENCODER_H
+
+#include <vector>
+#include <cstdint>
+
+struct OpusEncoder;
+
+/*
+ * Uplink Opus encoder working on one frame at a time.
+ *
+ * OpusEncoderWrapper does not expose the bitrate, so the uplink uses libopus directly. The packet
+ * is encoded into a scratch buffer of the maximum packet size and copied into the output vector,
+ * so a pooled vector only keeps the capacity of a real packet.
+ */
+class OpusVoiceEncoder {
+public:
+    OpusVoiceEncoder(int sample_rate, int channels, int duration_ms);
+    ~OpusVoiceEncoder();
+
+    void SetComplexity(int complexity);
+    // 0 lets Opus choose the bitrate
+    void SetBitrate(int bitrate);
+    void SetDtx(bool enable);
+    // In-band FEC: each packet also carries a low bitrate copy of the previous frame
+    void SetInbandFec(bool enable);
+    // Expected packet loss, a higher loss spends more of the bitrate on the FEC data
+    void SetPacketLossPercent(int percent);
+    void ResetState();
+    // The packet is written after the first headroom bytes of opus, which are left to the caller
+    bool Encode(const std::vector<int16_t>& pcm, std::vector<uint8_t>& opus, size_t headroom = 0);
+
+    inline int sample_rate() const { return sample_rate_; }
+    inline int duration_ms() const { return duration_ms_; }
+    inline size_t frame_size() const { return frame_size_; }
+
+private:
+    OpusEncoder* audio_enc_ = nullptr;
+    int sample_rate_;
+    int duration_ms_;
+    size_t frame_size_;
+    std::vector<uint8_t> packet_buffer_;
+};
+
+#endif // OPUS_VOICE_ENCODER_H
@@ -0,0 +1,77 @@
+#ifndef PCM_KERNELS_H
+#define PCM_KERNELS_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+/*
+ * Channel split / merge kernels for interleaved 16-bit PCM.
+ *
+ * Two frames are moved per iteration with 32-bit loads and stores (one stereo frame is one word),
+ * which halves the memory accesses on the Xtensa / RISC-V cores and lets the compiler vectorize
+ * the loop where the target has SIMD. memcpy keeps the word accesses valid for any alignment.
+ */
+
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "The PCM kernels assume little-endian samples");
+
+// Split interleaved stereo into the left and right channels
+inline void PcmDeinterleaveStereo(const int16_t* input, int16_t* left, int16_t* right, size_t frames) {
+    size_t i = 0;
+    for (; i + 2 <= frames; i += 2) {
+        uint32_t a, b;
+        memcpy(&a, input + 2 * i, sizeof(a));
+        memcpy(&b, input + 2 * i + 2, sizeof(b));
+        uint32_t l = (a & 0xFFFF) | (b << 16);
+        uint32_t r = (a >> 16) | (b & 0xFFFF0000);
+        memcpy(left + i, &l, sizeof(l));
+        memcpy(right + i, &r, sizeof(r));
+    }
+    for (; i < frames; ++i) {
+        left[i] = input[2 * i];
+        right[i] = input[2 * i + 1];
+    }
+}
+
+// Merge the left and right channels into interleaved stereo
+inline void PcmInterleaveStereo(const int16_t* left, const int16_t* right, int16_t* output, size_t frames) {
+    size_t i = 0;
+    for (; i + 2 <= frames; i += 2) {
+        uint32_t l, r;
+        memcpy(&l, left + i, sizeof(l));
+        memcpy(&r, right + i, sizeof(r));
+        uint32_t a = (l & 0xFFFF) | (r << 16);
+        uint32_t b = (l >> 16) | (r & 0xFFFF0000);
+        memcpy(output + 2 * i, &a, sizeof(a));
+        memcpy(output + 2 * i + 2, &b, sizeof(b));
+    }
+    for (; i < frames; ++i) {
+        output[2 * i] = left[i];
+        output[2 * i + 1] = right[i];
+    }
+}
+
+// Copy the left channel of interleaved stereo, output may be the input buffer (in-place downmix)
+inline void PcmExtractLeft(const int16_t* input, int16_t* output, size_t frames) {
+    size_t i = 0;
+    for (; i + 2 <= frames; i += 2) {
+        uint32_t a, b;
+        memcpy(&a, input + 2 * i, sizeof(a));
+        memcpy(&b, input + 2 * i + 2, sizeof(b));
+        uint32_t l = (a & 0xFFFF) | (b << 16);
+        memcpy(output + i, &l, sizeof(l));
+    }
+    for (; i < frames; ++i) {
+        output[i] = input[2 * i];
+    }
+}
+
+// Ramp the samples down to silence over their length instead of cutting the waveform, which would
+// click. output may be the input buffer.
+inline void PcmFadeOut(const int16_t* input, int16_t* output, size_t samples) {
+    for (size_t i = 0; i < samples; ++i) {
+        output[i] = static_cast<int16_t>(input[i] * (int32_t)(samples - i) / (int32_t)samples);
+    }
+}
+
+#endif // PCM_KERNELS_H
@@ -1,5 +1,6 @@
 #include "afe_audio_processor.h"
 #include <esp_log.h>
+#include <algorithm>
 
 #define PROCESSOR_RUNNING 0x01
 
@@ -77,6 +78,10 @@ AfeAudioProcessor::~AfeAudioProcessor() {
     vEventGroupDelete(event_group_);
 }
 
+void AfeAudioProcessor::SetFrameDuration(int frame_duration_ms) {
+    frame_samples_ = frame_duration_ms * 16000 / 1000;
+}
+
 size_t AfeAudioProcessor::GetFeedSize() {
     if (afe_data_ == nullptr) {
         return 0;
@@ -146,22 +151,23 @@ void AfeAudioProcessor::AudioProcessorTask() {
         }
 
         if (output_callback_) {
+            const int16_t* data = res->data;
             size_t samples = res->data_size / sizeof(int16_t);
-            
-            // Add data to buffer
-            output_buffer_.insert(output_buffer_.end(), res->data, res->data + samples);
-            
-            // Output complete frames when buffer has enough data
-            while (output_buffer_.size() >= frame_samples_) {
-                if (output_buffer_.size() == frame_samples_) {
-                    // If buffer size equals frame size, move the entire buffer
+            size_t frame_samples = frame_samples_;
+            if (output_buffer_.size() > frame_samples) {
+                // The frame duration was shortened, drop the partial frame
+                output_buffer_.clear();
+            }
+
+            // Fill the buffer up to one frame at a time; the callback hands back an empty buffer
+            while (samples > 0) {
+                size_t count = std::min(samples, frame_samples - output_buffer_.size());
+                output_buffer_.insert(output_buffer_.end(), data, data + count);
+                data += count;
+                samples -= count;
+                if (output_buffer_.size() == frame_samples) {
                     output_callback_(std::move(output_buffer_));
                     output_buffer_.clear();
-                    output_buffer_.reserve(frame_samples_);
-                } else {
-                    // If buffer size exceeds frame size, copy one frame and remove it
-                    output_callback_(std::vector<int16_t>(output_buffer_.begin(), output_buffer_.begin() + frame_samples_));
-                    output_buffer_.erase(output_buffer_.begin(), output_buffer_.begin() + frame_samples_);
                 }
             }
         }
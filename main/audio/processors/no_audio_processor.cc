@@ -1,6 +1,8 @@
 #include "no_audio_processor.h"
 #include <esp_log.h>
 
+#include "pcm_kernels.h"
+
 #define TAG "NoAudioProcessor"
 
 void NoAudioProcessor::Initialize(AudioCodec* codec, int frame_duration_ms) {
@@ -8,23 +10,26 @@ void NoAudioProcessor::Initialize(AudioCodec* codec, int frame_duration_ms) {
     frame_samples_ = frame_duration_ms * 16000 / 1000;
 }
 
+void NoAudioProcessor::SetFrameDuration(int frame_duration_ms) {
+    frame_samples_ = frame_duration_ms * 16000 / 1000;
+}
+
 void NoAudioProcessor::Feed(std::vector<int16_t>&& data) {
     if (!is_running_ || !output_callback_) {
         return;
     }
 
-    if (data.size() != frame_samples_) {
-        ESP_LOGE(TAG, "Feed data size is not equal to frame size, feed size: %u, frame size: %u", data.size(), frame_samples_);
+    size_t frame_samples = frame_samples_;
+    if (data.size() != frame_samples) {
+        ESP_LOGE(TAG, "Feed data size is not equal to frame size, feed size: %u, frame size: %u", data.size(), frame_samples);
         return;
     }
 
     if (codec_->input_channels() == 2) {
         // If input channels is 2, we need to fetch the left channel data
-        auto mono_data = std::vector<int16_t>(data.size() / 2);
-        for (size_t i = 0, j = 0; i < mono_data.size(); ++i, j += 2) {
-            mono_data[i] = data[j];
-        }
-        output_callback_(std::move(mono_data));
+        PcmExtractLeft(data.data(), data.data(), data.size() / 2);
+        data.resize(data.size() / 2);
+        output_callback_(std::move(data));
     } else {
         output_callback_(std::move(data));
     }
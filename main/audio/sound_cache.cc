@@ -0,0 +1,54 @@
+#include "sound_cache.h"
+
+#include <esp_log.h>
+
+#define TAG "SoundCache"
+
+
+SoundCache::SoundCache(size_t budget_bytes) {
+    statistics_.budget = budget_bytes;
+}
+
+std::shared_ptr<const std::vector<int16_t>> SoundCache::Find(const void* key) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+        if (it->key == key) {
+            entries_.splice(entries_.begin(), entries_, it);
+            statistics_.hits++;
+            return entries_.front().pcm;
+        }
+    }
+    statistics_.misses++;
+    return nullptr;
+}
+
+void SoundCache::Insert(const void* key, std::shared_ptr<const std::vector<int16_t>> pcm) {
+    size_t bytes = pcm->size() * sizeof(int16_t);
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (bytes > statistics_.budget) {
+        ESP_LOGW(TAG, "Sound of %u bytes exceeds the cache budget of %u bytes", bytes, statistics_.budget);
+        return;
+    }
+
+    for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+        if (it->key == key) {
+            statistics_.bytes -= it->pcm->size() * sizeof(int16_t);
+            entries_.erase(it);
+            break;
+        }
+    }
+    while (statistics_.bytes + bytes > statistics_.budget) {
+        statistics_.bytes -= entries_.back().pcm->size() * sizeof(int16_t);
+        entries_.pop_back();
+        statistics_.evictions++;
+    }
+
+    entries_.push_front(Entry{key, std::move(pcm)});
+    statistics_.bytes += bytes;
+    statistics_.entries = entries_.size();
+}
+
+SoundCacheStatistics SoundCache::statistics() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return statistics_;
+}
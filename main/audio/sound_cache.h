@@ -0,0 +1,49 @@
+#ifndef SOUND_CACHE_H
+#define SOUND_CACHE_H
+
+#include <memory>
+#include <vector>
+#include <list>
+#include <mutex>
+#include <cstdint>
+#include <cstddef>
+
+struct SoundCacheStatistics {
+    uint32_t hits = 0;
+    uint32_t misses = 0;
+    uint32_t evictions = 0;
+    size_t entries = 0;
+    size_t bytes = 0;
+    size_t budget = 0;
+};
+
+/*
+ * LRU cache of decoded notification sounds, already resampled to the output sample rate.
+ *
+ * The key is the address of the P3 data, so it only works for sounds that stay at the same
+ * address, such as the sounds embedded in the firmware. The PCM is shared with the output task,
+ * an evicted sound is freed when it finishes playing.
+ */
+class SoundCache {
+public:
+    explicit SoundCache(size_t budget_bytes);
+
+    // Returns nullptr on a miss, a hit becomes the most recently used sound
+    std::shared_ptr<const std::vector<int16_t>> Find(const void* key);
+    // Evicts the least recently used sounds until the new one fits, a sound larger than the budget is not cached
+    void Insert(const void* key, std::shared_ptr<const std::vector<int16_t>> pcm);
+    SoundCacheStatistics statistics();
+
+private:
+    struct Entry {
+        const void* key;
+        std::shared_ptr<const std::vector<int16_t>> pcm;
+    };
+
+    std::mutex mutex_;
+    // Most recently used first, there are only a few sounds so a linear search is enough
+    std::list<Entry> entries_;
+    SoundCacheStatistics statistics_;
+};
+
+#endif // SOUND_CACHE_H
@@ -40,7 +40,7 @@ void Ml307Board::StartNetwork() {
             if (device_state == kDeviceStateListening || device_state == kDeviceStateSpeaking) {
                 application.Schedule([this, &application]() {
                     application.SetDeviceState(kDeviceStateIdle);
-                });
+                }, kMainTaskPriorityHigh, "network_down");
             }
         }
     });
@@ -130,7 +130,8 @@ std::string Ml307Board::GetDeviceStatusJson() {
      *     "network": {
      *         "type": "cellular",
      *         "carrier": "CHINA MOBILE",
-     *         "csq": 10
+     *         "csq": 10,
+     *         "transport": { "hello_rtt_ms": 85, "sent": {...}, "received": { "lost": 0, "jitter_ms": 12, ... } }
      *     }
      * }
      */
@@ -184,6 +185,11 @@ std::string Ml307Board::GetDeviceStatusJson() {
     } else if (csq >= 25 && csq <= 31) {
         cJSON_AddStringToObject(network, "signal", "strong");
     }
+    // Audio transport of the current session
+    auto protocol = Application::GetInstance().GetProtocol();
+    if (protocol != nullptr) {
+        cJSON_AddItemToObject(network, "transport", protocol->transport_metrics().ToJson());
+    }
     cJSON_AddItemToObject(root, "network", network);
 
     auto json_str = cJSON_PrintUnformatted(root);
@@ -64,6 +64,7 @@ void PowerSaveTimer::PowerSaveCheck() {
         if (!in_sleep_mode_) {
             ESP_LOGI(TAG, "Enabling power save mode");
             in_sleep_mode_ = true;
+            app.SetPowerSaving(true);
             if (on_enter_sleep_mode_) {
                 on_enter_sleep_mode_();
             }
@@ -101,6 +102,7 @@ void PowerSaveTimer::WakeUp() {
     if (in_sleep_mode_) {
         ESP_LOGI(TAG, "Exiting power save mode");
         in_sleep_mode_ = false;
+        Application::GetInstance().SetPowerSaving(false);
 
         if (cpu_max_freq_ != -1) {
             esp_pm_config_t pm_config = {
@@ -193,7 +193,8 @@ std::string WifiBoard::GetDeviceStatusJson() {
      *     "network": {
      *         "type": "wifi",
      *         "ssid": "Xiaozhi",
-     *         "rssi": -60
+     *         "rssi": -60,
+     *         "transport": { "hello_rtt_ms": 85, "sent": {...}, "received": { "lost": 0, "jitter_ms": 12, ... } }
      *     },
      *     "chip": {
      *         "temperature": 25
@@ -247,6 +248,11 @@ std::string WifiBoard::GetDeviceStatusJson() {
     } else {
         cJSON_AddStringToObject(network, "signal", "weak");
     }
+    // Audio transport of the current session
+    auto protocol = Application::GetInstance().GetProtocol();
+    if (protocol != nullptr) {
+        cJSON_AddItemToObject(network, "transport", protocol->transport_metrics().ToJson());
+    }
     cJSON_AddItemToObject(root, "network", network);
 
     // Chip
@@ -7,22 +7,54 @@ DeviceStateEventManager& DeviceStateEventManager::GetInstance() {
     return instance;
 }
 
-void DeviceStateEventManager::RegisterStateChangeCallback(std::function<void(DeviceState, DeviceState)> callback) {
+void DeviceStateEventManager::RegisterStateChangeCallback(std::function<void(DeviceState, DeviceState)> callback,
+    uint32_t to_mask, uint32_t from_mask, DeviceStateDelivery delivery) {
     std::lock_guard<std::mutex> lock(mutex_);
-    callbacks_.push_back(callback);
+    /* Copy on write, the published list is never changed */
+    auto current = subscribers_.load(std::memory_order_relaxed);
+    auto list = current != nullptr ? std::make_unique<std::vector<Subscriber>>(*current) : std::make_unique<std::vector<Subscriber>>();
+    list->push_back({ std::move(callback), to_mask, from_mask, delivery });
+    subscribers_.store(list.get(), std::memory_order_release);
+    lists_.push_back(std::move(list));
 }
 
 void DeviceStateEventManager::PostStateChangeEvent(DeviceState previous_state, DeviceState current_state) {
-    device_state_event_data_t event_data = {
-        .previous_state = previous_state,
-        .current_state = current_state
-    };
-    esp_event_post(XIAOZHI_STATE_EVENTS, XIAOZHI_STATE_CHANGED_EVENT, &event_data, sizeof(event_data), portMAX_DELAY);
+    auto subscribers = subscribers_.load(std::memory_order_acquire);
+    if (subscribers == nullptr) {
+        return;
+    }
+
+    bool post = false;
+    for (const auto& subscriber : *subscribers) {
+        if (!subscriber.Matches(previous_state, current_state)) {
+            continue;
+        }
+        if (subscriber.delivery == kDeviceStateDeliveryDirect) {
+            subscriber.callback(previous_state, current_state);
+        } else {
+            post = true;
+        }
+    }
+
+    if (post) {
+        device_state_event_data_t event_data = {
+            .previous_state = previous_state,
+            .current_state = current_state
+        };
+        esp_event_post(XIAOZHI_STATE_EVENTS, XIAOZHI_STATE_CHANGED_EVENT, &event_data, sizeof(event_data), portMAX_DELAY);
+    }
 }
 
-std::vector<std::function<void(DeviceState, DeviceState)>> DeviceStateEventManager::GetCallbacks() {
-    std::lock_guard<std::mutex> lock(mutex_);
-    return callbacks_;
+void DeviceStateEventManager::DispatchFromEventLoop(DeviceState previous_state, DeviceState current_state) {
+    auto subscribers = subscribers_.load(std::memory_order_acquire);
+    if (subscribers == nullptr) {
+        return;
+    }
+    for (const auto& subscriber : *subscribers) {
+        if (subscriber.delivery == kDeviceStateDeliveryEventLoop && subscriber.Matches(previous_state, current_state)) {
+            subscriber.callback(previous_state, current_state);
+        }
+    }
 }
 
 DeviceStateEventManager::DeviceStateEventManager() {
@@ -31,16 +63,13 @@ DeviceStateEventManager::DeviceStateEventManager() {
         ESP_ERROR_CHECK(err);
     }
 
-    ESP_ERROR_CHECK(esp_event_handler_register(XIAOZHI_STATE_EVENTS, XIAOZHI_STATE_CHANGED_EVENT, 
+    ESP_ERROR_CHECK(esp_event_handler_register(XIAOZHI_STATE_EVENTS, XIAOZHI_STATE_CHANGED_EVENT,
         [](void* handler_args, esp_event_base_t base, int32_t id, void* event_data) {
             auto* data = static_cast<device_state_event_data_t*>(event_data);
-            auto& manager = DeviceStateEventManager::GetInstance();
-            for (const auto& callback : manager.GetCallbacks()) {
-                callback(data->previous_state, data->current_state);
-            }
+            DeviceStateEventManager::GetInstance().DispatchFromEventLoop(data->previous_state, data->current_state);
         }, nullptr));
 }
 
 DeviceStateEventManager::~DeviceStateEventManager() {
     esp_event_handler_unregister(XIAOZHI_STATE_EVENTS, XIAOZHI_STATE_CHANGED_EVENT, nullptr);
-}
\ No newline at end of file
+}
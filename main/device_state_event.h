@@ -4,6 +4,8 @@
 #include <esp_event.h>
 #include <functional>
 #include <vector>
+#include <memory>
+#include <atomic>
 #include <mutex>
 #include "device_state.h"
 
@@ -18,22 +20,59 @@ struct device_state_event_data_t {
     DeviceState current_state;
 };
 
+// Bit of a state in the transition masks of a subscriber
+#define DEVICE_STATE_MASK(state) (1u << (state))
+#define DEVICE_STATE_MASK_ALL 0xFFFFFFFFu
+
+enum DeviceStateDelivery {
+    // From the default event loop task, after the state change
+    kDeviceStateDeliveryEventLoop,
+    // From the task changing the state, before the change goes on. The callback must be short and must not block.
+    kDeviceStateDeliveryDirect,
+};
+
+/*
+ * Delivers the state changes to the subscribers of their transitions.
+ *
+ * The subscriber list is immutable once published: a registration publishes a new list with an
+ * atomic swap, so a state change reads it without a lock, a copy or an allocation. The lists
+ * replaced are kept, a dispatch may still be reading one; the subscribers register at startup
+ * and are few. The event is only posted to the event loop when an event loop subscriber wants
+ * the transition.
+ */
 class DeviceStateEventManager {
 public:
     static DeviceStateEventManager& GetInstance();
     DeviceStateEventManager(const DeviceStateEventManager&) = delete;
     DeviceStateEventManager& operator=(const DeviceStateEventManager&) = delete;
 
-    void RegisterStateChangeCallback(std::function<void(DeviceState, DeviceState)> callback);
+    // The callback gets the transitions to a state in to_mask from a state in from_mask
+    void RegisterStateChangeCallback(std::function<void(DeviceState, DeviceState)> callback,
+        uint32_t to_mask = DEVICE_STATE_MASK_ALL, uint32_t from_mask = DEVICE_STATE_MASK_ALL,
+        DeviceStateDelivery delivery = kDeviceStateDeliveryEventLoop);
     void PostStateChangeEvent(DeviceState previous_state, DeviceState current_state);
-    std::vector<std::function<void(DeviceState, DeviceState)>> GetCallbacks();
 
 private:
     DeviceStateEventManager();
     ~DeviceStateEventManager();
 
-    std::vector<std::function<void(DeviceState, DeviceState)>> callbacks_;
+    struct Subscriber {
+        std::function<void(DeviceState, DeviceState)> callback;
+        uint32_t to_mask;
+        uint32_t from_mask;
+        DeviceStateDelivery delivery;
+
+        bool Matches(DeviceState previous_state, DeviceState current_state) const {
+            return (to_mask & DEVICE_STATE_MASK(current_state)) && (from_mask & DEVICE_STATE_MASK(previous_state));
+        }
+    };
+
+    std::atomic<const std::vector<Subscriber>*> subscribers_ = nullptr;
+    // Every list published, guarded by the mutex together with the registrations
+    std::vector<std::unique_ptr<const std::vector<Subscriber>>> lists_;
     std::mutex mutex_;
+
+    void DispatchFromEventLoop(DeviceState previous_state, DeviceState current_state);
 };
 
-#endif // _DEVICE_STATE_EVENT_H_ 
\ No newline at end of file
+#endif // _DEVICE_STATE_EVENT_H_
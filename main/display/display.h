@@ -5,6 +5,9 @@
 #include <esp_timer.h>
 #include <esp_log.h>
 #include <esp_pm.h>
+#if CONFIG_USE_MAIN_LOOP_PROFILER
+#include "main_loop_profiler.h"
+#endif
 
 #include <string>
 #include <chrono>
@@ -69,16 +72,30 @@ protected:
 class DisplayLockGuard {
 public:
     DisplayLockGuard(Display *display) : display_(display) {
+#if CONFIG_USE_MAIN_LOOP_PROFILER
+        auto start_us = esp_timer_get_time();
+#endif
         if (!display_->Lock(30000)) {
             ESP_LOGE("Display", "Failed to lock display");
         }
+#if CONFIG_USE_MAIN_LOOP_PROFILER
+        locked_us_ = esp_timer_get_time();
+        wait_us_ = locked_us_ - start_us;
+#endif
     }
     ~DisplayLockGuard() {
         display_->Unlock();
+#if CONFIG_USE_MAIN_LOOP_PROFILER
+        MainLoopProfiler::GetInstance().OnDisplayLock(wait_us_, esp_timer_get_time() - locked_us_);
+#endif
     }
 
 private:
     Display *display_;
+#if CONFIG_USE_MAIN_LOOP_PROFILER
+    int64_t locked_us_ = 0;
+    int64_t wait_us_ = 0;
+#endif
 };
 
 class NoDisplay : public Display {
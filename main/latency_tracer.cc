@@ -0,0 +1,285 @@
+#include "latency_tracer.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <algorithm>
+#include <iterator>
+#include <string>
+
+#define TAG "LatencyTracer"
+
+static_assert((LATENCY_TRACER_RING_SIZE & (LATENCY_TRACER_RING_SIZE - 1)) == 0, "The index wraps around");
+static_assert(kLatencyEventCount < 31, "The events of a turn are bits of seen_");
+
+// Set in seen_ once the end of the turn was recorded
+static const uint32_t kTurnEndedBit = 1u << 31;
+static const int kSpeechEnd = kLatencyEventCount;
+
+// Threads of the Chrome trace
+enum TraceLane {
+    kLaneTurn = 1,
+    kLaneBreakdown,
+    kLaneApplication,
+    kLaneAudio,
+    kLaneProtocol,
+};
+
+static const struct {
+    TraceLane lane;
+    const char* name;
+} kLanes[] = {
+    { kLaneTurn, "turn" },
+    { kLaneBreakdown, "breakdown" },
+    { kLaneApplication, "application" },
+    { kLaneAudio, "audio service" },
+    { kLaneProtocol, "protocol" },
+};
+
+static const struct {
+    const char* name;
+    TraceLane lane;
+    // Only the first one of a turn is recorded
+    bool once;
+} kEvents[kLatencyEventCount] = {
+    { "wake_word", kLaneAudio, false },
+    { "listen_start", kLaneApplication, false },
+    { "channel_opened", kLaneProtocol, true },
+    { "uplink_first", kLaneProtocol, true },
+    { "voice_start", kLaneAudio, false },
+    { "voice_end", kLaneAudio, false },
+    { "listen_stop", kLaneProtocol, false },
+    { "stt", kLaneApplication, true },
+    { "tts_start", kLaneApplication, true },
+    { "downlink_first", kLaneProtocol, true },
+    { "playback_first", kLaneAudio, true },
+    { "abort", kLaneApplication, true },
+    { "tts_stop", kLaneApplication, true },
+};
+
+// The breakdown of the time to first audio, the last one is the whole of it
+static const struct {
+    const char* name;
+    int from;
+    int to;
+} kSegments[] = {
+    { "wake_to_channel", kLatencyWakeWord, kLatencyChannelOpened },
+    { "channel_to_uplink", kLatencyChannelOpened, kLatencyUplinkFirst },
+    { "speech_end_to_stt", kSpeechEnd, kLatencyStt },
+    { "stt_to_tts_start", kLatencyStt, kLatencyTtsStart },
+    { "tts_start_to_downlink", kLatencyTtsStart, kLatencyDownlinkFirst },
+    { "downlink_to_playback", kLatencyDownlinkFirst, kLatencyPlaybackFirst },
+    { "time_to_first_audio", kSpeechEnd, kLatencyPlaybackFirst },
+};
+
+void LatencyTracer::Record(LatencyEvent event) {
+    int64_t time_us = esp_timer_get_time();
+    uint32_t seen = seen_.load(std::memory_order_relaxed);
+    bool open = turn_.load(std::memory_order_relaxed) != 0 && (seen & kTurnEndedBit) == 0;
+    bool responding = (seen & (1u << kLatencyTtsStart)) != 0;
+    if (event == kLatencyWakeWord && !(open && responding)) {
+        /* A wake word while speaking interrupts the turn, the abort ends it */
+        BeginTurn();
+    } else if (event == kLatencyListenStart && !(open && !responding)) {
+        /* Listening after the wake word belongs to its turn */
+        BeginTurn();
+    }
+
+    uint32_t bit = 1u << event;
+    uint32_t previous = seen_.fetch_or(bit, std::memory_order_relaxed);
+    if (kEvents[event].once && (previous & bit) != 0) {
+        return;
+    }
+
+    uint32_t turn = turn_.load(std::memory_order_relaxed);
+    uint32_t index = next_index_.fetch_add(1, std::memory_order_relaxed);
+    auto& slot = ring_[index % LATENCY_TRACER_RING_SIZE];
+    /* A reader that sees the same sequence before and after copying the slot got a whole record */
+    slot.sequence.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.time_us = time_us;
+    slot.turn = turn;
+    slot.event = event;
+    slot.sequence.store(index + 1, std::memory_order_release);
+
+    if (turn != 0 && (event == kLatencyTtsStop || event == kLatencyAbort)) {
+        EndTurn(turn);
+    }
+}
+
+void LatencyTracer::BeginTurn() {
+    turn_.fetch_add(1, std::memory_order_relaxed);
+    seen_.store(0, std::memory_order_relaxed);
+}
+
+void LatencyTracer::EndTurn(uint32_t turn) {
+    if (seen_.fetch_or(kTurnEndedBit, std::memory_order_relaxed) & kTurnEndedBit) {
+        return;
+    }
+
+    auto entries = Snapshot();
+    PrintBreakdown(GetBreakdown(entries, turn));
+#if CONFIG_LATENCY_TRACER_SERIAL_EXPORT
+    auto json = CreateTrace(entries, turn, turn);
+    auto str = cJSON_PrintUnformatted(json);
+    if (str != nullptr) {
+        ESP_LOGI(TAG, LATENCY_TRACER_SERIAL_PREFIX "%s", str);
+        cJSON_free(str);
+    }
+    cJSON_Delete(json);
+#endif
+}
+
+std::vector<LatencyTracer::Entry> LatencyTracer::Snapshot() {
+    std::vector<Entry> entries;
+    entries.reserve(LATENCY_TRACER_RING_SIZE);
+    uint32_t end = next_index_.load(std::memory_order_acquire);
+    uint32_t begin = end > LATENCY_TRACER_RING_SIZE ? end - LATENCY_TRACER_RING_SIZE : 0;
+    for (uint32_t index = begin; index != end; index++) {
+        auto& slot = ring_[index % LATENCY_TRACER_RING_SIZE];
+        /* A slot being written, or overwritten meanwhile, is skipped */
+        if (slot.sequence.load(std::memory_order_acquire) != index + 1) {
+            continue;
+        }
+        Entry entry = { slot.time_us, slot.turn, (LatencyEvent)slot.event };
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.sequence.load(std::memory_order_relaxed) != index + 1) {
+            continue;
+        }
+        entries.push_back(entry);
+    }
+    return entries;
+}
+
+int64_t LatencyTracer::Breakdown::Time(int event) const {
+    if (event != kSpeechEnd) {
+        return times_us[event];
+    }
+    /* Without the local VAD, e.g. with the server VAD, the speech end is the stt */
+    int64_t speech_end = std::max(times_us[kLatencyVoiceEnd], times_us[kLatencyListenStop]);
+    return speech_end != 0 ? speech_end : times_us[kLatencyStt];
+}
+
+LatencyTracer::Breakdown LatencyTracer::GetBreakdown(const std::vector<Entry>& entries, uint32_t turn) {
+    Breakdown breakdown;
+    breakdown.turn = turn;
+    for (auto& entry : entries) {
+        if (entry.turn != turn) {
+            continue;
+        }
+        if (breakdown.start_us == 0 || entry.time_us < breakdown.start_us) {
+            breakdown.start_us = entry.time_us;
+        }
+        breakdown.end_us = std::max(breakdown.end_us, entry.time_us);
+
+        /* A pause in the sentence is not the speech end, the last one before the response is */
+        bool speech_end = entry.event == kLatencyVoiceEnd || entry.event == kLatencyListenStop;
+        if (breakdown.times_us[entry.event] == 0 || (speech_end && breakdown.times_us[kLatencyTtsStart] == 0)) {
+            breakdown.times_us[entry.event] = entry.time_us;
+        }
+    }
+    return breakdown;
+}
+
+void LatencyTracer::PrintBreakdown(const Breakdown& breakdown) {
+    std::string text;
+    char buffer[48];
+    for (auto& segment : kSegments) {
+        int64_t from = breakdown.Time(segment.from);
+        int64_t to = breakdown.Time(segment.to);
+        if (from != 0 && to != 0 && to >= from) {
+            snprintf(buffer, sizeof(buffer), " %s %lld", segment.name, (to - from) / 1000);
+        } else {
+            snprintf(buffer, sizeof(buffer), " %s -", segment.name);
+        }
+        text += buffer;
+    }
+    ESP_LOGI(TAG, "Turn %lu latency (ms):%s", (unsigned long)breakdown.turn, text.c_str());
+}
+
+cJSON* LatencyTracer::CreateTrace(const std::vector<Entry>& entries, uint32_t first_turn, uint32_t last_turn) {
+    cJSON* json = cJSON_CreateObject();
+    cJSON* events = cJSON_CreateArray();
+    cJSON* turns = cJSON_CreateArray();
+    for (auto& lane : kLanes) {
+        cJSON* metadata = cJSON_CreateObject();
+        cJSON_AddStringToObject(metadata, "name", "thread_name");
+        cJSON_AddStringToObject(metadata, "ph", "M");
+        cJSON_AddNumberToObject(metadata, "pid", 1);
+        cJSON_AddNumberToObject(metadata, "tid", lane.lane);
+        cJSON* args = cJSON_CreateObject();
+        cJSON_AddStringToObject(args, "name", lane.name);
+        cJSON_AddItemToObject(metadata, "args", args);
+        cJSON_AddItemToArray(events, metadata);
+    }
+
+    auto add_span = [events](const char* name, uint32_t turn, TraceLane lane, int64_t from, int64_t to) {
+        cJSON* span = cJSON_CreateObject();
+        cJSON_AddStringToObject(span, "name", name);
+        cJSON_AddStringToObject(span, "ph", "X");
+        cJSON_AddNumberToObject(span, "ts", from);
+        cJSON_AddNumberToObject(span, "dur", to - from);
+        cJSON_AddNumberToObject(span, "pid", 1);
+        cJSON_AddNumberToObject(span, "tid", lane);
+        cJSON* args = cJSON_CreateObject();
+        cJSON_AddNumberToObject(args, "turn", turn);
+        cJSON_AddItemToObject(span, "args", args);
+        cJSON_AddItemToArray(events, span);
+    };
+
+    for (auto& entry : entries) {
+        if (entry.turn < first_turn || entry.turn > last_turn) {
+            continue;
+        }
+        cJSON* event = cJSON_CreateObject();
+        cJSON_AddStringToObject(event, "name", kEvents[entry.event].name);
+        cJSON_AddStringToObject(event, "ph", "i");
+        cJSON_AddStringToObject(event, "s", "t");
+        cJSON_AddNumberToObject(event, "ts", entry.time_us);
+        cJSON_AddNumberToObject(event, "pid", 1);
+        cJSON_AddNumberToObject(event, "tid", kEvents[entry.event].lane);
+        cJSON* args = cJSON_CreateObject();
+        cJSON_AddNumberToObject(args, "turn", entry.turn);
+        cJSON_AddItemToObject(event, "args", args);
+        cJSON_AddItemToArray(events, event);
+    }
+
+    for (uint32_t turn = first_turn; turn != 0 && turn <= last_turn; turn++) {
+        auto breakdown = GetBreakdown(entries, turn);
+        if (breakdown.start_us == 0) {
+            /* Already overwritten in the ring */
+            continue;
+        }
+        char name[24];
+        snprintf(name, sizeof(name), "turn %lu", (unsigned long)turn);
+        add_span(name, turn, kLaneTurn, breakdown.start_us, breakdown.end_us);
+
+        cJSON* item = cJSON_CreateObject();
+        cJSON_AddNumberToObject(item, "turn", turn);
+        cJSON_AddNumberToObject(item, "start_us", breakdown.start_us);
+        cJSON* segments = cJSON_CreateObject();
+        for (auto& segment : kSegments) {
+            int64_t from = breakdown.Time(segment.from);
+            int64_t to = breakdown.Time(segment.to);
+            if (from == 0 || to == 0 || to < from) {
+                continue;
+            }
+            cJSON_AddNumberToObject(segments, segment.name, (to - from) / 1000);
+            /* The time to first audio spans the others, it goes with the turn */
+            add_span(segment.name, turn, &segment == &kSegments[std::size(kSegments) - 1] ? kLaneTurn : kLaneBreakdown, from, to);
+        }
+        cJSON_AddItemToObject(item, "segments_ms", segments);
+        cJSON_AddItemToArray(turns, item);
+    }
+
+    cJSON_AddItemToObject(json, "traceEvents", events);
+    cJSON_AddStringToObject(json, "displayTimeUnit", "ms");
+    cJSON_AddItemToObject(json, "turns", turns);
+    return json;
+}
+
+cJSON* LatencyTracer::ToJson(int turns) {
+    auto entries = Snapshot();
+    uint32_t last_turn = turn_.load(std::memory_order_relaxed);
+    uint32_t first_turn = last_turn > (uint32_t)turns ? last_turn - turns + 1 : 1;
+    return CreateTrace(entries, first_turn, last_turn);
+}
@@ -0,0 +1,105 @@
+#ifndef LATENCY_TRACER_H
+#define LATENCY_TRACER_H
+
+#include <cJSON.h>
+
+#include <atomic>
+#include <vector>
+#include <cstdint>
+
+// Must be a power of two
+#define LATENCY_TRACER_RING_SIZE 128
+// Marks the lines of the serial export, the viewer script looks for it
+#define LATENCY_TRACER_SERIAL_PREFIX "LATENCY_TRACE "
+
+enum LatencyEvent {
+    kLatencyWakeWord,
+    kLatencyListenStart,
+    kLatencyChannelOpened,
+    kLatencyUplinkFirst,
+    kLatencyVoiceStart,
+    kLatencyVoiceEnd,
+    kLatencyListenStop,
+    kLatencyStt,
+    kLatencyTtsStart,
+    kLatencyDownlinkFirst,
+    kLatencyPlaybackFirst,
+    kLatencyAbort,
+    kLatencyTtsStop,
+    kLatencyEventCount
+};
+
+/*
+ * Timeline of the key events of a conversation turn, from the wake word to the first PCM sample
+ * written to the speaker, for breaking down the time to first audio.
+ *
+ * Record() is lock free and cheap enough for the audio tasks and the network callbacks: it takes
+ * a slot of the ring with one atomic increment, and a per-frame event (first uplink frame, first
+ * downlink packet, first PCM written) is only recorded once per turn. A turn starts with the wake
+ * word or with listening after the last response, and ends with tts stop or an abort. The task
+ * that records the end, the main loop, logs the breakdown of the turn and, with
+ * CONFIG_LATENCY_TRACER_SERIAL_EXPORT, its Chrome trace on one line for scripts/latency_trace.py.
+ */
+class LatencyTracer {
+public:
+    static LatencyTracer& GetInstance() {
+        static LatencyTracer instance;
+        return instance;
+    }
+    LatencyTracer(const LatencyTracer&) = delete;
+    LatencyTracer& operator=(const LatencyTracer&) = delete;
+
+    void Record(LatencyEvent event);
+    // Chrome trace of the last turns still in the ring, with their breakdown. The caller owns the returned object.
+    cJSON* ToJson(int turns);
+
+private:
+    LatencyTracer() = default;
+
+    struct Slot {
+        // Index of the record plus one, 0 while it is being written
+        std::atomic<uint32_t> sequence = 0;
+        int64_t time_us = 0;
+        uint32_t turn = 0;
+        uint8_t event = 0;
+    };
+
+    struct Entry {
+        int64_t time_us;
+        uint32_t turn;
+        LatencyEvent event;
+    };
+
+    struct Breakdown {
+        uint32_t turn = 0;
+        // 0 for the events that did not happen, the speech end is the last one before the response
+        int64_t times_us[kLatencyEventCount] = {};
+        int64_t start_us = 0;
+        int64_t end_us = 0;
+
+        // kLatencyEventCount gives the speech end
+        int64_t Time(int event) const;
+    };
+
+    Slot ring_[LATENCY_TRACER_RING_SIZE];
+    std::atomic<uint32_t> next_index_ = 0;
+    std::atomic<uint32_t> turn_ = 0;
+    // Bits of the events recorded in the current turn
+    std::atomic<uint32_t> seen_ = 0;
+
+    void BeginTurn();
+    void EndTurn(uint32_t turn);
+    std::vector<Entry> Snapshot();
+    Breakdown GetBreakdown(const std::vector<Entry>& entries, uint32_t turn);
+    void PrintBreakdown(const Breakdown& breakdown);
+    cJSON* CreateTrace(const std::vector<Entry>& entries, uint32_t first_turn, uint32_t last_turn);
+};
+
+// Records the event, does nothing without CONFIG_USE_LATENCY_TRACER
+inline void TraceLatency(LatencyEvent event) {
+#if CONFIG_USE_LATENCY_TRACER
+    LatencyTracer::GetInstance().Record(event);
+#endif
+}
+
+#endif // LATENCY_TRACER_H
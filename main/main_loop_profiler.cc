@@ -0,0 +1,148 @@
+#include "main_loop_profiler.h"
+
+#include <esp_log.h>
+#include <cstring>
+#include <algorithm>
+
+#define TAG "MainLoopProfiler"
+
+static const int kBucketsMs[] = MAIN_LOOP_PROFILER_BUCKETS_MS;
+static_assert(sizeof(kBucketsMs) / sizeof(kBucketsMs[0]) == MAIN_LOOP_PROFILER_BUCKETS - 1, "The last bucket has no bound");
+
+void MainLoopProfiler::Histogram::Add(int64_t us) {
+    int bucket = 0;
+    while (bucket < MAIN_LOOP_PROFILER_BUCKETS - 1 && us >= kBucketsMs[bucket] * 1000LL) {
+        bucket++;
+    }
+    buckets[bucket]++;
+    count++;
+    total_us += us;
+    max_us = std::max(max_us, us);
+}
+
+cJSON* MainLoopProfiler::Histogram::ToJson() const {
+    cJSON* json = cJSON_CreateObject();
+    cJSON_AddNumberToObject(json, "avg_us", count > 0 ? total_us / count : 0);
+    cJSON_AddNumberToObject(json, "max_us", max_us);
+    cJSON* histogram = cJSON_CreateArray();
+    for (auto bucket : buckets) {
+        cJSON_AddItemToArray(histogram, cJSON_CreateNumber(bucket));
+    }
+    cJSON_AddItemToObject(json, "histogram", histogram);
+    return json;
+}
+
+// Labels are string literals, so the pointer is compared before the text
+MainLoopProfiler::Entry* MainLoopProfiler::FindEntry(const char* label) {
+    if (label == nullptr) {
+        label = "unknown";
+    }
+    for (int i = 0; i < entry_count_; i++) {
+        if (entries_[i].label == label || strcmp(entries_[i].label, label) == 0) {
+            return &entries_[i];
+        }
+    }
+    if (entry_count_ == MAIN_LOOP_PROFILER_MAX_LABELS - 1) {
+        /* The last entry collects the labels that do not fit */
+        entries_[entry_count_].label = "other";
+        return &entries_[entry_count_];
+    }
+    entries_[entry_count_].label = label;
+    return &entries_[entry_count_++];
+}
+
+void MainLoopProfiler::BeginTask(const char* label, int64_t wait_us) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    main_task_ = xTaskGetCurrentTaskHandle();
+    running_ = FindEntry(label);
+    running_wait_us_ = wait_us;
+    running_lock_wait_us_ = 0;
+    running_start_us_ = esp_timer_get_time();
+}
+
+void MainLoopProfiler::EndTask() {
+    int64_t run_us = esp_timer_get_time() - running_start_us_;
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (running_ == nullptr) {
+        return;
+    }
+    running_->run.Add(run_us);
+    if (running_wait_us_ >= 0) {
+        running_->wait.Add(running_wait_us_);
+    }
+    if (run_us > CONFIG_MAIN_LOOP_TASK_BUDGET_MS * 1000LL) {
+        running_->over_budget++;
+        ESP_LOGW(TAG, "%s ran %lld ms, budget %d ms (queued %lld ms, waited %lld ms for the display lock)", running_->label,
+            run_us / 1000, CONFIG_MAIN_LOOP_TASK_BUDGET_MS, std::max<int64_t>(running_wait_us_, 0) / 1000, running_lock_wait_us_ / 1000);
+    }
+    running_ = nullptr;
+}
+
+void MainLoopProfiler::OnDisplayLock(int64_t wait_us, int64_t held_us) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (running_ == nullptr || xTaskGetCurrentTaskHandle() != main_task_) {
+        return;
+    }
+    running_->lock_wait_total_us += wait_us;
+    running_->lock_wait_max_us = std::max(running_->lock_wait_max_us, wait_us);
+    running_->lock_held_total_us += held_us;
+    running_lock_wait_us_ += wait_us;
+}
+
+void MainLoopProfiler::PrintStatistics() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (int i = 0; i <= entry_count_ && i < MAIN_LOOP_PROFILER_MAX_LABELS; i++) {
+        auto& entry = entries_[i];
+        if (entry.label == nullptr || entry.run.count == 0) {
+            continue;
+        }
+        ESP_LOGI(TAG, "%-24s %5lu runs, run avg/max %lld/%lld us, wait avg/max %lld/%lld us, display lock wait max %lld us held %lld us, over budget %lu",
+            entry.label, (unsigned long)entry.run.count, entry.run.total_us / entry.run.count, entry.run.max_us,
+            entry.wait.count > 0 ? entry.wait.total_us / entry.wait.count : 0LL, entry.wait.max_us,
+            entry.lock_wait_max_us, entry.lock_held_total_us, (unsigned long)entry.over_budget);
+    }
+}
+
+cJSON* MainLoopProfiler::ToJson() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    cJSON* json = cJSON_CreateObject();
+    cJSON_AddNumberToObject(json, "budget_ms", CONFIG_MAIN_LOOP_TASK_BUDGET_MS);
+    cJSON* buckets = cJSON_CreateArray();
+    for (auto bound : kBucketsMs) {
+        cJSON_AddItemToArray(buckets, cJSON_CreateNumber(bound));
+    }
+    cJSON_AddItemToObject(json, "buckets_ms", buckets);
+
+    cJSON* tasks = cJSON_CreateArray();
+    for (int i = 0; i <= entry_count_ && i < MAIN_LOOP_PROFILER_MAX_LABELS; i++) {
+        auto& entry = entries_[i];
+        if (entry.label == nullptr || entry.run.count == 0) {
+            continue;
+        }
+        cJSON* task = cJSON_CreateObject();
+        cJSON_AddStringToObject(task, "label", entry.label);
+        cJSON_AddNumberToObject(task, "count", entry.run.count);
+        cJSON_AddNumberToObject(task, "over_budget", entry.over_budget);
+        cJSON_AddItemToObject(task, "run", entry.run.ToJson());
+        if (entry.wait.count > 0) {
+            cJSON_AddItemToObject(task, "wait", entry.wait.ToJson());
+        }
+        cJSON_AddNumberToObject(task, "display_lock_wait_max_us", entry.lock_wait_max_us);
+        cJSON_AddNumberToObject(task, "display_lock_wait_total_us", entry.lock_wait_total_us);
+        cJSON_AddNumberToObject(task, "display_lock_held_total_us", entry.lock_held_total_us);
+        cJSON_AddItemToArray(tasks, task);
+    }
+    cJSON_AddItemToObject(json, "tasks", tasks);
+    return json;
+}
+
+void MainLoopProfiler::Reset() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    /* The running task keeps its entry, it is counted again when it ends */
+    const char* running_label = running_ != nullptr ? running_->label : nullptr;
+    for (auto& entry : entries_) {
+        entry = Entry();
+    }
+    entry_count_ = 0;
+    running_ = running_label != nullptr ? FindEntry(running_label) : nullptr;
+}
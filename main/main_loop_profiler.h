@@ -0,0 +1,98 @@
+#ifndef MAIN_LOOP_PROFILER_H
+#define MAIN_LOOP_PROFILER_H
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <esp_timer.h>
+#include <cJSON.h>
+
+#include <mutex>
+#include <cstdint>
+
+#define MAIN_LOOP_PROFILER_MAX_LABELS 32
+// Upper bounds of the histogram buckets in milliseconds, the last bucket has no bound
+#define MAIN_LOOP_PROFILER_BUCKETS_MS { 1, 2, 5, 10, 20, 50, 100 }
+#define MAIN_LOOP_PROFILER_BUCKETS 8
+
+/*
+ * Latency of the main loop, per source label of the scheduled tasks and per event bit.
+ *
+ * For every label it records how long the tasks waited in the queue and how long they ran, and
+ * how long they waited for and held the display lock while running. The main loop calls
+ * BeginTask() / EndTask() through MainLoopTaskScope, DisplayLockGuard calls OnDisplayLock().
+ */
+class MainLoopProfiler {
+public:
+    static MainLoopProfiler& GetInstance() {
+        static MainLoopProfiler instance;
+        return instance;
+    }
+    MainLoopProfiler(const MainLoopProfiler&) = delete;
+    MainLoopProfiler& operator=(const MainLoopProfiler&) = delete;
+
+    // wait_us is -1 for the events, they are not queued
+    void BeginTask(const char* label, int64_t wait_us);
+    void EndTask();
+    // Only counted when the display is locked by the running task of the main loop
+    void OnDisplayLock(int64_t wait_us, int64_t held_us);
+    void PrintStatistics();
+    // The caller owns the returned object
+    cJSON* ToJson();
+    void Reset();
+
+private:
+    MainLoopProfiler() = default;
+
+    struct Histogram {
+        uint32_t count = 0;
+        uint32_t buckets[MAIN_LOOP_PROFILER_BUCKETS] = {};
+        int64_t total_us = 0;
+        int64_t max_us = 0;
+
+        void Add(int64_t us);
+        cJSON* ToJson() const;
+    };
+
+    struct Entry {
+        const char* label = nullptr;
+        uint32_t over_budget = 0;
+        Histogram wait;
+        Histogram run;
+        int64_t lock_wait_total_us = 0;
+        int64_t lock_wait_max_us = 0;
+        int64_t lock_held_total_us = 0;
+    };
+
+    std::mutex mutex_;
+    Entry entries_[MAIN_LOOP_PROFILER_MAX_LABELS];
+    int entry_count_ = 0;
+
+    // The task being run by the main loop
+    TaskHandle_t main_task_ = nullptr;
+    Entry* running_ = nullptr;
+    int64_t running_start_us_ = 0;
+    int64_t running_wait_us_ = 0;
+    int64_t running_lock_wait_us_ = 0;
+
+    Entry* FindEntry(const char* label);
+};
+
+// Times a task or an event of the main loop, does nothing without CONFIG_USE_MAIN_LOOP_PROFILER
+class MainLoopTaskScope {
+public:
+#if CONFIG_USE_MAIN_LOOP_PROFILER
+    // scheduled_us is the time the task was queued, 0 for the events
+    MainLoopTaskScope(const char* label, int64_t scheduled_us = 0) {
+        MainLoopProfiler::GetInstance().BeginTask(label, scheduled_us != 0 ? esp_timer_get_time() - scheduled_us : -1);
+    }
+    ~MainLoopTaskScope() {
+        MainLoopProfiler::GetInstance().EndTask();
+    }
+#else
+    MainLoopTaskScope(const char* label, int64_t scheduled_us = 0) {}
+#endif
+    MainLoopTaskScope(const MainLoopTaskScope&) = delete;
+    MainLoopTaskScope& operator=(const MainLoopTaskScope&) = delete;
+};
+
+#endif // MAIN_LOOP_PROFILER_H
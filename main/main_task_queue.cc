@@ -0,0 +1,104 @@
+#include "main_task_queue.h"
+
+#include <esp_log.h>
+#include <algorithm>
+
+#define TAG "MainTaskQueue"
+
+static const char* const kLaneNames[kMainTaskPriorityCount] = { "high", "normal", "display" };
+
+MainTaskQueue::MainTaskQueue() {
+    lanes_[kMainTaskPriorityHigh].offset = 0;
+    lanes_[kMainTaskPriorityHigh].capacity = MAIN_TASK_HIGH_DEPTH;
+    lanes_[kMainTaskPriorityNormal].offset = MAIN_TASK_HIGH_DEPTH;
+    lanes_[kMainTaskPriorityNormal].capacity = MAIN_TASK_NORMAL_DEPTH;
+    lanes_[kMainTaskPriorityDisplay].offset = MAIN_TASK_HIGH_DEPTH + MAIN_TASK_NORMAL_DEPTH;
+    lanes_[kMainTaskPriorityDisplay].capacity = MAIN_TASK_DISPLAY_DEPTH;
+}
+
+void MainTaskQueue::Push(MainTaskPriority priority, MainTask&& task, const MainTaskTag& tag) {
+    /* A dropped task is destroyed after the lock is released */
+    MainTask dropped;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto& lane = lanes_[priority];
+        if (!lane.overflow.empty() || (lane.count == lane.capacity && priority != kMainTaskPriorityDisplay)) {
+            if (lane.overflow.size() == MAIN_TASK_OVERFLOW_LIMIT) {
+                /* The main loop has not run for a long time, the heap is not given to the backlog */
+                lane.statistics.dropped++;
+                ESP_LOGE(TAG, "The %s lane is %u tasks behind, dropped the task from %s", kLaneNames[priority],
+                    lane.count + lane.overflow.size(), tag.label != nullptr ? tag.label : "unknown");
+                dropped = std::move(task);
+                return;
+            }
+            /* Behind the ring until the main loop catches up, a state change or a message is not dropped */
+            lane.overflow.push_back({ std::move(task), tag });
+            lane.statistics.spilled++;
+            lane.statistics.max_depth = std::max(lane.statistics.max_depth, lane.count + lane.overflow.size());
+            if (lane.overflow.size() == 1) {
+                ESP_LOGW(TAG, "The %s lane is full, spilling to the heap from %s", kLaneNames[priority],
+                    tag.label != nullptr ? tag.label : "unknown");
+            }
+            return;
+        }
+        if (lane.count == lane.capacity) {
+            lane.statistics.dropped++;
+            auto label = tags_[lane.offset + lane.head].label;
+            dropped = std::move(slots_[lane.offset + lane.head]);
+            lane.head = (lane.head + 1) % lane.capacity;
+            lane.count--;
+            ESP_LOGW(TAG, "The %s lane is full, %u tasks dropped, the last from %s", kLaneNames[priority], lane.statistics.dropped,
+                label != nullptr ? label : "unknown");
+        }
+        size_t index = lane.offset + (lane.head + lane.count) % lane.capacity;
+        slots_[index] = std::move(task);
+        tags_[index] = tag;
+        lane.count++;
+        lane.statistics.max_depth = std::max(lane.statistics.max_depth, lane.count);
+    }
+}
+
+bool MainTaskQueue::Pop(MainTask& task, MainTaskPriority* priority, MainTaskTag* tag) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (int i = 0; i < kMainTaskPriorityCount; i++) {
+        auto& lane = lanes_[i];
+        if (lane.count > 0) {
+            task = std::move(slots_[lane.offset + lane.head]);
+            if (tag != nullptr) {
+                *tag = tags_[lane.offset + lane.head];
+            }
+            lane.head = (lane.head + 1) % lane.capacity;
+            lane.count--;
+        } else if (!lane.overflow.empty()) {
+            task = std::move(lane.overflow.front().task);
+            if (tag != nullptr) {
+                *tag = lane.overflow.front().tag;
+            }
+            lane.overflow.pop_front();
+        } else {
+            continue;
+        }
+        if (priority != nullptr) {
+            *priority = static_cast<MainTaskPriority>(i);
+        }
+        return true;
+    }
+    return false;
+}
+
+bool MainTaskQueue::IsEmpty() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& lane : lanes_) {
+        if (lane.count > 0 || !lane.overflow.empty()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+MainTaskQueue::LaneStatistics MainTaskQueue::GetLaneStatistics(MainTaskPriority priority) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto statistics = lanes_[priority].statistics;
+    statistics.depth = lanes_[priority].count + lanes_[priority].overflow.size();
+    return statistics;
+}
@@ -0,0 +1,166 @@
+#ifndef MAIN_TASK_QUEUE_H
+#define MAIN_TASK_QUEUE_H
+
+#include <mutex>
+#include <list>
+#include <new>
+#include <utility>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+// Lanes of the main loop, a task only runs when the lanes above it are empty
+enum MainTaskPriority {
+    kMainTaskPriorityHigh,      // Device state changes, abort, audio channel control
+    kMainTaskPriorityNormal,    // Messages to the server and other work that must not be lost
+    kMainTaskPriorityDisplay,   // Display updates, the oldest one is dropped when the lane is full
+    kMainTaskPriorityCount
+};
+
+// Where a task was scheduled from and when, for the main loop profiler
+struct MainTaskTag {
+    const char* label = nullptr;    // A string literal
+    int64_t scheduled_us = 0;       // 0 unless the profiler is enabled
+};
+
+#define MAIN_TASK_HIGH_DEPTH 16
+#define MAIN_TASK_NORMAL_DEPTH 16
+#define MAIN_TASK_DISPLAY_DEPTH 16
+// Tasks of the high or the normal lane that may wait on the heap behind a full ring
+#define MAIN_TASK_OVERFLOW_LIMIT 48
+
+/*
+ * Callable stored inline, without a heap allocation.
+ *
+ * The captures of the callable must fit in kStorageSize bytes, the compiler rejects larger ones.
+ * A lambda capturing `this`, a pointer and a std::string fits on the device and on a host build.
+ */
+class MainTask {
+public:
+    static constexpr size_t kStorageSize = 48;
+
+    MainTask() = default;
+
+    template <typename F, typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, MainTask>>>
+    MainTask(F&& callable) {
+        using Callable = std::decay_t<F>;
+        static_assert(sizeof(Callable) <= kStorageSize, "The task captures too much, capture a pointer or a std::string instead");
+        static_assert(alignof(Callable) <= alignof(std::max_align_t), "The task captures an over-aligned type");
+        new (storage_) Callable(std::forward<F>(callable));
+        ops_ = &kOps<Callable>;
+    }
+
+    MainTask(MainTask&& other) noexcept {
+        MoveFrom(other);
+    }
+
+    MainTask& operator=(MainTask&& other) noexcept {
+        if (this != &other) {
+            Reset();
+            MoveFrom(other);
+        }
+        return *this;
+    }
+
+    MainTask(const MainTask&) = delete;
+    MainTask& operator=(const MainTask&) = delete;
+
+    ~MainTask() {
+        Reset();
+    }
+
+    explicit operator bool() const { return ops_ != nullptr; }
+
+    void operator()() {
+        ops_->invoke(storage_);
+    }
+
+    void Reset() {
+        if (ops_ != nullptr) {
+            ops_->destroy(storage_);
+            ops_ = nullptr;
+        }
+    }
+
+private:
+    struct Ops {
+        void (*invoke)(void* storage);
+        void (*relocate)(void* destination, void* source);  // Move constructs and destroys the source
+        void (*destroy)(void* storage);
+    };
+
+    template <typename Callable>
+    static constexpr Ops kOps = {
+        [](void* storage) { (*static_cast<Callable*>(storage))(); },
+        [](void* destination, void* source) {
+            new (destination) Callable(std::move(*static_cast<Callable*>(source)));
+            static_cast<Callable*>(source)->~Callable();
+        },
+        [](void* storage) { static_cast<Callable*>(storage)->~Callable(); },
+    };
+
+    alignas(std::max_align_t) unsigned char storage_[kStorageSize];
+    const Ops* ops_ = nullptr;
+
+    void MoveFrom(MainTask& other) {
+        if (other.ops_ != nullptr) {
+            other.ops_->relocate(storage_, other.storage_);
+            ops_ = other.ops_;
+            other.ops_ = nullptr;
+        }
+    }
+};
+
+/*
+ * Task queue of the main loop, one fixed ring of MainTask per priority lane.
+ *
+ * Push() may be called from any task, Pop() only from the main loop. The slots are allocated
+ * with the queue, so scheduling a task does not touch the heap while its lane has room. When the
+ * high or the normal lane is full, the new tasks spill to a list on the heap behind the ring, and
+ * the lane keeps its order. The rings are sized for the usual bursts, the list only takes the rare
+ * longer ones. It is bounded by MAIN_TASK_OVERFLOW_LIMIT: a lane that far behind means the main
+ * loop is stuck, a task pushed then is dropped with an error rather than growing the heap. The
+ * display lane drops its oldest task when it is full, a newer update replaces what it showed.
+ */
+class MainTaskQueue {
+public:
+    struct LaneStatistics {
+        size_t depth = 0;
+        size_t max_depth = 0;
+        size_t dropped = 0;     // The oldest of the display lane, the newest past the overflow limit of the other lanes
+        size_t spilled = 0;     // Tasks that went to the overflow list
+    };
+
+    MainTaskQueue();
+    MainTaskQueue(const MainTaskQueue&) = delete;
+    MainTaskQueue& operator=(const MainTaskQueue&) = delete;
+
+    void Push(MainTaskPriority priority, MainTask&& task, const MainTaskTag& tag = {});
+    // Takes the oldest task of the highest lane that is not empty
+    bool Pop(MainTask& task, MainTaskPriority* priority = nullptr, MainTaskTag* tag = nullptr);
+    bool IsEmpty();
+    LaneStatistics GetLaneStatistics(MainTaskPriority priority);
+
+private:
+    struct OverflowTask {
+        MainTask task;
+        MainTaskTag tag;
+    };
+
+    struct Lane {
+        size_t offset;
+        size_t capacity;
+        size_t head = 0;
+        size_t count = 0;
+        // Newer than the tasks of the ring, empty most of the time
+        std::list<OverflowTask> overflow;
+        LaneStatistics statistics;
+    };
+
+    std::mutex mutex_;
+    MainTask slots_[MAIN_TASK_HIGH_DEPTH + MAIN_TASK_NORMAL_DEPTH + MAIN_TASK_DISPLAY_DEPTH];
+    MainTaskTag tags_[MAIN_TASK_HIGH_DEPTH + MAIN_TASK_NORMAL_DEPTH + MAIN_TASK_DISPLAY_DEPTH];
+    Lane lanes_[kMainTaskPriorityCount];
+};
+
+#endif // MAIN_TASK_QUEUE_H
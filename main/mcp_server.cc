@@ -13,6 +13,8 @@
 #include "application.h"
 #include "display.h"
 #include "board.h"
+#include "main_loop_profiler.h"
+#include "latency_tracer.h"
 
 #define TAG "MCP"
 
@@ -56,6 +58,117 @@ void McpServer::AddCommonTools() {
             return true;
         });
     
+    AddTool("self.audio_speaker.get_playback_statistics",
+        "Diagnostics of the audio playback, for tuning the board: the current look-ahead of the playback queue (frames),\n"
+        "the number of underruns, how long the speaker starved, the percentiles of the playback queue depth,\n"
+        "how long it took to silence the speaker after an interruption, and the lost frames of the server audio\n"
+        "(concealed, rebuilt from the FEC data of the next packet, recovered from the redundant copy).",
+        PropertyList(),
+        [](const PropertyList& properties) -> ReturnValue {
+            auto& audio_service = Application::GetInstance().GetAudioService();
+            auto& s = audio_service.GetDebugStatistics();
+            auto json = cJSON_CreateObject();
+            cJSON_AddNumberToObject(json, "lookahead", s.playback_lookahead);
+            cJSON_AddNumberToObject(json, "frames", s.playback_count);
+            cJSON_AddNumberToObject(json, "underruns", s.playback_underruns);
+            cJSON_AddNumberToObject(json, "starvation_avg_ms", s.starvation_time.average_us() / 1000);
+            cJSON_AddNumberToObject(json, "starvation_max_ms", s.starvation_time.max_us / 1000);
+            cJSON_AddNumberToObject(json, "starvation_total_ms", s.starvation_time.total_us / 1000);
+            auto depth = cJSON_CreateObject();
+            cJSON_AddNumberToObject(depth, "p50", s.playback_queue_depth_percentile(50));
+            cJSON_AddNumberToObject(depth, "p90", s.playback_queue_depth_percentile(90));
+            cJSON_AddNumberToObject(depth, "p99", s.playback_queue_depth_percentile(99));
+            cJSON_AddItemToObject(json, "queue_depth", depth);
+            cJSON_AddNumberToObject(json, "aborts", s.abort_latency.count);
+            cJSON_AddNumberToObject(json, "abort_latency_avg_ms", s.abort_latency.average_us() / 1000);
+            cJSON_AddNumberToObject(json, "abort_latency_max_ms", s.abort_latency.max_us / 1000);
+            auto jitter = audio_service.GetJitterBufferStatistics();
+            auto lost = cJSON_CreateObject();
+            cJSON_AddNumberToObject(lost, "decoded", jitter.concealed);
+            cJSON_AddNumberToObject(lost, "fec", s.fec_count);
+            cJSON_AddNumberToObject(lost, "redundancy", jitter.recovered);
+            cJSON_AddNumberToObject(lost, "skipped", jitter.skipped);
+            cJSON_AddItemToObject(json, "lost_frames", lost);
+            auto str = cJSON_PrintUnformatted(json);
+            std::string result(str);
+            cJSON_free(str);
+            cJSON_Delete(json);
+            return result;
+        });
+
+    AddTool("self.network.get_transport_statistics",
+        "Diagnostics of the audio transport in the current session, for telling network problems from audio problems:\n"
+        "the hello round trip time, the packets and bytes sent and received, the throughput, the time to send an\n"
+        "uplink frame and the frames dropped because the link was slower than realtime, the lost, reordered\n"
+        "and rejected packets and the inter-arrival jitter of the received audio.\n"
+        "Args:\n"
+        "  `reset`: Start counting again after returning the statistics.",
+        PropertyList({
+            Property("reset", kPropertyTypeBoolean, false)
+        }),
+        [](const PropertyList& properties) -> ReturnValue {
+            auto protocol = Application::GetInstance().GetProtocol();
+            if (protocol == nullptr) {
+                throw std::runtime_error("Protocol is not started");
+            }
+            auto& metrics = protocol->transport_metrics();
+            auto json = metrics.ToJson();
+            if (properties["reset"].value<bool>()) {
+                metrics.Reset();
+            }
+            auto str = cJSON_PrintUnformatted(json);
+            std::string result(str);
+            cJSON_free(str);
+            cJSON_Delete(json);
+            return result;
+        });
+
+#if CONFIG_USE_MAIN_LOOP_PROFILER
+    AddTool("self.system.get_main_loop_statistics",
+        "Diagnostics of the main event loop, for finding what delays state changes and audio: for every source of the\n"
+        "scheduled tasks and every event, how long the tasks waited in the queue and how long they ran (average, maximum\n"
+        "and a histogram over `buckets_ms`), how often they ran over the budget, and how long they waited for and held\n"
+        "the display lock.\n"
+        "Args:\n"
+        "  `reset`: Start counting again after returning the statistics.",
+        PropertyList({
+            Property("reset", kPropertyTypeBoolean, false)
+        }),
+        [](const PropertyList& properties) -> ReturnValue {
+            auto& profiler = MainLoopProfiler::GetInstance();
+            auto json = profiler.ToJson();
+            if (properties["reset"].value<bool>()) {
+                profiler.Reset();
+            }
+            auto str = cJSON_PrintUnformatted(json);
+            std::string result(str);
+            cJSON_free(str);
+            cJSON_Delete(json);
+            return result;
+        });
+#endif
+
+#if CONFIG_USE_LATENCY_TRACER
+    AddTool("self.system.get_latency_trace",
+        "Timeline of the last conversation turns, for breaking down the time to first audio. Returns a Chrome trace\n"
+        "(`traceEvents`, timestamps in microseconds since boot) with the wake word, channel opened, first uplink frame,\n"
+        "voice end, stt, tts start, first downlink packet and first PCM played, and for every turn `segments_ms`, the\n"
+        "time between them.\n"
+        "Args:\n"
+        "  `turns`: Number of the last turns to return.",
+        PropertyList({
+            Property("turns", kPropertyTypeInteger, 1, 1, 8)
+        }),
+        [](const PropertyList& properties) -> ReturnValue {
+            auto json = LatencyTracer::GetInstance().ToJson(properties["turns"].value<int>());
+            auto str = cJSON_PrintUnformatted(json);
+            std::string result(str);
+            cJSON_free(str);
+            cJSON_Delete(json);
+            return result;
+        });
+#endif
+
     auto backlight = board.GetBacklight();
     if (backlight) {
         AddTool("self.screen.set_brightness",
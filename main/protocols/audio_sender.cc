@@ -0,0 +1,131 @@
+#include "audio_sender.h"
+#include "protocol.h"
+#include "audio_service.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#define TAG "AudioSender"
+
+
+AudioSender::AudioSender(Protocol& protocol, AudioService& audio_service)
+    : protocol_(protocol), audio_service_(audio_service) {
+}
+
+AudioSender::~AudioSender() {
+    stopped_ = true;
+    Notify();
+    while (task_handle_ != nullptr) {
+        vTaskDelay(pdMS_TO_TICKS(10));
+    }
+}
+
+void AudioSender::Start() {
+    if (task_handle_ != nullptr) {
+        return;
+    }
+    xTaskCreate([](void* arg) {
+        auto sender = (AudioSender*)arg;
+        sender->Run();
+        sender->task_handle_ = nullptr;
+        vTaskDelete(NULL);
+    }, "audio_sender", AUDIO_SENDER_TASK_STACK_SIZE, this, AUDIO_SENDER_TASK_PRIORITY, &task_handle_);
+}
+
+void AudioSender::Notify() {
+    if (task_handle_ != nullptr) {
+        xTaskNotifyGive(task_handle_);
+    }
+}
+
+void AudioSender::Pause() {
+    paused_ = true;
+    /* The task checks the flag before every frame, so it stops after the current one */
+    std::lock_guard<std::mutex> lock(send_mutex_);
+    /* Nothing takes from the send queue until Resume(), the encode task drops the oldest frames once it is full */
+    audio_service_.HoldSendQueue(true);
+}
+
+void AudioSender::Resume() {
+    audio_service_.HoldSendQueue(false);
+    paused_ = false;
+    Notify();
+}
+
+void AudioSender::SendTextAfterAudio(std::string text) {
+    {
+        std::lock_guard<std::mutex> lock(text_mutex_);
+        texts_after_audio_.push_back(std::move(text));
+    }
+    Notify();
+}
+
+void AudioSender::Run() {
+    while (!stopped_) {
+        /* A batch that is not full is sent when its first frame has waited for the negotiated delay */
+        int deadline_ms;
+        {
+            std::lock_guard<std::mutex> lock(send_mutex_);
+            deadline_ms = protocol_.GetAudioBatchDeadlineMs();
+        }
+        ulTaskNotifyTake(pdTRUE, deadline_ms >= 0 ? pdMS_TO_TICKS(deadline_ms) + 1 : portMAX_DELAY);
+        if (stopped_) {
+            break;
+        }
+        SendQueuedAudio();
+    }
+}
+
+void AudioSender::SendQueuedAudio() {
+    std::lock_guard<std::mutex> lock(send_mutex_);
+    if (paused_) {
+        return;
+    }
+
+    /* Only the frames queued so far, so a text waiting for them is not held up by the later ones */
+    size_t pending = audio_service_.GetSendQueueSize();
+    while (pending > 0 && !paused_) {
+        auto packet = audio_service_.PopPacketFromSendQueue();
+        if (!packet) {
+            break;
+        }
+        pending--;
+
+        int frame_duration = packet->frame_duration;
+        if (send_time_avg_us_ > frame_duration * 1000LL && (int)(pending + 1) * frame_duration > AUDIO_SENDER_MAX_BACKLOG_MS) {
+            /* The link is slower than realtime, the oldest frame is too late to be useful */
+            protocol_.transport_metrics().OnStaleAudioDropped();
+            audio_service_.ReleasePacket(std::move(packet));
+            continue;
+        }
+
+        auto start_time = esp_timer_get_time();
+        bool sent = protocol_.QueueAudio(*packet, pending > 0);
+        auto duration = esp_timer_get_time() - start_time;
+        audio_service_.ReleasePacket(std::move(packet));
+        if (!sent) {
+            break;
+        }
+        protocol_.transport_metrics().OnAudioSendTime(duration, frame_duration);
+        send_time_avg_us_ += (duration - send_time_avg_us_) / 8;
+        if (protocol_.on_audio_sent_ != nullptr) {
+            protocol_.on_audio_sent_();
+        }
+    }
+
+    if (protocol_.GetAudioBatchDeadlineMs() == 0) {
+        protocol_.FlushAudioBatch();
+    }
+
+    std::vector<std::string> texts;
+    {
+        std::lock_guard<std::mutex> text_lock(text_mutex_);
+        texts.swap(texts_after_audio_);
+    }
+    if (!texts.empty()) {
+        protocol_.FlushAudioBatch();
+        for (auto& text : texts) {
+            protocol_.SendText(text);
+        }
+    }
+}
@@ -0,0 +1,64 @@
+#ifndef AUDIO_SENDER_H
+#define AUDIO_SENDER_H
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#define AUDIO_SENDER_TASK_STACK_SIZE 6144
+#define AUDIO_SENDER_TASK_PRIORITY 3
+// Backlog of the send queue above which the oldest frames are dropped, once the link is slower than realtime
+#define AUDIO_SENDER_MAX_BACKLOG_MS 1200
+
+class Protocol;
+class AudioService;
+
+/*
+ * Task that takes the uplink audio from the send queue of the audio service and hands it to the
+ * transport, so a slow or blocked write never holds up the main loop.
+ *
+ * The send queue gives the backpressure: while a write blocks, the frames wait in it and the
+ * encoder stops once it is full. When more than one frame is waiting, they are coalesced into a
+ * full batch if the server accepted batching. When the average send takes longer than a frame
+ * lasts and the backlog still grows past AUDIO_SENDER_MAX_BACKLOG_MS, the oldest frames are
+ * dropped, so the server hears the speaker with a bounded delay. A backlog built up while the
+ * channel was opening is not dropped, the link is not slow then. While the sender is paused, the
+ * send queue is held and keeps the latest frames, so the capture never waits for the sender.
+ */
+class AudioSender {
+public:
+    AudioSender(Protocol& protocol, AudioService& audio_service);
+    ~AudioSender();
+
+    void Start();
+    // Wakes up the task, e.g. after a packet was pushed to the send queue
+    void Notify();
+    // Returns once the frame being sent, if any, is done. While paused, the caller may send audio itself
+    // and the send queue keeps its latest frames, see AudioService::HoldSendQueue().
+    void Pause();
+    void Resume();
+    // Sends the text after the audio already in the send queue
+    void SendTextAfterAudio(std::string text);
+
+private:
+    Protocol& protocol_;
+    AudioService& audio_service_;
+    TaskHandle_t task_handle_ = nullptr;
+    std::atomic<bool> paused_ = false;
+    std::atomic<bool> stopped_ = false;
+    // Held while the task sends
+    std::mutex send_mutex_;
+    std::mutex text_mutex_;
+    std::vector<std::string> texts_after_audio_;
+    // Moving average of the send time of a frame
+    int64_t send_time_avg_us_ = 0;
+
+    void Run();
+    void SendQueuedAudio();
+};
+
+#endif // AUDIO_SENDER_H
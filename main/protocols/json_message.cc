@@ -0,0 +1,305 @@
+#include "json_message.h"
+
+#include <esp_log.h>
+
+#define TAG "JsonMessage"
+
+#define KEYWORD_TABLE_SIZE 32
+
+namespace {
+
+struct Keyword {
+    std::string_view word;
+    JsonKeyword keyword;
+};
+
+constexpr Keyword kKeywords[] = {
+    {"hello", kJsonKeywordHello},
+    {"goodbye", kJsonKeywordGoodbye},
+    {"tts", kJsonKeywordTts},
+    {"stt", kJsonKeywordStt},
+    {"llm", kJsonKeywordLlm},
+    {"mcp", kJsonKeywordMcp},
+    {"system", kJsonKeywordSystem},
+    {"alert", kJsonKeywordAlert},
+    {"custom", kJsonKeywordCustom},
+    {"start", kJsonKeywordStart},
+    {"stop", kJsonKeywordStop},
+    {"sentence_start", kJsonKeywordSentenceStart},
+    {"sentence_end", kJsonKeywordSentenceEnd},
+};
+
+// Perfect for the words above, checked at compile time. Adding a word may need another multiplier.
+constexpr size_t HashKeyword(std::string_view word) {
+    return (static_cast<uint8_t>(word[0]) + word.size() * 7) % KEYWORD_TABLE_SIZE;
+}
+
+struct KeywordTable {
+    Keyword slots[KEYWORD_TABLE_SIZE] = {};
+    bool perfect = true;
+
+    constexpr KeywordTable() {
+        for (const auto& keyword : kKeywords) {
+            auto& slot = slots[HashKeyword(keyword.word)];
+            if (!slot.word.empty()) {
+                perfect = false;
+            }
+            slot = keyword;
+        }
+    }
+};
+
+constexpr KeywordTable kKeywordTable;
+static_assert(kKeywordTable.perfect, "The keyword hash has a collision");
+
+inline const char* SkipSpaces(const char* p, const char* end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) {
+        p++;
+    }
+    return p;
+}
+
+// p is after the opening quote, returns the closing quote or nullptr
+inline const char* SkipString(const char* p, const char* end) {
+    while (p < end) {
+        if (*p == '\\') {
+            /* An escape cut off by the end of the text */
+            if (end - p < 2) {
+                return nullptr;
+            }
+            p += 2;
+        } else if (*p == '"') {
+            return p;
+        } else {
+            p++;
+        }
+    }
+    return nullptr;
+}
+
+// p is at the opening bracket, returns the character after the matching bracket or nullptr
+const char* SkipContainer(const char* p, const char* end) {
+    int depth = 0;
+    while (p < end) {
+        char c = *p;
+        if (c == '"') {
+            p = SkipString(p + 1, end);
+            if (p == nullptr) {
+                return nullptr;
+            }
+        } else if (c == '{' || c == '[') {
+            depth++;
+        } else if (c == '}' || c == ']') {
+            if (--depth == 0) {
+                return p + 1;
+            }
+        }
+        p++;
+    }
+    return nullptr;
+}
+
+int HexValue(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+bool ParseHex4(const char* p, const char* end, uint32_t& value) {
+    if (end - p < 4) {
+        return false;
+    }
+    value = 0;
+    for (int i = 0; i < 4; i++) {
+        int digit = HexValue(p[i]);
+        if (digit < 0) {
+            return false;
+        }
+        value = (value << 4) | digit;
+    }
+    return true;
+}
+
+void AppendUtf8(std::string& out, uint32_t code) {
+    if (code < 0x80) {
+        out += static_cast<char>(code);
+    } else if (code < 0x800) {
+        out += static_cast<char>(0xC0 | (code >> 6));
+        out += static_cast<char>(0x80 | (code & 0x3F));
+    } else if (code < 0x10000) {
+        out += static_cast<char>(0xE0 | (code >> 12));
+        out += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (code & 0x3F));
+    } else {
+        out += static_cast<char>(0xF0 | (code >> 18));
+        out += static_cast<char>(0x80 | ((code >> 12) & 0x3F));
+        out += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (code & 0x3F));
+    }
+}
+
+} // namespace
+
+JsonKeyword JsonMessage::LookupKeyword(std::string_view word) {
+    if (word.empty()) {
+        return kJsonKeywordUnknown;
+    }
+    const auto& slot = kKeywordTable.slots[HashKeyword(word)];
+    return slot.word == word ? slot.keyword : kJsonKeywordUnknown;
+}
+
+bool JsonMessage::Parse(const char* data, size_t len) {
+    member_count_ = 0;
+    type_ = kJsonKeywordUnknown;
+    state_ = kJsonKeywordUnknown;
+    type_name_ = {};
+
+    const char* end = data + len;
+    const char* p = SkipSpaces(data, end);
+    if (p == end || *p != '{') {
+        return false;
+    }
+    p = SkipSpaces(p + 1, end);
+    if (p < end && *p == '}') {
+        return true;
+    }
+
+    while (p < end) {
+        /* Key */
+        if (*p != '"') {
+            return false;
+        }
+        const char* key_end = SkipString(p + 1, end);
+        if (key_end == nullptr) {
+            return false;
+        }
+        std::string_view key(p + 1, key_end - p - 1);
+        p = SkipSpaces(key_end + 1, end);
+        if (p == end || *p != ':') {
+            return false;
+        }
+        p = SkipSpaces(p + 1, end);
+        if (p == end) {
+            return false;
+        }
+
+        /* Value */
+        Member member = { key, {}, false };
+        if (*p == '"') {
+            const char* value_end = SkipString(p + 1, end);
+            if (value_end == nullptr) {
+                return false;
+            }
+            member.value = std::string_view(p + 1, value_end - p - 1);
+            member.is_string = true;
+            p = value_end + 1;
+        } else if (*p == '{' || *p == '[') {
+            const char* value_end = SkipContainer(p, end);
+            if (value_end == nullptr) {
+                return false;
+            }
+            member.value = std::string_view(p, value_end - p);
+            p = value_end;
+        } else {
+            const char* value_start = p;
+            while (p < end && *p != ',' && *p != '}' && *p != ' ' && *p != '\n' && *p != '\r' && *p != '\t') {
+                p++;
+            }
+            /* A member without a value, e.g. {"type":} */
+            if (p == value_start) {
+                return false;
+            }
+            member.value = std::string_view(value_start, p - value_start);
+        }
+
+        if (member.is_string && key == "type") {
+            type_name_ = member.value;
+            type_ = LookupKeyword(member.value);
+        } else if (member.is_string && key == "state") {
+            state_ = LookupKeyword(member.value);
+        }
+        if (member_count_ < JSON_MESSAGE_MAX_MEMBERS) {
+            members_[member_count_++] = member;
+        } else {
+            ESP_LOGW(TAG, "Too many members, ignoring: %.*s", (int)key.size(), key.data());
+        }
+
+        p = SkipSpaces(p, end);
+        if (p == end) {
+            return false;
+        }
+        if (*p == '}') {
+            return true;
+        }
+        if (*p != ',') {
+            return false;
+        }
+        p = SkipSpaces(p + 1, end);
+    }
+    return false;
+}
+
+const JsonMessage::Member* JsonMessage::Find(std::string_view key) const {
+    for (size_t i = 0; i < member_count_; i++) {
+        if (members_[i].key == key) {
+            return &members_[i];
+        }
+    }
+    return nullptr;
+}
+
+bool JsonMessage::GetString(std::string_view key, std::string& value) const {
+    auto member = Find(key);
+    if (member == nullptr || !member->is_string) {
+        return false;
+    }
+
+    value.clear();
+    value.reserve(member->value.size());
+    const char* p = member->value.data();
+    const char* end = p + member->value.size();
+    while (p < end) {
+        if (*p != '\\') {
+            value += *p++;
+            continue;
+        }
+        if (++p == end) {
+            break;
+        }
+        char c = *p++;
+        switch (c) {
+        case 'n': value += '\n'; break;
+        case 't': value += '\t'; break;
+        case 'r': value += '\r'; break;
+        case 'b': value += '\b'; break;
+        case 'f': value += '\f'; break;
+        case 'u': {
+            uint32_t code;
+            if (!ParseHex4(p, end, code)) {
+                return false;
+            }
+            p += 4;
+            /* A character outside the BMP comes as a surrogate pair */
+            if (code >= 0xD800 && code < 0xDC00) {
+                uint32_t low;
+                if (end - p >= 6 && p[0] == '\\' && p[1] == 'u' && ParseHex4(p + 2, end, low) && low >= 0xDC00 && low < 0xE000) {
+                    code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                    p += 6;
+                }
+            }
+            AppendUtf8(value, code);
+            break;
+        }
+        default:
+            value += c;     // \" \\ \/
+            break;
+        }
+    }
+    return true;
+}
+
+std::string_view JsonMessage::GetRaw(std::string_view key) const {
+    auto member = Find(key);
+    return member != nullptr ? member->value : std::string_view();
+}
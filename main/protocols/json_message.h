@@ -0,0 +1,68 @@
+#ifndef JSON_MESSAGE_H
+#define JSON_MESSAGE_H
+
+#include <string>
+#include <string_view>
+#include <cstdint>
+#include <cstddef>
+
+#define JSON_MESSAGE_MAX_MEMBERS 16
+
+// Values of "type" and "state" the device acts on
+enum JsonKeyword {
+    kJsonKeywordUnknown,
+    kJsonKeywordHello,
+    kJsonKeywordGoodbye,
+    kJsonKeywordTts,
+    kJsonKeywordStt,
+    kJsonKeywordLlm,
+    kJsonKeywordMcp,
+    kJsonKeywordSystem,
+    kJsonKeywordAlert,
+    kJsonKeywordCustom,
+    kJsonKeywordStart,
+    kJsonKeywordStop,
+    kJsonKeywordSentenceStart,
+    kJsonKeywordSentenceEnd,
+};
+
+/*
+ * Control message from the server, scanned in place instead of building a cJSON tree.
+ *
+ * Only the members of the top level object are recorded, as views into the text, which must stay
+ * valid while the message is used. Nested objects and arrays are skipped and can be handed to
+ * cJSON as raw text, e.g. the MCP payload. "type" and "state" are resolved with a perfect hash.
+ */
+class JsonMessage {
+public:
+    // Returns false if the text is not a JSON object
+    bool Parse(const char* data, size_t len);
+
+    inline JsonKeyword type() const { return type_; }
+    inline JsonKeyword state() const { return state_; }
+    inline std::string_view type_name() const { return type_name_; }
+
+    // Unescaped value of a top level string member, false if it is missing or not a string
+    bool GetString(std::string_view key, std::string& value) const;
+    // Raw text of a top level member, e.g. an object to pass to cJSON_ParseWithLength(), empty if missing
+    std::string_view GetRaw(std::string_view key) const;
+
+    static JsonKeyword LookupKeyword(std::string_view word);
+
+private:
+    struct Member {
+        std::string_view key;
+        std::string_view value;     // without the quotes for a string, still escaped
+        bool is_string;
+    };
+
+    Member members_[JSON_MESSAGE_MAX_MEMBERS];
+    size_t member_count_ = 0;
+    JsonKeyword type_ = kJsonKeywordUnknown;
+    JsonKeyword state_ = kJsonKeywordUnknown;
+    std::string_view type_name_;
+
+    const Member* Find(std::string_view key) const;
+};
+
+#endif // JSON_MESSAGE_H
@@ -2,6 +2,7 @@
 #include "board.h"
 #include "application.h"
 #include "settings.h"
+#include "latency_tracer.h"
 
 #include <esp_log.h>
 #include <cstring>
@@ -54,32 +55,35 @@ bool MqttProtocol::StartMqttClient(bool report_error) {
     });
 
     mqtt_->OnMessage([this](const std::string& topic, const std::string& payload) {
-        cJSON* root = cJSON_Parse(payload.c_str());
-        if (root == nullptr) {
+        // Scan JSON data in place, only the hello is parsed with cJSON
+        JsonMessage message;
+        if (!message.Parse(payload.data(), payload.size())) {
             ESP_LOGE(TAG, "Failed to parse json message %s", payload.c_str());
             return;
         }
-        cJSON* type = cJSON_GetObjectItem(root, "type");
-        if (!cJSON_IsString(type)) {
+        if (message.type_name().empty()) {
             ESP_LOGE(TAG, "Message type is invalid");
-            cJSON_Delete(root);
             return;
         }
 
-        if (strcmp(type->valuestring, "hello") == 0) {
-            ParseServerHello(root);
-        } else if (strcmp(type->valuestring, "goodbye") == 0) {
-            auto session_id = cJSON_GetObjectItem(root, "session_id");
-            ESP_LOGI(TAG, "Received goodbye message, session_id: %s", session_id ? session_id->valuestring : "null");
-            if (session_id == nullptr || session_id_ == session_id->valuestring) {
+        if (message.type() == kJsonKeywordHello) {
+            cJSON* root = cJSON_ParseWithLength(payload.data(), payload.size());
+            if (root != nullptr) {
+                ParseServerHello(root);
+                cJSON_Delete(root);
+            }
+        } else if (message.type() == kJsonKeywordGoodbye) {
+            std::string session_id;
+            bool has_session_id = message.GetString("session_id", session_id);
+            ESP_LOGI(TAG, "Received goodbye message, session_id: %s", has_session_id ? session_id.c_str() : "null");
+            if (!has_session_id || session_id_ == session_id) {
                 Application::GetInstance().Schedule([this]() {
                     CloseAudioChannel();
-                });
+                }, kMainTaskPriorityHigh, "goodbye");
             }
         } else if (on_incoming_json_ != nullptr) {
-            on_incoming_json_(root);
+            on_incoming_json_(message);
         }
-        cJSON_Delete(root);
         last_incoming_time_ = std::chrono::steady_clock::now();
     });
 
@@ -115,30 +119,71 @@ bool MqttProtocol::SendText(const std::string& text) {
     return true;
 }
 
-bool MqttProtocol::SendAudio(std::unique_ptr<AudioStreamPacket> packet) {
+bool MqttProtocol::SendAudio(AudioStreamPacket& packet) {
     std::lock_guard<std::mutex> lock(channel_mutex_);
     if (udp_ == nullptr) {
         return false;
     }
+    if (audio_fec_redundancy_) {
+        return SendRedundantAudio(packet);
+    }
+    return SendUdpAudio(aes_nonce_[0], packet.timestamp, packet.opus_data(), packet.opus_size());
+}
 
-    std::string nonce(aes_nonce_);
-    *(uint16_t*)&nonce[2] = htons(packet->payload.size());
-    *(uint32_t*)&nonce[8] = htonl(packet->timestamp);
-    *(uint32_t*)&nonce[12] = htonl(++local_sequence_);
+// Called with channel_mutex_ held
+bool MqttProtocol::SendRedundantAudio(const AudioStreamPacket& packet) {
+    /* |payload_size 2u|frame of this packet|frame of the previous sequence| */
+    size_t size = packet.opus_size();
+    redundant_buffer_.resize(sizeof(BinaryProtocolRedundantFrame) + size + previous_frame_.size());
+    auto frame = (BinaryProtocolRedundantFrame*)redundant_buffer_.data();
+    frame->payload_size = htons(size);
+    memcpy(frame->payload, packet.opus_data(), size);
+    if (!previous_frame_.empty()) {
+        memcpy(frame->payload + size, previous_frame_.data(), previous_frame_.size());
+    }
+    previous_frame_.assign(packet.opus_data(), packet.opus_data() + size);
+    return SendUdpAudio(AUDIO_REDUNDANT_TYPE, packet.timestamp, redundant_buffer_.data(), redundant_buffer_.size());
+}
 
-    std::string encrypted;
-    encrypted.resize(aes_nonce_.size() + packet->payload.size());
-    memcpy(encrypted.data(), nonce.data(), nonce.size());
+bool MqttProtocol::SendAudioBatch(std::vector<uint8_t>& batch, int frames) {
+    std::lock_guard<std::mutex> lock(channel_mutex_);
+    if (udp_ == nullptr) {
+        return false;
+    }
+    /* The frames of a batch are not repeated, the next packet has no previous frame to carry */
+    previous_frame_.clear();
+    auto first_frame = (const BinaryProtocolBatchFrame*)(batch.data() + AUDIO_PACKET_HEADROOM);
+    return SendUdpAudio(AUDIO_BATCH_TYPE, ntohl(first_frame->timestamp),
+        batch.data() + AUDIO_PACKET_HEADROOM, batch.size() - AUDIO_PACKET_HEADROOM);
+}
+
+// Called with channel_mutex_ held
+bool MqttProtocol::SendUdpAudio(uint8_t type, uint32_t timestamp, const uint8_t* data, size_t size) {
+    /* The datagram buffer keeps its capacity, the ciphertext is written right behind the nonce */
+    udp_send_buffer_.resize(aes_nonce_.size() + size);
+    auto nonce = (uint8_t*)udp_send_buffer_.data();
+    memcpy(nonce, aes_nonce_.data(), aes_nonce_.size());
+    nonce[0] = type;
+    *(uint16_t*)&nonce[2] = htons(size);
+    *(uint32_t*)&nonce[8] = htonl(timestamp);
+    *(uint32_t*)&nonce[12] = htonl(++local_sequence_);
 
+    /* One call for all the blocks of the packet, mbedtls advances a copy of the nonce */
     size_t nc_off = 0;
     uint8_t stream_block[16] = {0};
-    if (mbedtls_aes_crypt_ctr(&aes_ctx_, packet->payload.size(), &nc_off, (uint8_t*)nonce.c_str(), stream_block,
-        (uint8_t*)packet->payload.data(), (uint8_t*)&encrypted[nonce.size()]) != 0) {
+    uint8_t counter[16];
+    memcpy(counter, nonce, sizeof(counter));
+    if (mbedtls_aes_crypt_ctr(&aes_ctx_, size, &nc_off, counter, stream_block, data, nonce + aes_nonce_.size()) != 0) {
         ESP_LOGE(TAG, "Failed to encrypt audio data");
         return false;
     }
 
-    return udp_->Send(encrypted) > 0;
+    if (udp_->Send(udp_send_buffer_) <= 0) {
+        return false;
+    }
+    transport_metrics_.OnPacketSent(udp_send_buffer_.size());
+    TraceLatency(kLatencyUplinkFirst);
+    return true;
 }
 
 void MqttProtocol::CloseAudioChannel() {
@@ -171,6 +216,7 @@ bool MqttProtocol::OpenAudioChannel() {
     xEventGroupClearBits(event_group_handle_, MQTT_PROTOCOL_SERVER_HELLO_EVENT);
 
     auto message = GetHelloMessage();
+    transport_metrics_.Reset();
     if (!SendText(message)) {
         return false;
     }
@@ -192,47 +238,84 @@ bool MqttProtocol::OpenAudioChannel() {
          * |type 1u|flags 1u|payload_len 2u|ssrc 4u|timestamp 4u|sequence 4u|
          * |payload payload_len|
          */
-        if (data.size() < sizeof(aes_nonce_)) {
+        if (data.size() < aes_nonce_.size()) {
             ESP_LOGE(TAG, "Invalid audio packet size: %u", data.size());
             return;
         }
-        if (data[0] != 0x01) {
+        if (data[0] != 0x01 && data[0] != AUDIO_REDUNDANT_TYPE) {
             ESP_LOGE(TAG, "Invalid audio packet type: %x", data[0]);
             return;
         }
         uint32_t timestamp = ntohl(*(uint32_t*)&data[8]);
         uint32_t sequence = ntohl(*(uint32_t*)&data[12]);
-        if (sequence < remote_sequence_) {
-            ESP_LOGW(TAG, "Received audio packet with old sequence: %lu, expected: %lu", sequence, remote_sequence_);
+        // Late and lost packets are handled by the jitter buffer of the audio service, only replays are dropped
+        if (!replay_window_.Check(sequence)) {
+            replay_window_.CountRejected();
+            transport_metrics_.OnPacketRejected();
+            ESP_LOGD(TAG, "Dropped replayed or too old audio packet: %lu, highest: %lu", sequence, replay_window_.highest());
             return;
         }
-        if (sequence != remote_sequence_ + 1) {
-            ESP_LOGW(TAG, "Received audio packet with wrong sequence: %lu, expected: %lu", sequence, remote_sequence_ + 1);
-        }
 
+        /* Decrypted straight into the pooled packet, mbedtls advances a copy of the nonce */
         size_t decrypted_size = data.size() - aes_nonce_.size();
         size_t nc_off = 0;
         uint8_t stream_block[16] = {0};
-        auto nonce = (uint8_t*)data.data();
-        auto encrypted = (uint8_t*)data.data() + aes_nonce_.size();
-        auto packet = std::make_unique<AudioStreamPacket>();
+        uint8_t counter[16];
+        memcpy(counter, data.data(), sizeof(counter));
+        auto encrypted = (const uint8_t*)data.data() + aes_nonce_.size();
+        auto& audio_service = Application::GetInstance().GetAudioService();
+        auto packet = audio_service.AcquirePacket();
         packet->sample_rate = server_sample_rate_;
         packet->frame_duration = server_frame_duration_;
         packet->timestamp = timestamp;
+        packet->sequence = sequence;
         packet->payload.resize(decrypted_size);
-        int ret = mbedtls_aes_crypt_ctr(&aes_ctx_, decrypted_size, &nc_off, nonce, stream_block, encrypted, (uint8_t*)packet->payload.data());
+        int ret = mbedtls_aes_crypt_ctr(&aes_ctx_, decrypted_size, &nc_off, counter, stream_block, encrypted, packet->payload.data());
         if (ret != 0) {
             ESP_LOGE(TAG, "Failed to decrypt audio data, ret: %d", ret);
+            audio_service.ReleasePacket(std::move(packet));
             return;
         }
+
+        std::unique_ptr<AudioStreamPacket> previous;
+        if (data[0] == AUDIO_REDUNDANT_TYPE) {
+            auto frame = (const BinaryProtocolRedundantFrame*)packet->payload.data();
+            size_t frame_size = decrypted_size >= sizeof(BinaryProtocolRedundantFrame) ? ntohs(frame->payload_size) : SIZE_MAX;
+            if (frame_size > decrypted_size - sizeof(BinaryProtocolRedundantFrame)) {
+                ESP_LOGE(TAG, "Invalid redundant audio packet, size: %u", decrypted_size);
+                audio_service.ReleasePacket(std::move(packet));
+                return;
+            }
+            /* The copy of the previous frame only fills a gap in the jitter buffer */
+            size_t previous_size = decrypted_size - sizeof(BinaryProtocolRedundantFrame) - frame_size;
+            if (previous_size > 0 && sequence > 1) {
+                previous = audio_service.AcquirePacket();
+                previous->sample_rate = server_sample_rate_;
+                previous->frame_duration = server_frame_duration_;
+                previous->timestamp = timestamp != 0 ? timestamp - server_frame_duration_ : 0;
+                previous->sequence = sequence - 1;
+                previous->redundant = true;
+                previous->payload.assign(frame->payload + frame_size, frame->payload + frame_size + previous_size);
+            }
+            /* The frame of this packet is decoded in place, behind the size field */
+            packet->headroom = sizeof(BinaryProtocolRedundantFrame);
+            packet->payload.resize(sizeof(BinaryProtocolRedundantFrame) + frame_size);
+        }
+
+        replay_window_.Update(sequence);
+        transport_metrics_.OnPacketReceived(data.size(), timestamp, server_frame_duration_, sequence);
+        TraceLatency(kLatencyDownlinkFirst);
         if (on_incoming_audio_ != nullptr) {
+            if (previous) {
+                on_incoming_audio_(std::move(previous));
+            }
             on_incoming_audio_(std::move(packet));
         }
-        remote_sequence_ = sequence;
         last_incoming_time_ = std::chrono::steady_clock::now();
     });
 
     udp_->Connect(udp_server_, udp_port_);
+    TraceLatency(kLatencyChannelOpened);
 
     if (on_audio_channel_opened_ != nullptr) {
         on_audio_channel_opened_();
@@ -256,7 +339,17 @@ std::string MqttProtocol::GetHelloMessage() {
     cJSON_AddStringToObject(audio_params, "format", "opus");
     cJSON_AddNumberToObject(audio_params, "sample_rate", 16000);
     cJSON_AddNumberToObject(audio_params, "channels", 1);
-    cJSON_AddNumberToObject(audio_params, "frame_duration", OPUS_FRAME_DURATION_MS);
+    auto& profile = Application::GetInstance().GetAudioService().GetPreferredAudioProfile();
+    cJSON_AddNumberToObject(audio_params, "frame_duration", profile.frame_duration_ms);
+    // The server may choose another one of the profiles in its hello
+    cJSON_AddStringToObject(audio_params, "profile", profile.name);
+    cJSON* profiles = cJSON_CreateArray();
+    for (const auto& item : kAudioProfiles) {
+        cJSON_AddItemToArray(profiles, cJSON_CreateString(item.name));
+    }
+    cJSON_AddItemToObject(audio_params, "profiles", profiles);
+    AddAudioBatchParams(audio_params);
+    AddAudioFecParams(audio_params);
     cJSON_AddItemToObject(root, "audio_params", audio_params);
     auto json_str = cJSON_PrintUnformatted(root);
     std::string message(json_str);
@@ -280,6 +373,7 @@ void MqttProtocol::ParseServerHello(const cJSON* root) {
 
     // Get sample rate from hello message
     auto audio_params = cJSON_GetObjectItem(root, "audio_params");
+    server_audio_profile_.clear();
     if (cJSON_IsObject(audio_params)) {
         auto sample_rate = cJSON_GetObjectItem(audio_params, "sample_rate");
         if (cJSON_IsNumber(sample_rate)) {
@@ -289,7 +383,13 @@ void MqttProtocol::ParseServerHello(const cJSON* root) {
         if (cJSON_IsNumber(frame_duration)) {
             server_frame_duration_ = frame_duration->valueint;
         }
+        auto profile = cJSON_GetObjectItem(audio_params, "profile");
+        if (cJSON_IsString(profile)) {
+            server_audio_profile_ = profile->valuestring;
+        }
     }
+    ParseAudioBatchParams(audio_params);
+    ParseAudioFecParams(audio_params);
 
     auto udp = cJSON_GetObjectItem(root, "udp");
     if (!cJSON_IsObject(udp)) {
@@ -307,7 +407,9 @@ void MqttProtocol::ParseServerHello(const cJSON* root) {
     mbedtls_aes_init(&aes_ctx_);
     mbedtls_aes_setkey_enc(&aes_ctx_, (const unsigned char*)DecodeHexString(key).c_str(), 128);
     local_sequence_ = 0;
-    remote_sequence_ = 0;
+    previous_frame_.clear();
+    replay_window_.Reset();
+    transport_metrics_.OnHelloReceived();
     xEventGroupSetBits(event_group_handle_, MQTT_PROTOCOL_SERVER_HELLO_EVENT);
 }
 
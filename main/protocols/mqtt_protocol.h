@@ -3,6 +3,7 @@
 
 
 #include "protocol.h"
+#include "replay_window.h"
 #include <mqtt.h>
 #include <udp.h>
 #include <cJSON.h>
@@ -14,6 +15,7 @@
 #include <string>
 #include <map>
 #include <mutex>
+#include <vector>
 
 #define MQTT_PING_INTERVAL_SECONDS 90
 #define MQTT_RECONNECT_INTERVAL_MS 10000
@@ -26,7 +28,7 @@ public:
     ~MqttProtocol();
 
     bool Start() override;
-    bool SendAudio(std::unique_ptr<AudioStreamPacket> packet) override;
+    bool SendAudio(AudioStreamPacket& packet) override;
     bool OpenAudioChannel() override;
     void CloseAudioChannel() override;
     bool IsAudioChannelOpened() const override;
@@ -44,13 +46,21 @@ private:
     std::string udp_server_;
     int udp_port_;
     uint32_t local_sequence_;
-    uint32_t remote_sequence_;
+    ReplayWindow replay_window_;
+    // Encrypted datagram, reused for every audio packet
+    std::string udp_send_buffer_;
+    // Packet redundancy: the last frame sent, repeated in the next packet
+    std::vector<uint8_t> previous_frame_;
+    std::vector<uint8_t> redundant_buffer_;
 
     bool StartMqttClient(bool report_error=false);
     void ParseServerHello(const cJSON* root);
     std::string DecodeHexString(const std::string& hex_string);
 
     bool SendText(const std::string& text) override;
+    bool SendAudioBatch(std::vector<uint8_t>& batch, int frames) override;
+    bool SendUdpAudio(uint8_t type, uint32_t timestamp, const uint8_t* data, size_t size);
+    bool SendRedundantAudio(const AudioStreamPacket& packet);
     std::string GetHelloMessage();
 };
 
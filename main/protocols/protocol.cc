@@ -1,10 +1,21 @@
 #include "protocol.h"
+#include "audio_sender.h"
+#include "latency_tracer.h"
 
 #include <esp_log.h>
+#include <arpa/inet.h>
+#include <cstring>
+#include <algorithm>
 
 #define TAG "Protocol"
 
-void Protocol::OnIncomingJson(std::function<void(const cJSON* root)> callback) {
+Protocol::Protocol() {
+}
+
+Protocol::~Protocol() {
+}
+
+void Protocol::OnIncomingJson(std::function<void(const JsonMessage& message)> callback) {
     on_incoming_json_ = callback;
 }
 
@@ -24,6 +35,10 @@ void Protocol::OnNetworkError(std::function<void(const std::string& message)> ca
     on_network_error_ = callback;
 }
 
+void Protocol::OnAudioSent(std::function<void()> callback) {
+    on_audio_sent_ = callback;
+}
+
 void Protocol::SetError(const std::string& message) {
     error_occurred_ = true;
     if (on_network_error_ != nullptr) {
@@ -61,7 +76,14 @@ void Protocol::SendStartListening(ListeningMode mode) {
 }
 
 void Protocol::SendStopListening() {
+    TraceLatency(kLatencyListenStop);
     std::string message = "{\"session_id\":\"" + session_id_ + "\",\"type\":\"listen\",\"state\":\"stop\"}";
+    /* The server expects the whole utterance before the stop */
+    if (audio_sender_ != nullptr) {
+        audio_sender_->SendTextAfterAudio(std::move(message));
+        return;
+    }
+    FlushAudioBatch();
     SendText(message);
 }
 
@@ -75,6 +97,124 @@ void Protocol::SendReminderMessage(const std::string& payload) {
     SendText(message);
 }
 
+bool Protocol::QueueAudio(AudioStreamPacket& packet, bool more_pending) {
+    if (audio_batch_max_frames_ <= 1 || packet.frame_duration <= 0) {
+        return SendAudio(packet);
+    }
+
+    if (audio_batch_frames_ == 0) {
+        audio_batch_.resize(AUDIO_PACKET_HEADROOM);
+        audio_batch_start_time_ = std::chrono::steady_clock::now();
+    }
+    size_t offset = audio_batch_.size();
+    audio_batch_.resize(offset + sizeof(BinaryProtocolBatchFrame) + packet.opus_size());
+    auto frame = (BinaryProtocolBatchFrame*)&audio_batch_[offset];
+    frame->timestamp = htonl(packet.timestamp);
+    frame->payload_size = htons(packet.opus_size());
+    memcpy(frame->payload, packet.opus_data(), packet.opus_size());
+    audio_batch_frames_++;
+
+    /* The first frame waits for the later ones, but never longer than the negotiated delay. Late frames fill the batch. */
+    int max_frames = more_pending ? audio_batch_max_frames_ :
+        std::min(audio_batch_max_frames_, audio_batch_max_delay_ms_ / packet.frame_duration + 1);
+    if (audio_batch_frames_ >= max_frames) {
+        return FlushAudioBatch();
+    }
+    return true;
+}
+
+bool Protocol::FlushAudioBatch() {
+    if (audio_batch_frames_ == 0) {
+        return true;
+    }
+    int frames = audio_batch_frames_;
+    audio_batch_frames_ = 0;
+    return SendAudioBatch(audio_batch_, frames);
+}
+
+int Protocol::GetAudioBatchDeadlineMs() const {
+    if (audio_batch_frames_ == 0) {
+        return -1;
+    }
+    auto waited = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - audio_batch_start_time_);
+    return std::max(0, audio_batch_max_delay_ms_ - (int)waited.count());
+}
+
+void Protocol::StartAudioSender(AudioService& audio_service) {
+    audio_sender_ = std::make_unique<AudioSender>(*this, audio_service);
+    audio_sender_->Start();
+}
+
+void Protocol::NotifyAudioSender() {
+    if (audio_sender_ != nullptr) {
+        audio_sender_->Notify();
+    }
+}
+
+void Protocol::PauseAudioSender(bool paused) {
+    if (audio_sender_ == nullptr) {
+        return;
+    }
+    if (paused) {
+        audio_sender_->Pause();
+    } else {
+        audio_sender_->Resume();
+    }
+}
+
+// Offer batching in the hello message, the server enables it by answering with its own limits
+void Protocol::AddAudioBatchParams(cJSON* audio_params) const {
+#if CONFIG_AUDIO_BATCH_MAX_DELAY_MS > 0
+    cJSON* batch = cJSON_CreateObject();
+    cJSON_AddNumberToObject(batch, "max_frames", AUDIO_BATCH_MAX_FRAMES);
+    cJSON_AddNumberToObject(batch, "max_delay_ms", CONFIG_AUDIO_BATCH_MAX_DELAY_MS);
+    cJSON_AddItemToObject(audio_params, "batch", batch);
+#endif
+}
+
+void Protocol::ParseAudioBatchParams(const cJSON* audio_params) {
+    audio_batch_max_frames_ = 1;
+    audio_batch_max_delay_ms_ = 0;
+    audio_batch_frames_ = 0;
+#if CONFIG_AUDIO_BATCH_MAX_DELAY_MS > 0
+    auto batch = cJSON_GetObjectItem(audio_params, "batch");
+    if (!cJSON_IsObject(batch)) {
+        return;
+    }
+    auto max_frames = cJSON_GetObjectItem(batch, "max_frames");
+    auto max_delay_ms = cJSON_GetObjectItem(batch, "max_delay_ms");
+    if (cJSON_IsNumber(max_frames) && cJSON_IsNumber(max_delay_ms)) {
+        audio_batch_max_frames_ = std::clamp(max_frames->valueint, 1, AUDIO_BATCH_MAX_FRAMES);
+        audio_batch_max_delay_ms_ = std::clamp(max_delay_ms->valueint, 0, CONFIG_AUDIO_BATCH_MAX_DELAY_MS);
+        ESP_LOGI(TAG, "Uplink batching: up to %d frames, %d ms", audio_batch_max_frames_, audio_batch_max_delay_ms_);
+    }
+#endif
+}
+
+// Offer the loss protection in the hello message, the server enables each part by answering true
+void Protocol::AddAudioFecParams(cJSON* audio_params) const {
+#if CONFIG_USE_AUDIO_FEC
+    cJSON* fec = cJSON_CreateObject();
+    cJSON_AddBoolToObject(fec, "inband", true);
+    cJSON_AddBoolToObject(fec, "redundancy", true);
+    cJSON_AddItemToObject(audio_params, "fec", fec);
+#endif
+}
+
+void Protocol::ParseAudioFecParams(const cJSON* audio_params) {
+    audio_fec_inband_ = false;
+    audio_fec_redundancy_ = false;
+#if CONFIG_USE_AUDIO_FEC
+    auto fec = cJSON_GetObjectItem(audio_params, "fec");
+    if (!cJSON_IsObject(fec)) {
+        return;
+    }
+    audio_fec_inband_ = cJSON_IsTrue(cJSON_GetObjectItem(fec, "inband"));
+    audio_fec_redundancy_ = cJSON_IsTrue(cJSON_GetObjectItem(fec, "redundancy"));
+    ESP_LOGI(TAG, "Audio FEC: inband %d, redundancy %d", audio_fec_inband_, audio_fec_redundancy_);
+#endif
+}
+
 bool Protocol::IsTimeout() const {
     const int kTimeoutSeconds = 120;
     auto now = std::chrono::steady_clock::now();
@@ -2,16 +2,31 @@
 #define PROTOCOL_H
 
 #include <cJSON.h>
+#include "json_message.h"
+#include "transport_metrics.h"
 #include <string>
 #include <functional>
 #include <chrono>
 #include <vector>
+#include <memory>
+
+// Bytes the audio service leaves in front of the Opus data of an uplink packet, so the transport
+// can write its header in place. BinaryProtocol2 is the largest header.
+#define AUDIO_PACKET_HEADROOM 16
 
 struct AudioStreamPacket {
     int sample_rate = 0;
     int frame_duration = 0;
     uint32_t timestamp = 0;
+    uint32_t sequence = 0;  // 0 if the transport does not number the packets
     std::vector<uint8_t> payload;
+    size_t headroom = 0;    // bytes in front of the Opus data in payload, free for the transport header
+    bool fec = false;       // the frame is lost, payload is the next packet whose in-band FEC data rebuilds it
+    bool redundant = false; // a repeated copy of the previous frame, only used to fill a gap
+
+    uint8_t* opus_data() { return payload.data() + headroom; }
+    const uint8_t* opus_data() const { return payload.data() + headroom; }
+    size_t opus_size() const { return payload.size() - headroom; }
 };
 
 struct BinaryProtocol2 {
@@ -30,6 +45,44 @@ struct BinaryProtocol3 {
     uint8_t payload[];
 } __attribute__((packed));
 
+// Version 4 numbers the frames like the UDP transport, a batch carries the sequence of its first frame.
+// A server that understands it switches to it with the version of its hello.
+#define BINARY_PROTOCOL_NEGOTIATED_VERSION 4
+// The first frame after listen start (uplink) or tts start (downlink)
+#define AUDIO_FRAME_FLAG_STREAM_START 0x01
+
+struct BinaryProtocol4 {
+    uint8_t type;           // Message type (0: OPUS, 2: batch)
+    uint8_t flags;          // AUDIO_FRAME_FLAG_*
+    uint16_t sequence;      // Frame sequence, wraps around
+    uint32_t timestamp;     // Timestamp in milliseconds (used for server-side AEC)
+    uint16_t payload_size;  // Payload size in bytes
+    uint8_t payload[];      // Payload data
+} __attribute__((packed));
+
+// Uplink batching: message type 2 of BinaryProtocol2 / 3 / 4 and packet type 2 of MQTT UDP.
+// The payload is a sequence of frames, each one with its own timestamp and size.
+#define AUDIO_BATCH_TYPE 2
+#define AUDIO_BATCH_MAX_FRAMES 8
+
+struct BinaryProtocolBatchFrame {
+    uint32_t timestamp;
+    uint16_t payload_size;
+    uint8_t payload[];
+} __attribute__((packed));
+
+// Packet redundancy: packet type 3 of MQTT UDP. The payload is the frame of the packet followed by
+// the frame of the previous sequence, so a single lost packet is recovered from the next one.
+#define AUDIO_REDUNDANT_TYPE 3
+
+struct BinaryProtocolRedundantFrame {
+    uint16_t payload_size;  // Size of the frame of this packet, the previous frame takes the rest
+    uint8_t payload[];
+} __attribute__((packed));
+
+class AudioSender;
+class AudioService;
+
 enum AbortReason {
     kAbortReasonNone,
     kAbortReasonWakeWordDetected
@@ -43,7 +96,8 @@ enum ListeningMode {
 
 class Protocol {
 public:
-    virtual ~Protocol() = default;
+    Protocol();
+    virtual ~Protocol();
 
     inline int server_sample_rate() const {
         return server_sample_rate_;
@@ -51,21 +105,62 @@ public:
     inline int server_frame_duration() const {
         return server_frame_duration_;
     }
+    // Uplink audio profile chosen by the server, empty if it did not choose one
+    inline const std::string& server_audio_profile() const {
+        return server_audio_profile_;
+    }
     inline const std::string& session_id() const {
         return session_id_;
     }
+    // Opus in-band FEC in both directions, accepted by the server in its hello
+    inline bool audio_fec_inband() const {
+        return audio_fec_inband_;
+    }
+    // Every packet repeats the previous frame, accepted by the server in its hello
+    inline bool audio_fec_redundancy() const {
+        return audio_fec_redundancy_;
+    }
+    // Audio transport statistics of the current session
+    inline TransportMetrics& transport_metrics() {
+        return transport_metrics_;
+    }
 
     void OnIncomingAudio(std::function<void(std::unique_ptr<AudioStreamPacket> packet)> callback);
-    void OnIncomingJson(std::function<void(const cJSON* root)> callback);
+    // Control messages other than the hello, scanned in place
+    void OnIncomingJson(std::function<void(const JsonMessage& message)> callback);
     void OnAudioChannelOpened(std::function<void()> callback);
     void OnAudioChannelClosed(std::function<void()> callback);
     void OnNetworkError(std::function<void(const std::string& message)> callback);
+    // Called by the audio sender task after every frame it sent
+    void OnAudioSent(std::function<void()> callback);
 
     virtual bool Start() = 0;
     virtual bool OpenAudioChannel() = 0;
     virtual void CloseAudioChannel() = 0;
     virtual bool IsAudioChannelOpened() const = 0;
-    virtual bool SendAudio(std::unique_ptr<AudioStreamPacket> packet) = 0;
+    // Starts to connect and authenticate in the background without starting a session, so that the
+    // next OpenAudioChannel only needs the hello round trip. Returns at once, false if nothing was started.
+    // Transports with a persistent connection do nothing.
+    virtual bool WarmUpAudioChannel() { return false; }
+    virtual void ReleaseWarmAudioChannel() {}
+    virtual bool HasWarmAudioChannel() const { return false; }
+    // The transport may write its header into the headroom of the packet
+    virtual bool SendAudio(AudioStreamPacket& packet) = 0;
+    // Sends the packet, or adds it to the uplink batch if the server accepted batching. The batch
+    // is sent once it holds as many frames as the negotiated delay allows, or as many as the server
+    // accepts while more frames are pending, i.e. the sender is behind.
+    bool QueueAudio(AudioStreamPacket& packet, bool more_pending = false);
+    // Sends the frames of the batch that is not full yet
+    bool FlushAudioBatch();
+    // Milliseconds until the first frame of the batch has waited for the negotiated delay, -1 without a batch
+    int GetAudioBatchDeadlineMs() const;
+    // Starts the task that sends the uplink audio from the send queue, see AudioSender. Once it is
+    // started, only the task calls QueueAudio() and FlushAudioBatch().
+    void StartAudioSender(AudioService& audio_service);
+    // Called when a packet is pushed to the send queue
+    void NotifyAudioSender();
+    // While paused, the main loop may call SendAudio() itself, e.g. for the wake word audio
+    void PauseAudioSender(bool paused);
     virtual void SendWakeWordDetected(const std::string& wake_word);
     virtual void SendStartListening(ListeningMode mode);
     virtual void SendStopListening();
@@ -74,21 +169,44 @@ public:
     virtual void SendReminderMessage(const std::string& payload);
 
 protected:
-    std::function<void(const cJSON* root)> on_incoming_json_;
+    std::function<void(const JsonMessage& message)> on_incoming_json_;
     std::function<void(std::unique_ptr<AudioStreamPacket> packet)> on_incoming_audio_;
     std::function<void()> on_audio_channel_opened_;
     std::function<void()> on_audio_channel_closed_;
     std::function<void(const std::string& message)> on_network_error_;
+    std::function<void()> on_audio_sent_;
 
     int server_sample_rate_ = 24000;
     int server_frame_duration_ = 60;
+    std::string server_audio_profile_;
     bool error_occurred_ = false;
     std::string session_id_;
     std::chrono::time_point<std::chrono::steady_clock> last_incoming_time_;
+    TransportMetrics transport_metrics_;
+
+    // Uplink batching, off while max_frames is 1
+    int audio_batch_max_frames_ = 1;
+    int audio_batch_max_delay_ms_ = 0;
+    // Loss protection of lossy transports, off unless the server accepts it
+    bool audio_fec_inband_ = false;
+    bool audio_fec_redundancy_ = false;
 
     virtual bool SendText(const std::string& text) = 0;
     virtual void SetError(const std::string& message);
     virtual bool IsTimeout() const;
+    // The frames start after AUDIO_PACKET_HEADROOM bytes of batch, which are free for the transport header
+    virtual bool SendAudioBatch(std::vector<uint8_t>& batch, int frames) { return false; }
+    void AddAudioBatchParams(cJSON* audio_params) const;
+    void ParseAudioBatchParams(const cJSON* audio_params);
+    void AddAudioFecParams(cJSON* audio_params) const;
+    void ParseAudioFecParams(const cJSON* audio_params);
+
+private:
+    friend class AudioSender;
+    std::unique_ptr<AudioSender> audio_sender_;
+    std::vector<uint8_t> audio_batch_;
+    int audio_batch_frames_ = 0;
+    std::chrono::time_point<std::chrono::steady_clock> audio_batch_start_time_;
 };
 
 #endif // PROTOCOL_H
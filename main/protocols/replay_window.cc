@@ -0,0 +1,34 @@
+#include "replay_window.h"
+
+
+void ReplayWindow::Reset() {
+    highest_ = 0;
+    bitmap_ = 0;
+    rejected_ = 0;
+}
+
+bool ReplayWindow::Check(uint32_t sequence) const {
+    /* Nothing received since the reset, the peer may start counting anywhere */
+    if (bitmap_ == 0 || static_cast<int32_t>(sequence - highest_) > 0) {
+        return true;
+    }
+    uint32_t age = highest_ - sequence;
+    if (age >= REPLAY_WINDOW_SIZE) {
+        return false;
+    }
+    return !((bitmap_ >> age) & 1);
+}
+
+void ReplayWindow::Update(uint32_t sequence) {
+    if (bitmap_ == 0) {
+        bitmap_ = 1;
+        highest_ = sequence;
+    } else if (static_cast<int32_t>(sequence - highest_) > 0) {
+        uint32_t shift = sequence - highest_;
+        bitmap_ = shift < REPLAY_WINDOW_SIZE ? bitmap_ << shift : 0;
+        bitmap_ |= 1;
+        highest_ = sequence;
+    } else {
+        bitmap_ |= 1ULL << (highest_ - sequence);
+    }
+}
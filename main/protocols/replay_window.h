@@ -0,0 +1,34 @@
+#ifndef REPLAY_WINDOW_H
+#define REPLAY_WINDOW_H
+
+#include <cstdint>
+
+#define REPLAY_WINDOW_SIZE 64
+
+/*
+ * Sliding window anti-replay check of the packet sequence numbers, as in IPsec (RFC 4303).
+ *
+ * A packet is accepted once, even if it arrives out of order, as long as it is not older than
+ * REPLAY_WINDOW_SIZE packets behind the highest sequence received. The first packet after a reset
+ * sets the highest sequence, whatever its value.
+ */
+class ReplayWindow {
+public:
+    void Reset();
+    // Returns false for a sequence received before, or too old to tell
+    bool Check(uint32_t sequence) const;
+    // Mark the sequence as received, after the packet was accepted
+    void Update(uint32_t sequence);
+
+    inline uint32_t highest() const { return highest_; }
+    inline uint32_t rejected() const { return rejected_; }
+    inline void CountRejected() { rejected_++; }
+
+private:
+    uint32_t highest_ = 0;
+    // Bit i is set if highest_ - i was received, bit 0 is set once any packet was received
+    uint64_t bitmap_ = 0;
+    uint32_t rejected_ = 0;
+};
+
+#endif // REPLAY_WINDOW_H
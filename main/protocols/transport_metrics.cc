@@ -0,0 +1,145 @@
+#include "transport_metrics.h"
+
+#include <esp_timer.h>
+#include <cstdlib>
+#include <algorithm>
+
+
+void TransportMetrics::Reset() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    session_start_ms_ = esp_timer_get_time() / 1000;
+    hello_rtt_ms_ = -1;
+    packets_sent_ = 0;
+    bytes_sent_ = 0;
+    sends_timed_ = 0;
+    send_time_total_us_ = 0;
+    send_time_max_us_ = 0;
+    slow_sends_ = 0;
+    stale_dropped_ = 0;
+    packets_received_ = 0;
+    bytes_received_ = 0;
+    lost_ = 0;
+    reordered_ = 0;
+    rejected_ = 0;
+    highest_sequence_ = 0;
+    last_update_received_ = 0;
+    last_update_lost_ = 0;
+    expected_loss_percent_ = 0;
+    last_arrival_ms_ = 0;
+    last_send_time_ms_ = 0;
+    jitter_ms_ = 0;
+    max_interarrival_ms_ = 0;
+}
+
+void TransportMetrics::OnHelloReceived() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (hello_rtt_ms_ < 0) {
+        hello_rtt_ms_ = esp_timer_get_time() / 1000 - session_start_ms_;
+    }
+}
+
+void TransportMetrics::OnPacketSent(size_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    packets_sent_++;
+    bytes_sent_ += bytes;
+}
+
+void TransportMetrics::OnAudioSendTime(int64_t duration_us, int frame_duration_ms) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    sends_timed_++;
+    send_time_total_us_ += duration_us;
+    send_time_max_us_ = std::max(send_time_max_us_, duration_us);
+    if (duration_us > frame_duration_ms * 1000LL) {
+        slow_sends_++;
+    }
+}
+
+void TransportMetrics::OnStaleAudioDropped() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stale_dropped_++;
+}
+
+void TransportMetrics::OnPacketReceived(size_t bytes, uint32_t timestamp, int frame_duration_ms, uint32_t sequence) {
+    int64_t now_ms = esp_timer_get_time() / 1000;
+    std::lock_guard<std::mutex> lock(mutex_);
+    packets_received_++;
+    bytes_received_ += bytes;
+
+    if (sequence != 0) {
+        if (highest_sequence_ == 0 || static_cast<int32_t>(sequence - highest_sequence_) > 0) {
+            if (highest_sequence_ != 0) {
+                lost_ += sequence - highest_sequence_ - 1;
+            }
+            highest_sequence_ = sequence;
+        } else {
+            /* A late packet fills a gap that was counted as lost */
+            reordered_++;
+            if (lost_ > 0) {
+                lost_--;
+            }
+            return;
+        }
+    }
+
+    int64_t send_time_ms = timestamp != 0 ? timestamp : last_send_time_ms_ + frame_duration_ms;
+    int64_t interarrival_ms = now_ms - last_arrival_ms_;
+    if (last_arrival_ms_ != 0 && interarrival_ms < TRANSPORT_METRICS_BURST_GAP_MS) {
+        int64_t d = interarrival_ms - (send_time_ms - last_send_time_ms_);
+        jitter_ms_ += (std::abs(d) - jitter_ms_) / 16;
+        max_interarrival_ms_ = std::max<int>(max_interarrival_ms_, interarrival_ms);
+    }
+    last_arrival_ms_ = now_ms;
+    last_send_time_ms_ = send_time_ms;
+}
+
+void TransportMetrics::OnPacketRejected() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    rejected_++;
+}
+
+int TransportMetrics::UpdateExpectedLoss() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    /* A late packet may take back a loss counted before the last update */
+    uint32_t received = packets_received_ - last_update_received_;
+    uint32_t lost = lost_ > last_update_lost_ ? lost_ - last_update_lost_ : 0;
+    last_update_received_ = packets_received_;
+    last_update_lost_ = lost_;
+    if (received + lost == 0) {
+        return expected_loss_percent_;
+    }
+
+    int measured = lost * 100 / (received + lost);
+    expected_loss_percent_ = std::max(measured, (expected_loss_percent_ + measured) / 2);
+    return expected_loss_percent_;
+}
+
+cJSON* TransportMetrics::ToJson() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    int64_t duration_ms = session_start_ms_ != 0 ? esp_timer_get_time() / 1000 - session_start_ms_ : 0;
+    auto json = cJSON_CreateObject();
+    cJSON_AddNumberToObject(json, "session_ms", duration_ms);
+    cJSON_AddNumberToObject(json, "hello_rtt_ms", hello_rtt_ms_);
+
+    auto sent = cJSON_CreateObject();
+    cJSON_AddNumberToObject(sent, "packets", packets_sent_);
+    cJSON_AddNumberToObject(sent, "bytes", bytes_sent_);
+    cJSON_AddNumberToObject(sent, "kbps", duration_ms > 0 ? bytes_sent_ * 8 / duration_ms : 0);
+    cJSON_AddNumberToObject(sent, "send_avg_us", sends_timed_ > 0 ? send_time_total_us_ / sends_timed_ : 0);
+    cJSON_AddNumberToObject(sent, "send_max_us", send_time_max_us_);
+    cJSON_AddNumberToObject(sent, "slow_sends", slow_sends_);
+    cJSON_AddNumberToObject(sent, "stale_dropped", stale_dropped_);
+    cJSON_AddItemToObject(json, "sent", sent);
+
+    auto received = cJSON_CreateObject();
+    cJSON_AddNumberToObject(received, "packets", packets_received_);
+    cJSON_AddNumberToObject(received, "bytes", bytes_received_);
+    cJSON_AddNumberToObject(received, "kbps", duration_ms > 0 ? bytes_received_ * 8 / duration_ms : 0);
+    cJSON_AddNumberToObject(received, "lost", lost_);
+    cJSON_AddNumberToObject(received, "reordered", reordered_);
+    cJSON_AddNumberToObject(received, "rejected", rejected_);
+    cJSON_AddNumberToObject(received, "jitter_ms", (int)jitter_ms_);
+    cJSON_AddNumberToObject(received, "max_interarrival_ms", max_interarrival_ms_);
+    cJSON_AddNumberToObject(received, "expected_loss_percent", expected_loss_percent_);
+    cJSON_AddItemToObject(json, "received", received);
+    return json;
+}
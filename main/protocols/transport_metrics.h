@@ -0,0 +1,69 @@
+#ifndef TRANSPORT_METRICS_H
+#define TRANSPORT_METRICS_H
+
+#include <mutex>
+#include <cstdint>
+#include <cstddef>
+#include <cJSON.h>
+
+// A longer pause between two downlink packets starts a new burst, it is not counted as jitter
+#define TRANSPORT_METRICS_BURST_GAP_MS 1000
+
+/*
+ * Audio transport statistics of the current session, reset when the audio channel is opened.
+ *
+ * The inter-arrival jitter is estimated as in RTP (RFC 3550, 6.4.1). The sender time of a packet
+ * is its timestamp, or one frame after the previous packet if the transport has no timestamp.
+ * Loss and reordering are only known when the transport numbers its packets (MQTT + UDP).
+ */
+class TransportMetrics {
+public:
+    // A new session, the hello is being sent
+    void Reset();
+    void OnHelloReceived();
+    void OnPacketSent(size_t bytes);
+    // Time the sender task spent handing an uplink frame to the transport, a send is slow when it
+    // takes longer than the frame lasts
+    void OnAudioSendTime(int64_t duration_us, int frame_duration_ms);
+    // An uplink frame dropped by the sender because the link is slower than realtime
+    void OnStaleAudioDropped();
+    // A sequence of 0 means the transport does not number its packets
+    void OnPacketReceived(size_t bytes, uint32_t timestamp, int frame_duration_ms, uint32_t sequence = 0);
+    // A replayed or too old packet, dropped by the transport
+    void OnPacketRejected();
+    // Expected packet loss in percent for the in-band FEC of the encoder, from the loss of the packets
+    // received since the last call. It rises at once and decays by half while the loss is lower, and is
+    // kept when nothing was received, e.g. while the device is listening.
+    int UpdateExpectedLoss();
+    // The caller owns the returned object
+    cJSON* ToJson();
+
+private:
+    std::mutex mutex_;
+    int64_t session_start_ms_ = 0;
+    int hello_rtt_ms_ = -1;
+
+    uint32_t packets_sent_ = 0;
+    uint64_t bytes_sent_ = 0;
+    uint32_t sends_timed_ = 0;
+    int64_t send_time_total_us_ = 0;
+    int64_t send_time_max_us_ = 0;
+    uint32_t slow_sends_ = 0;
+    uint32_t stale_dropped_ = 0;
+    uint32_t packets_received_ = 0;
+    uint64_t bytes_received_ = 0;
+    uint32_t lost_ = 0;
+    uint32_t reordered_ = 0;
+    uint32_t rejected_ = 0;
+    uint32_t highest_sequence_ = 0;
+    uint32_t last_update_received_ = 0;
+    uint32_t last_update_lost_ = 0;
+    int expected_loss_percent_ = 0;
+
+    int64_t last_arrival_ms_ = 0;
+    int64_t last_send_time_ms_ = 0;
+    float jitter_ms_ = 0;
+    int max_interarrival_ms_ = 0;
+};
+
+#endif // TRANSPORT_METRICS_H
@@ -3,10 +3,14 @@
 #include "system_info.h"
 #include "application.h"
 #include "settings.h"
+#include "latency_tracer.h"
 
 #include <cstring>
+#include <algorithm>
 #include <cJSON.h>
 #include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/task.h>
 #include <arpa/inet.h>
 #include "assets/lang_config.h"
 
@@ -17,6 +21,10 @@ WebsocketProtocol::WebsocketProtocol() {
 }
 
 WebsocketProtocol::~WebsocketProtocol() {
+    CancelWarmUp();
+    while (warm_up_running_) {
+        vTaskDelay(pdMS_TO_TICKS(10));
+    }
     vEventGroupDelete(event_group_handle_);
 }
 
@@ -25,39 +33,119 @@ bool WebsocketProtocol::Start() {
     return true;
 }
 
-bool WebsocketProtocol::SendAudio(std::unique_ptr<AudioStreamPacket> packet) {
+static_assert(sizeof(BinaryProtocol2) <= AUDIO_PACKET_HEADROOM, "The headroom must fit the binary protocol header");
+static_assert(sizeof(BinaryProtocol4) <= AUDIO_PACKET_HEADROOM, "The headroom must fit the binary protocol header");
+
+size_t WebsocketProtocol::HeaderSize(int version) {
+    switch (version) {
+    case 2:
+        return sizeof(BinaryProtocol2);
+    case 3:
+        return sizeof(BinaryProtocol3);
+    case 4:
+        return sizeof(BinaryProtocol4);
+    default:
+        return 0;
+    }
+}
+
+bool WebsocketProtocol::SendAudio(AudioStreamPacket& packet) {
+    std::lock_guard<std::mutex> lock(channel_mutex_);
     if (websocket_ == nullptr || !websocket_->IsConnected()) {
         return false;
     }
 
-    if (version_ == 2) {
-        std::string serialized;
-        serialized.resize(sizeof(BinaryProtocol2) + packet->payload.size());
-        auto bp2 = (BinaryProtocol2*)serialized.data();
-        bp2->version = htons(version_);
+    /* Read once, the header matches its size even if the server hello changes the version meanwhile */
+    int version = version_;
+    size_t header_size = HeaderSize(version);
+    if (packet.headroom < header_size) {
+        /* Not encoded by the audio service, e.g. the wake word audio */
+        packet.payload.insert(packet.payload.begin(), header_size - packet.headroom, 0);
+        packet.headroom = header_size;
+    }
+
+    /* The header is written in place, right in front of the Opus data */
+    uint8_t* header = packet.opus_data() - header_size;
+    if (version == 2) {
+        auto bp2 = (BinaryProtocol2*)header;
+        bp2->version = htons(version);
         bp2->type = 0;
         bp2->reserved = 0;
-        bp2->timestamp = htonl(packet->timestamp);
-        bp2->payload_size = htonl(packet->payload.size());
-        memcpy(bp2->payload, packet->payload.data(), packet->payload.size());
-
-        return websocket_->Send(serialized.data(), serialized.size(), true);
-    } else if (version_ == 3) {
-        std::string serialized;
-        serialized.resize(sizeof(BinaryProtocol3) + packet->payload.size());
-        auto bp3 = (BinaryProtocol3*)serialized.data();
+        bp2->timestamp = htonl(packet.timestamp);
+        bp2->payload_size = htonl(packet.opus_size());
+    } else if (version == 3) {
+        auto bp3 = (BinaryProtocol3*)header;
         bp3->type = 0;
         bp3->reserved = 0;
-        bp3->payload_size = htons(packet->payload.size());
-        memcpy(bp3->payload, packet->payload.data(), packet->payload.size());
+        bp3->payload_size = htons(packet.opus_size());
+    } else if (version == 4) {
+        auto bp4 = (BinaryProtocol4*)header;
+        bp4->type = 0;
+        bp4->flags = stream_start_.exchange(false) ? AUDIO_FRAME_FLAG_STREAM_START : 0;
+        bp4->sequence = htons(++local_sequence_);
+        bp4->timestamp = htonl(packet.timestamp);
+        bp4->payload_size = htons(packet.opus_size());
+    }
+    if (!websocket_->Send(header, header_size + packet.opus_size(), true)) {
+        return false;
+    }
+    transport_metrics_.OnPacketSent(header_size + packet.opus_size());
+    TraceLatency(kLatencyUplinkFirst);
+    return true;
+}
+
+bool WebsocketProtocol::SendAudioBatch(std::vector<uint8_t>& batch, int frames) {
+    std::lock_guard<std::mutex> lock(channel_mutex_);
+    if (websocket_ == nullptr || !websocket_->IsConnected()) {
+        return false;
+    }
 
-        return websocket_->Send(serialized.data(), serialized.size(), true);
+    int version = version_;
+    size_t payload_size = batch.size() - AUDIO_PACKET_HEADROOM;
+    auto first_frame = (const BinaryProtocolBatchFrame*)(batch.data() + AUDIO_PACKET_HEADROOM);
+    uint8_t* header;
+    if (version == 2) {
+        header = batch.data() + AUDIO_PACKET_HEADROOM - sizeof(BinaryProtocol2);
+        auto bp2 = (BinaryProtocol2*)header;
+        bp2->version = htons(version);
+        bp2->type = htons(AUDIO_BATCH_TYPE);
+        bp2->reserved = 0;
+        bp2->timestamp = first_frame->timestamp;
+        bp2->payload_size = htonl(payload_size);
+    } else if (version == 4) {
+        /* The frames of the batch take the sequences after the one of the header */
+        header = batch.data() + AUDIO_PACKET_HEADROOM - sizeof(BinaryProtocol4);
+        auto bp4 = (BinaryProtocol4*)header;
+        bp4->type = AUDIO_BATCH_TYPE;
+        bp4->flags = stream_start_.exchange(false) ? AUDIO_FRAME_FLAG_STREAM_START : 0;
+        bp4->sequence = htons(local_sequence_ + 1);
+        bp4->timestamp = first_frame->timestamp;
+        bp4->payload_size = htons(payload_size);
+        local_sequence_ += frames;
     } else {
-        return websocket_->Send(packet->payload.data(), packet->payload.size(), true);
+        header = batch.data() + AUDIO_PACKET_HEADROOM - sizeof(BinaryProtocol3);
+        auto bp3 = (BinaryProtocol3*)header;
+        bp3->type = AUDIO_BATCH_TYPE;
+        bp3->reserved = 0;
+        bp3->payload_size = htons(payload_size);
+    }
+    size_t size = batch.data() + batch.size() - header;
+    if (!websocket_->Send(header, size, true)) {
+        return false;
     }
+    transport_metrics_.OnPacketSent(size);
+    TraceLatency(kLatencyUplinkFirst);
+    return true;
+}
+
+void WebsocketProtocol::SendStartListening(ListeningMode mode) {
+    /* The next uplink frame starts a new stream */
+    stream_start_ = true;
+    Protocol::SendStartListening(mode);
 }
 
 bool WebsocketProtocol::SendText(const std::string& text) {
+    std::lock_guard<std::mutex> lock(channel_mutex_);
     if (websocket_ == nullptr || !websocket_->IsConnected()) {
         return false;
     }
@@ -72,29 +160,177 @@ bool WebsocketProtocol::SendText(const std::string& text) {
 }
 
 bool WebsocketProtocol::IsAudioChannelOpened() const {
-    return websocket_ != nullptr && websocket_->IsConnected() && !error_occurred_ && !IsTimeout();
+    return websocket_ != nullptr && websocket_->IsConnected() && !warm_ && !error_occurred_ && !IsTimeout();
 }
 
-void WebsocketProtocol::CloseAudioChannel() {
+// The audio sender task may be sending on it
+void WebsocketProtocol::ResetWebsocket() {
+    std::lock_guard<std::mutex> lock(channel_mutex_);
+    active_websocket_ = nullptr;
     websocket_.reset();
 }
 
+void WebsocketProtocol::CloseAudioChannel() {
+    ResetWebsocket();
+    warm_ = false;
+}
+
+bool WebsocketProtocol::HasWarmAudioChannel() const {
+    return warm_ && websocket_ != nullptr && websocket_->IsConnected();
+}
+
+bool WebsocketProtocol::WarmUpAudioChannel() {
+    {
+        std::lock_guard<std::mutex> lock(channel_mutex_);
+        if (websocket_ != nullptr && websocket_->IsConnected()) {
+            return warm_;
+        }
+        if (esp_timer_get_time() < warm_up_retry_us_) {
+            ESP_LOGD(TAG, "Warm-up backing off after a failure");
+            return false;
+        }
+    }
+    if (warm_up_running_.exchange(true)) {
+        return true;
+    }
+
+    warm_up_cancelled_ = false;
+    auto ret = xTaskCreate([](void* arg) {
+        auto protocol = (WebsocketProtocol*)arg;
+        protocol->WarmUpTask();
+        protocol->warm_up_running_ = false;
+        vTaskDelete(NULL);
+    }, "ws_warm_up", WEBSOCKET_WARM_UP_TASK_STACK_SIZE, this, WEBSOCKET_WARM_UP_TASK_PRIORITY, nullptr);
+    if (ret != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create the warm-up task");
+        warm_up_running_ = false;
+        return false;
+    }
+    return true;
+}
+
+// Connects on the warm-up task, the main loop goes on meanwhile
+void WebsocketProtocol::WarmUpTask() {
+    auto start_time = esp_timer_get_time();
+    auto websocket = CreateWebsocket();
+
+    std::lock_guard<std::mutex> lock(channel_mutex_);
+    if (websocket == nullptr) {
+        warm_up_backoff_ms_ = std::clamp(warm_up_backoff_ms_ * 2, WEBSOCKET_WARM_UP_MIN_BACKOFF_MS, WEBSOCKET_WARM_UP_MAX_BACKOFF_MS);
+        warm_up_retry_us_ = esp_timer_get_time() + warm_up_backoff_ms_ * 1000LL;
+        ESP_LOGW(TAG, "Warm-up failed, next attempt in %d s at the earliest", warm_up_backoff_ms_ / 1000);
+        return;
+    }
+    warm_up_backoff_ms_ = 0;
+    warm_up_retry_us_ = 0;
+    if (warm_up_cancelled_ || websocket_ != nullptr) {
+        /* A session was opened meanwhile with a connection of its own, or the device went to sleep */
+        ESP_LOGI(TAG, "Warm-up cancelled, the connection is dropped");
+        return;
+    }
+    websocket_ = std::move(websocket);
+    active_websocket_ = websocket_.get();
+    warm_ = true;
+    ESP_LOGI(TAG, "Warm connection ready in %ld ms", (long)((esp_timer_get_time() - start_time) / 1000));
+}
+
+void WebsocketProtocol::CancelWarmUp() {
+    if (warm_up_running_) {
+        warm_up_cancelled_ = true;
+    }
+}
+
+void WebsocketProtocol::ReleaseWarmAudioChannel() {
+    CancelWarmUp();
+    if (warm_) {
+        ESP_LOGI(TAG, "Releasing warm connection");
+        ResetWebsocket();
+        warm_ = false;
+    }
+}
+
 bool WebsocketProtocol::OpenAudioChannel() {
+    auto start_time = esp_timer_get_time();
+    error_occurred_ = false;
+
+    bool reused = HasWarmAudioChannel();
+    if (reused) {
+        /* The TLS handshake and the authentication are already done, only the hello is left */
+        version_ = GetConfiguredVersion();
+        warm_ = false;
+    } else {
+        /* A warm-up still connecting is not waited for, its connection is dropped when it is done.
+           A warm connection dropped by the server is released while it is still marked warm. */
+        ReleaseWarmAudioChannel();
+        if (!Connect()) {
+            ResetWebsocket();
+            SetError(Lang::Strings::SERVER_NOT_CONNECTED);
+            return false;
+        }
+    }
+
+    {
+        /* Numbered from the start of each session, the audio sender is paused until the server hello */
+        std::lock_guard<std::mutex> lock(channel_mutex_);
+        local_sequence_ = 0;
+    }
+
+    // Send hello message to describe the client
+    auto message = GetHelloMessage();
+    transport_metrics_.Reset();
+    if (!SendText(message)) {
+        return false;
+    }
+
+    // Wait for server hello
+    EventBits_t bits = xEventGroupWaitBits(event_group_handle_, WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT, pdTRUE, pdFALSE, pdMS_TO_TICKS(10000));
+    if (!(bits & WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT)) {
+        ESP_LOGE(TAG, "Failed to receive server hello");
+        SetError(Lang::Strings::SERVER_TIMEOUT);
+        return false;
+    }
+    ESP_LOGI(TAG, "Audio channel opened in %ld ms, warm connection: %s",
+        (long)((esp_timer_get_time() - start_time) / 1000), reused ? "yes" : "no");
+    TraceLatency(kLatencyChannelOpened);
+
+    if (on_audio_channel_opened_ != nullptr) {
+        on_audio_channel_opened_();
+    }
+
+    return true;
+}
+
+bool WebsocketProtocol::Connect() {
+    version_ = GetConfiguredVersion();
+    auto websocket = CreateWebsocket();
+    if (websocket == nullptr) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(channel_mutex_);
+    websocket_ = std::move(websocket);
+    active_websocket_ = websocket_.get();
+    return true;
+}
+
+// A version negotiated in the last session is not kept, the next server may not support it
+int WebsocketProtocol::GetConfiguredVersion() {
     Settings settings("websocket", false);
-    std::string url = settings.GetString("url");
-    std::string token = settings.GetString("token");
     int version = settings.GetInt("version");
-    if (version != 0) {
-        version_ = version;
-    }
+    return version != 0 ? version : 1;
+}
 
-    error_occurred_ = false;
+// Creates and connects a websocket, on the main loop or on the warm-up task
+std::unique_ptr<WebSocket> WebsocketProtocol::CreateWebsocket() {
+    Settings settings("websocket", false);
+    std::string url = settings.GetString("url");
+    std::string token = settings.GetString("token");
+    int version = GetConfiguredVersion();
 
     auto network = Board::GetInstance().GetNetwork();
-    websocket_ = network->CreateWebSocket(1);
-    if (websocket_ == nullptr) {
+    auto websocket = network->CreateWebSocket(1);
+    if (websocket == nullptr) {
         ESP_LOGE(TAG, "Failed to create websocket");
-        return false;
+        return nullptr;
     }
 
     if (!token.empty()) {
@@ -102,101 +338,137 @@ bool WebsocketProtocol::OpenAudioChannel() {
         if (token.find(" ") == std::string::npos) {
             token = "Bearer " + token;
         }
-        websocket_->SetHeader("Authorization", token.c_str());
+        websocket->SetHeader("Authorization", token.c_str());
     }
-    websocket_->SetHeader("Protocol-Version", std::to_string(version_).c_str());
-    websocket_->SetHeader("Device-Id", SystemInfo::GetMacAddress().c_str());
-    websocket_->SetHeader("Client-Id", Board::GetInstance().GetUuid().c_str());
+    websocket->SetHeader("Protocol-Version", std::to_string(version).c_str());
+    websocket->SetHeader("Device-Id", SystemInfo::GetMacAddress().c_str());
+    websocket->SetHeader("Client-Id", Board::GetInstance().GetUuid().c_str());
 
-    websocket_->OnData([this](const char* data, size_t len, bool binary) {
+    websocket->OnData([this](const char* data, size_t len, bool binary) {
         if (binary) {
             if (on_incoming_audio_ != nullptr) {
-                if (version_ == 2) {
-                    BinaryProtocol2* bp2 = (BinaryProtocol2*)data;
-                    bp2->version = ntohs(bp2->version);
-                    bp2->type = ntohs(bp2->type);
-                    bp2->timestamp = ntohl(bp2->timestamp);
-                    bp2->payload_size = ntohl(bp2->payload_size);
-                    auto payload = (uint8_t*)bp2->payload;
-                    on_incoming_audio_(std::make_unique<AudioStreamPacket>(AudioStreamPacket{
-                        .sample_rate = server_sample_rate_,
-                        .frame_duration = server_frame_duration_,
-                        .timestamp = bp2->timestamp,
-                        .payload = std::vector<uint8_t>(payload, payload + bp2->payload_size)
-                    }));
-                } else if (version_ == 3) {
-                    BinaryProtocol3* bp3 = (BinaryProtocol3*)data;
-                    bp3->type = bp3->type;
-                    bp3->payload_size = ntohs(bp3->payload_size);
-                    auto payload = (uint8_t*)bp3->payload;
-                    on_incoming_audio_(std::make_unique<AudioStreamPacket>(AudioStreamPacket{
-                        .sample_rate = server_sample_rate_,
-                        .frame_duration = server_frame_duration_,
-                        .timestamp = 0,
-                        .payload = std::vector<uint8_t>(payload, payload + bp3->payload_size)
-                    }));
-                } else {
-                    on_incoming_audio_(std::make_unique<AudioStreamPacket>(AudioStreamPacket{
-                        .sample_rate = server_sample_rate_,
-                        .frame_duration = server_frame_duration_,
-                        .timestamp = 0,
-                        .payload = std::vector<uint8_t>((uint8_t*)data, (uint8_t*)data + len)
-                    }));
-                }
+                OnBinaryData((const uint8_t*)data, len);
             }
         } else {
-            // Parse JSON data
-            auto root = cJSON_Parse(data);
-            auto type = cJSON_GetObjectItem(root, "type");
-            if (cJSON_IsString(type)) {
-                if (strcmp(type->valuestring, "hello") == 0) {
+            // Scan JSON data in place, only the hello is parsed with cJSON
+            JsonMessage message;
+            if (!message.Parse(data, len) || message.type_name().empty()) {
+                ESP_LOGE(TAG, "Missing message type, data: %.*s", (int)len, data);
+            } else if (message.type() == kJsonKeywordHello) {
+                auto root = cJSON_ParseWithLength(data, len);
+                if (root != nullptr) {
                     ParseServerHello(root);
-                } else {
-                    if (on_incoming_json_ != nullptr) {
-                        on_incoming_json_(root);
-                    }
+                    cJSON_Delete(root);
                 }
-            } else {
-                ESP_LOGE(TAG, "Missing message type, data: %s", data);
+            } else if (on_incoming_json_ != nullptr) {
+                on_incoming_json_(message);
             }
-            cJSON_Delete(root);
         }
         last_incoming_time_ = std::chrono::steady_clock::now();
     });
 
-    websocket_->OnDisconnected([this]() {
+    websocket->OnDisconnected([this, connection = websocket.get()]() {
+        if (connection != active_websocket_) {
+            /* Dropped by a cancelled warm-up */
+            return;
+        }
+        if (warm_) {
+            /* No session was started on it, nothing to close */
+            ESP_LOGI(TAG, "Warm connection closed by the server");
+            return;
+        }
         ESP_LOGI(TAG, "Websocket disconnected");
         if (on_audio_channel_closed_ != nullptr) {
             on_audio_channel_closed_();
         }
     });
 
-    ESP_LOGI(TAG, "Connecting to websocket server: %s with version: %d", url.c_str(), version_);
-    if (!websocket_->Connect(url.c_str())) {
+    ESP_LOGI(TAG, "Connecting to websocket server: %s with version: %d", url.c_str(), version);
+    if (!websocket->Connect(url.c_str())) {
         ESP_LOGE(TAG, "Failed to connect to websocket server");
-        SetError(Lang::Strings::SERVER_NOT_CONNECTED);
-        return false;
+        return nullptr;
     }
+    return websocket;
+}
 
-    // Send hello message to describe the client
-    auto message = GetHelloMessage();
-    if (!SendText(message)) {
-        return false;
+void WebsocketProtocol::OnBinaryData(const uint8_t* data, size_t len) {
+    int version = version_;
+    size_t header_size = HeaderSize(version);
+    if (len < header_size) {
+        ESP_LOGW(TAG, "Binary frame too short: %u bytes", len);
+        return;
+    }
+    TraceLatency(kLatencyDownlinkFirst);
+    if (version == 4 && ((const BinaryProtocol4*)data)->type == AUDIO_BATCH_TYPE) {
+        OnBatchData((const BinaryProtocol4*)data, len);
+        return;
     }
 
-    // Wait for server hello
-    EventBits_t bits = xEventGroupWaitBits(event_group_handle_, WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT, pdTRUE, pdFALSE, pdMS_TO_TICKS(10000));
-    if (!(bits & WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT)) {
-        ESP_LOGE(TAG, "Failed to receive server hello");
-        SetError(Lang::Strings::SERVER_TIMEOUT);
-        return false;
+    /* The header is read without touching the receive buffer, only the Opus data is copied into a pooled packet */
+    auto packet = Application::GetInstance().GetAudioService().AcquirePacket();
+    packet->sample_rate = server_sample_rate_;
+    packet->frame_duration = server_frame_duration_;
+    auto payload = data + header_size;
+    size_t payload_size = len - header_size;
+    if (version == 2) {
+        auto bp2 = (const BinaryProtocol2*)data;
+        packet->timestamp = ntohl(bp2->timestamp);
+        payload_size = std::min<size_t>(ntohl(bp2->payload_size), payload_size);
+    } else if (version == 3) {
+        auto bp3 = (const BinaryProtocol3*)data;
+        payload_size = std::min<size_t>(ntohs(bp3->payload_size), payload_size);
+    } else if (version == 4) {
+        auto bp4 = (const BinaryProtocol4*)data;
+        packet->timestamp = ntohl(bp4->timestamp);
+        packet->sequence = ExtendSequence(ntohs(bp4->sequence));
+        payload_size = std::min<size_t>(ntohs(bp4->payload_size), payload_size);
     }
+    packet->payload.assign(payload, payload + payload_size);
+    transport_metrics_.OnPacketReceived(len, packet->timestamp, server_frame_duration_, packet->sequence);
+    on_incoming_audio_(std::move(packet));
+}
 
-    if (on_audio_channel_opened_ != nullptr) {
-        on_audio_channel_opened_();
+// A version 4 batch, every frame becomes a packet with its own sequence and timestamp
+void WebsocketProtocol::OnBatchData(const BinaryProtocol4* header, size_t len) {
+    auto& audio_service = Application::GetInstance().GetAudioService();
+    size_t offset = 0;
+    size_t payload_size = std::min<size_t>(ntohs(header->payload_size), len - sizeof(BinaryProtocol4));
+    uint16_t sequence = ntohs(header->sequence);
+    size_t bytes = len;
+    while (offset + sizeof(BinaryProtocolBatchFrame) <= payload_size) {
+        auto frame = (const BinaryProtocolBatchFrame*)(header->payload + offset);
+        size_t frame_size = ntohs(frame->payload_size);
+        offset += sizeof(BinaryProtocolBatchFrame) + frame_size;
+        if (offset > payload_size) {
+            ESP_LOGW(TAG, "Truncated batch frame: %u bytes", frame_size);
+            return;
+        }
+
+        auto packet = audio_service.AcquirePacket();
+        packet->sample_rate = server_sample_rate_;
+        packet->frame_duration = server_frame_duration_;
+        packet->timestamp = ntohl(frame->timestamp);
+        packet->sequence = ExtendSequence(sequence++);
+        packet->payload.assign(frame->payload, frame->payload + frame_size);
+        /* The header bytes are counted with the first frame */
+        transport_metrics_.OnPacketReceived(bytes, packet->timestamp, server_frame_duration_, packet->sequence);
+        bytes = sizeof(BinaryProtocolBatchFrame) + frame_size;
+        on_incoming_audio_(std::move(packet));
     }
+}
 
-    return true;
+// The 16-bit sequence of version 4 is extended to the 32-bit sequence of the jitter buffer, which
+// treats 0 as not numbered. A packet older than the highest one keeps the highest in place.
+uint32_t WebsocketProtocol::ExtendSequence(uint16_t sequence) {
+    if (remote_sequence_ == 0) {
+        remote_sequence_ = 0x10000 | sequence;
+        return remote_sequence_;
+    }
+    uint32_t extended = remote_sequence_ + static_cast<int16_t>(sequence - static_cast<uint16_t>(remote_sequence_));
+    if (static_cast<int32_t>(extended - remote_sequence_) > 0) {
+        remote_sequence_ = extended;
+    }
+    return extended;
 }
 
 std::string WebsocketProtocol::GetHelloMessage() {
@@ -204,6 +476,13 @@ std::string WebsocketProtocol::GetHelloMessage() {
     cJSON* root = cJSON_CreateObject();
     cJSON_AddStringToObject(root, "type", "hello");
     cJSON_AddNumberToObject(root, "version", version_);
+    // The server may switch to a newer binary protocol with the version of its hello
+    if (version_ < BINARY_PROTOCOL_NEGOTIATED_VERSION) {
+        cJSON* versions = cJSON_CreateArray();
+        cJSON_AddItemToArray(versions, cJSON_CreateNumber(version_));
+        cJSON_AddItemToArray(versions, cJSON_CreateNumber(BINARY_PROTOCOL_NEGOTIATED_VERSION));
+        cJSON_AddItemToObject(root, "supported_versions", versions);
+    }
     cJSON* features = cJSON_CreateObject();
 #if CONFIG_USE_SERVER_AEC
     cJSON_AddBoolToObject(features, "aec", true);
@@ -215,7 +494,19 @@ std::string WebsocketProtocol::GetHelloMessage() {
     cJSON_AddStringToObject(audio_params, "format", "opus");
     cJSON_AddNumberToObject(audio_params, "sample_rate", 16000);
     cJSON_AddNumberToObject(audio_params, "channels", 1);
-    cJSON_AddNumberToObject(audio_params, "frame_duration", OPUS_FRAME_DURATION_MS);
+    auto& profile = Application::GetInstance().GetAudioService().GetPreferredAudioProfile();
+    cJSON_AddNumberToObject(audio_params, "frame_duration", profile.frame_duration_ms);
+    // The server may choose another one of the profiles in its hello
+    cJSON_AddStringToObject(audio_params, "profile", profile.name);
+    cJSON* profiles = cJSON_CreateArray();
+    for (const auto& item : kAudioProfiles) {
+        cJSON_AddItemToArray(profiles, cJSON_CreateString(item.name));
+    }
+    cJSON_AddItemToObject(audio_params, "profiles", profiles);
+    // Version 1 has no header to mark a batch
+    if (version_ >= 2) {
+        AddAudioBatchParams(audio_params);
+    }
     cJSON_AddItemToObject(root, "audio_params", audio_params);
     auto json_str = cJSON_PrintUnformatted(root);
     std::string message(json_str);
@@ -237,7 +528,18 @@ void WebsocketProtocol::ParseServerHello(const cJSON* root) {
         ESP_LOGI(TAG, "Session ID: %s", session_id_.c_str());
     }
 
+    // Only the negotiated version is taken from the server, older servers may echo another one
+    auto version = cJSON_GetObjectItem(root, "version");
+    /* Atomic, the audio sender reads it once per frame. local_sequence_ was reset before the client hello. */
+    if (cJSON_IsNumber(version) && version->valueint == BINARY_PROTOCOL_NEGOTIATED_VERSION && version_ != version->valueint) {
+        ESP_LOGI(TAG, "Binary protocol version %d -> %d", version_.load(), version->valueint);
+        version_ = version->valueint;
+    }
+    remote_sequence_ = 0;
+    stream_start_ = false;
+
     auto audio_params = cJSON_GetObjectItem(root, "audio_params");
+    server_audio_profile_.clear();
     if (cJSON_IsObject(audio_params)) {
         auto sample_rate = cJSON_GetObjectItem(audio_params, "sample_rate");
         if (cJSON_IsNumber(sample_rate)) {
@@ -247,7 +549,13 @@ void WebsocketProtocol::ParseServerHello(const cJSON* root) {
         if (cJSON_IsNumber(frame_duration)) {
             server_frame_duration_ = frame_duration->valueint;
         }
+        auto profile = cJSON_GetObjectItem(audio_params, "profile");
+        if (cJSON_IsString(profile)) {
+            server_audio_profile_ = profile->valuestring;
+        }
     }
+    ParseAudioBatchParams(audio_params);
 
+    transport_metrics_.OnHelloReceived();
     xEventGroupSetBits(event_group_handle_, WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT);
 }
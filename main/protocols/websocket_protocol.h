@@ -5,29 +5,72 @@
 #include "protocol.h"
 
 #include <web_socket.h>
+#include <atomic>
+#include <mutex>
 #include <freertos/FreeRTOS.h>
 #include <freertos/event_groups.h>
 
 #define WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT (1 << 0)
 
+// The TLS handshake of the warm-up runs on its own task
+#define WEBSOCKET_WARM_UP_TASK_STACK_SIZE 8192
+#define WEBSOCKET_WARM_UP_TASK_PRIORITY 1
+// Delay before the next warm-up after a failed one, doubled after every failure
+#define WEBSOCKET_WARM_UP_MIN_BACKOFF_MS 5000
+#define WEBSOCKET_WARM_UP_MAX_BACKOFF_MS (5 * 60 * 1000)
+
 class WebsocketProtocol : public Protocol {
 public:
     WebsocketProtocol();
     ~WebsocketProtocol();
 
     bool Start() override;
-    bool SendAudio(std::unique_ptr<AudioStreamPacket> packet) override;
+    bool SendAudio(AudioStreamPacket& packet) override;
     bool OpenAudioChannel() override;
     void CloseAudioChannel() override;
     bool IsAudioChannelOpened() const override;
+    bool WarmUpAudioChannel() override;
+    void ReleaseWarmAudioChannel() override;
+    bool HasWarmAudioChannel() const override;
+    void SendStartListening(ListeningMode mode) override;
 
 private:
     EventGroupHandle_t event_group_handle_;
     std::unique_ptr<WebSocket> websocket_;
-    int version_ = 1;
+    // Binary protocol version, read without channel_mutex_ by the receive callback
+    std::atomic<int> version_ = 1;
+    // Guards websocket_ between the main loop, the audio sender task and the warm-up task
+    std::mutex channel_mutex_;
+    // websocket_, for the callbacks of a connection dropped by the warm-up
+    std::atomic<WebSocket*> active_websocket_ = nullptr;
+    // Connected and authenticated, but the hello has not been sent yet
+    std::atomic<bool> warm_ = false;
+    // A warm-up task is connecting, it drops its connection when cancelled meanwhile
+    std::atomic<bool> warm_up_running_ = false;
+    std::atomic<bool> warm_up_cancelled_ = false;
+    // Backoff after failed warm-ups, guarded by channel_mutex_
+    int warm_up_backoff_ms_ = 0;
+    int64_t warm_up_retry_us_ = 0;
+    // Version 4 frame numbering, restarted with every session. local_sequence_ is guarded by
+    // channel_mutex_, remote_sequence_ is only used by the receive callback.
+    uint16_t local_sequence_ = 0;
+    uint32_t remote_sequence_ = 0;
+    std::atomic<bool> stream_start_ = false;
+
+    bool Connect();
+    std::unique_ptr<WebSocket> CreateWebsocket();
+    int GetConfiguredVersion();
+    void WarmUpTask();
+    void CancelWarmUp();
+    void ResetWebsocket();
+    void OnBinaryData(const uint8_t* data, size_t len);
+    void OnBatchData(const BinaryProtocol4* header, size_t len);
+    uint32_t ExtendSequence(uint16_t sequence);
+    static size_t HeaderSize(int version);
 
     void ParseServerHello(const cJSON* root);
     bool SendText(const std::string& text) override;
+    bool SendAudioBatch(std::vector<uint8_t>& batch, int frames) override;
     std::string GetHelloMessage();
 };
 
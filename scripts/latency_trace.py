@@ -0,0 +1,154 @@
+#!/usr/bin/env python3
+"""
+提取设备记录的对话延迟时间线 (CONFIG_USE_LATENCY_TRACER)，合并为一个 Chrome trace 文件，
+并打印每轮首音延迟的分解。
+
+输入可以是串口日志（包含 LATENCY_TRACE 开头的行），也可以是 MCP 工具
+self.system.get_latency_trace 返回的 JSON 文件。生成的文件可以用 chrome://tracing 或
+https://ui.perfetto.dev 打开。
+
+    python scripts/latency_trace.py monitor.log -o trace.json
+    python scripts/latency_trace.py --port /dev/ttyUSB0
+"""
+import argparse
+import json
+import statistics
+import sys
+
+PREFIX = "LATENCY_TRACE "
+SEGMENTS = [
+    "wake_to_channel",
+    "channel_to_uplink",
+    "speech_end_to_stt",
+    "stt_to_tts_start",
+    "tts_start_to_downlink",
+    "downlink_to_playback",
+    "time_to_first_audio",
+]
+
+
+def parse_line(line):
+    """串口日志中的一行，不是导出的 trace 时返回 None"""
+    start = line.find(PREFIX)
+    if start < 0:
+        return None
+    text = line[start + len(PREFIX):].strip()
+    # 去掉日志颜色的结束码
+    end = text.rfind("}")
+    try:
+        return json.loads(text[:end + 1])
+    except ValueError:
+        print(f"无法解析的行: {line.strip()[:80]}", file=sys.stderr)
+        return None
+
+
+def load_file(path):
+    with open(path, "r", encoding="utf-8", errors="replace") as f:
+        content = f.read()
+    # MCP 工具的返回值是一个完整的 JSON
+    try:
+        trace = json.loads(content)
+        if isinstance(trace, dict) and "traceEvents" in trace:
+            return [trace]
+    except ValueError:
+        pass
+    return [trace for trace in map(parse_line, content.splitlines()) if trace is not None]
+
+
+class TraceMerger:
+    def __init__(self):
+        self.events = []
+        self.metadata = {}
+        self.turns = {}
+
+    def add(self, trace):
+        for event in trace.get("traceEvents", []):
+            if event.get("ph") == "M":
+                self.metadata[(event.get("pid"), event.get("tid"))] = event
+            else:
+                self.events.append(event)
+        for turn in trace.get("turns", []):
+            # 设备重启后轮次从 1 开始，用开始时间区分
+            self.turns[(turn["start_us"], turn["turn"])] = turn
+
+    def write(self, path):
+        # 同一轮可能被多次导出，重复的事件只保留一个
+        unique = {}
+        for event in self.events:
+            key = (event.get("name"), event.get("ph"), event.get("ts"), event.get("tid"))
+            unique[key] = event
+        events = list(self.metadata.values()) + sorted(unique.values(), key=lambda e: e.get("ts", 0))
+        with open(path, "w", encoding="utf-8") as f:
+            json.dump({"traceEvents": events, "displayTimeUnit": "ms"}, f)
+        print(f"已写入 {len(events)} 个事件到 {path}")
+
+
+def format_turn(turn):
+    segments = turn.get("segments_ms", {})
+    cells = [str(segments[name]) if name in segments else "-" for name in SEGMENTS]
+    return f"{turn['turn']:>5} " + " ".join(f"{cell:>{len(name)}}" for name, cell in zip(SEGMENTS, cells))
+
+
+def print_table(turns):
+    if not turns:
+        print("没有找到任何一轮对话")
+        return
+    print("turn  " + " ".join(SEGMENTS))
+    for turn in turns:
+        print(format_turn(turn))
+    if len(turns) < 2:
+        return
+    # 多轮时汇总中位数和最大值
+    for label, func in (("p50", statistics.median), ("max", max)):
+        cells = []
+        for name in SEGMENTS:
+            values = [turn["segments_ms"][name] for turn in turns if name in turn.get("segments_ms", {})]
+            cells.append(str(int(func(values))) if values else "-")
+        print(f"{label:>5} " + " ".join(f"{cell:>{len(name)}}" for name, cell in zip(SEGMENTS, cells)))
+
+
+def read_serial(port, baudrate, merger, output):
+    try:
+        import serial
+    except ImportError:
+        sys.exit("读取串口需要 pyserial: pip install pyserial")
+    print(f"正在读取 {port}，每轮结束时更新 {output}，按 Ctrl+C 退出")
+    with serial.Serial(port, baudrate, timeout=1) as ser:
+        try:
+            while True:
+                line = ser.readline().decode("utf-8", errors="replace")
+                trace = parse_line(line)
+                if trace is None:
+                    continue
+                merger.add(trace)
+                for turn in trace.get("turns", []):
+                    print(format_turn(turn))
+                merger.write(output)
+        except KeyboardInterrupt:
+            pass
+
+
+def main():
+    parser = argparse.ArgumentParser(description="合并设备导出的对话延迟时间线，打印首音延迟的分解")
+    parser.add_argument("inputs", nargs="*", help="串口日志或 MCP 工具返回的 JSON 文件")
+    parser.add_argument("-o", "--output", default="latency_trace.json", help="输出的 Chrome trace 文件，默认 latency_trace.json")
+    parser.add_argument("-p", "--port", help="直接读取串口，例如 /dev/ttyUSB0")
+    parser.add_argument("-b", "--baudrate", type=int, default=115200, help="串口波特率，默认 115200")
+    args = parser.parse_args()
+
+    merger = TraceMerger()
+    if args.port:
+        read_serial(args.port, args.baudrate, merger, args.output)
+    else:
+        if not args.inputs:
+            parser.error("需要输入文件或 --port")
+        for path in args.inputs:
+            for trace in load_file(path):
+                merger.add(trace)
+        if merger.events:
+            merger.write(args.output)
+    print_table(list(merger.turns.values()))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,149 @@
+#!/usr/bin/env python3
+'''
+  End-to-end latency benchmark of the firmware against the local stand-in server.
+
+  Each iteration runs --trigger-command (e.g. plays the wake word through a speaker next to the device),
+  waits for the session of the device and measures:
+
+  - wake_to_listen:    the trigger command exits -> "listen start" received
+                       (without a trigger command: the device connects -> "listen start")
+  - eos_to_first_tts:  end of speech (server VAD stand-in or "listen stop") -> first TTS frame delivered,
+                       including the injected latency
+  - barge_in:          --barge-in-command exits -> "abort" received, the device side abort latency
+                       (end of the faded audio) is read with the MCP tool self.audio_speaker.get_playback_statistics
+
+  The results are printed and written to --output as JSON, to be compared between firmware builds.
+'''
+import argparse
+import asyncio
+import json
+import statistics
+import time
+
+from stand_in_server import StandInServer, add_arguments, now_ms
+
+
+class SessionWaiter:
+    '''Waits for the events recorded by the sessions of the stand-in server'''
+    def __init__(self, server):
+        self.session = None
+        self.changed = asyncio.Event()
+        server.listeners.append(self.on_event)
+
+    def on_event(self, session, name):
+        if name == 'connect':
+            self.session = session
+        self.changed.set()
+
+    async def wait(self, name, timeout):
+        deadline = time.monotonic() + timeout
+        while self.session is None or name not in self.session.events:
+            remaining = deadline - time.monotonic()
+            if remaining <= 0:
+                return None
+            self.changed.clear()
+            try:
+                await asyncio.wait_for(self.changed.wait(), remaining)
+            except asyncio.TimeoutError:
+                return None
+        return self.session.events[name]
+
+
+async def run_command(command):
+    if not command:
+        return
+    process = await asyncio.create_subprocess_shell(command)
+    await process.wait()
+
+
+def summarize(values):
+    if not values:
+        return None
+    values = sorted(values)
+    return {
+        'count': len(values),
+        'min': round(values[0], 1),
+        'p50': round(statistics.median(values), 1),
+        'p90': round(values[min(len(values) - 1, int(len(values) * 0.9))], 1),
+        'max': round(values[-1], 1),
+        'mean': round(statistics.mean(values), 1),
+    }
+
+
+async def benchmark(args):
+    # Every session ends after its answer, so that each iteration starts from the idle state
+    args.close_after_tts = True
+    server = StandInServer(args)
+    await server.start()
+    waiter = SessionWaiter(server)
+
+    results = {'wake_to_listen': [], 'eos_to_first_tts': [], 'barge_in': [], 'failures': 0}
+    device_playback = None
+    for i in range(args.iterations):
+        print(f'--- Iteration {i + 1}/{args.iterations}')
+        waiter.session = None
+        if args.trigger_command:
+            await run_command(args.trigger_command)
+            reference = now_ms()
+        else:
+            print('Waiting for the device to start a session (wake word or button)...')
+            reference = await waiter.wait('connect', args.timeout_s * 10)
+
+        listen_start = await waiter.wait('listen_start', args.timeout_s)
+        if reference is None or listen_start is None:
+            print('No session started')
+            results['failures'] += 1
+            continue
+        results['wake_to_listen'].append(listen_start - reference)
+        session = waiter.session
+
+        first_tts = await waiter.wait('first_tts_audio', args.timeout_s)
+        if first_tts is None:
+            print('No answer played')
+            results['failures'] += 1
+            continue
+        results['eos_to_first_tts'].append(first_tts - session.events['end_of_speech'])
+
+        if args.barge_in_command:
+            await asyncio.sleep(args.barge_in_after_ms / 1000)
+            await run_command(args.barge_in_command)
+            barge_in = now_ms()
+            abort = await waiter.wait('abort', args.timeout_s)
+            if abort is None:
+                print('The device did not abort')
+                results['failures'] += 1
+            else:
+                results['barge_in'].append(abort - barge_in)
+                device_playback = await session.call_tool('self.audio_speaker.get_playback_statistics') or device_playback
+
+        await waiter.wait('close', args.timeout_s * 2)
+        await asyncio.sleep(args.interval_s)
+
+    report = {
+        'transport': args.transport,
+        'impairment': {'latency_ms': args.latency_ms, 'jitter_ms': args.jitter_ms, 'loss': args.loss,
+                       'loss_burst': args.loss_burst},
+        'iterations': args.iterations,
+        'failures': results['failures'],
+        'wake_to_listen_ms': summarize(results['wake_to_listen']),
+        'eos_to_first_tts_ms': summarize(results['eos_to_first_tts']),
+        'barge_in_ms': summarize(results['barge_in']),
+        'device_playback_statistics': device_playback,
+    }
+    print(json.dumps(report, indent=2, ensure_ascii=False))
+    if args.output:
+        with open(args.output, 'w') as f:
+            json.dump(report, f, indent=2, ensure_ascii=False)
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description='固件端到端延迟测试 (使用本地协议测试服务器)')
+    add_arguments(parser)
+    parser.add_argument('--iterations', type=int, default=10, help='测试次数')
+    parser.add_argument('--trigger-command', help='每次测试开始时执行的命令，例如播放唤醒词音频')
+    parser.add_argument('--barge-in-command', help='收到第一帧 tts 后执行的打断命令')
+    parser.add_argument('--barge-in-after-ms', type=int, default=1000, help='第一帧 tts 之后多久执行打断命令')
+    parser.add_argument('--timeout-s', type=float, default=15, help='每个阶段的超时时间')
+    parser.add_argument('--interval-s', type=float, default=3, help='两次测试之间的间隔')
+    parser.add_argument('--output', help='把结果写入该 JSON 文件')
+    asyncio.run(benchmark(parser.parse_args()))
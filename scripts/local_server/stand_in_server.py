@@ -0,0 +1,743 @@
+#!/usr/bin/env python3
+'''
+  Local stand-in for the chat server, for testing the firmware without the cloud.
+
+  - OTA:       answers the version check with the address of this server (set CONFIG_OTA_URL to http://<ip>:8002/ota/)
+  - WebSocket: binary protocol version 1, 2, 3 and 4 (switched to when the device offers it), including the batches
+  - MQTT+UDP:  a minimal MQTT 3.1.1 broker for one device, the hello hands out the UDP key and nonce, the audio is AES-CTR encrypted
+  - Scripted answers: after the end of speech, sends stt, tts start, the frames of a P3 file (or silence) and tts stop
+  - Network impairments: latency, jitter and loss (loss only applies to the UDP audio), optionally in bursts
+  - Loss protection on UDP: in-band FEC and packet redundancy are accepted as offered in the hello, the
+    redundant copies of the uplink fill the gaps and the downlink packets repeat the previous frame
+
+  Every protocol event of a session is recorded with a monotonic timestamp in milliseconds, see benchmark.py.
+'''
+import argparse
+import asyncio
+import json
+import random
+import secrets
+import socket
+import struct
+import time
+
+import websockets
+from cryptography.hazmat.primitives.ciphers import Cipher, algorithms, modes
+
+
+def now_ms():
+    return time.monotonic() * 1000
+
+
+def local_ip():
+    # The address of the interface that routes to the outside, the device connects to it
+    s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    try:
+        s.connect(('10.255.255.255', 1))
+        return s.getsockname()[0]
+    except OSError:
+        return '127.0.0.1'
+    finally:
+        s.close()
+
+
+def load_p3(filename):
+    # P3: |type 1u|reserved 1u|payload_size 2u|opus payload_size| ..., 16000 Hz, 60 ms frames
+    frames = []
+    with open(filename, 'rb') as f:
+        data = f.read()
+    offset = 0
+    while offset + 4 <= len(data):
+        _, _, size = struct.unpack('>BBH', data[offset:offset + 4])
+        frames.append(data[offset + 4:offset + 4 + size])
+        offset += 4 + size
+    return frames
+
+
+# A packet with a single empty SILK 60 ms frame, the decoder conceals it as silence
+SILENCE_FRAME = bytes([0x58])
+
+
+def split_batch(payload):
+    # Uplink batch: |timestamp 4u|payload_size 2u|opus payload_size| ...
+    frames = []
+    offset = 0
+    while offset + 6 <= len(payload):
+        timestamp, size = struct.unpack('>IH', payload[offset:offset + 6])
+        frames.append((timestamp, payload[offset + 6:offset + 6 + size]))
+        offset += 6 + size
+    return frames
+
+
+def split_redundant(payload):
+    # Redundant packet: |payload_size 2u|opus payload_size|opus of the previous sequence|
+    if len(payload) < 2:
+        return None, None
+    size = struct.unpack('>H', payload[:2])[0]
+    if size > len(payload) - 2:
+        return None, None
+    return payload[2:2 + size], payload[2 + size:]
+
+
+class Impairment:
+    def __init__(self, latency_ms=0, jitter_ms=0, loss=0.0, loss_burst=1):
+        self.latency_ms = latency_ms
+        self.jitter_ms = jitter_ms
+        self.loss = loss
+        self.loss_burst = max(1, loss_burst)
+        self.burst_left = 0
+
+    def delay(self):
+        return max(0.0, self.latency_ms + random.uniform(-self.jitter_ms, self.jitter_ms)) / 1000
+
+    def lost(self):
+        # A loss takes the next loss_burst - 1 packets with it, the average loss rate stays the same
+        if self.burst_left > 0:
+            self.burst_left -= 1
+            return True
+        if random.random() < self.loss / self.loss_burst:
+            self.burst_left = self.loss_burst - 1
+            return True
+        return False
+
+
+class OrderedLink:
+    '''Delays the messages of a stream transport (TCP) by the impairment, without reordering them'''
+    def __init__(self, impairment):
+        self.impairment = impairment
+        self.queue = asyncio.Queue()
+        self.last_due = 0
+        self.task = asyncio.create_task(self.run())
+
+    def put(self, callback):
+        loop = asyncio.get_running_loop()
+        self.last_due = max(loop.time() + self.impairment.delay(), self.last_due)
+        self.queue.put_nowait((self.last_due, callback))
+
+    async def run(self):
+        loop = asyncio.get_running_loop()
+        while True:
+            due, callback = await self.queue.get()
+            if due > loop.time():
+                await asyncio.sleep(due - loop.time())
+            try:
+                result = callback()
+                if asyncio.iscoroutine(result):
+                    await result
+            except (ConnectionError, websockets.ConnectionClosed):
+                pass
+
+    def close(self):
+        self.task.cancel()
+
+
+class Session:
+    '''The transport independent part of a chat session'''
+    def __init__(self, server, transport):
+        self.server = server
+        self.args = server.args
+        self.transport = transport
+        self.session_id = secrets.token_hex(8)
+        self.events = {}
+        self.version = 1
+        self.frame_duration = 60
+        self.batch = None
+        self.listen_mode = None
+        self.heard_ms = 0
+        self.responding = False
+        self.aborted = False
+        self.tts_task = None
+        self.mcp_id = 0
+        self.mcp_calls = {}
+        self.closed = False
+        # Numbered uplink frames (MQTT + UDP, WebSocket version 4)
+        self.uplink_sequences = set()
+        self.uplink_stats = {'packets': 0, 'lost': 0, 'reordered': 0, 'recovered': 0}
+        self.mark('connect')
+
+    def mark(self, name):
+        # Only the first occurrence of an event is recorded
+        if name not in self.events:
+            self.events[name] = now_ms()
+            self.server.notify(self, name)
+
+    def receive_sequence(self, sequence):
+        '''Counts a numbered uplink frame, returns False for a duplicate'''
+        if sequence in self.uplink_sequences:
+            return False
+        if self.uplink_sequences and sequence < max(self.uplink_sequences):
+            self.uplink_stats['reordered'] += 1
+        self.uplink_sequences.add(sequence)
+        self.uplink_stats['packets'] += 1
+        return True
+
+    def hello_reply(self, hello):
+        self.version = hello.get('version', 1)
+        audio_params = hello.get('audio_params', {})
+        self.frame_duration = audio_params.get('frame_duration', 60)
+        reply = {
+            'type': 'hello',
+            'transport': self.transport,
+            'session_id': self.session_id,
+            'audio_params': {'format': 'opus', 'sample_rate': 16000, 'channels': 1, 'frame_duration': 60},
+        }
+        # Batching is accepted as offered
+        if 'batch' in audio_params and not self.args.no_batch:
+            self.batch = audio_params['batch']
+            reply['audio_params']['batch'] = self.batch
+        return reply
+
+    async def on_json(self, message):
+        kind = message.get('type')
+        state = message.get('state')
+        if kind == 'listen':
+            if state == 'detect':
+                self.mark('listen_detect')
+                print(f'[{self.session_id}] wake word: {message.get("text")}')
+            elif state == 'start':
+                self.mark('listen_start')
+                self.listen_mode = message.get('mode')
+                self.heard_ms = 0
+                self.responding = False
+            elif state == 'stop':
+                self.mark('listen_stop')
+                self.end_of_speech()
+        elif kind == 'abort':
+            self.mark('abort')
+            self.aborted = True
+            print(f'[{self.session_id}] abort: {message.get("reason", "none")}')
+        elif kind == 'mcp':
+            payload = message.get('payload', {})
+            future = self.mcp_calls.pop(payload.get('id'), None)
+            if future is not None and not future.done():
+                future.set_result(payload)
+        elif kind == 'goodbye':
+            await self.close()
+        else:
+            print(f'[{self.session_id}] {message}')
+
+    def on_audio(self, timestamp, opus):
+        self.mark('first_audio')
+        self.server.audio_frames += 1
+        if self.listen_mode in ('auto', 'realtime') and not self.responding:
+            # Stands in for the server VAD: the speech ends after --speech-ms of audio
+            self.heard_ms += self.frame_duration
+            if self.heard_ms >= self.args.speech_ms:
+                self.end_of_speech()
+
+    def end_of_speech(self):
+        if self.responding:
+            return
+        self.responding = True
+        self.mark('end_of_speech')
+        self.tts_task = asyncio.create_task(self.respond())
+
+    async def respond(self):
+        args = self.args
+        await self.send_json({'session_id': self.session_id, 'type': 'stt', 'text': args.stt_text})
+        await asyncio.sleep(args.response_delay_ms / 1000)
+        await self.send_json({'session_id': self.session_id, 'type': 'tts', 'state': 'start'})
+        await self.send_json({'session_id': self.session_id, 'type': 'tts', 'state': 'sentence_start', 'text': args.tts_text})
+        self.aborted = False
+        frames = self.server.tts_frames
+        loop = asyncio.get_running_loop()
+        start = loop.time()
+        for i, frame in enumerate(frames):
+            if self.aborted or self.closed:
+                break
+            # Real time pacing, the first frames are sent ahead like a streaming TTS
+            due = start + max(0, i - args.tts_lead_frames) * 0.06
+            if due > loop.time():
+                await asyncio.sleep(due - loop.time())
+            self.send_audio(i * 60, frame, stream_start=i == 0)
+        if self.closed:
+            return
+        await self.send_json({'session_id': self.session_id, 'type': 'tts', 'state': 'stop'})
+        self.mark('tts_stop')
+        if args.close_after_tts:
+            # Let the last frames play out before ending the session
+            await asyncio.sleep(args.tts_lead_frames * 0.06 + 0.5)
+            await self.end_session()
+
+    async def call_tool(self, name, arguments=None, timeout=3.0):
+        '''Calls an MCP tool of the device, returns the decoded JSON text of the result or None'''
+        self.mcp_id += 1
+        future = asyncio.get_running_loop().create_future()
+        self.mcp_calls[self.mcp_id] = future
+        await self.send_json({'session_id': self.session_id, 'type': 'mcp', 'payload': {
+            'jsonrpc': '2.0', 'id': self.mcp_id, 'method': 'tools/call',
+            'params': {'name': name, 'arguments': arguments or {}}}})
+        try:
+            payload = await asyncio.wait_for(future, timeout)
+            return json.loads(payload['result']['content'][0]['text'])
+        except (asyncio.TimeoutError, KeyError, IndexError, ValueError):
+            return None
+
+    async def close(self):
+        if self.closed:
+            return
+        self.closed = True
+        if self.tts_task is not None:
+            self.tts_task.cancel()
+        if self.uplink_sequences:
+            self.uplink_stats['lost'] = max(self.uplink_sequences) - min(self.uplink_sequences) + 1 - len(self.uplink_sequences)
+            print(f'[{self.session_id}] uplink: {self.uplink_stats}')
+        self.mark('close')
+        self.server.session_closed(self)
+
+    # Implemented by the transports
+    async def send_json(self, message):
+        raise NotImplementedError
+
+    def send_audio(self, timestamp, opus, stream_start=False):
+        raise NotImplementedError
+
+    async def end_session(self):
+        raise NotImplementedError
+
+
+class WebsocketSession(Session):
+    def __init__(self, server, ws):
+        super().__init__(server, 'websocket')
+        self.ws = ws
+        self.downlink = OrderedLink(server.impairment)
+        self.uplink = OrderedLink(server.impairment)
+        self.sequence = 0
+        self.uplink_highest = None
+
+    def extend_sequence(self, sequence):
+        # The 16-bit sequence of version 4, extended around the highest one received
+        if self.uplink_highest is None:
+            self.uplink_highest = sequence + 0x10000
+            return self.uplink_highest
+        diff = ((sequence - self.uplink_highest + 0x8000) & 0xFFFF) - 0x8000
+        self.uplink_highest = max(self.uplink_highest, self.uplink_highest + diff)
+        return self.uplink_highest if diff >= 0 else self.uplink_highest + diff
+
+    def hello_reply(self, hello):
+        reply = super().hello_reply(hello)
+        # Version 4 is taken whenever the device offers it, the version of the reply switches to it
+        if 4 in hello.get('supported_versions', []) and not self.args.no_v4:
+            self.version = 4
+            reply['version'] = 4
+        return reply
+
+    async def send_json(self, message):
+        text = json.dumps(message)
+        self.downlink.put(lambda: self.ws.send(text))
+
+    def send_audio(self, timestamp, opus, stream_start=False):
+        if self.version == 4:
+            self.sequence = (self.sequence + 1) & 0xFFFF
+            data = struct.pack('>BBHIH', 0, 1 if stream_start else 0, self.sequence, timestamp, len(opus)) + opus
+        elif self.version == 2:
+            data = struct.pack('>HHIII', 2, 0, 0, timestamp, len(opus)) + opus
+        elif self.version == 3:
+            data = struct.pack('>BBH', 0, 0, len(opus)) + opus
+        else:
+            data = opus
+
+        def send():
+            self.mark('first_tts_audio')
+            return self.ws.send(data)
+        self.downlink.put(send)
+
+    async def end_session(self):
+        await self.ws.close()
+
+    def on_binary(self, data):
+        if self.version == 4:
+            kind, flags, sequence, timestamp, size = struct.unpack('>BBHIH', data[:10])
+            payload = data[10:10 + size]
+            if flags & 1:
+                self.mark('stream_start')
+            frames = split_batch(payload) if kind == 2 else [(timestamp, payload)]
+            for i, (frame_timestamp, opus) in enumerate(frames):
+                # The frames of a batch take the sequences after the one of the header
+                if self.receive_sequence(self.extend_sequence((sequence + i) & 0xFFFF)):
+                    self.on_audio(frame_timestamp, opus)
+            return
+        if self.version == 2:
+            _, kind, _, timestamp, size = struct.unpack('>HHIII', data[:16])
+            payload = data[16:16 + size]
+        elif self.version == 3:
+            kind, _, size = struct.unpack('>BBH', data[:4])
+            payload = data[4:4 + size]
+        else:
+            self.on_audio(0, data)
+            return
+        if kind == 2:
+            for timestamp, opus in split_batch(payload):
+                self.on_audio(timestamp, opus)
+        else:
+            self.on_audio(timestamp if self.version == 2 else 0, payload)
+
+    async def run(self):
+        try:
+            async for data in self.ws:
+                if isinstance(data, bytes):
+                    self.uplink.put(lambda data=data: self.on_binary(data))
+                    continue
+                message = json.loads(data)
+                if message.get('type') == 'hello':
+                    self.mark('hello')
+                    await self.send_json(self.hello_reply(message))
+                else:
+                    self.uplink.put(lambda message=message: self.on_json(message))
+        except websockets.ConnectionClosed:
+            pass
+        finally:
+            self.downlink.close()
+            self.uplink.close()
+            await self.close()
+
+
+class MqttSession(Session):
+    def __init__(self, server, client):
+        super().__init__(server, 'udp')
+        self.client = client
+        self.key = secrets.token_bytes(16)
+        # Bytes 4..7 of the nonce (ssrc) are kept by the device, they identify the session of a datagram
+        self.ssrc = secrets.token_bytes(4)
+        self.nonce = bytes([1, 0, 0, 0]) + self.ssrc + bytes(8)
+        self.udp_address = None
+        self.sequence = 0
+        self.downlink = OrderedLink(server.impairment)
+        self.uplink = OrderedLink(server.impairment)
+        self.fec = {}
+        self.previous_opus = b''
+
+    def hello_reply(self, hello):
+        reply = super().hello_reply(hello)
+        # The loss protection is accepted as offered, the stand-in does not encode, so in-band FEC only
+        # helps the downlink if the P3 file was encoded with it
+        offered = hello.get('audio_params', {}).get('fec', {})
+        self.fec = {
+            'inband': bool(offered.get('inband')) and not self.args.no_fec_inband,
+            'redundancy': bool(offered.get('redundancy')) and not self.args.no_fec_redundancy,
+        }
+        if offered:
+            reply['audio_params']['fec'] = self.fec
+            print(f'[{self.session_id}] fec: {self.fec}')
+        reply['udp'] = {
+            'server': self.server.host_ip,
+            'port': self.args.udp_port,
+            'key': self.key.hex().upper(),
+            'nonce': self.nonce.hex().upper(),
+        }
+        return reply
+
+    def crypt(self, header, data):
+        cipher = Cipher(algorithms.AES(self.key), modes.CTR(header)).encryptor()
+        return cipher.update(data) + cipher.finalize()
+
+    async def send_json(self, message):
+        text = json.dumps(message)
+        self.downlink.put(lambda: self.client.publish(self.args.mqtt_device_topic, text))
+
+    def send_audio(self, timestamp, opus, stream_start=False):
+        if self.udp_address is None:
+            return
+        self.sequence += 1
+        header = bytearray(self.nonce)
+        payload = opus
+        if self.fec.get('redundancy'):
+            header[0] = 3
+            payload = struct.pack('>H', len(opus)) + opus + self.previous_opus
+            self.previous_opus = opus
+        else:
+            header[0] = 1
+        struct.pack_into('>H', header, 2, len(payload))
+        struct.pack_into('>II', header, 8, timestamp, self.sequence)
+        datagram = bytes(header) + self.crypt(bytes(header), payload)
+        if self.server.impairment.lost():
+            return
+
+        def send():
+            self.mark('first_tts_audio')
+            self.server.udp.sendto(datagram, self.udp_address)
+        # UDP may reorder, every datagram gets its own delay
+        asyncio.get_running_loop().call_later(self.server.impairment.delay(), send)
+
+    def on_datagram(self, data, address):
+        self.udp_address = address
+        header, encrypted = data[:16], data[16:]
+        payload = self.crypt(header, encrypted)
+        timestamp, sequence = struct.unpack('>II', header[8:16])
+        if not self.receive_sequence(sequence):
+            return
+        if header[0] == 2:
+            for frame_timestamp, opus in split_batch(payload):
+                self.on_audio(frame_timestamp, opus)
+        elif header[0] == 3:
+            opus, previous = split_redundant(payload)
+            if opus is None:
+                print(f'[{self.session_id}] invalid redundant packet')
+                return
+            # The copy of the previous frame fills the gap if that packet is lost
+            if previous and sequence > 1 and sequence - 1 not in self.uplink_sequences:
+                self.uplink_sequences.add(sequence - 1)
+                self.uplink_stats['recovered'] += 1
+                self.on_audio(timestamp - self.frame_duration, previous)
+            self.on_audio(timestamp, opus)
+        else:
+            self.on_audio(timestamp, payload)
+
+    async def end_session(self):
+        await self.send_json({'session_id': self.session_id, 'type': 'goodbye'})
+        # Closed once the goodbye has gone through the delayed downlink
+        self.downlink.put(self.close)
+
+    async def close(self):
+        self.downlink.close()
+        self.uplink.close()
+        await super().close()
+
+
+class MqttClient(asyncio.Protocol):
+    '''Just enough of MQTT 3.1.1 for the device: CONNECT, PUBLISH (QoS 0/1), SUBSCRIBE, PINGREQ, DISCONNECT'''
+    def __init__(self, server):
+        self.server = server
+        self.buffer = b''
+        self.transport = None
+        self.client_id = None
+        self.session = None
+
+    def connection_made(self, transport):
+        self.transport = transport
+
+    def connection_lost(self, exc):
+        print(f'MQTT client {self.client_id} disconnected')
+        if self.session is not None:
+            asyncio.ensure_future(self.session.close())
+
+    def data_received(self, data):
+        self.buffer += data
+        while True:
+            packet = self.read_packet()
+            if packet is None:
+                return
+            self.handle(*packet)
+
+    def read_packet(self):
+        if len(self.buffer) < 2:
+            return None
+        length, multiplier, offset = 0, 1, 1
+        while True:
+            if offset >= len(self.buffer):
+                return None
+            byte = self.buffer[offset]
+            length += (byte & 0x7F) * multiplier
+            multiplier *= 128
+            offset += 1
+            if not byte & 0x80:
+                break
+        if len(self.buffer) < offset + length:
+            return None
+        header = self.buffer[0]
+        body = self.buffer[offset:offset + length]
+        self.buffer = self.buffer[offset + length:]
+        return header, body
+
+    def send_packet(self, header, body):
+        length = len(body)
+        encoded = bytearray()
+        while True:
+            byte = length % 128
+            length //= 128
+            encoded.append(byte | (0x80 if length > 0 else 0))
+            if length == 0:
+                break
+        self.transport.write(bytes([header]) + bytes(encoded) + body)
+
+    def publish(self, topic, text):
+        topic_bytes = topic.format(client_id=self.client_id).encode()
+        self.send_packet(0x30, struct.pack('>H', len(topic_bytes)) + topic_bytes + text.encode())
+
+    def handle(self, header, body):
+        kind = header >> 4
+        if kind == 1:  # CONNECT
+            name_length = struct.unpack('>H', body[0:2])[0]
+            offset = 2 + name_length + 4  # protocol name, level, flags, keep alive
+            id_length = struct.unpack('>H', body[offset:offset + 2])[0]
+            self.client_id = body[offset + 2:offset + 2 + id_length].decode()
+            print(f'MQTT client {self.client_id} connected')
+            self.send_packet(0x20, b'\x00\x00')
+        elif kind == 3:  # PUBLISH
+            qos = (header >> 1) & 0x03
+            topic_length = struct.unpack('>H', body[0:2])[0]
+            offset = 2 + topic_length
+            if qos > 0:
+                packet_id = body[offset:offset + 2]
+                offset += 2
+                self.send_packet(0x40, packet_id)
+            self.on_message(json.loads(body[offset:]))
+        elif kind == 8:  # SUBSCRIBE
+            self.send_packet(0x90, body[0:2] + b'\x00')
+        elif kind == 12:  # PINGREQ
+            self.send_packet(0xD0, b'')
+        elif kind == 14:  # DISCONNECT
+            self.transport.close()
+
+    def on_message(self, message):
+        if message.get('type') == 'hello':
+            if self.session is not None:
+                asyncio.ensure_future(self.session.close())
+            self.session = MqttSession(self.server, self)
+            self.server.udp_sessions[self.session.ssrc] = self.session
+            self.session.mark('hello')
+            asyncio.ensure_future(self.session.send_json(self.session.hello_reply(message)))
+        elif self.session is not None and not self.session.closed:
+            session = self.session
+            session.uplink.put(lambda: session.on_json(message))
+
+
+class UdpAudio(asyncio.DatagramProtocol):
+    def __init__(self, server):
+        self.server = server
+
+    def datagram_received(self, data, address):
+        if len(data) < 16 or self.server.impairment.lost():
+            return
+        session = self.server.udp_sessions.get(data[4:8])
+        if session is None or session.closed:
+            return
+        asyncio.get_running_loop().call_later(self.server.impairment.delay(), session.on_datagram, data, address)
+
+
+class StandInServer:
+    def __init__(self, args):
+        self.args = args
+        self.host_ip = args.host_ip or local_ip()
+        self.impairment = Impairment(args.latency_ms, args.jitter_ms, args.loss, args.loss_burst)
+        if args.tts_p3:
+            self.tts_frames = load_p3(args.tts_p3)
+        else:
+            self.tts_frames = [SILENCE_FRAME] * max(1, args.tts_ms // 60)
+        self.sessions = []
+        self.udp_sessions = {}
+        self.udp = None
+        self.audio_frames = 0
+        # Called with (session, event name) for every recorded event, see benchmark.py
+        self.listeners = []
+
+    def notify(self, session, name):
+        for listener in self.listeners:
+            listener(session, name)
+
+    def session_closed(self, session):
+        self.sessions.append(session)
+        if self.args.events:
+            with open(self.args.events, 'a') as f:
+                f.write(json.dumps({'session_id': session.session_id, 'transport': session.transport,
+                                    'events': session.events}) + '\n')
+        print(f'[{session.session_id}] closed, events: ' +
+              ', '.join(f'{k} +{v - session.events["connect"]:.0f}ms' for k, v in session.events.items()))
+
+    def ota_response(self):
+        args = self.args
+        response = {
+            'server_time': {'timestamp': int(time.time() * 1000), 'timezone_offset': args.timezone_offset},
+            'firmware': {'version': '0.0.0', 'url': ''},
+        }
+        if args.transport == 'mqtt':
+            response['mqtt'] = {
+                'endpoint': f'{self.host_ip}:{args.mqtt_port}',
+                'client_id': 'stand-in-device',
+                'username': 'stand-in',
+                'password': 'stand-in',
+                'publish_topic': 'device-server',
+            }
+        else:
+            response['websocket'] = {
+                'url': f'ws://{self.host_ip}:{args.ws_port}/',
+                'token': args.token,
+                'version': args.protocol_version,
+            }
+        return json.dumps(response).encode()
+
+    async def handle_http(self, reader, writer):
+        # The OTA check only needs one request and one response per connection
+        try:
+            header = await reader.readuntil(b'\r\n\r\n')
+            length = 0
+            for line in header.decode(errors='ignore').split('\r\n'):
+                if line.lower().startswith('content-length:'):
+                    length = int(line.split(':', 1)[1])
+            if length > 0:
+                await reader.readexactly(length)
+            body = self.ota_response()
+            writer.write(b'HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n' +
+                         f'Content-Length: {len(body)}\r\nConnection: close\r\n\r\n'.encode() + body)
+            await writer.drain()
+        except (asyncio.IncompleteReadError, ConnectionError):
+            pass
+        finally:
+            writer.close()
+
+    async def handle_websocket(self, ws):
+        headers = ws.request.headers
+        token = headers.get('Authorization', '')
+        if self.args.token and token != f'Bearer {self.args.token}':
+            print(f'Rejected websocket with token: {token}')
+            await ws.close(4001, 'unauthorized')
+            return
+        print(f'Websocket from device {headers.get("Device-Id")}, version {headers.get("Protocol-Version")}')
+        session = WebsocketSession(self, ws)
+        await session.run()
+
+    async def start(self):
+        args = self.args
+        loop = asyncio.get_running_loop()
+        await asyncio.start_server(self.handle_http, '0.0.0.0', args.http_port)
+        await websockets.serve(self.handle_websocket, '0.0.0.0', args.ws_port, max_size=None)
+        await loop.create_server(lambda: MqttClient(self), '0.0.0.0', args.mqtt_port)
+        self.udp, _ = await loop.create_datagram_endpoint(lambda: UdpAudio(self), local_addr=('0.0.0.0', args.udp_port))
+        print(f'OTA:       http://{self.host_ip}:{args.http_port}/ota/ (transport: {args.transport})')
+        print(f'WebSocket: ws://{self.host_ip}:{args.ws_port}/')
+        print(f'MQTT:      {self.host_ip}:{args.mqtt_port}, UDP: {args.udp_port}')
+
+
+def add_arguments(parser):
+    parser.add_argument('--transport', choices=['websocket', 'mqtt'], default='websocket', help='OTA 返回的协议')
+    parser.add_argument('--host-ip', help='设备访问本机的地址 (默认: 自动检测)')
+    parser.add_argument('--http-port', type=int, default=8002, help='OTA 端口 (默认: 8002)')
+    parser.add_argument('--ws-port', type=int, default=8000, help='WebSocket 端口 (默认: 8000)')
+    parser.add_argument('--mqtt-port', type=int, default=1883, help='MQTT 端口, 非 8883 时不使用 TLS (默认: 1883)')
+    parser.add_argument('--udp-port', type=int, default=8888, help='UDP 音频端口 (默认: 8888)')
+    parser.add_argument('--mqtt-device-topic', default='devices/p2p/{client_id}', help='下发给设备的主题')
+    parser.add_argument('--token', default='stand-in-token', help='WebSocket 鉴权令牌，为空时不检查')
+    parser.add_argument('--protocol-version', type=int, default=3, choices=[1, 2, 3, 4], help='WebSocket 二进制协议版本')
+    parser.add_argument('--no-v4', action='store_true', help='设备提供版本 4 时不切换')
+    parser.add_argument('--timezone-offset', type=int, default=480, help='时区偏移 (分钟)')
+    parser.add_argument('--no-batch', action='store_true', help='不接受上行批量发送')
+    parser.add_argument('--no-fec-inband', action='store_true', help='不接受 Opus 带内 FEC')
+    parser.add_argument('--no-fec-redundancy', action='store_true', help='不接受冗余包')
+    parser.add_argument('--speech-ms', type=int, default=1500, help='自动模式下收到多少毫秒音频后视为说话结束')
+    parser.add_argument('--response-delay-ms', type=int, default=0, help='stt 与 tts start 之间的延迟')
+    parser.add_argument('--stt-text', default='你好', help='stt 文本')
+    parser.add_argument('--tts-text', default='你好，我是本地测试服务器', help='tts 文本')
+    parser.add_argument('--tts-p3', help='tts 音频 (P3 文件，16000 Hz，60 ms)，默认为静音')
+    parser.add_argument('--tts-ms', type=int, default=3000, help='静音 tts 的时长')
+    parser.add_argument('--tts-lead-frames', type=int, default=5, help='tts 开始时提前发送的帧数')
+    parser.add_argument('--close-after-tts', action='store_true', help='tts 结束后关闭会话')
+    parser.add_argument('--latency-ms', type=int, default=0, help='单向附加延迟')
+    parser.add_argument('--jitter-ms', type=int, default=0, help='延迟抖动 (±)')
+    parser.add_argument('--loss', type=float, default=0.0, help='UDP 音频丢包率 (0-1)')
+    parser.add_argument('--loss-burst', type=int, default=1, help='平均连续丢包个数, 丢包率不变')
+    parser.add_argument('--events', help='把每个会话的事件时间追加写入该 JSON Lines 文件')
+
+
+async def serve_forever(args):
+    server = StandInServer(args)
+    await server.start()
+    await asyncio.Future()
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description='本地协议测试服务器 (OTA + WebSocket + MQTT/UDP)')
+    add_arguments(parser)
+    try:
+        asyncio.run(serve_forever(parser.parse_args()))
+    except KeyboardInterrupt:
+        pass
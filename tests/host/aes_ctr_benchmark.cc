@@ -0,0 +1,126 @@
+/*
+ * Benchmark of the UDP audio encryption of MqttProtocol with the mbedtls software AES: the send
+ * path before, which copied the nonce and allocated the ciphertext for every packet, against the
+ * send path now, which encrypts into a datagram buffer reused across packets. Both must produce
+ * the same datagrams.
+ */
+#include "host_test.h"
+
+#include <mbedtls/aes.h>
+#include <arpa/inet.h>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <cstring>
+
+using Clock = std::chrono::steady_clock;
+
+#define NONCE_SIZE 16
+#define BENCHMARK_PACKETS 200000
+
+// The per-packet path of SendUdpAudio before the change, the datagram is returned
+static std::string EncryptAllocating(mbedtls_aes_context* aes_ctx, const std::string& aes_nonce,
+    uint32_t& local_sequence, uint8_t type, uint32_t timestamp, const uint8_t* data, size_t size) {
+    std::string nonce(aes_nonce);
+    nonce[0] = type;
+    *(uint16_t*)&nonce[2] = htons(size);
+    *(uint32_t*)&nonce[8] = htonl(timestamp);
+    *(uint32_t*)&nonce[12] = htonl(++local_sequence);
+
+    std::string encrypted;
+    encrypted.resize(aes_nonce.size() + size);
+    memcpy(encrypted.data(), nonce.data(), nonce.size());
+
+    size_t nc_off = 0;
+    uint8_t stream_block[16] = {0};
+    if (mbedtls_aes_crypt_ctr(aes_ctx, size, &nc_off, (uint8_t*)nonce.c_str(), stream_block,
+        data, (uint8_t*)&encrypted[nonce.size()]) != 0) {
+        return std::string();
+    }
+    return encrypted;
+}
+
+// The path of SendUdpAudio now, the datagram is left in udp_send_buffer
+static bool EncryptInPlace(mbedtls_aes_context* aes_ctx, const std::string& aes_nonce, std::string& udp_send_buffer,
+    uint32_t& local_sequence, uint8_t type, uint32_t timestamp, const uint8_t* data, size_t size) {
+    udp_send_buffer.resize(aes_nonce.size() + size);
+    auto nonce = (uint8_t*)udp_send_buffer.data();
+    memcpy(nonce, aes_nonce.data(), aes_nonce.size());
+    nonce[0] = type;
+    *(uint16_t*)&nonce[2] = htons(size);
+    *(uint32_t*)&nonce[8] = htonl(timestamp);
+    *(uint32_t*)&nonce[12] = htonl(++local_sequence);
+
+    size_t nc_off = 0;
+    uint8_t stream_block[16] = {0};
+    uint8_t counter[16];
+    memcpy(counter, nonce, sizeof(counter));
+    return mbedtls_aes_crypt_ctr(aes_ctx, size, &nc_off, counter, stream_block, data, nonce + aes_nonce.size()) == 0;
+}
+
+// Opus frames of a 60 ms, 16 kHz voice stream vary between about 40 and 200 bytes
+static std::vector<std::vector<uint8_t>> MakeFrames() {
+    std::vector<std::vector<uint8_t>> frames;
+    uint32_t seed = 1;
+    for (int i = 0; i < 64; i++) {
+        seed = seed * 1103515245 + 12345;
+        std::vector<uint8_t> frame(40 + (seed >> 16) % 160);
+        for (auto& byte : frame) {
+            seed = seed * 1103515245 + 12345;
+            byte = seed >> 24;
+        }
+        frames.push_back(std::move(frame));
+    }
+    return frames;
+}
+
+int main() {
+    mbedtls_aes_context aes_ctx;
+    mbedtls_aes_init(&aes_ctx);
+    const uint8_t key[16] = { 0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c };
+    CHECK(mbedtls_aes_setkey_enc(&aes_ctx, key, 128) == 0);
+    std::string aes_nonce(NONCE_SIZE, '\0');
+    for (int i = 0; i < NONCE_SIZE; i++) {
+        aes_nonce[i] = 0xf0 + i;
+    }
+    auto frames = MakeFrames();
+
+    /* Same datagrams from both paths */
+    uint32_t sequence_allocating = 0;
+    uint32_t sequence_in_place = 0;
+    std::string udp_send_buffer;
+    size_t bytes = 0;
+    for (size_t i = 0; i < frames.size(); i++) {
+        auto& frame = frames[i];
+        auto expected = EncryptAllocating(&aes_ctx, aes_nonce, sequence_allocating, 1, i * 60, frame.data(), frame.size());
+        CHECK(EncryptInPlace(&aes_ctx, aes_nonce, udp_send_buffer, sequence_in_place, 1, i * 60, frame.data(), frame.size()));
+        CHECK(expected.size() == NONCE_SIZE + frame.size());
+        CHECK(expected == udp_send_buffer);
+        bytes += frame.size();
+    }
+
+    /* The sink keeps the compiler from dropping the work */
+    uint32_t sink = 0;
+    auto start = Clock::now();
+    for (int i = 0; i < BENCHMARK_PACKETS; i++) {
+        auto& frame = frames[i % frames.size()];
+        auto datagram = EncryptAllocating(&aes_ctx, aes_nonce, sequence_allocating, 1, i * 60, frame.data(), frame.size());
+        sink += (uint8_t)datagram.back();
+    }
+    auto allocating_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+
+    start = Clock::now();
+    for (int i = 0; i < BENCHMARK_PACKETS; i++) {
+        auto& frame = frames[i % frames.size()];
+        CHECK(EncryptInPlace(&aes_ctx, aes_nonce, udp_send_buffer, sequence_in_place, 1, i * 60, frame.data(), frame.size()));
+        sink += (uint8_t)udp_send_buffer.back();
+    }
+    auto in_place_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+    mbedtls_aes_free(&aes_ctx);
+
+    printf("AES-CTR send path, %d packets of %u bytes on average (sink %u):\n", BENCHMARK_PACKETS,
+        (unsigned)(bytes / frames.size()), (unsigned)sink);
+    printf("  per-packet allocation: %lld ns/packet\n", (long long)(allocating_ns / BENCHMARK_PACKETS));
+    printf("  reused buffer:         %lld ns/packet\n", (long long)(in_place_ns / BENCHMARK_PACKETS));
+    return 0;
+}
@@ -0,0 +1,207 @@
+/*
+ * Benchmark of the WebSocket audio framing of protocol versions 2 and 3, per second of 60 ms Opus
+ * uplink: the send path before, which allocated a string per packet and copied the Opus data
+ * behind the header, against the send path now, which writes the header into the headroom the
+ * audio service leaves in front of the Opus data. The receive path copies the Opus data into a
+ * pooled packet once, before and after, and is counted for the total. Both send paths must hand
+ * the same frames to the transport.
+ */
+#include "protocol.h"
+#include "host_test.h"
+
+#include <arpa/inet.h>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <string>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+#define FRAME_DURATION_MS 60
+#define FRAMES_PER_SECOND ((1000 + FRAME_DURATION_MS - 1) / FRAME_DURATION_MS)
+#define BENCHMARK_SECONDS 20000
+
+struct CopyCounter {
+    size_t bytes = 0;
+    size_t allocations = 0;
+};
+
+// Stands for websocket_->Send, the same in both paths. It reads a few bytes only, so the time is that of the framing
+static uint32_t Send(const void* data, size_t size) {
+    auto bytes = (const uint8_t*)data;
+    return bytes[0] + bytes[size / 2] + bytes[size - 1] + size;
+}
+
+// SendAudio before the change
+static uint32_t SendSerialized(int version, const AudioStreamPacket& packet, CopyCounter& counter, std::string* sent = nullptr) {
+    std::string serialized;
+    if (version == 2) {
+        serialized.resize(sizeof(BinaryProtocol2) + packet.payload.size());
+        auto bp2 = (BinaryProtocol2*)serialized.data();
+        bp2->version = htons(version);
+        bp2->type = 0;
+        bp2->reserved = 0;
+        bp2->timestamp = htonl(packet.timestamp);
+        bp2->payload_size = htonl(packet.payload.size());
+        memcpy(bp2->payload, packet.payload.data(), packet.payload.size());
+    } else {
+        serialized.resize(sizeof(BinaryProtocol3) + packet.payload.size());
+        auto bp3 = (BinaryProtocol3*)serialized.data();
+        bp3->type = 0;
+        bp3->reserved = 0;
+        bp3->payload_size = htons(packet.payload.size());
+        memcpy(bp3->payload, packet.payload.data(), packet.payload.size());
+    }
+    counter.bytes += packet.payload.size();
+    counter.allocations++;
+    if (sent != nullptr) {
+        *sent = serialized;
+    }
+    return Send(serialized.data(), serialized.size());
+}
+
+// SendAudio now, the packet comes from the encoder with AUDIO_PACKET_HEADROOM in front of the Opus data
+static uint32_t SendInPlace(int version, AudioStreamPacket& packet, CopyCounter& counter, std::string* sent = nullptr) {
+    size_t header_size = version == 2 ? sizeof(BinaryProtocol2) : sizeof(BinaryProtocol3);
+    if (packet.headroom < header_size) {
+        packet.payload.insert(packet.payload.begin(), header_size - packet.headroom, 0);
+        packet.headroom = header_size;
+        counter.bytes += packet.opus_size();
+    }
+    uint8_t* header = packet.opus_data() - header_size;
+    if (version == 2) {
+        auto bp2 = (BinaryProtocol2*)header;
+        bp2->version = htons(version);
+        bp2->type = 0;
+        bp2->reserved = 0;
+        bp2->timestamp = htonl(packet.timestamp);
+        bp2->payload_size = htonl(packet.opus_size());
+    } else {
+        auto bp3 = (BinaryProtocol3*)header;
+        bp3->type = 0;
+        bp3->reserved = 0;
+        bp3->payload_size = htons(packet.opus_size());
+    }
+    if (sent != nullptr) {
+        sent->assign((const char*)header, header_size + packet.opus_size());
+    }
+    return Send(header, header_size + packet.opus_size());
+}
+
+// The receive callback, before and after: the Opus data is copied into a pooled packet
+static uint32_t Receive(int version, const std::string& frame, AudioStreamPacket& packet, CopyCounter& counter) {
+    size_t header_size = version == 2 ? sizeof(BinaryProtocol2) : sizeof(BinaryProtocol3);
+    auto payload = (const uint8_t*)frame.data() + header_size;
+    size_t payload_size = frame.size() - header_size;
+    if (version == 2) {
+        auto bp2 = (const BinaryProtocol2*)frame.data();
+        packet.timestamp = ntohl(bp2->timestamp);
+        payload_size = std::min<size_t>(ntohl(bp2->payload_size), payload_size);
+    } else {
+        auto bp3 = (const BinaryProtocol3*)frame.data();
+        payload_size = std::min<size_t>(ntohs(bp3->payload_size), payload_size);
+    }
+    packet.payload.assign(payload, payload + payload_size);
+    counter.bytes += payload_size;
+    return packet.payload.size();
+}
+
+// One second of Opus frames of a 16 kHz voice stream, between about 40 and 200 bytes
+static std::vector<std::vector<uint8_t>> MakeFrames() {
+    std::vector<std::vector<uint8_t>> frames;
+    uint32_t seed = 1;
+    for (int i = 0; i < FRAMES_PER_SECOND; i++) {
+        seed = seed * 1103515245 + 12345;
+        std::vector<uint8_t> frame(40 + (seed >> 16) % 160);
+        for (auto& byte : frame) {
+            seed = seed * 1103515245 + 12345;
+            byte = seed >> 24;
+        }
+        frames.push_back(std::move(frame));
+    }
+    return frames;
+}
+
+// The packets of the pool, as the encoder fills them: without headroom before, with it now
+static std::vector<AudioStreamPacket> MakePackets(const std::vector<std::vector<uint8_t>>& frames, size_t headroom) {
+    std::vector<AudioStreamPacket> packets(frames.size());
+    for (size_t i = 0; i < frames.size(); i++) {
+        auto& packet = packets[i];
+        packet.timestamp = i * FRAME_DURATION_MS;
+        packet.headroom = headroom;
+        packet.payload.assign(headroom, 0);
+        packet.payload.insert(packet.payload.end(), frames[i].begin(), frames[i].end());
+    }
+    return packets;
+}
+
+int main() {
+    auto frames = MakeFrames();
+    size_t opus_bytes = 0;
+    for (auto& frame : frames) {
+        opus_bytes += frame.size();
+    }
+    auto old_packets = MakePackets(frames, 0);
+    auto new_packets = MakePackets(frames, AUDIO_PACKET_HEADROOM);
+
+    for (int version = 2; version <= 3; version++) {
+        /* Same frames from both paths, and back to the same Opus data */
+        CopyCounter check;
+        std::string expected, sent;
+        AudioStreamPacket received;
+        for (size_t i = 0; i < frames.size(); i++) {
+            SendSerialized(version, old_packets[i], check, &expected);
+            SendInPlace(version, new_packets[i], check, &sent);
+            CHECK(expected == sent);
+            Receive(version, sent, received, check);
+            CHECK(received.payload == frames[i]);
+        }
+        std::vector<std::string> downlink;
+        for (auto& packet : old_packets) {
+            SendSerialized(version, packet, check, &sent);
+            downlink.push_back(sent);
+        }
+
+        /* The sink keeps the compiler from dropping the work */
+        uint32_t sink = 0;
+        CopyCounter serialized;
+        auto start = Clock::now();
+        for (int second = 0; second < BENCHMARK_SECONDS; second++) {
+            for (auto& packet : old_packets) {
+                sink += SendSerialized(version, packet, serialized);
+            }
+        }
+        auto serialized_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+
+        CopyCounter in_place;
+        start = Clock::now();
+        for (int second = 0; second < BENCHMARK_SECONDS; second++) {
+            for (auto& packet : new_packets) {
+                sink += SendInPlace(version, packet, in_place);
+            }
+        }
+        auto in_place_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+
+        CopyCounter receive;
+        start = Clock::now();
+        for (int second = 0; second < BENCHMARK_SECONDS; second++) {
+            for (auto& frame : downlink) {
+                sink += Receive(version, frame, received, receive);
+            }
+        }
+        auto receive_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+
+        printf("Protocol version %d, %d frames of %u bytes on average per second of audio (sink %u):\n", version,
+            FRAMES_PER_SECOND, (unsigned)(opus_bytes / frames.size()), (unsigned)sink);
+        printf("  send, serialized: %5u bytes copied, %2u allocations, %lld ns per second of audio\n",
+            (unsigned)(serialized.bytes / BENCHMARK_SECONDS), (unsigned)(serialized.allocations / BENCHMARK_SECONDS),
+            (long long)(serialized_ns / BENCHMARK_SECONDS));
+        printf("  send, in place:   %5u bytes copied, %2u allocations, %lld ns per second of audio\n",
+            (unsigned)(in_place.bytes / BENCHMARK_SECONDS), (unsigned)(in_place.allocations / BENCHMARK_SECONDS),
+            (long long)(in_place_ns / BENCHMARK_SECONDS));
+        printf("  receive:          %5u bytes copied, %lld ns per second of audio\n",
+            (unsigned)(receive.bytes / BENCHMARK_SECONDS), (long long)(receive_ns / BENCHMARK_SECONDS));
+    }
+    return 0;
+}
@@ -0,0 +1,138 @@
+/*
+ * Stress test of AudioQueue: one producer, one consumer and a third task that calls Clear() and
+ * SetLimit() at random. Every item must reach the consumer exactly once, in push order, either
+ * from Pop() or, when flushed, through the OnDrop() callback.
+ */
+#include "audio_queue.h"
+#include "host_test.h"
+
+#include <thread>
+#include <random>
+#include <vector>
+#include <atomic>
+
+#define EVENT_NOT_EMPTY (1 << 0)
+#define EVENT_NOT_FULL (1 << 1)
+#define EVENT_STOPPED (1 << 2)
+
+static void TestOrderAndLoss(uint32_t items, size_t capacity, bool clear) {
+    auto event_group = xEventGroupCreate();
+    AudioQueue<std::unique_ptr<uint32_t>> queue(capacity, event_group, EVENT_NOT_EMPTY, EVENT_NOT_FULL);
+
+    // Written by the consumer only, Pop() calls OnDrop() from the consumer
+    std::vector<uint32_t> received;
+    std::vector<uint32_t> seen;
+    received.reserve(items);
+    seen.reserve(items);
+    queue.OnDrop([&seen](std::unique_ptr<uint32_t>&& item) {
+        seen.push_back(*item);
+    });
+
+    std::thread producer([&]() {
+        for (uint32_t i = 0; i < items; i++) {
+            auto item = std::make_unique<uint32_t>(i);
+            while (!queue.Push(std::move(item))) {
+                CHECK(item != nullptr);
+                queue.WaitNotFull(0, pdMS_TO_TICKS(10));
+            }
+        }
+    });
+
+    std::atomic<bool> done = false;
+    std::thread clearer([&]() {
+        std::mt19937 random(1);
+        while (!done) {
+            if (clear && random() % 4 == 0) {
+                queue.Clear();
+            }
+            if (random() % 8 == 0) {
+                queue.SetLimit(1 + random() % capacity);
+            }
+            CHECK(queue.Size() <= queue.capacity());
+            std::this_thread::yield();
+        }
+        queue.SetLimit(capacity);
+    });
+
+    std::thread consumer([&]() {
+        std::unique_ptr<uint32_t> item;
+        while (seen.size() < items) {
+            if (queue.Pop(item)) {
+                CHECK(item != nullptr);
+                received.push_back(*item);
+                seen.push_back(*item);
+            } else {
+                queue.WaitNotEmpty(0, pdMS_TO_TICKS(10));
+            }
+        }
+    });
+
+    producer.join();
+    consumer.join();
+    done = true;
+    clearer.join();
+
+    /* Received and flushed together are every item once, in push order */
+    CHECK(seen.size() == items);
+    for (uint32_t i = 0; i < items; i++) {
+        CHECK(seen[i] == i);
+    }
+    for (size_t i = 1; i < received.size(); i++) {
+        CHECK(received[i - 1] < received[i]);
+    }
+    CHECK(queue.Empty());
+    CHECK(queue.Size() == 0);
+    if (!clear) {
+        CHECK(received.size() == items);
+    }
+    printf("capacity %zu, clear %s: %zu received, %zu flushed\n", capacity, clear ? "yes" : "no",
+        received.size(), seen.size() - received.size());
+    vEventGroupDelete(event_group);
+}
+
+// A Clear() flushes what was pushed before it and nothing pushed after it
+static void TestClearMark() {
+    auto event_group = xEventGroupCreate();
+    AudioQueue<int> queue(4, event_group, EVENT_NOT_EMPTY, EVENT_NOT_FULL);
+    std::vector<int> dropped;
+    queue.OnDrop([&dropped](int&& item) {
+        dropped.push_back(item);
+    });
+
+    CHECK(queue.Push(1));
+    CHECK(queue.Push(2));
+    queue.Clear();
+    CHECK(queue.Size() == 0);
+    CHECK(!queue.Empty());
+    CHECK(queue.Push(3));
+    CHECK(queue.Size() == 1);
+
+    int item = 0;
+    CHECK(queue.Pop(item));
+    CHECK(item == 3);
+    CHECK(dropped == std::vector<int>({ 1, 2 }));
+    CHECK(!queue.Pop(item));
+
+    /* Limits and wrap around of the slots */
+    queue.SetLimit(2);
+    CHECK(queue.Push(4));
+    CHECK(queue.Push(5));
+    CHECK(queue.Full());
+    CHECK(!queue.Push(6));
+    for (int i = 0; i < 100; i++) {
+        CHECK(queue.Pop(item));
+        CHECK(queue.Push(i + 100));
+    }
+    CHECK(queue.Size() == 2);
+    vEventGroupDelete(event_group);
+}
+
+int main() {
+    TestClearMark();
+    TestOrderAndLoss(200000, 8, false);
+    TestOrderAndLoss(200000, 8, true);
+    TestOrderAndLoss(200000, 1, true);
+    TestOrderAndLoss(200000, 120, true);
+    printf("audio_queue_test passed\n");
+    return 0;
+}
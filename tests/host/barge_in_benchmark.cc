@@ -0,0 +1,147 @@
+/*
+ * Measurement of the barge-in latency, from the abort to silence at the speaker, with a codec
+ * stand-in that plays at the output sample rate through a DMA ring of the size the I2S driver
+ * gets. Time is simulated in samples, so the result does not depend on the host. Before, the
+ * output task wrote whole decoded frames and only stopped when the tts stop of the server changed
+ * the state and ResetDecoder() cleared the queues. Now AbortPlayback() clears them at once, and
+ * the output task, which writes in chunks, fades the rest of its frame out. The abort_latency the
+ * device reports must not be below the simulated one.
+ */
+#include "pcm_kernels.h"
+#include "host_test.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+// As in audio_codec.h and audio_service.h
+#define AUDIO_CODEC_DMA_DESC_NUM 6
+#define AUDIO_CODEC_DMA_FRAME_NUM 240
+#define PLAYBACK_CHUNK_DURATION_MS 20
+#define PLAYBACK_FADE_OUT_DURATION_MS 10
+
+#define OUTPUT_SAMPLE_RATE 24000
+#define FRAME_DURATION_MS 60
+// More than the decode and playback queues hold, the server keeps sending until it sees the abort
+#define STREAM_FRAMES 200
+// From the abort message to the tts stop of the server, which ended the playback before
+#define SERVER_STOP_DELAY_MS 300
+#define ABORTS 1000
+
+#define SAMPLES_TO_MS(samples) ((double)(samples) * 1000 / OUTPUT_SAMPLE_RATE)
+
+// Plays the samples at the output sample rate, a write waits while the DMA ring is full as i2s_channel_write does
+class FakeCodec {
+public:
+    void OutputData(const int16_t* data, size_t samples) {
+        int64_t capacity = AUDIO_CODEC_DMA_DESC_NUM * AUDIO_CODEC_DMA_FRAME_NUM;
+        int64_t queued = std::max<int64_t>(speaker_end_ - now_, 0);
+        if (queued + (int64_t)samples > capacity) {
+            now_ += queued + samples - capacity;
+        }
+        speaker_end_ = std::max(speaker_end_, now_) + samples;
+        /* The speaker is silent after the last sample that is not */
+        size_t audible = samples;
+        while (audible > 0 && data[audible - 1] == 0) {
+            audible--;
+        }
+        if (audible > 0) {
+            sound_end_ = speaker_end_ - (samples - audible);
+        }
+    }
+
+    int64_t now() const { return now_; }
+    int64_t sound_end() const { return sound_end_; }
+
+private:
+    int64_t now_ = 0;
+    int64_t speaker_end_ = 0;
+    int64_t sound_end_ = 0;
+};
+
+// The output task before the change, the latency in samples is returned
+static int64_t PlayBefore(const std::vector<int16_t>& frame, int64_t abort_at) {
+    FakeCodec codec;
+    int64_t reset_at = abort_at + SERVER_STOP_DELAY_MS * OUTPUT_SAMPLE_RATE / 1000;
+    for (int i = 0; i < STREAM_FRAMES; i++) {
+        if (codec.now() >= reset_at) {
+            /* ResetDecoder() cleared the queues */
+            break;
+        }
+        codec.OutputData(frame.data(), frame.size());
+    }
+    return codec.sound_end() - abort_at;
+}
+
+// The output task now, the latency reported as abort_latency is set if the frame was faded out
+static int64_t PlayNow(const std::vector<int16_t>& frame, int64_t abort_at, int64_t& reported) {
+    FakeCodec codec;
+    size_t chunk_samples = PLAYBACK_CHUNK_DURATION_MS * OUTPUT_SAMPLE_RATE / 1000;
+    std::vector<int16_t> faded;
+    reported = -1;
+    for (int i = 0; i < STREAM_FRAMES; i++) {
+        if (codec.now() >= abort_at) {
+            /* The queues were cleared, there is no next frame */
+            break;
+        }
+        for (size_t offset = 0; offset < frame.size(); offset += chunk_samples) {
+            if (offset > 0 && codec.now() >= abort_at) {
+                faded.resize(std::min<size_t>(frame.size() - offset, PLAYBACK_FADE_OUT_DURATION_MS * OUTPUT_SAMPLE_RATE / 1000));
+                PcmFadeOut(frame.data() + offset, faded.data(), faded.size());
+                codec.OutputData(faded.data(), faded.size());
+                reported = codec.now() - abort_at + AUDIO_CODEC_DMA_DESC_NUM * AUDIO_CODEC_DMA_FRAME_NUM;
+                return codec.sound_end() - abort_at;
+            }
+            codec.OutputData(frame.data() + offset, std::min(chunk_samples, frame.size() - offset));
+        }
+    }
+    return codec.sound_end() - abort_at;
+}
+
+struct Latency {
+    int64_t total = 0;
+    int64_t max = 0;
+    int count = 0;
+
+    void Add(int64_t samples) {
+        total += samples;
+        max = std::max(max, samples);
+        count++;
+    }
+    double average_ms() const { return count > 0 ? SAMPLES_TO_MS(total) / count : 0; }
+    double max_ms() const { return SAMPLES_TO_MS(max); }
+};
+
+int main() {
+    /* A 440 Hz tone above zero, so only the end of the audio is silent */
+    std::vector<int16_t> frame(FRAME_DURATION_MS * OUTPUT_SAMPLE_RATE / 1000);
+    for (size_t i = 0; i < frame.size(); i++) {
+        frame[i] = (int16_t)(8000 + 4000 * sin(2 * M_PI * 440 * i / OUTPUT_SAMPLE_RATE));
+    }
+
+    Latency before, now, reported;
+    int between_frames = 0;
+    for (int i = 0; i < ABORTS; i++) {
+        /* Spread over 3 s of speaking, after the DMA ring is full */
+        int64_t abort_at = OUTPUT_SAMPLE_RATE + (int64_t)i * 7919 % (3 * OUTPUT_SAMPLE_RATE);
+        before.Add(PlayBefore(frame, abort_at));
+        int64_t reported_latency;
+        int64_t latency = PlayNow(frame, abort_at, reported_latency);
+        now.Add(latency);
+        if (reported_latency < 0) {
+            between_frames++;
+        } else {
+            CHECK(reported_latency >= latency);
+            reported.Add(reported_latency);
+        }
+    }
+
+    printf("Abort to silence, %d aborts while speaking %d ms frames at %d Hz, %d ms DMA ring:\n", ABORTS,
+        FRAME_DURATION_MS, OUTPUT_SAMPLE_RATE, AUDIO_CODEC_DMA_DESC_NUM * AUDIO_CODEC_DMA_FRAME_NUM * 1000 / OUTPUT_SAMPLE_RATE);
+    printf("  before, until the tts stop %d ms later: avg %.1f ms, max %.1f ms\n", SERVER_STOP_DELAY_MS,
+        before.average_ms(), before.max_ms());
+    printf("  now, flushed and faded out:             avg %.1f ms, max %.1f ms\n", now.average_ms(), now.max_ms());
+    printf("  now, as abort_latency reports it:       avg %.1f ms, max %.1f ms (%d aborts between frames not reported)\n",
+        reported.average_ms(), reported.max_ms(), between_frames);
+    return 0;
+}
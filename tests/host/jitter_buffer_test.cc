@@ -0,0 +1,301 @@
+/*
+ * Replays downlink packet traces through JitterBuffer with reordering, loss, duplicates, delay
+ * spikes and a sequence wrap. The replay drains the buffer like AudioService does: every 20 ms,
+ * into a decode queue that holds a few frames, and a lost frame is rebuilt from the in-band FEC
+ * data of the next packet when it is buffered, or concealed otherwise.
+ */
+#include "jitter_buffer.h"
+#include "host_test.h"
+
+#include <vector>
+#include <algorithm>
+
+#define FRAME_DURATION_MS 60
+#define CHECK_INTERVAL_MS 20
+#define DECODE_QUEUE_MS (3 * FRAME_DURATION_MS)
+// The values of AudioService
+#define CAPACITY 60
+#define MIN_DELAY_MS 20
+#define MAX_DELAY_MS 600
+
+struct Arrival {
+    uint32_t sequence;
+    int64_t time_ms;
+    bool redundant = false;
+};
+
+struct Output {
+    enum Kind { kPacket, kFec, kPlc } kind;
+    uint32_t sequence;
+};
+
+class Replay {
+public:
+    Replay() : buffer_(CAPACITY, MIN_DELAY_MS, MAX_DELAY_MS) {
+        buffer_.OnDrop([this](std::unique_ptr<AudioStreamPacket>&& packet) {
+            dropped_.push_back(packet->sequence);
+        });
+    }
+
+    // Replays the arrivals until end_ms, the outputs and the drops are kept across calls
+    void Run(std::vector<Arrival> arrivals, int64_t end_ms) {
+        std::stable_sort(arrivals.begin(), arrivals.end(), [](const Arrival& a, const Arrival& b) {
+            return a.time_ms < b.time_ms;
+        });
+        size_t next = 0;
+        for (; now_ms_ <= end_ms; now_ms_ += CHECK_INTERVAL_MS) {
+            for (; next < arrivals.size() && arrivals[next].time_ms <= now_ms_; next++) {
+                auto packet = std::make_unique<AudioStreamPacket>();
+                packet->sequence = arrivals[next].sequence;
+                packet->redundant = arrivals[next].redundant;
+                packet->sample_rate = 16000;
+                packet->frame_duration = FRAME_DURATION_MS;
+                packet->payload.assign(4, (uint8_t)packet->sequence);
+                buffer_.Put(std::move(packet), now_ms_);
+            }
+            Drain();
+        }
+    }
+
+    JitterBuffer& buffer() { return buffer_; }
+    const std::vector<Output>& outputs() const { return outputs_; }
+    const std::vector<uint32_t>& dropped() const { return dropped_; }
+
+private:
+    JitterBuffer buffer_;
+    int64_t now_ms_ = 0;
+    int64_t played_until_ms_ = 0;
+    std::vector<Output> outputs_;
+    std::vector<uint32_t> dropped_;
+
+    void Drain() {
+        while (played_until_ms_ - now_ms_ < DECODE_QUEUE_MS) {
+            std::unique_ptr<AudioStreamPacket> packet;
+            auto result = buffer_.Get(now_ms_, packet);
+            if (result == JitterBuffer::kNone) {
+                break;
+            }
+            if (result == JitterBuffer::kPacket) {
+                outputs_.push_back({ Output::kPacket, packet->sequence });
+            } else {
+                /* The lost frame is the one before the packet Get() returns next */
+                uint32_t sequence = outputs_.empty() ? 0 : outputs_.back().sequence + 1;
+                auto next = buffer_.Peek();
+                if (next != nullptr) {
+                    CHECK(next->sequence == sequence + 1);
+                    outputs_.push_back({ Output::kFec, sequence });
+                } else {
+                    outputs_.push_back({ Output::kPlc, sequence });
+                }
+            }
+            played_until_ms_ = std::max(played_until_ms_, now_ms_) + FRAME_DURATION_MS;
+        }
+    }
+};
+
+// Packets sent every frame from first, each delayed by the network by delay(sequence)
+template <typename Delay>
+static std::vector<Arrival> MakeTrace(uint32_t first, int count, int64_t start_ms, Delay delay) {
+    std::vector<Arrival> arrivals;
+    for (int i = 0; i < count; i++) {
+        uint32_t sequence = first + i;
+        arrivals.push_back({ sequence, start_ms + i * FRAME_DURATION_MS + delay(i) });
+    }
+    return arrivals;
+}
+
+static void CheckInOrder(const std::vector<Output>& outputs, uint32_t first, size_t count) {
+    CHECK(outputs.size() == count);
+    for (size_t i = 0; i < count; i++) {
+        CHECK(outputs[i].sequence == first + i);
+    }
+}
+
+// Network delay of a packet: every fourth one is overtaken by the next
+static int ReorderingDelay(int i) {
+    return (i % 4 == 0) ? FRAME_DURATION_MS + 10 : 0;
+}
+
+static void TestReordering() {
+    Replay replay;
+    /* The first stream starts without a jitter estimate, the late packets of it are dropped */
+    replay.Run(MakeTrace(100, 50, 0, ReorderingDelay), 50 * FRAME_DURATION_MS + 1000);
+    auto first = replay.buffer().statistics();
+    CHECK(first.received == 50);
+    CHECK(first.late > 0);
+    CHECK(first.late + replay.outputs().size() == 50 + first.concealed);
+    CHECK(first.target_delay_ms > FRAME_DURATION_MS * 2);
+    CHECK(first.rebuffered >= 1);
+
+    /* The next stream pre-buffers for the measured jitter and plays every packet in order */
+    size_t played = replay.outputs().size();
+    int64_t start_ms = 50 * FRAME_DURATION_MS + 1000;
+    replay.Run(MakeTrace(150, 50, start_ms, ReorderingDelay), start_ms + 50 * FRAME_DURATION_MS + 1000);
+    std::vector<Output> second(replay.outputs().begin() + played, replay.outputs().end());
+    CheckInOrder(second, 150, 50);
+    for (auto& output : second) {
+        CHECK(output.kind == Output::kPacket);
+    }
+    auto statistics = replay.buffer().statistics();
+    CHECK(statistics.received == 100);
+    CHECK(statistics.late == first.late);
+    CHECK(statistics.concealed == first.concealed);
+    CHECK(statistics.reordered > first.reordered);
+}
+
+static int KindOf(const std::vector<Output>& outputs, uint32_t sequence) {
+    for (auto& output : outputs) {
+        if (output.sequence == sequence) {
+            return output.kind;
+        }
+    }
+    return -1;
+}
+
+static void TestLossGivesFecOrPlc() {
+    Replay replay;
+    /* The server sends faster than realtime, the packets after a gap are buffered when it is played */
+    std::vector<Arrival> arrivals;
+    for (uint32_t sequence = 0; sequence < 60; sequence++) {
+        /* 10 lost alone: its FEC data is in 11. 20 and 21: 20 is concealed, 21 is rebuilt from 22.
+           40 to 45: three frames are concealed, the rest of the gap is skipped. */
+        if (sequence == 10 || sequence == 20 || sequence == 21 || (sequence >= 40 && sequence <= 45)) {
+            continue;
+        }
+        arrivals.push_back({ sequence, (int64_t)sequence * FRAME_DURATION_MS / 2 });
+    }
+    replay.Run(arrivals, 6000);
+
+    auto& outputs = replay.outputs();
+    CHECK(KindOf(outputs, 10) == Output::kFec);
+    CHECK(KindOf(outputs, 20) == Output::kPlc);
+    CHECK(KindOf(outputs, 21) == Output::kFec);
+    CHECK(KindOf(outputs, 40) == Output::kPlc);
+    CHECK(KindOf(outputs, 41) == Output::kPlc);
+    CHECK(KindOf(outputs, 42) == Output::kPlc);
+    CHECK(KindOf(outputs, 43) == -1);
+    CHECK(KindOf(outputs, 44) == -1);
+    CHECK(KindOf(outputs, 45) == -1);
+
+    /* Everything else is played in order */
+    CHECK(outputs.size() == 57);
+    for (size_t i = 1; i < outputs.size(); i++) {
+        CHECK(outputs[i].sequence > outputs[i - 1].sequence);
+        CHECK(outputs[i].kind != Output::kPacket || outputs[i].sequence == outputs[i - 1].sequence + 1 ||
+            outputs[i].sequence == 46);
+    }
+    auto statistics = replay.buffer().statistics();
+    CHECK(statistics.concealed == 6);
+    CHECK(statistics.skipped == 3);
+    CHECK(statistics.rebuffered == 1);
+}
+
+// In realtime a gap longer than the buffered audio ends the stream, the next packet starts a new one
+static void TestLongGapRestarts() {
+    Replay replay;
+    auto arrivals = MakeTrace(0, 30, 0, [](int) { return 0; });
+    arrivals.erase(arrivals.begin() + 10, arrivals.begin() + 18);
+    replay.Run(arrivals, 3000);
+
+    auto& outputs = replay.outputs();
+    CHECK(KindOf(outputs, 9) == Output::kPacket);
+    CHECK(KindOf(outputs, 18) == Output::kPacket);
+    for (uint32_t sequence = 10; sequence < 18; sequence++) {
+        CHECK(KindOf(outputs, sequence) != Output::kPacket);
+    }
+    CHECK(replay.buffer().statistics().rebuffered >= 2);
+    CHECK(outputs.back().sequence == 29);
+}
+
+static void TestDuplicatesAndRedundancy() {
+    Replay replay;
+    /* Sent faster than realtime, so the packets wait in the buffer */
+    std::vector<Arrival> arrivals;
+    for (uint32_t sequence = 0; sequence < 30; sequence++) {
+        if (sequence != 12) {
+            arrivals.push_back({ sequence, (int64_t)sequence * FRAME_DURATION_MS / 2 });
+        }
+    }
+    /* A duplicate of a packet still buffered, and one of a packet already played */
+    arrivals.push_back({ 5, 5 * FRAME_DURATION_MS / 2 + 10 });
+    arrivals.push_back({ 2, 25 * FRAME_DURATION_MS / 2 });
+    /* 12 is lost, its redundant copy arrives with 13 and fills the gap, a second copy is dropped */
+    arrivals.push_back({ 12, 13 * FRAME_DURATION_MS / 2, true });
+    arrivals.push_back({ 12, 14 * FRAME_DURATION_MS / 2, true });
+    replay.Run(arrivals, 3000);
+
+    CheckInOrder(replay.outputs(), 0, 30);
+    for (auto& output : replay.outputs()) {
+        CHECK(output.kind == Output::kPacket);
+    }
+    auto statistics = replay.buffer().statistics();
+    CHECK(statistics.recovered == 1);
+    CHECK(statistics.duplicated == 1);
+    CHECK(statistics.late == 1);
+    CHECK(statistics.concealed == 0);
+    CHECK((replay.dropped() == std::vector<uint32_t>{ 5, 12, 2 }));
+}
+
+static void TestSequenceWrap() {
+    Replay replay;
+    const uint32_t first = 0xFFFFFFF0u;
+    /* Sent faster than realtime, once the buffer holds a few frames every third packet is overtaken by the next two */
+    std::vector<Arrival> arrivals;
+    for (int i = 0; i < 40; i++) {
+        /* The packet after the wrap is lost */
+        if (i != 17) {
+            arrivals.push_back({ first + i, i * FRAME_DURATION_MS / 2 + ((i >= 6 && i % 3 == 1) ? 70 : 0) });
+        }
+    }
+    replay.Run(arrivals, 5000);
+
+    auto& outputs = replay.outputs();
+    CHECK(outputs.size() == 40);
+    for (size_t i = 0; i < outputs.size(); i++) {
+        CHECK(outputs[i].sequence == first + (uint32_t)i);
+        CHECK(outputs[i].kind == (i == 17 ? Output::kFec : Output::kPacket));
+    }
+    CHECK(replay.buffer().statistics().late == 0);
+}
+
+static void TestTargetDelayAdapts() {
+    Replay replay;
+    /* A steady link: the target is one frame */
+    replay.Run(MakeTrace(0, 50, 0, [](int) { return 0; }), 50 * FRAME_DURATION_MS + 1000);
+    auto steady = replay.buffer().statistics();
+    CHECK(steady.jitter_ms <= CHECK_INTERVAL_MS);
+    CHECK(steady.target_delay_ms <= FRAME_DURATION_MS + 2 * CHECK_INTERVAL_MS);
+
+    /* Every tenth packet is held up by 200 ms: it comes too late to be played, but the target follows */
+    int64_t start_ms = 50 * FRAME_DURATION_MS + 1000;
+    replay.Run(MakeTrace(50, 50, start_ms, [](int i) { return (i % 10 == 5) ? 200 : 0; }),
+        start_ms + 50 * FRAME_DURATION_MS + 1000);
+    auto spike = replay.buffer().statistics();
+    CHECK(spike.late > 0);
+    CHECK(spike.jitter_ms >= 150);
+    CHECK(spike.target_delay_ms >= FRAME_DURATION_MS + 150);
+    CHECK(spike.target_delay_ms <= MAX_DELAY_MS);
+
+    /* A steady link again: the target decays slowly, and the stream is played in order */
+    size_t played = replay.outputs().size();
+    start_ms += 50 * FRAME_DURATION_MS + 1000;
+    replay.Run(MakeTrace(100, 100, start_ms, [](int) { return 0; }), start_ms + 100 * FRAME_DURATION_MS + 1000);
+    auto recovered = replay.buffer().statistics();
+    CHECK(recovered.target_delay_ms < spike.target_delay_ms / 2);
+    CHECK(recovered.late == spike.late);
+    std::vector<Output> last(replay.outputs().begin() + played, replay.outputs().end());
+    CheckInOrder(last, 100, 100);
+    printf("Target delay: steady %d ms, after 200 ms spikes %d ms, recovered %d ms\n",
+        steady.target_delay_ms, spike.target_delay_ms, recovered.target_delay_ms);
+}
+
+int main() {
+    TestReordering();
+    TestLossGivesFecOrPlc();
+    TestLongGapRestarts();
+    TestDuplicatesAndRedundancy();
+    TestSequenceWrap();
+    TestTargetDelayAdapts();
+    printf("jitter_buffer_test passed\n");
+    return 0;
+}
@@ -0,0 +1,143 @@
+/*
+ * Benchmark of the dispatch of the server control messages on a session trace, one message per
+ * line: the perfect hash lookup of "type" and "state" against the strcmp() chain it replaced,
+ * and the whole handling of a message by JsonMessage, scan, dispatch and the strings the
+ * application takes out of it.
+ */
+#include "json_message.h"
+#include "host_test.h"
+
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+#define BENCHMARK_ROUNDS 20000
+
+// The strcmp() chain of Application::Start before the change, then "hello" and "goodbye" of the protocols
+static JsonKeyword LookupTypeByStrcmp(const char* type) {
+    if (strcmp(type, "tts") == 0) {
+        return kJsonKeywordTts;
+    } else if (strcmp(type, "stt") == 0) {
+        return kJsonKeywordStt;
+    } else if (strcmp(type, "llm") == 0) {
+        return kJsonKeywordLlm;
+    } else if (strcmp(type, "mcp") == 0) {
+        return kJsonKeywordMcp;
+    } else if (strcmp(type, "system") == 0) {
+        return kJsonKeywordSystem;
+    } else if (strcmp(type, "alert") == 0) {
+        return kJsonKeywordAlert;
+    } else if (strcmp(type, "custom") == 0) {
+        return kJsonKeywordCustom;
+    } else if (strcmp(type, "hello") == 0) {
+        return kJsonKeywordHello;
+    } else if (strcmp(type, "goodbye") == 0) {
+        return kJsonKeywordGoodbye;
+    }
+    return kJsonKeywordUnknown;
+}
+
+static JsonKeyword LookupStateByStrcmp(const char* state) {
+    if (strcmp(state, "start") == 0) {
+        return kJsonKeywordStart;
+    } else if (strcmp(state, "stop") == 0) {
+        return kJsonKeywordStop;
+    } else if (strcmp(state, "sentence_start") == 0) {
+        return kJsonKeywordSentenceStart;
+    } else if (strcmp(state, "sentence_end") == 0) {
+        return kJsonKeywordSentenceEnd;
+    }
+    return kJsonKeywordUnknown;
+}
+
+// What the OnIncomingJson callback of Application takes out of a message, the size of the strings is returned
+static size_t Handle(const JsonMessage& message, std::string& text) {
+    switch (message.type()) {
+    case kJsonKeywordTts:
+        if (message.state() == kJsonKeywordSentenceStart && message.GetString("text", text)) {
+            return text.size();
+        }
+        return 1;
+    case kJsonKeywordStt:
+        return message.GetString("text", text) ? text.size() : 0;
+    case kJsonKeywordLlm:
+        return message.GetString("emotion", text) ? text.size() : 0;
+    case kJsonKeywordMcp:
+        return message.GetRaw("payload").size();
+    case kJsonKeywordAlert:
+        return message.GetString("message", text) ? text.size() : 0;
+    default:
+        return 0;
+    }
+}
+
+int main(int argc, char* argv[]) {
+    const char* path = argc > 1 ? argv[1] : HOST_TEST_DATA_DIR "/server_session.jsonl";
+    std::ifstream file(path);
+    CHECK(file.is_open());
+    std::vector<std::string> messages;
+    std::string line;
+    size_t bytes = 0;
+    while (std::getline(file, line)) {
+        if (!line.empty()) {
+            bytes += line.size();
+            messages.push_back(std::move(line));
+        }
+    }
+    CHECK(!messages.empty());
+
+    /* The fields the old dispatch compared, as NUL terminated strings like cJSON gave them */
+    std::vector<std::string> types;
+    std::vector<std::string> states;
+    JsonMessage message;
+    std::string text;
+    for (auto& text_message : messages) {
+        CHECK(message.Parse(text_message.data(), text_message.size()));
+        std::string state;
+        message.GetString("state", state);
+        types.emplace_back(message.type_name());
+        states.push_back(std::move(state));
+        CHECK(message.type() == LookupTypeByStrcmp(types.back().c_str()));
+        CHECK(message.state() == LookupStateByStrcmp(states.back().c_str()));
+    }
+
+    /* The sink keeps the compiler from dropping the work */
+    size_t sink = 0;
+    size_t lookups = (size_t)BENCHMARK_ROUNDS * messages.size();
+    auto start = Clock::now();
+    for (int round = 0; round < BENCHMARK_ROUNDS; round++) {
+        for (size_t i = 0; i < messages.size(); i++) {
+            sink += LookupTypeByStrcmp(types[i].c_str()) + LookupStateByStrcmp(states[i].c_str());
+        }
+    }
+    auto strcmp_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+
+    start = Clock::now();
+    for (int round = 0; round < BENCHMARK_ROUNDS; round++) {
+        for (size_t i = 0; i < messages.size(); i++) {
+            sink += JsonMessage::LookupKeyword(types[i]) + JsonMessage::LookupKeyword(states[i]);
+        }
+    }
+    auto hash_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+
+    start = Clock::now();
+    for (int round = 0; round < BENCHMARK_ROUNDS; round++) {
+        for (auto& text_message : messages) {
+            message.Parse(text_message.data(), text_message.size());
+            sink += Handle(message, text);
+        }
+    }
+    auto handle_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+
+    printf("Dispatch of %u messages, %u bytes on average, %d rounds (sink %u):\n", (unsigned)messages.size(),
+        (unsigned)(bytes / messages.size()), BENCHMARK_ROUNDS, (unsigned)sink);
+    printf("  type and state by strcmp chain: %.1f ns/message\n", (double)strcmp_ns / lookups);
+    printf("  type and state by perfect hash: %.1f ns/message\n", (double)hash_ns / lookups);
+    printf("  scan, dispatch and strings:     %.1f ns/message, %.2f ns/byte\n", (double)handle_ns / lookups,
+        (double)handle_ns / BENCHMARK_ROUNDS / bytes);
+    return 0;
+}
@@ -0,0 +1,205 @@
+/*
+ * Test of JsonMessage, the in-place scanner of the server control messages. Every message is
+ * copied into a buffer of its exact length without a terminating NUL, so a read past the end is
+ * caught by the address sanitizer.
+ */
+#include "json_message.h"
+#include "host_test.h"
+
+#include <cstring>
+#include <memory>
+#include <string>
+
+// The text of a message without a NUL after it, it must outlive the JsonMessage
+class Buffer {
+public:
+    explicit Buffer(std::string_view text) : data_(new char[text.size()]), size_(text.size()) {
+        memcpy(data_.get(), text.data(), text.size());
+    }
+
+    const char* data() const { return data_.get(); }
+    size_t size() const { return size_; }
+
+private:
+    std::unique_ptr<char[]> data_;
+    size_t size_;
+};
+
+static std::string GetString(const JsonMessage& message, std::string_view key) {
+    std::string value;
+    CHECK(message.GetString(key, value));
+    return value;
+}
+
+static void TestKeywords() {
+    const char* words[] = { "hello", "goodbye", "tts", "stt", "llm", "mcp", "system", "alert", "custom",
+        "start", "stop", "sentence_start", "sentence_end" };
+    for (size_t i = 0; i < sizeof(words) / sizeof(words[0]); i++) {
+        CHECK(JsonMessage::LookupKeyword(words[i]) == static_cast<JsonKeyword>(kJsonKeywordHello + i));
+    }
+    /* Not keywords, "ttx" lands in the slot of "tts" */
+    CHECK(JsonMessage::LookupKeyword("ttx") == kJsonKeywordUnknown);
+    CHECK(JsonMessage::LookupKeyword("sentence_stop") == kJsonKeywordUnknown);
+    CHECK(JsonMessage::LookupKeyword("TTS") == kJsonKeywordUnknown);
+    CHECK(JsonMessage::LookupKeyword("") == kJsonKeywordUnknown);
+    CHECK(JsonMessage::LookupKeyword("listen") == kJsonKeywordUnknown);
+}
+
+static void TestMembers() {
+    Buffer buffer(" {\n  \"session_id\" : \"a1\",\t\"type\":\"tts\", \"state\": \"sentence_start\",\r\n"
+        "  \"text\": \"\xe4\xbd\xa0\xe5\xa5\xbd\", \"index\": -12.5e3, \"final\": true, \"extra\": null }");
+    JsonMessage message;
+    CHECK(message.Parse(buffer.data(), buffer.size()));
+    CHECK(message.type() == kJsonKeywordTts);
+    CHECK(message.state() == kJsonKeywordSentenceStart);
+    CHECK(message.type_name() == "tts");
+    CHECK(GetString(message, "session_id") == "a1");
+    CHECK(GetString(message, "text") == "\xe4\xbd\xa0\xe5\xa5\xbd");
+    CHECK(message.GetRaw("index") == "-12.5e3");
+    CHECK(message.GetRaw("final") == "true");
+    CHECK(message.GetRaw("extra") == "null");
+
+    /* A number is not a string */
+    std::string value = "unchanged";
+    CHECK(!message.GetString("index", value));
+    CHECK(!message.GetString("missing", value));
+    CHECK(value == "unchanged");
+    CHECK(message.GetRaw("missing").empty());
+
+    Buffer empty("{ }");
+    CHECK(message.Parse(empty.data(), empty.size()));
+    CHECK(message.type() == kJsonKeywordUnknown);
+    CHECK(message.type_name().empty());
+    CHECK(message.GetRaw("type").empty());
+}
+
+static void TestEscapes() {
+    Buffer buffer("{\"type\":\"stt\",\"text\":\"say \\\"hi\\\" \\\\ a\\/b\\n\\t\\r\\b\\f"
+        "\\u0041\\u00e9\\u4f60\\ud83d\\ude00\",\"key \\\"quoted\\\"\":\"v\"}");
+    JsonMessage message;
+    CHECK(message.Parse(buffer.data(), buffer.size()));
+    CHECK(message.type() == kJsonKeywordStt);
+    CHECK(GetString(message, "text") == "say \"hi\" \\ a/b\n\t\r\b\f" "A" "\xc3\xa9" "\xe4\xbd\xa0" "\xf0\x9f\x98\x80");
+    /* Keys are compared as they are written */
+    CHECK(GetString(message, "key \\\"quoted\\\"") == "v");
+
+    /* A lone high surrogate is kept as it is */
+    Buffer lone("{\"text\":\"\\ud83dx\"}");
+    CHECK(message.Parse(lone.data(), lone.size()));
+    CHECK(GetString(message, "text") == "\xed\xa0\xbd" "x");
+
+    /* A \u escape cut short is an error of the value, not of the message */
+    Buffer short_escape("{\"text\":\"\\u12\"}");
+    CHECK(message.Parse(short_escape.data(), short_escape.size()));
+    std::string value;
+    CHECK(!message.GetString("text", value));
+    Buffer bad_escape("{\"text\":\"\\uzzzz\"}");
+    CHECK(message.Parse(bad_escape.data(), bad_escape.size()));
+    CHECK(!message.GetString("text", value));
+}
+
+static void TestNested() {
+    /* Strings with brackets and escaped quotes in the nested values, "type" nested before the top level one */
+    Buffer buffer("{\"payload\":{\"type\":\"tts\",\"jsonrpc\":\"2.0\",\"params\":{\"name\":\"a}b]\\\"{\","
+        "\"arguments\":[1,{\"r\":255},[\"]\"]]},\"id\":1},\"type\":\"mcp\",\"list\":[{\"state\":\"stop\"}],\"state\":\"start\"}");
+    JsonMessage message;
+    CHECK(message.Parse(buffer.data(), buffer.size()));
+    CHECK(message.type() == kJsonKeywordMcp);
+    CHECK(message.state() == kJsonKeywordStart);
+    CHECK(message.GetRaw("payload") == "{\"type\":\"tts\",\"jsonrpc\":\"2.0\",\"params\":{\"name\":\"a}b]\\\"{\","
+        "\"arguments\":[1,{\"r\":255},[\"]\"]]},\"id\":1}");
+    CHECK(message.GetRaw("list") == "[{\"state\":\"stop\"}]");
+    /* Members of nested objects are not seen at the top level */
+    CHECK(message.GetRaw("jsonrpc").empty());
+    CHECK(message.GetRaw("id").empty());
+    std::string value;
+    CHECK(!message.GetString("payload", value));
+}
+
+static void TestUnknownKeys() {
+    Buffer buffer("{\"type\":\"listen\",\"state\":\"detect\",\"future_field\":{\"a\":[1,2]},\"another\":\"x\"}");
+    JsonMessage message;
+    CHECK(message.Parse(buffer.data(), buffer.size()));
+    CHECK(message.type() == kJsonKeywordUnknown);
+    CHECK(message.state() == kJsonKeywordUnknown);
+    CHECK(message.type_name() == "listen");
+    CHECK(GetString(message, "another") == "x");
+
+    /* Members past JSON_MESSAGE_MAX_MEMBERS are skipped, "type" is still resolved */
+    std::string text = "{";
+    for (int i = 0; i < JSON_MESSAGE_MAX_MEMBERS + 4; i++) {
+        text += "\"k" + std::to_string(i) + "\":" + std::to_string(i) + ",";
+    }
+    text += "\"type\":\"llm\",\"emotion\":\"happy\"}";
+    Buffer many(text);
+    CHECK(message.Parse(many.data(), many.size()));
+    CHECK(message.type() == kJsonKeywordLlm);
+    CHECK(message.GetRaw("k0") == "0");
+    CHECK(message.GetRaw("k" + std::to_string(JSON_MESSAGE_MAX_MEMBERS - 1)) == std::to_string(JSON_MESSAGE_MAX_MEMBERS - 1));
+    CHECK(message.GetRaw("k" + std::to_string(JSON_MESSAGE_MAX_MEMBERS)).empty());
+    CHECK(message.GetRaw("emotion").empty());
+}
+
+static void TestTruncated() {
+    const char* messages[] = {
+        "{\"session_id\":\"xxx\",\"type\":\"tts\",\"state\":\"sentence_start\",\"text\":\"a \\\"b\\\" \\u4f60\"}",
+        "{\"type\":\"mcp\",\"payload\":{\"jsonrpc\":\"2.0\",\"method\":\"tools/call\",\"params\":{\"name\":\"x\",\"arguments\":{\"r\":255}},\"id\":1}}",
+        "{ \"type\" : \"alert\" , \"status\" : \"s\" , \"message\" : \"m\" , \"emotion\" : \"e\" , \"n\" : 12 , \"b\" : false }",
+        "{\"list\":[[],{},[{\"a\":\"]}\"}]],\"v\":-1}",
+    };
+    for (auto text : messages) {
+        std::string_view full(text);
+        JsonMessage message;
+        Buffer buffer(full);
+        CHECK(message.Parse(buffer.data(), buffer.size()));
+        /* Every prefix is incomplete, and none is read past its end */
+        for (size_t len = 0; len < full.size(); len++) {
+            Buffer prefix(full.substr(0, len));
+            if (message.Parse(prefix.data(), prefix.size())) {
+                fprintf(stderr, "Parsed a truncated message: %.*s\n", (int)len, text);
+                CHECK(false);
+            }
+        }
+    }
+}
+
+static void TestInvalid() {
+    const char* messages[] = {
+        "",
+        "   ",
+        "[]",
+        "\"type\"",
+        "{type:\"tts\"}",
+        "{\"type\" \"tts\"}",
+        "{\"type\":\"tts\" \"state\":\"start\"}",
+        "{\"type\":\"tts\",}",
+        "{\"type\":}",
+        "{\"type\": ,\"state\":\"stop\"}",
+        "{,}",
+    };
+    JsonMessage message;
+    for (auto text : messages) {
+        Buffer buffer(text);
+        CHECK(!message.Parse(buffer.data(), buffer.size()));
+    }
+
+    /* The parse of another message leaves nothing behind */
+    Buffer valid("{\"type\":\"tts\",\"state\":\"stop\"}");
+    CHECK(message.Parse(valid.data(), valid.size()));
+    Buffer other("{\"type\":\"stt\"");
+    CHECK(!message.Parse(other.data(), other.size()));
+    CHECK(message.state() == kJsonKeywordUnknown);
+    CHECK(message.GetRaw("state").empty());
+}
+
+int main() {
+    TestKeywords();
+    TestMembers();
+    TestEscapes();
+    TestNested();
+    TestUnknownKeys();
+    TestTruncated();
+    TestInvalid();
+    printf("json_message_test passed\n");
+    return 0;
+}
@@ -0,0 +1,208 @@
+/*
+ * Test of MainTaskQueue: the lanes run in priority order, the high and normal lanes keep every task
+ * up to their overflow limit, and the display lane keeps its newest tasks. A flood of slow display updates from another
+ * task must not hold up a state change by more than the display task that is running.
+ */
+#include "main_task_queue.h"
+#include "host_test.h"
+
+#include <thread>
+#include <chrono>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+
+using Clock = std::chrono::steady_clock;
+
+static void RunAll(MainTaskQueue& queue) {
+    MainTask task;
+    while (queue.Pop(task)) {
+        task();
+        task.Reset();
+    }
+}
+
+static void TestPriority() {
+    MainTaskQueue queue;
+    std::vector<int> order;
+    queue.Push(kMainTaskPriorityDisplay, [&order]() { order.push_back(3); });
+    queue.Push(kMainTaskPriorityNormal, [&order]() { order.push_back(2); });
+    queue.Push(kMainTaskPriorityHigh, [&order]() { order.push_back(1); });
+    queue.Push(kMainTaskPriorityNormal, [&order]() { order.push_back(22); });
+
+    MainTask task;
+    MainTaskPriority priority;
+    CHECK(queue.Pop(task, &priority));
+    CHECK(priority == kMainTaskPriorityHigh);
+    task();
+    RunAll(queue);
+    CHECK((order == std::vector<int>{ 1, 2, 22, 3 }));
+    CHECK(queue.IsEmpty());
+}
+
+// More tasks than the ring holds, pushed while the main loop is busy
+static void TestNoLoss(MainTaskPriority priority, size_t depth) {
+    MainTaskQueue queue;
+    /* As many as the lane keeps, the ring takes no task while older ones wait in the overflow */
+    const int tasks = depth + MAIN_TASK_OVERFLOW_LIMIT;
+    std::vector<int> order;
+    for (int i = 0; i < tasks; i++) {
+        queue.Push(priority, [&order, i]() { order.push_back(i); });
+        /* A task is taken in the middle of the burst, the ring has room again while tasks are spilled */
+        if (i == (int)depth + 1) {
+            MainTask task;
+            CHECK(queue.Pop(task));
+            task();
+        }
+    }
+    auto statistics = queue.GetLaneStatistics(priority);
+    CHECK(statistics.dropped == 0);
+    CHECK(statistics.spilled > 0);
+    CHECK(statistics.depth == (size_t)tasks - 1);
+
+    RunAll(queue);
+    CHECK((int)order.size() == tasks);
+    for (int i = 0; i < tasks; i++) {
+        CHECK(order[i] == i);
+    }
+    CHECK(queue.IsEmpty());
+
+    /* Back to the ring once the overflow is drained */
+    queue.Push(priority, [&order]() { order.push_back(-1); });
+    CHECK(queue.GetLaneStatistics(priority).spilled == statistics.spilled);
+    RunAll(queue);
+    CHECK(order.back() == -1);
+}
+
+// The main loop is stuck, the tasks past the overflow limit are dropped instead of filling the heap
+static void TestOverflowLimit(MainTaskPriority priority, size_t depth) {
+    MainTaskQueue queue;
+    const int kept = depth + MAIN_TASK_OVERFLOW_LIMIT;
+    const int tasks = kept + 5;
+    std::vector<int> order;
+    for (int i = 0; i < tasks; i++) {
+        queue.Push(priority, [&order, i]() { order.push_back(i); });
+    }
+    auto statistics = queue.GetLaneStatistics(priority);
+    CHECK(statistics.dropped == (size_t)(tasks - kept));
+    CHECK(statistics.spilled == MAIN_TASK_OVERFLOW_LIMIT);
+    CHECK(statistics.depth == (size_t)kept);
+    CHECK(statistics.max_depth == (size_t)kept);
+
+    /* The oldest tasks are kept in order, and the lane takes tasks again once it is drained */
+    RunAll(queue);
+    CHECK((int)order.size() == kept);
+    for (int i = 0; i < kept; i++) {
+        CHECK(order[i] == i);
+    }
+    queue.Push(priority, [&order]() { order.push_back(-1); });
+    RunAll(queue);
+    CHECK(order.back() == -1);
+    CHECK(queue.GetLaneStatistics(priority).dropped == (size_t)(tasks - kept));
+}
+
+static void TestDisplayDropsOldest() {
+    MainTaskQueue queue;
+    const int tasks = MAIN_TASK_DISPLAY_DEPTH * 3;
+    std::vector<int> order;
+    for (int i = 0; i < tasks; i++) {
+        queue.Push(kMainTaskPriorityDisplay, [&order, i]() { order.push_back(i); });
+    }
+    auto statistics = queue.GetLaneStatistics(kMainTaskPriorityDisplay);
+    CHECK(statistics.dropped == (size_t)tasks - MAIN_TASK_DISPLAY_DEPTH);
+    CHECK(statistics.spilled == 0);
+
+    RunAll(queue);
+    CHECK(order.size() == MAIN_TASK_DISPLAY_DEPTH);
+    for (int i = 0; i < MAIN_TASK_DISPLAY_DEPTH; i++) {
+        CHECK(order[i] == tasks - MAIN_TASK_DISPLAY_DEPTH + i);
+    }
+}
+
+/*
+ * A TTS stream floods the display lane with updates that take a few milliseconds each, while
+ * another task changes the device state. A state change waits at most for the display update
+ * being run, not for the display backlog, which would take MAIN_TASK_DISPLAY_DEPTH times longer.
+ */
+static void TestFloodLatency() {
+    const auto kDisplayTaskTime = std::chrono::milliseconds(4);
+    const int kStateChanges = 100;
+    MainTaskQueue queue;
+    std::atomic<bool> stop = false;
+    std::atomic<int> display_runs = 0;
+
+    std::thread display_producer([&]() {
+        while (!stop) {
+            queue.Push(kMainTaskPriorityDisplay, [&display_runs, kDisplayTaskTime]() {
+                auto end = Clock::now() + kDisplayTaskTime;
+                while (Clock::now() < end) {
+                }
+                display_runs++;
+            });
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+        }
+    });
+
+    // Written by the main loop only
+    std::vector<int64_t> latencies_us;
+    std::vector<int> order;
+    latencies_us.reserve(kStateChanges);
+    std::thread state_producer([&]() {
+        /* Let the display backlog build up first */
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        for (int i = 0; i < kStateChanges; i++) {
+            auto pushed = Clock::now();
+            queue.Push(kMainTaskPriorityHigh, [&latencies_us, &order, pushed, i]() {
+                latencies_us.push_back(std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - pushed).count());
+                order.push_back(i);
+            });
+            std::this_thread::sleep_for(std::chrono::milliseconds(7));
+        }
+    });
+
+    std::thread main_loop([&]() {
+        MainTask task;
+        while (!stop || !queue.IsEmpty()) {
+            if (queue.Pop(task)) {
+                task();
+                task.Reset();
+            } else {
+                std::this_thread::yield();
+            }
+        }
+    });
+
+    state_producer.join();
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    stop = true;
+    display_producer.join();
+    main_loop.join();
+
+    CHECK((int)order.size() == kStateChanges);
+    for (int i = 0; i < kStateChanges; i++) {
+        CHECK(order[i] == i);
+    }
+    auto display = queue.GetLaneStatistics(kMainTaskPriorityDisplay);
+    CHECK(display.dropped > 0);
+    CHECK(display.max_depth == MAIN_TASK_DISPLAY_DEPTH);
+
+    std::sort(latencies_us.begin(), latencies_us.end());
+    auto p50 = latencies_us[kStateChanges / 2];
+    auto p99 = latencies_us[kStateChanges * 99 / 100];
+    auto backlog_us = std::chrono::duration_cast<std::chrono::microseconds>(kDisplayTaskTime).count() * MAIN_TASK_DISPLAY_DEPTH;
+    printf("State change latency with %d display updates run, %u dropped: p50 %lld us, p99 %lld us, max %lld us, display backlog %lld us\n",
+        display_runs.load(), (unsigned)display.dropped, (long long)p50, (long long)p99, (long long)latencies_us.back(), (long long)backlog_us);
+    CHECK(p99 < backlog_us / 2);
+}
+
+int main() {
+    TestPriority();
+    TestNoLoss(kMainTaskPriorityHigh, MAIN_TASK_HIGH_DEPTH);
+    TestNoLoss(kMainTaskPriorityNormal, MAIN_TASK_NORMAL_DEPTH);
+    TestOverflowLimit(kMainTaskPriorityHigh, MAIN_TASK_HIGH_DEPTH);
+    TestOverflowLimit(kMainTaskPriorityNormal, MAIN_TASK_NORMAL_DEPTH);
+    TestDisplayDropsOldest();
+    TestFloodLatency();
+    printf("main_task_queue_test passed\n");
+    return 0;
+}
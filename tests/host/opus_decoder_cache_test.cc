@@ -0,0 +1,142 @@
+/*
+ * Test of OpusDecoderCache with a fake decoder: slots are kept per format and evicted least
+ * recently used first, and ResetState() from another task never resets the slot while the decode
+ * task decodes with it, but before its next packet.
+ */
+#include "opus_decoder_cache.h"
+#include "host_test.h"
+
+#include <thread>
+#include <atomic>
+#include <chrono>
+
+using Clock = std::chrono::steady_clock;
+
+// Set while a fake decoder decodes, the decode task uses one slot at a time
+static std::atomic<bool> decoding = false;
+static std::atomic<int> resets_while_decoding = 0;
+
+// The fake counts the frames decoded since its last reset in frame_size_ and writes the count to the samples
+OpusVoiceDecoder::OpusVoiceDecoder(int sample_rate, int channels, int duration_ms)
+    : sample_rate_(sample_rate), duration_ms_(duration_ms), channels_(channels) {
+}
+
+OpusVoiceDecoder::~OpusVoiceDecoder() {
+}
+
+bool OpusVoiceDecoder::Decode(const uint8_t* data, size_t size, std::vector<int16_t>& pcm, bool fec) {
+    decoding = true;
+    pcm.assign(sample_rate_ / 1000 * duration_ms_ * channels_, frame_size_++);
+    auto end = Clock::now() + std::chrono::microseconds(20);
+    while (Clock::now() < end) {
+    }
+    decoding = false;
+    return true;
+}
+
+void OpusVoiceDecoder::ResetState() {
+    if (decoding) {
+        resets_while_decoding++;
+    }
+    frame_size_ = 0;
+}
+
+static int16_t DecodeFrame(OpusDecoderSlot& slot) {
+    std::vector<int16_t> pcm;
+    CHECK(slot.decoder->Decode(nullptr, 0, pcm));
+    CHECK(pcm.size() == (size_t)slot.sample_rate / 1000 * slot.frame_duration_ms);
+    return pcm[0];
+}
+
+static void TestSlots() {
+    OpusDecoderCache cache(2);
+    cache.Initialize(24000);
+
+    auto& tts = cache.Select(24000, 60);
+    CHECK(tts.resampler == nullptr);
+    CHECK(DecodeFrame(tts) == 0);
+    CHECK(DecodeFrame(tts) == 1);
+    CHECK(&cache.Select(24000, 60) == &tts);
+    CHECK(DecodeFrame(tts) == 2);
+
+    auto& sound = cache.Select(16000, 60);
+    CHECK(sound.resampler != nullptr);
+    CHECK(sound.resampler->output_sample_rate() == 24000);
+
+    /* Back to a cached slot, its state is from an earlier stream */
+    CHECK(&cache.Select(24000, 60) == &tts);
+    CHECK(DecodeFrame(tts) == 0);
+
+    /* The least recently used slot is replaced, never the selected one */
+    cache.Prepare(16000, 20);
+    auto statistics = cache.statistics();
+    CHECK(statistics.creations == 3);
+    CHECK(statistics.evictions == 1);
+    CHECK(statistics.entries == 2);
+    CHECK(statistics.switches == 3);
+    CHECK(&cache.Select(24000, 60) == &tts);
+    CHECK(cache.statistics().creations == 3);
+    cache.Select(16000, 60);
+    CHECK(cache.statistics().creations == 4);
+}
+
+static void TestResetBeforeNextPacket() {
+    OpusDecoderCache cache(2);
+    cache.Initialize(24000);
+    /* Nothing selected yet */
+    cache.ResetState();
+
+    auto& slot = cache.Select(24000, 60);
+    CHECK(DecodeFrame(slot) == 0);
+    CHECK(DecodeFrame(slot) == 1);
+    cache.ResetState();
+    cache.ResetState();
+    CHECK(&cache.Select(24000, 60) == &slot);
+    CHECK(DecodeFrame(slot) == 0);
+    /* Applied once */
+    CHECK(&cache.Select(24000, 60) == &slot);
+    CHECK(DecodeFrame(slot) == 1);
+
+    /* A reset pending when the format changes is done by the switch */
+    cache.ResetState();
+    auto& other = cache.Select(16000, 60);
+    CHECK(DecodeFrame(other) == 0);
+    CHECK(DecodeFrame(other) == 1);
+    CHECK(DecodeFrame(cache.Select(16000, 60)) == 2);
+}
+
+// The decode task decodes while the main task resets the decoder at the start of each new stream
+static void TestResetWhileDecoding() {
+    const int kResets = 2000;
+    OpusDecoderCache cache(2);
+    cache.Initialize(24000);
+    std::atomic<bool> stop = false;
+    std::atomic<int> frames = 0;
+
+    std::thread decode_task([&]() {
+        while (!stop) {
+            auto& slot = cache.Select(24000, 60);
+            DecodeFrame(slot);
+            frames++;
+        }
+    });
+
+    for (int i = 0; i < kResets; i++) {
+        cache.ResetState();
+        std::this_thread::sleep_for(std::chrono::microseconds(10));
+    }
+    stop = true;
+    decode_task.join();
+
+    printf("%d frames decoded, %d resets, %d while decoding\n", frames.load(), kResets, resets_while_decoding.load());
+    CHECK(frames > 0);
+    CHECK(resets_while_decoding == 0);
+}
+
+int main() {
+    TestSlots();
+    TestResetBeforeNextPacket();
+    TestResetWhileDecoding();
+    printf("opus_decoder_cache_test passed\n");
+    return 0;
+}
@@ -0,0 +1,150 @@
+/*
+ * Benchmark of the stereo input path of AudioService::ReadAudioData on 60 ms frames of a 24 kHz
+ * mic + reference codec, the most common input of the boards: the split / merge kernels of
+ * pcm_kernels.h against the scalar loops they replaced, and the whole read path through the
+ * preallocated buffers against the four vectors it allocated per read. The resampler is the host
+ * stand-in, so only the difference between the two paths is meaningful, not their total.
+ */
+#include "pcm_kernels.h"
+#include "opus_resampler.h"
+#include "host_test.h"
+
+#include <chrono>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+#define BENCHMARK_INPUT_SAMPLE_RATE 24000
+#define BENCHMARK_FRAME_DURATION_MS 60
+#define BENCHMARK_ROUNDS 20000
+
+// The loops of ReadAudioData before the change. These and the kernels below are kept out of line, so they are timed alike
+__attribute__((noinline)) static void DeinterleaveScalar(const int16_t* input, int16_t* left, int16_t* right, size_t frames) {
+    for (size_t i = 0, j = 0; i < frames; ++i, j += 2) {
+        left[i] = input[j];
+        right[i] = input[j + 1];
+    }
+}
+
+__attribute__((noinline)) static void InterleaveScalar(const int16_t* left, const int16_t* right, int16_t* output, size_t frames) {
+    for (size_t i = 0, j = 0; i < frames; ++i, j += 2) {
+        output[j] = left[i];
+        output[j + 1] = right[i];
+    }
+}
+
+__attribute__((noinline)) static void Deinterleave(const int16_t* input, int16_t* left, int16_t* right, size_t frames) {
+    PcmDeinterleaveStereo(input, left, right, frames);
+}
+
+__attribute__((noinline)) static void Interleave(const int16_t* left, const int16_t* right, int16_t* output, size_t frames) {
+    PcmInterleaveStereo(left, right, output, frames);
+}
+
+// The stereo path of ReadAudioData before the change
+static void ReadStereoAllocating(std::vector<int16_t>& data, OpusResampler& input_resampler, OpusResampler& reference_resampler) {
+    auto mic_channel = std::vector<int16_t>(data.size() / 2);
+    auto reference_channel = std::vector<int16_t>(data.size() / 2);
+    DeinterleaveScalar(data.data(), mic_channel.data(), reference_channel.data(), mic_channel.size());
+    auto resampled_mic = std::vector<int16_t>(input_resampler.GetOutputSamples(mic_channel.size()));
+    auto resampled_reference = std::vector<int16_t>(reference_resampler.GetOutputSamples(reference_channel.size()));
+    input_resampler.Process(mic_channel.data(), mic_channel.size(), resampled_mic.data());
+    reference_resampler.Process(reference_channel.data(), reference_channel.size(), resampled_reference.data());
+    data.resize(resampled_mic.size() + resampled_reference.size());
+    InterleaveScalar(resampled_mic.data(), resampled_reference.data(), data.data(), resampled_mic.size());
+}
+
+// The stereo path of ReadAudioData now, the scratch buffers belong to AudioService
+struct StereoReader {
+    OpusResampler input_resampler;
+    OpusResampler reference_resampler;
+    std::vector<int16_t> mic_channel_buffer;
+    std::vector<int16_t> reference_channel_buffer;
+    std::vector<int16_t> resampled_mic_buffer;
+    std::vector<int16_t> resampled_reference_buffer;
+
+    void Read(std::vector<int16_t>& data) {
+        size_t frames = data.size() / 2;
+        mic_channel_buffer.resize(frames);
+        reference_channel_buffer.resize(frames);
+        Deinterleave(data.data(), mic_channel_buffer.data(), reference_channel_buffer.data(), frames);
+        resampled_mic_buffer.resize(input_resampler.GetOutputSamples(frames));
+        resampled_reference_buffer.resize(reference_resampler.GetOutputSamples(frames));
+        input_resampler.Process(mic_channel_buffer.data(), frames, resampled_mic_buffer.data());
+        reference_resampler.Process(reference_channel_buffer.data(), frames, resampled_reference_buffer.data());
+        data.resize(resampled_mic_buffer.size() * 2);
+        Interleave(resampled_mic_buffer.data(), resampled_reference_buffer.data(), data.data(), resampled_mic_buffer.size());
+    }
+};
+
+template <typename Function>
+static double NanosecondsPerRound(Function&& function) {
+    auto start = Clock::now();
+    for (int round = 0; round < BENCHMARK_ROUNDS; round++) {
+        function(round);
+    }
+    return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count() / BENCHMARK_ROUNDS;
+}
+
+int main() {
+    const size_t frames = BENCHMARK_INPUT_SAMPLE_RATE / 1000 * BENCHMARK_FRAME_DURATION_MS;
+    std::vector<int16_t> input(frames * 2);
+    uint32_t seed = 1;
+    for (auto& sample : input) {
+        seed = seed * 1103515245 + 12345;
+        sample = (int16_t)(seed >> 16);
+    }
+    std::vector<int16_t> left(frames), right(frames), merged(frames * 2);
+    std::vector<int16_t> expected_left(frames), expected_right(frames);
+    Deinterleave(input.data(), left.data(), right.data(), frames);
+    DeinterleaveScalar(input.data(), expected_left.data(), expected_right.data(), frames);
+    CHECK(left == expected_left && right == expected_right);
+
+    /* The sink keeps the compiler from dropping the work */
+    uint32_t sink = 0;
+    double deinterleave_scalar_ns = NanosecondsPerRound([&](int round) {
+        DeinterleaveScalar(input.data(), left.data(), right.data(), frames);
+        sink += (uint16_t)left[round % frames];
+    });
+    double deinterleave_ns = NanosecondsPerRound([&](int round) {
+        Deinterleave(input.data(), left.data(), right.data(), frames);
+        sink += (uint16_t)left[round % frames];
+    });
+    double interleave_scalar_ns = NanosecondsPerRound([&](int round) {
+        InterleaveScalar(left.data(), right.data(), merged.data(), frames);
+        sink += (uint16_t)merged[round % frames];
+    });
+    double interleave_ns = NanosecondsPerRound([&](int round) {
+        Interleave(left.data(), right.data(), merged.data(), frames);
+        sink += (uint16_t)merged[round % frames];
+    });
+
+    OpusResampler input_resampler, reference_resampler;
+    input_resampler.Configure(BENCHMARK_INPUT_SAMPLE_RATE, 16000);
+    reference_resampler.Configure(BENCHMARK_INPUT_SAMPLE_RATE, 16000);
+    StereoReader reader;
+    reader.input_resampler.Configure(BENCHMARK_INPUT_SAMPLE_RATE, 16000);
+    reader.reference_resampler.Configure(BENCHMARK_INPUT_SAMPLE_RATE, 16000);
+    std::vector<int16_t> data;
+    data.reserve(input.size());
+    double read_allocating_ns = NanosecondsPerRound([&](int round) {
+        data.assign(input.begin(), input.end());
+        ReadStereoAllocating(data, input_resampler, reference_resampler);
+        sink += (uint16_t)data[round % data.size()];
+    });
+    double read_ns = NanosecondsPerRound([&](int round) {
+        data.assign(input.begin(), input.end());
+        reader.Read(data);
+        sink += (uint16_t)data[round % data.size()];
+    });
+
+    printf("Stereo input of %d ms at %d Hz, %u samples per channel, %d reads (sink %u):\n", BENCHMARK_FRAME_DURATION_MS,
+        BENCHMARK_INPUT_SAMPLE_RATE, (unsigned)frames, BENCHMARK_ROUNDS, (unsigned)sink);
+    printf("  deinterleave, scalar loop:  %.0f ns/read\n", deinterleave_scalar_ns);
+    printf("  deinterleave, kernel:       %.0f ns/read\n", deinterleave_ns);
+    printf("  interleave, scalar loop:    %.0f ns/read\n", interleave_scalar_ns);
+    printf("  interleave, kernel:         %.0f ns/read\n", interleave_ns);
+    printf("  read path, allocating:      %.0f ns/read\n", read_allocating_ns);
+    printf("  read path, preallocated:    %.0f ns/read\n", read_ns);
+    return 0;
+}
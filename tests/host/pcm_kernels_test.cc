@@ -0,0 +1,179 @@
+/*
+ * Test of the channel split / merge kernels of pcm_kernels.h against the scalar loops they
+ * replaced, for every length up to a few words, aligned and not, of the playback fade-out, and of
+ * the stereo read path of AudioService::ReadAudioData, which splits, resamples and merges through
+ * preallocated buffers, against the allocating path before it. Every buffer ends where its data
+ * ends, so a write or a read past the end is caught by the address sanitizer.
+ */
+#include "pcm_kernels.h"
+#include "opus_resampler.h"
+#include "host_test.h"
+
+#include <cstring>
+#include <memory>
+#include <vector>
+
+// The loops of ReadAudioData and AudioInputTask before the change
+static void DeinterleaveScalar(const int16_t* input, int16_t* left, int16_t* right, size_t frames) {
+    for (size_t i = 0, j = 0; i < frames; ++i, j += 2) {
+        left[i] = input[j];
+        right[i] = input[j + 1];
+    }
+}
+
+static void InterleaveScalar(const int16_t* left, const int16_t* right, int16_t* output, size_t frames) {
+    for (size_t i = 0, j = 0; i < frames; ++i, j += 2) {
+        output[j] = left[i];
+        output[j + 1] = right[i];
+    }
+}
+
+// Samples at an offset of 0 or 1 from the start of their allocation, 1 is not word aligned
+class Samples {
+public:
+    Samples(size_t count, size_t offset) : data_(new int16_t[offset + count]), offset_(offset), count_(count) {
+        for (size_t i = 0; i < offset + count; i++) {
+            data_[i] = (int16_t)(0x7F00 - i * 2);
+        }
+    }
+
+    void Fill(uint32_t seed) {
+        for (size_t i = 0; i < count_; i++) {
+            seed = seed * 1103515245 + 12345;
+            data()[i] = (int16_t)(seed >> 16);
+        }
+    }
+
+    int16_t* data() { return data_.get() + offset_; }
+    bool Equals(const int16_t* other) const {
+        return memcmp(data_.get() + offset_, other, count_ * sizeof(int16_t)) == 0;
+    }
+
+private:
+    std::unique_ptr<int16_t[]> data_;
+    size_t offset_;
+    size_t count_;
+};
+
+static void TestKernels() {
+    for (size_t frames = 0; frames <= 67; frames++) {
+        for (size_t offset = 0; offset <= 1; offset++) {
+            Samples stereo(frames * 2, offset);
+            stereo.Fill(frames + 1);
+            Samples left(frames, 1 - offset), right(frames, offset);
+            Samples expected_left(frames, 0), expected_right(frames, 0);
+            PcmDeinterleaveStereo(stereo.data(), left.data(), right.data(), frames);
+            DeinterleaveScalar(stereo.data(), expected_left.data(), expected_right.data(), frames);
+            CHECK(left.Equals(expected_left.data()));
+            CHECK(right.Equals(expected_right.data()));
+
+            Samples merged(frames * 2, 1 - offset), expected_merged(frames * 2, 0);
+            PcmInterleaveStereo(left.data(), right.data(), merged.data(), frames);
+            InterleaveScalar(expected_left.data(), expected_right.data(), expected_merged.data(), frames);
+            CHECK(merged.Equals(expected_merged.data()));
+            CHECK(merged.Equals(stereo.data()));
+
+            Samples mono(frames, 1 - offset);
+            PcmExtractLeft(stereo.data(), mono.data(), frames);
+            CHECK(mono.Equals(expected_left.data()));
+
+            /* In place, as the downmix of AudioInputTask */
+            PcmExtractLeft(stereo.data(), stereo.data(), frames);
+            CHECK(memcmp(stereo.data(), expected_left.data(), frames * sizeof(int16_t)) == 0);
+        }
+    }
+}
+
+static void TestFadeOut() {
+    const int16_t levels[] = { 32767, -32768, 1000, -3 };
+    for (int16_t level : levels) {
+        for (size_t samples = 1; samples <= 240; samples++) {
+            std::vector<int16_t> input(samples, level), output(samples);
+            PcmFadeOut(input.data(), output.data(), samples);
+            /* Starts at the input level and only gets quieter, down to a step above silence */
+            CHECK(output[0] == level);
+            for (size_t i = 1; i < samples; i++) {
+                CHECK(abs(output[i]) <= abs(output[i - 1]));
+            }
+            CHECK(abs(output[samples - 1]) <= abs(level) / (int)samples);
+
+            PcmFadeOut(input.data(), input.data(), samples);
+            CHECK(input == output);
+        }
+    }
+}
+
+// The stereo path of ReadAudioData before the change, four vectors allocated per read
+static void ReadStereoAllocating(std::vector<int16_t>& data, OpusResampler& input_resampler, OpusResampler& reference_resampler) {
+    auto mic_channel = std::vector<int16_t>(data.size() / 2);
+    auto reference_channel = std::vector<int16_t>(data.size() / 2);
+    DeinterleaveScalar(data.data(), mic_channel.data(), reference_channel.data(), mic_channel.size());
+    auto resampled_mic = std::vector<int16_t>(input_resampler.GetOutputSamples(mic_channel.size()));
+    auto resampled_reference = std::vector<int16_t>(reference_resampler.GetOutputSamples(reference_channel.size()));
+    input_resampler.Process(mic_channel.data(), mic_channel.size(), resampled_mic.data());
+    reference_resampler.Process(reference_channel.data(), reference_channel.size(), resampled_reference.data());
+    data.resize(resampled_mic.size() + resampled_reference.size());
+    InterleaveScalar(resampled_mic.data(), resampled_reference.data(), data.data(), resampled_mic.size());
+}
+
+// The stereo path of ReadAudioData now, the scratch buffers belong to AudioService
+struct StereoReader {
+    OpusResampler input_resampler;
+    OpusResampler reference_resampler;
+    std::vector<int16_t> mic_channel_buffer;
+    std::vector<int16_t> reference_channel_buffer;
+    std::vector<int16_t> resampled_mic_buffer;
+    std::vector<int16_t> resampled_reference_buffer;
+
+    void Read(std::vector<int16_t>& data) {
+        size_t frames = data.size() / 2;
+        mic_channel_buffer.resize(frames);
+        reference_channel_buffer.resize(frames);
+        PcmDeinterleaveStereo(data.data(), mic_channel_buffer.data(), reference_channel_buffer.data(), frames);
+        resampled_mic_buffer.resize(input_resampler.GetOutputSamples(frames));
+        resampled_reference_buffer.resize(reference_resampler.GetOutputSamples(frames));
+        input_resampler.Process(mic_channel_buffer.data(), frames, resampled_mic_buffer.data());
+        reference_resampler.Process(reference_channel_buffer.data(), frames, resampled_reference_buffer.data());
+        data.resize(resampled_mic_buffer.size() * 2);
+        PcmInterleaveStereo(resampled_mic_buffer.data(), resampled_reference_buffer.data(), data.data(), resampled_mic_buffer.size());
+    }
+};
+
+static void TestStereoRead() {
+    const int rates[] = { 24000, 44100, 48000 };
+    for (int rate : rates) {
+        StereoReader reader;
+        reader.input_resampler.Configure(rate, 16000);
+        reader.reference_resampler.Configure(rate, 16000);
+        OpusResampler input_resampler, reference_resampler;
+        input_resampler.Configure(rate, 16000);
+        reference_resampler.Configure(rate, 16000);
+
+        /* The wake word, the audio processor and the audio test read frames of different sizes */
+        const int durations_ms[] = { 60, 32, 10, 60, 1 };
+        std::vector<int16_t> data;
+        for (int duration_ms : durations_ms) {
+            size_t frames = rate / 1000 * duration_ms;
+            std::vector<int16_t> input(frames * 2);
+            uint32_t seed = rate + duration_ms;
+            for (auto& sample : input) {
+                seed = seed * 1103515245 + 12345;
+                sample = (int16_t)(seed >> 16);
+            }
+            std::vector<int16_t> expected(input);
+            ReadStereoAllocating(expected, input_resampler, reference_resampler);
+            data = input;
+            reader.Read(data);
+            CHECK(data.size() == (size_t)input_resampler.GetOutputSamples(frames) * 2);
+            CHECK(data == expected);
+        }
+    }
+}
+
+int main() {
+    TestKernels();
+    TestFadeOut();
+    TestStereoRead();
+    printf("pcm_kernels_test passed\n");
+    return 0;
+}
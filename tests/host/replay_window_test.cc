@@ -0,0 +1,148 @@
+/*
+ * Test of ReplayWindow, the anti-replay check of the UDP audio packets: every sequence is accepted
+ * once, in any order, as long as it is less than REPLAY_WINDOW_SIZE behind the highest one, also
+ * across the 32-bit wrap of the sequence.
+ */
+#include "replay_window.h"
+#include "host_test.h"
+
+// Check() and, when accepted, Update(), as the UDP receive callback does
+static bool Receive(ReplayWindow& window, uint32_t sequence) {
+    if (!window.Check(sequence)) {
+        window.CountRejected();
+        return false;
+    }
+    window.Update(sequence);
+    return true;
+}
+
+static void TestInOrder() {
+    ReplayWindow window;
+    for (uint32_t sequence = 1; sequence <= 1000; sequence++) {
+        CHECK(Receive(window, sequence));
+        CHECK(window.highest() == sequence);
+    }
+    CHECK(window.rejected() == 0);
+}
+
+static void TestDuplicates() {
+    ReplayWindow window;
+    for (uint32_t sequence = 1; sequence <= 10; sequence++) {
+        CHECK(Receive(window, sequence));
+    }
+    CHECK(!Receive(window, 10));
+    CHECK(!Receive(window, 5));
+    CHECK(!Receive(window, 1));
+    CHECK(window.rejected() == 3);
+    CHECK(window.highest() == 10);
+
+    /* Reordered packets are accepted once */
+    CHECK(Receive(window, 20));
+    CHECK(Receive(window, 15));
+    CHECK(!Receive(window, 15));
+    CHECK(Receive(window, 11));
+    CHECK(!Receive(window, 20));
+    CHECK(window.highest() == 20);
+    CHECK(window.rejected() == 5);
+}
+
+static void TestTooOld() {
+    ReplayWindow window;
+    CHECK(Receive(window, 1));
+    CHECK(Receive(window, 1000));
+    /* Never received, but too old to tell */
+    CHECK(!Receive(window, 500));
+    CHECK(!Receive(window, 2));
+    CHECK(window.rejected() == 2);
+}
+
+static void TestWindowEdge() {
+    const uint32_t highest = 1000;
+    ReplayWindow window;
+    CHECK(Receive(window, highest));
+    /* The oldest sequence the bitmap holds, then one past it */
+    CHECK(Receive(window, highest - (REPLAY_WINDOW_SIZE - 1)));
+    CHECK(!Receive(window, highest - (REPLAY_WINDOW_SIZE - 1)));
+    CHECK(!Receive(window, highest - REPLAY_WINDOW_SIZE));
+
+    /* One step forward shifts the oldest bit out: it is too old now, the next one is a duplicate */
+    CHECK(Receive(window, highest + 1));
+    CHECK(!window.Check(highest - (REPLAY_WINDOW_SIZE - 1)));
+    CHECK(Receive(window, highest - (REPLAY_WINDOW_SIZE - 2)));
+
+    /* A step of exactly the window size keeps only the new highest */
+    ReplayWindow shifted;
+    CHECK(Receive(shifted, highest));
+    CHECK(Receive(shifted, highest + REPLAY_WINDOW_SIZE));
+    CHECK(!shifted.Check(highest));
+    for (uint32_t age = 1; age < REPLAY_WINDOW_SIZE; age++) {
+        CHECK(shifted.Check(highest + REPLAY_WINDOW_SIZE - age));
+    }
+}
+
+static void TestLargeJump() {
+    ReplayWindow window;
+    for (uint32_t sequence = 1; sequence <= 100; sequence++) {
+        CHECK(Receive(window, sequence));
+    }
+    /* Packets lost for a while, the bitmap is cleared rather than shifted */
+    const uint32_t jump = 100 + 1000000;
+    CHECK(Receive(window, jump));
+    CHECK(window.highest() == jump);
+    CHECK(!Receive(window, 100));
+    CHECK(Receive(window, jump - 1));
+    CHECK(Receive(window, jump - (REPLAY_WINDOW_SIZE - 1)));
+    CHECK(!Receive(window, jump));
+
+    /* Half the sequence space ahead counts as behind, and is rejected */
+    CHECK(!Receive(window, jump + 0x80000000u));
+    CHECK(window.highest() == jump);
+}
+
+static void TestWrap() {
+    ReplayWindow window;
+    const uint32_t first = 0xFFFFFFF0u;
+    /* The peer starts counting near the wrap: the first packet sets the highest sequence */
+    CHECK(Receive(window, first));
+    CHECK(window.highest() == first);
+    for (uint32_t i = 1; i < 32; i++) {
+        /* Every fourth packet swapped with the next, across the wrap to 0 */
+        uint32_t sequence = first + (i % 4 == 1 ? i + 1 : i % 4 == 2 ? i - 1 : i);
+        CHECK(Receive(window, sequence));
+    }
+    CHECK(window.highest() == first + 31);
+    CHECK(window.highest() == 0x0000000Fu);
+    CHECK(window.rejected() == 0);
+
+    CHECK(!Receive(window, 0xFFFFFFFFu));
+    CHECK(!Receive(window, 0));
+    CHECK(!Receive(window, first));
+    CHECK(window.rejected() == 3);
+
+    CHECK(Receive(window, 0x10));
+    CHECK(!Receive(window, 0x10 - REPLAY_WINDOW_SIZE));
+}
+
+static void TestReset() {
+    ReplayWindow window;
+    CHECK(Receive(window, 5000));
+    CHECK(!Receive(window, 5000));
+    window.Reset();
+    CHECK(window.rejected() == 0);
+    /* A new session may count from 1 again */
+    CHECK(Receive(window, 1));
+    CHECK(Receive(window, 2));
+    CHECK(window.highest() == 2);
+}
+
+int main() {
+    TestInOrder();
+    TestDuplicates();
+    TestTooOld();
+    TestWindowEdge();
+    TestLargeJump();
+    TestWrap();
+    TestReset();
+    printf("replay_window_test passed\n");
+    return 0;
+}
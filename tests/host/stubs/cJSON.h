@@ -0,0 +1,7 @@
+#ifndef HOST_CJSON_H
+#define HOST_CJSON_H
+
+// The headers under test only pass cJSON pointers around
+typedef struct cJSON cJSON;
+
+#endif // HOST_CJSON_H
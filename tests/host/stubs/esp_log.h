@@ -0,0 +1,23 @@
+#ifndef HOST_ESP_LOG_H
+#define HOST_ESP_LOG_H
+
+// Prints the errors of the code under test, the other levels are dropped
+
+#include <cstdio>
+#include <cstdarg>
+
+static inline void HostLog(const char* level, const char* tag, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    fprintf(stderr, "%s (%s): ", level, tag);
+    vfprintf(stderr, format, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+}
+
+#define ESP_LOGE(tag, format, ...) HostLog("E", tag, format, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...) do { if (false) HostLog("W", tag, format, ##__VA_ARGS__); } while (0)
+#define ESP_LOGI(tag, format, ...) do { if (false) HostLog("I", tag, format, ##__VA_ARGS__); } while (0)
+#define ESP_LOGD(tag, format, ...) do { if (false) HostLog("D", tag, format, ##__VA_ARGS__); } while (0)
+
+#endif // HOST_ESP_LOG_H
@@ -0,0 +1,17 @@
+#ifndef HOST_FREERTOS_H
+#define HOST_FREERTOS_H
+
+// The few FreeRTOS definitions the host tests need, one tick is one millisecond
+
+#include <cstdint>
+
+typedef uint32_t TickType_t;
+typedef uint32_t EventBits_t;
+typedef int32_t BaseType_t;
+
+#define pdFALSE 0
+#define pdTRUE 1
+#define portMAX_DELAY ((TickType_t)0xffffffffUL)
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+
+#endif // HOST_FREERTOS_H
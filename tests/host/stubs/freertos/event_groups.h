@@ -0,0 +1,65 @@
+#ifndef HOST_EVENT_GROUPS_H
+#define HOST_EVENT_GROUPS_H
+
+// Event groups on top of a mutex and a condition variable, for the host tests
+
+#include "FreeRTOS.h"
+
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
+
+struct HostEventGroup {
+    std::mutex mutex;
+    std::condition_variable cv;
+    EventBits_t bits = 0;
+};
+
+typedef HostEventGroup* EventGroupHandle_t;
+
+inline EventGroupHandle_t xEventGroupCreate() {
+    return new HostEventGroup();
+}
+
+inline void vEventGroupDelete(EventGroupHandle_t group) {
+    delete group;
+}
+
+inline EventBits_t xEventGroupSetBits(EventGroupHandle_t group, EventBits_t bits) {
+    std::lock_guard<std::mutex> lock(group->mutex);
+    group->bits |= bits;
+    group->cv.notify_all();
+    return group->bits;
+}
+
+inline EventBits_t xEventGroupClearBits(EventGroupHandle_t group, EventBits_t bits) {
+    std::lock_guard<std::mutex> lock(group->mutex);
+    EventBits_t previous = group->bits;
+    group->bits &= ~bits;
+    return previous;
+}
+
+inline EventBits_t xEventGroupGetBits(EventGroupHandle_t group) {
+    std::lock_guard<std::mutex> lock(group->mutex);
+    return group->bits;
+}
+
+inline EventBits_t xEventGroupWaitBits(EventGroupHandle_t group, EventBits_t bits, BaseType_t clear_on_exit,
+    BaseType_t wait_for_all, TickType_t timeout) {
+    std::unique_lock<std::mutex> lock(group->mutex);
+    auto ready = [&]() {
+        return wait_for_all ? (group->bits & bits) == bits : (group->bits & bits) != 0;
+    };
+    if (timeout == portMAX_DELAY) {
+        group->cv.wait(lock, ready);
+    } else {
+        group->cv.wait_for(lock, std::chrono::milliseconds(timeout), ready);
+    }
+    EventBits_t result = group->bits;
+    if (clear_on_exit && ready()) {
+        group->bits &= ~bits;
+    }
+    return result;
+}
+
+#endif // HOST_EVENT_GROUPS_H
@@ -0,0 +1,36 @@
+#ifndef HOST_OPUS_RESAMPLER_H
+#define HOST_OPUS_RESAMPLER_H
+
+// Takes the nearest earlier sample. The tests compare paths through the same resampler, not the audio
+
+#include <cstdint>
+
+class OpusResampler {
+public:
+    void Configure(int input_sample_rate, int output_sample_rate) {
+        input_sample_rate_ = input_sample_rate;
+        output_sample_rate_ = output_sample_rate;
+    }
+    void Process(const int16_t* input, int input_samples, int16_t* output) {
+        /* Nearest sample before, stepped in 16.16 fixed point rather than divided per sample */
+        int output_samples = GetOutputSamples(input_samples);
+        int64_t step = ((int64_t)input_sample_rate_ << 16) / output_sample_rate_;
+        int64_t position = 0;
+        for (int i = 0; i < output_samples; i++) {
+            output[i] = input[position >> 16];
+            position += step;
+        }
+    }
+    int GetOutputSamples(int input_samples) const {
+        return (int64_t)input_samples * output_sample_rate_ / input_sample_rate_;
+    }
+
+    int input_sample_rate() const { return input_sample_rate_; }
+    int output_sample_rate() const { return output_sample_rate_; }
+
+private:
+    int input_sample_rate_ = 0;
+    int output_sample_rate_ = 0;
+};
+
+#endif // HOST_OPUS_RESAMPLER_H